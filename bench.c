@@ -0,0 +1,812 @@
+/*
+** bench
+**
+** Times each stage of the lispy REPL on generated
+** input and writes the results as JSON.
+**
+**   bench [-t] [-k kind]... [-s size]... [-r runs]
+**         [-b baseline | -c baseline [-x percent]]
+**
+** The corpora are generated one line at a time
+** from a fixed seed, so every run sees the same
+** input and it never has to be held in memory.
+** The kinds are `nested` for deeply nested
+** S-expressions, `wide` for very wide Q-expressions,
+** `numbers` for long lists of numbers to add up and
+** `mixed` for random expressions using every
+** builtin. Sizes take a `K`, `M` or `G` suffix and
+** default to 1K, 64K and 1M for every kind.
+**
+** Each line is parsed, read, evaluated and printed
+** as the REPL does, with the printing going to
+** `/dev/null`, and every stage is timed on its own.
+** Parsing uses the compiled grammar like the REPL,
+** or the parser itself with `-t`. The time to free
+** the AST is counted as parsing and the time to
+** free the result as evaluation. Allocations are
+** the calls to `malloc` and `realloc` made by the
+** interpreter along with the parse pool statistics.
+** Every run happens in a child process of its own,
+** so the peak resident memory reported is that of
+** the one benchmark rather than all run before it.
+** If a child crashes or fails, how it ended is
+** reported, the benchmark is marked as failed and
+** bench exits with status `3` once all are done.
+**
+** Every benchmark is run `-r` times and the run
+** with the median total time is reported. `-b`
+** also saves the times of all the runs to a named
+** baseline file. `-c` instead runs the benchmarks
+** in a baseline again and prints how much each
+** stage has changed, exiting with status `1` if
+** any total time is significantly slower by more
+** than `-x` percent, 5 by default. Both default to
+** five runs rather than one.
+**
+** It includes parsing.c and needs a POSIX system:
+**
+**   cc -O2 bench.c mpc.c -lm -o bench
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <readline/readline.h>
+#include <readline/history.h>
+
+#include "mpc.h"
+
+static unsigned long bench_allocs = 0;
+
+static void *bench_malloc(size_t n) {
+  bench_allocs++;
+  return malloc(n);
+}
+
+static void *bench_realloc(void *p, size_t n) {
+  bench_allocs++;
+  return realloc(p, n);
+}
+
+#define LISPY_NO_MAIN
+#define malloc bench_malloc
+#define realloc bench_realloc
+#include "parsing.c"
+#undef malloc
+#undef realloc
+
+/*
+** Corpora
+*/
+
+enum {
+  BENCH_NESTED  = 0,
+  BENCH_WIDE    = 1,
+  BENCH_NUMBERS = 2,
+  BENCH_MIXED   = 3,
+  BENCH_KINDS   = 4
+};
+
+static const char *bench_kinds[BENCH_KINDS] = { "nested", "wide", "numbers", "mixed" };
+
+/* mpc stops at a recursion depth of 1000, which is about 110 levels of lispy */
+
+enum {
+  BENCH_LINE_MAX      = 1 << 16,
+  BENCH_NEST_DEPTH    = 100,
+  BENCH_WIDE_ITEMS    = 8192,
+  BENCH_NUMBERS_ITEMS = 1024,
+  BENCH_MIXED_DEPTH   = 5
+};
+
+typedef struct {
+  int kind;
+  unsigned long seed;
+  char *line;
+  size_t length;
+  size_t limit;
+} bench_gen_t;
+
+/* A fixed LCG so the corpora are the same everywhere */
+static unsigned long bench_rand(bench_gen_t *g, unsigned long n) {
+  g->seed = (g->seed * 1103515245UL + 12345UL) & 0x7FFFFFFFUL;
+  return (g->seed >> 8) % n;
+}
+
+static void bench_put(bench_gen_t *g, const char *s) {
+  size_t n = strlen(s);
+  if (g->length + n < BENCH_LINE_MAX) {
+    memcpy(g->line + g->length, s, n);
+    g->length += n;
+  }
+}
+
+static void bench_put_num(bench_gen_t *g, unsigned long n) {
+  char num[32];
+  sprintf(num, "%lu", n);
+  bench_put(g, num);
+}
+
+static void bench_gen_mixed(bench_gen_t *g, int depth) {
+
+  static const char *ops[] = { "+", "-", "/" };
+  int j, n;
+
+  if (depth == 0 || bench_rand(g, 4) == 0) {
+    bench_put_num(g, bench_rand(g, 1000) + 1);
+    return;
+  }
+
+  switch (bench_rand(g, 6)) {
+    case 0: case 1: case 2:
+      bench_put(g, "(");
+      bench_put(g, ops[bench_rand(g, 3)]);
+      n = 1 + (int)bench_rand(g, 4);
+      for (j = 0; j < n; j++) { bench_put(g, " "); bench_gen_mixed(g, depth-1); }
+      bench_put(g, ")");
+      break;
+    case 3:
+      bench_put(g, bench_rand(g, 2) ? "(head {" : "(tail {");
+      n = 1 + (int)bench_rand(g, 4);
+      for (j = 0; j < n; j++) { if (j) { bench_put(g, " "); } bench_gen_mixed(g, depth-1); }
+      bench_put(g, "})");
+      break;
+    case 4:
+      bench_put(g, "(join {");
+      bench_gen_mixed(g, depth-1);
+      bench_put(g, "} (list ");
+      bench_gen_mixed(g, depth-1);
+      bench_put(g, "))");
+      break;
+    default:
+      bench_put(g, "(eval {+ ");
+      bench_gen_mixed(g, depth-1);
+      bench_put(g, " ");
+      bench_gen_mixed(g, depth-1);
+      bench_put(g, "})");
+      break;
+  }
+}
+
+static void bench_gen_line(bench_gen_t *g) {
+
+  int j;
+
+  g->length = 0;
+
+  switch (g->kind) {
+    case BENCH_NESTED:
+      for (j = 0; j < BENCH_NEST_DEPTH; j++) { bench_put(g, "(+ 1 "); }
+      bench_put_num(g, bench_rand(g, 1000));
+      for (j = 0; j < BENCH_NEST_DEPTH; j++) { bench_put(g, ")"); }
+      break;
+    case BENCH_WIDE:
+      bench_put(g, "{");
+      for (j = 0; j < BENCH_WIDE_ITEMS && g->length + 16 < g->limit; j++) {
+        if (j) { bench_put(g, " "); }
+        bench_put_num(g, bench_rand(g, 100000));
+      }
+      bench_put(g, "}");
+      break;
+    case BENCH_NUMBERS:
+      bench_put(g, "(+");
+      for (j = 0; j < BENCH_NUMBERS_ITEMS && g->length + 16 < g->limit; j++) {
+        bench_put(g, " ");
+        bench_put_num(g, bench_rand(g, 100000));
+      }
+      bench_put(g, ")");
+      break;
+    default:
+      bench_gen_mixed(g, BENCH_MIXED_DEPTH);
+      break;
+  }
+
+  g->line[g->length] = '\0';
+}
+
+/*
+** Running
+*/
+
+typedef struct {
+  char name[64];
+  unsigned long bytes;
+  unsigned long lines;
+  unsigned long exprs;
+  unsigned long errors;
+  unsigned long allocs;
+  double parse;
+  double read;
+  double eval;
+  double print;
+  mpc_pool_stats_t pool;
+  long peak_rss;
+} bench_result_t;
+
+typedef struct {
+  mpc_parser_t *lispy;
+  mpc_code_t *code;
+  bench_gen_t gen;
+} bench_t;
+
+static double bench_clock(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static long bench_peak_rss(void) {
+  struct rusage u;
+  getrusage(RUSAGE_SELF, &u);
+#ifdef __APPLE__
+  return u.ru_maxrss / 1024;
+#else
+  return u.ru_maxrss;
+#endif
+}
+
+static void bench_run(bench_t *b, int kind, const char *size, unsigned long bytes, bench_result_t *res) {
+
+  mpc_context_t *ctx = mpc_context_new(0);
+  mpc_result_t r;
+  lval *x;
+  double t0, t1, t2, t3, t4, t5, t6;
+  unsigned long allocs;
+  int ok, out, null;
+
+  memset(res, 0, sizeof(bench_result_t));
+  sprintf(res->name, "%s/%.32s", bench_kinds[kind], size);
+
+  mpc_context_set_flags(ctx, MPC_CONTEXT_AST_ARENA | MPC_CONTEXT_AST_SPANS | MPC_CONTEXT_LAZY_ERRORS);
+
+  b->gen.kind = kind;
+  b->gen.seed = 0x5EED + (unsigned long)kind;
+
+  /* Printing goes to /dev/null so the JSON on stdout stays clean */
+  fflush(stdout);
+  out = dup(STDOUT_FILENO);
+  null = open("/dev/null", O_WRONLY);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+
+  allocs = bench_allocs;
+
+  while (res->bytes < bytes) {
+
+    /* Lists are cut short to stay near the requested size */
+    b->gen.limit = bytes - res->bytes < BENCH_LINE_MAX ? bytes - res->bytes : BENCH_LINE_MAX;
+    bench_gen_line(&b->gen);
+    res->bytes += b->gen.length + 1;
+    res->lines++;
+
+    t0 = bench_clock();
+    ok = b->code
+      ? mpc_context_code_nparse(ctx, "<bench>", b->gen.line, b->gen.length, b->code, &r)
+      : mpc_context_nparse(ctx, "<bench>", b->gen.line, b->gen.length, b->lispy, &r);
+    t1 = bench_clock();
+
+    if (!ok) {
+      res->parse += t1 - t0;
+      mpc_err_delete(r.error);
+      res->errors++;
+      continue;
+    }
+
+    x = lval_read(r.output);
+    t2 = bench_clock();
+    mpc_ast_delete(r.output);
+    t3 = bench_clock();
+
+    res->exprs += (unsigned long)x->count;
+
+    x = lval_eval(x);
+    t4 = bench_clock();
+    lval_println(x);
+    t5 = bench_clock();
+    lval_del(x);
+    t6 = bench_clock();
+
+    res->parse += (t1 - t0) + (t3 - t2);
+    res->read  += t2 - t1;
+    res->eval  += (t4 - t3) + (t6 - t5);
+    res->print += t5 - t4;
+  }
+
+  fflush(stdout);
+  dup2(out, STDOUT_FILENO);
+  close(out);
+
+  res->allocs = bench_allocs - allocs;
+  mpc_context_stats(ctx, &res->pool);
+  res->peak_rss = bench_peak_rss();
+
+  mpc_context_delete(ctx);
+}
+
+/* Runs a benchmark in a child which sends its result back, returning 0 if it fails */
+
+static int bench_fork(const char *name, bench_t *b, int kind, const char *size, unsigned long bytes, bench_result_t *res) {
+
+  int fds[2], status = 0;
+  ssize_t n = 0;
+  pid_t pid;
+
+  fflush(stdout);
+  fflush(stderr);
+
+  if (pipe(fds) != 0) {
+    fprintf(stderr, "bench: %s: could not create a pipe: %s\n", name, strerror(errno));
+    return 0;
+  }
+
+  pid = fork();
+
+  if (pid == 0) {
+    close(fds[0]);
+    bench_run(b, kind, size, bytes, res);
+    n = write(fds[1], res, sizeof(bench_result_t));
+    _exit(n == (ssize_t)sizeof(bench_result_t) ? 0 : 1);
+  }
+
+  close(fds[1]);
+  if (pid < 0) {
+    fprintf(stderr, "bench: %s: could not fork: %s\n", name, strerror(errno));
+    close(fds[0]);
+    return 0;
+  }
+
+  n = read(fds[0], res, sizeof(bench_result_t));
+  close(fds[0]);
+
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+  if (WIFSIGNALED(status)) {
+    fprintf(stderr, "bench: %s: killed by signal %d\n", name, WTERMSIG(status));
+    return 0;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "bench: %s: exited with status %d\n", name, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return 0;
+  }
+  if (n != (ssize_t)sizeof(bench_result_t)) {
+    fprintf(stderr, "bench: %s: sent back no result\n", name);
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+** Output
+*/
+
+static double bench_rate(double n, double t) {
+  return t > 0.0 ? n / t : 0.0;
+}
+
+static void bench_print(FILE *f, bench_result_t *r) {
+
+  double mb = (double)r->bytes / (1024.0 * 1024.0);
+  double total = r->parse + r->read + r->eval + r->print;
+
+  fprintf(f, "    {\"name\": \"%s\", \"bytes\": %lu, \"lines\": %lu, \"exprs\": %lu, \"errors\": %lu,\n",
+    r->name, r->bytes, r->lines, r->exprs, r->errors);
+  fprintf(f, "     \"seconds\": {\"parse\": %.6f, \"read\": %.6f, \"eval\": %.6f, \"print\": %.6f, \"total\": %.6f},\n",
+    r->parse, r->read, r->eval, r->print, total);
+  fprintf(f, "     \"mb_per_s\": {\"parse\": %.3f, \"read\": %.3f, \"eval\": %.3f, \"print\": %.3f, \"total\": %.3f},\n",
+    bench_rate(mb, r->parse), bench_rate(mb, r->read), bench_rate(mb, r->eval),
+    bench_rate(mb, r->print), bench_rate(mb, total));
+  fprintf(f, "     \"exprs_per_s\": %.1f, \"allocs\": %lu,\n",
+    bench_rate((double)r->exprs, total), r->allocs);
+  fprintf(f, "     \"pool\": {\"hits\": %lu, \"full\": %lu, \"large\": %lu, \"peak\": %lu},\n",
+    r->pool.hits, r->pool.full, r->pool.large, (unsigned long)r->pool.peak);
+  fprintf(f, "     \"peak_rss_kb\": %ld}", r->peak_rss);
+}
+
+static unsigned long bench_size(const char *s) {
+  char *end;
+  unsigned long n = strtoul(s, &end, 10);
+  switch (*end) {
+    case 'k': case 'K': return n << 10;
+    case 'm': case 'M': return n << 20;
+    case 'g': case 'G': return n << 30;
+    case '\0': return n;
+    default: return 0;
+  }
+}
+
+/*
+** Baselines
+**
+** A baseline is a text file with the time of
+** every stage of every run, one benchmark and
+** stage to a line after the parser used:
+**
+**   parser code
+**   nested/1K parse 0.001242 0.001198 ...
+**
+** A comparison runs the same benchmarks again
+** with the same parser and compares the mean
+** time of each stage using Welch's t-test. A
+** benchmark has regressed when its total time
+** is worse by more than the threshold and the
+** slowdown is significant at 95%. With a single
+** run on either side there is no interval, and
+** the threshold alone decides.
+*/
+
+enum {
+  BENCH_STAGES   = 5,
+  BENCH_RUNS_MAX = 64,
+  BENCH_BASELINE_LINE = 4096
+};
+
+static const char *bench_stages[BENCH_STAGES] = { "parse", "read", "eval", "print", "total" };
+
+typedef struct {
+  char name[64];
+  int kind;
+  const char *size;
+  int runs;
+  double times[BENCH_STAGES][BENCH_RUNS_MAX];
+} bench_series_t;
+
+static double bench_stage(bench_result_t *r, int stage) {
+  switch (stage) {
+    case 0: return r->parse;
+    case 1: return r->read;
+    case 2: return r->eval;
+    case 3: return r->print;
+    default: return r->parse + r->read + r->eval + r->print;
+  }
+}
+
+/* Names are a kind and a size, as in `nested/64K` */
+static int bench_series_name(bench_series_t *s, const char *name) {
+
+  char *size;
+  int k;
+
+  if (strlen(name) >= sizeof(s->name)) { return 0; }
+  strcpy(s->name, name);
+
+  size = strchr(s->name, '/');
+  if (size == NULL || bench_size(size + 1) == 0) { return 0; }
+
+  for (k = 0; k < BENCH_KINDS; k++) {
+    if (strncmp(s->name, bench_kinds[k], (size_t)(size - s->name)) == 0
+    &&  bench_kinds[k][size - s->name] == '\0') { break; }
+  }
+  if (k == BENCH_KINDS) { return 0; }
+
+  s->kind = k;
+  s->size = size + 1;
+  s->runs = 0;
+  return 1;
+}
+
+static int bench_baseline_save(const char *filename, int tree, bench_series_t *ss, int n) {
+
+  FILE *f = fopen(filename, "w");
+  int j, k, r;
+
+  if (f == NULL) { return 0; }
+
+  fprintf(f, "parser %s\n", tree ? "tree" : "code");
+  for (j = 0; j < n; j++) {
+    if (ss[j].runs == 0) { continue; }
+    for (k = 0; k < BENCH_STAGES; k++) {
+      fprintf(f, "%s %s", ss[j].name, bench_stages[k]);
+      for (r = 0; r < ss[j].runs; r++) { fprintf(f, " %.9f", ss[j].times[k][r]); }
+      fprintf(f, "\n");
+    }
+  }
+
+  return fclose(f) == 0;
+}
+
+static bench_series_t *bench_baseline_load(const char *filename, int *tree, int *n) {
+
+  FILE *f = fopen(filename, "r");
+  char line[BENCH_BASELINE_LINE], *name, *stage, *time;
+  bench_series_t *ss = NULL;
+  int k, r;
+
+  if (f == NULL) { return NULL; }
+
+  *n = 0;
+  *tree = 0;
+
+  while (fgets(line, sizeof(line), f)) {
+
+    name = strtok(line, " \n");
+    stage = strtok(NULL, " \n");
+    if (name == NULL || stage == NULL) { continue; }
+
+    if (strcmp(name, "parser") == 0) {
+      *tree = strcmp(stage, "tree") == 0;
+      continue;
+    }
+
+    for (k = 0; k < BENCH_STAGES; k++) {
+      if (strcmp(stage, bench_stages[k]) == 0) { break; }
+    }
+    if (k == BENCH_STAGES) { goto fail; }
+
+    /* Stages of one benchmark are on consecutive lines */
+    if (*n == 0 || strcmp(ss[*n-1].name, name) != 0) {
+      ss = realloc(ss, sizeof(bench_series_t) * (*n + 1));
+      if (!bench_series_name(ss + *n, name)) { goto fail; }
+      (*n)++;
+    }
+
+    for (r = 0; (time = strtok(NULL, " \n")) && r < BENCH_RUNS_MAX; r++) {
+      ss[*n-1].times[k][r] = strtod(time, NULL);
+    }
+    if (r == 0) { goto fail; }
+    ss[*n-1].runs = r;
+  }
+
+  fclose(f);
+  if (*n == 0) { free(ss); return NULL; }
+  return ss;
+
+fail:
+  fclose(f);
+  free(ss);
+  return NULL;
+}
+
+/* Two sided 95% critical values of Student's t for 1 to 30 degrees of freedom */
+static const double bench_t95[30] = {
+  12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+  2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+  2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+
+static void bench_moments(double *xs, int n, double *mean, double *var) {
+  int j;
+  *mean = 0.0;
+  *var = 0.0;
+  for (j = 0; j < n; j++) { *mean += xs[j]; }
+  *mean /= n;
+  for (j = 0; j < n; j++) { *var += (xs[j] - *mean) * (xs[j] - *mean); }
+  *var = n > 1 ? *var / (n - 1) : 0.0;
+}
+
+/* Returns the half width of the 95% interval for the difference of the means, or -1 */
+static double bench_welch(double *a, int an, double *b, int bn, double *am, double *bm) {
+
+  double av, bv, x, y, df;
+
+  bench_moments(a, an, am, &av);
+  bench_moments(b, bn, bm, &bv);
+
+  if (an < 2 || bn < 2) { return -1.0; }
+
+  x = av / an;
+  y = bv / bn;
+  if (x + y == 0.0) { return 0.0; }
+
+  df = (x + y) * (x + y) / (x * x / (an - 1) + y * y / (bn - 1));
+  return (df < 30.0 ? bench_t95[(int)df > 0 ? (int)df - 1 : 0] : 1.96) * sqrt(x + y);
+}
+
+static int bench_compare(bench_series_t *base, bench_series_t *cur, int n, double threshold) {
+
+  int j, k, slower, regressions = 0;
+  double bm, cm, ci, delta;
+
+  printf("%-16s %-6s %12s %12s %9s %9s\n", "benchmark", "stage", "base ms", "current ms", "delta %", "95% ci");
+
+  for (j = 0; j < n; j++) {
+
+    if (cur[j].runs == 0) {
+      printf("%-16s %-6s %12s\n", cur[j].name, "total", "FAILED");
+      continue;
+    }
+
+    for (k = 0; k < BENCH_STAGES; k++) {
+
+      ci = bench_welch(base[j].times[k], base[j].runs, cur[j].times[k], cur[j].runs, &bm, &cm);
+      delta = bm > 0.0 ? 100.0 * (cm - bm) / bm : 0.0;
+
+      printf("%-16s %-6s %12.3f %12.3f %+9.2f", cur[j].name, bench_stages[k], bm * 1000.0, cm * 1000.0, delta);
+      if (ci < 0.0) { printf(" %9s", "n/a"); }
+      else { printf(" %8.2f%%", bm > 0.0 ? 100.0 * ci / bm : 0.0); }
+
+      slower = delta > threshold && (ci < 0.0 || cm - bm > ci);
+      if (k == BENCH_STAGES - 1 && slower) {
+        printf("  REGRESSION");
+        regressions++;
+      }
+      printf("\n");
+    }
+  }
+
+  printf("%d of %d benchmarks regressed by more than %.1f%%\n", regressions, n, threshold);
+  return regressions;
+}
+
+/*
+** Driver
+*/
+
+/* The run with the median total time is the one reported */
+static bench_result_t *bench_median(bench_result_t *rs, int n) {
+
+  int j, k, below, same;
+  double t;
+
+  for (j = 0; j < n; j++) {
+    t = bench_stage(rs + j, BENCH_STAGES - 1);
+    for (k = 0, below = 0, same = 0; k < n; k++) {
+      below += bench_stage(rs + k, BENCH_STAGES - 1) < t;
+      same  += bench_stage(rs + k, BENCH_STAGES - 1) == t;
+    }
+    if (below <= n / 2 && below + same > n / 2) { return rs + j; }
+  }
+
+  return rs;
+}
+
+static int bench_usage(const char *name) {
+  fprintf(stderr, "usage: %s [-t] [-k kind]... [-s size]... [-r runs] [-b baseline | -c baseline [-x percent]]\n", name);
+  return 2;
+}
+
+int main(int argc, char **argv) {
+
+  bench_t b;
+  bench_result_t *results;
+  bench_series_t *series, *base = NULL;
+  const char **sizes = malloc(sizeof(char*) * (argc + 3));
+  const char *save = NULL, *compare = NULL;
+  int j, k, r, n = 0, kinds[BENCH_KINDS], kinds_num = 0, sizes_num = 0, tree = 0, runs = 0;
+  int status = 0, failed = 0;
+  double threshold = 5.0;
+  mpc_err_t *e;
+
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *Sexpr  = mpc_new("sexpr");
+  mpc_parser_t *Qexpr  = mpc_new("qexpr");
+  mpc_parser_t *Expr   = mpc_new("expr");
+  mpc_parser_t *Lispy  = mpc_new("lispy");
+
+  for (j = 1; j < argc; j++) {
+    if (strcmp(argv[j], "-t") == 0) {
+      tree = 1;
+    } else if (strcmp(argv[j], "-k") == 0 && j + 1 < argc) {
+      for (k = 0; k < BENCH_KINDS; k++) {
+        if (strcmp(argv[j+1], bench_kinds[k]) == 0) { break; }
+      }
+      if (k == BENCH_KINDS || kinds_num == BENCH_KINDS) {
+        fprintf(stderr, "%s: unknown kind '%s'\n", argv[0], argv[j+1]);
+        return 2;
+      }
+      kinds[kinds_num++] = k;
+      j++;
+    } else if (strcmp(argv[j], "-s") == 0 && j + 1 < argc && bench_size(argv[j+1])) {
+      sizes[sizes_num++] = argv[++j];
+    } else if (strcmp(argv[j], "-r") == 0 && j + 1 < argc) {
+      runs = atoi(argv[++j]);
+      if (runs < 1 || runs > BENCH_RUNS_MAX) { return bench_usage(argv[0]); }
+    } else if (strcmp(argv[j], "-b") == 0 && j + 1 < argc) {
+      save = argv[++j];
+    } else if (strcmp(argv[j], "-c") == 0 && j + 1 < argc) {
+      compare = argv[++j];
+    } else if (strcmp(argv[j], "-x") == 0 && j + 1 < argc) {
+      threshold = atof(argv[++j]);
+    } else {
+      return bench_usage(argv[0]);
+    }
+  }
+
+  if (save && compare) { return bench_usage(argv[0]); }
+
+  if (kinds_num == 0) {
+    for (k = 0; k < BENCH_KINDS; k++) { kinds[k] = k; }
+    kinds_num = BENCH_KINDS;
+  }
+
+  if (sizes_num == 0) {
+    sizes[sizes_num++] = "1K";
+    sizes[sizes_num++] = "64K";
+    sizes[sizes_num++] = "1M";
+  }
+
+  /* A comparison runs whatever the baseline has */
+  if (compare) {
+    base = bench_baseline_load(compare, &tree, &n);
+    if (base == NULL) {
+      fprintf(stderr, "%s: could not read baseline '%s'\n", argv[0], compare);
+      return 2;
+    }
+    series = malloc(sizeof(bench_series_t) * n);
+    for (j = 0; j < n; j++) { bench_series_name(series + j, base[j].name); }
+  } else {
+    series = malloc(sizeof(bench_series_t) * kinds_num * sizes_num);
+    for (k = 0; k < kinds_num; k++) {
+      for (j = 0; j < sizes_num; j++) {
+        series[n].kind = kinds[k];
+        series[n].size = sizes[j];
+        series[n].runs = 0;
+        sprintf(series[n].name, "%s/%.32s", bench_kinds[kinds[k]], sizes[j]);
+        n++;
+      }
+    }
+  }
+
+  if (runs == 0) { runs = save || compare ? 5 : 1; }
+
+  e = mpca_lang(MPCA_LANG_DEFAULT, lispy_grammar, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  if (e) {
+    mpc_err_print_to(e, stderr);
+    mpc_err_delete(e);
+    return 1;
+  }
+
+  lval_read_tags();
+
+  b.lispy = Lispy;
+  b.code = tree ? NULL : mpc_compile(Lispy);
+  b.gen.line = malloc(BENCH_LINE_MAX + 1);
+
+  results = malloc(sizeof(bench_result_t) * runs);
+
+  if (!compare) { printf("{\n  \"parser\": \"%s\",\n  \"runs\": %d,\n  \"benchmarks\": [\n", tree ? "tree" : "code", runs); }
+
+  for (j = 0; j < n; j++) {
+
+    /* A failed benchmark is left with no runs */
+    for (r = 0; r < runs; r++) {
+      if (!bench_fork(series[j].name, &b, series[j].kind, series[j].size, bench_size(series[j].size), results + r)) { break; }
+      for (k = 0; k < BENCH_STAGES; k++) { series[j].times[k][r] = bench_stage(results + r, k); }
+    }
+    series[j].runs = r == runs ? runs : 0;
+    if (series[j].runs == 0) { failed++; }
+
+    if (!compare) {
+      if (series[j].runs == 0) {
+        printf("    {\"name\": \"%s\", \"failed\": true}", series[j].name);
+      } else {
+        bench_print(stdout, bench_median(results, runs));
+      }
+      printf("%s\n", j + 1 < n ? "," : "");
+      fflush(stdout);
+    }
+  }
+
+  if (!compare) { printf("  ]\n}\n"); }
+
+  if (save && !bench_baseline_save(save, tree, series, n)) {
+    fprintf(stderr, "%s: could not write baseline '%s'\n", argv[0], save);
+    status = 2;
+  }
+
+  if (compare && bench_compare(base, series, n, threshold) > 0) { status = 1; }
+
+  if (failed > 0) {
+    fprintf(stderr, "%s: %d of %d benchmarks failed\n", argv[0], failed, n);
+    status = 3;
+  }
+
+  free(results);
+  free(series);
+  free(base);
+  free(b.gen.line);
+  free((void*)sizes);
+  if (b.code) { mpc_code_delete(b.code); }
+  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+
+  return status;
+}
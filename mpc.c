@@ -1,4 +1,32 @@
+/*
+** On POSIX systems regular files are memory
+** mapped. Define `MPC_NO_MMAP` to read regular
+** files through stdio instead.
+*/
+
+#if !defined(_WIN32)
+#define MPC_USE_POSIX
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#endif
+
 #include "mpc.h"
+#include <time.h>
+
+#ifdef MPC_USE_POSIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef MPC_NO_MMAP
+#define MPC_USE_MMAP
+#include <sys/mman.h>
+#endif
+#ifndef MPC_NO_THREADS
+#define MPC_USE_THREADS
+#include <pthread.h>
+#endif
+#endif
 
 /*
 ** State Type
@@ -30,26 +58,43 @@ static mpc_state_t mpc_state_new(void) {
 ** In mpc the input type has three modes of
 ** operation: String, File and Pipe.
 **
-** String is easy. The whole contents are
-** loaded into a buffer and scanned through.
-** The cursor can jump around at will making
-** backtracking easy.
+** String is easy. The caller's buffer is
+** scanned through directly, without being
+** copied, so it must stay alive and unchanged
+** for the duration of the parse. The cursor
+** can jump around at will making backtracking
+** easy.
 **
 ** The second is a File which is also somewhat
-** easy. The contents are never loaded into
+** easy. Where possible regular files are memory
+** mapped and then scanned exactly like a String.
+** Otherwise the contents are never loaded into
 ** memory but backtracking can still be achieved
 ** by seeking in the file at different positions.
+** Files which turn out not to be seekable at all
+** are read as a Pipe.
 **
 ** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and
-** only support a single character lookahead at
-** any point, when the input is marked for a
-** potential backtracking we start buffering any
-** input.
+** one. As we assume pipes cannot be seeked, the
+** input is read into a buffer which holds
+** everything from the oldest mark onwards. Input
+** before that point can never be rewound to, so
+** it is dropped whenever the buffer needs more
+** room. The buffer itself grows in chunks.
 **
 ** This means that if we are requested to seek
 ** back we can simply start reading from the
-** buffer instead of the input.
+** buffer instead of the input, for any amount
+** of lookahead.
+**
+** The buffer is filled from the `FILE` in whole
+** chunks with `fread`, so anything stdio already
+** holds is read first. A chunk may run past the
+** end of what the parse consumes, and those
+** bytes are dropped with the buffer when the
+** input is deleted. The stream is therefore
+** used up by a parse and is not left positioned
+** after the consumed input.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -71,20 +116,59 @@ enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
-typedef struct {
+typedef union mpc_mem_t {
   char mem[64];
+  union mpc_mem_t *next;
 } mpc_mem_t;
 
+enum {
+  MPC_INPUT_SPAN_NUM = 1024
+};
+
+typedef union mpc_span_t {
+  struct {
+    const char *start;
+    size_t length;
+  } s;
+  union mpc_span_t *next;
+} mpc_span_t;
+
+typedef struct {
+  char *name;
+  size_t length;
+  unsigned long hash;
+} mpc_label_t;
+
+typedef struct {
+  int a;
+  int b;
+  int r;
+} mpc_label_edge_t;
+
 typedef struct {
 
   int type;
   char *filename;
   mpc_state_t state;
 
-  char *string;
-  char *buffer;
+  const char *string;
+  size_t length;
+  long string_pos;
+  int partial;
+  int starved;
+  int recognize;
   FILE *file;
 
+  char *buffer;
+  size_t buffer_len;
+  size_t buffer_slots;
+  long buffer_pos;
+  int buffer_eof;
+
+  void *map;
+  size_t map_length;
+  long map_offset;
+
   int suppress;
   int backtrack;
   int marks_slots;
@@ -94,163 +178,262 @@ typedef struct {
   char *lasts;
   char last;
 
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
-  mpc_mem_t mem[MPC_INPUT_MEM_NUM];
+  size_t mem_num;
+  size_t mem_used;
+  mpc_mem_t *mem_free;
+  mpc_mem_t *mem;
+  mpc_pool_stats_t mem_stats;
 
-} mpc_input_t;
+  int flags;
+  mpc_arena_t *arena;
+
+  size_t spans_used;
+  mpc_span_t *spans_free;
+  mpc_span_t *spans;
+
+  mpc_err_t err_flight;
+  int err_flight_id;
+  mpc_state_t err_state;
+  const char *err_failure;
+  int err_expected_num;
+  int err_expected_slots;
+  int *err_expected;
+  int err_seen_words;
+  unsigned long *err_seen;
+
+  mpc_label_t *labels;
+  int labels_num;
+  int labels_slots;
+  int *labels_table;
+  size_t labels_table_size;
+  mpc_label_edge_t *label_edges;
+  size_t label_edges_num;
+  size_t label_edges_size;
+
+  unsigned long rewinds;
+  mpc_profile_t *profile;
+  mpc_trace_t *trace;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+} mpc_input_t;
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+/* Resets everything which belongs to a single parse */
 
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
+static void mpc_input_init(mpc_input_t *i, const char *string, size_t length) {
 
   i->state = mpc_state_new();
 
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
-  i->buffer = NULL;
-  i->file = NULL;
+  i->string = string;
+  i->length = length;
+  i->string_pos = 0;
+  i->partial = 0;
+  i->starved = 0;
+  i->recognize = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
   i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
-
-  return i;
+  i->arena = NULL;
 }
 
-static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+static mpc_input_t *mpc_input_new(const char *filename, int type) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
 
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
+  i->type = type;
+  i->file = NULL;
 
-  i->state = mpc_state_new();
+  mpc_input_init(i, NULL, 0);
 
-  i->string = malloc(length + 1);
-  strncpy(i->string, string, length);
-  i->string[length] = '\0';
   i->buffer = NULL;
-  i->file = NULL;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
+  i->buffer_pos = 0;
+  i->buffer_eof = 0;
+
+  i->map = NULL;
+  i->map_length = 0;
+  i->map_offset = 0;
 
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->mem_num = MPC_INPUT_MEM_NUM;
+  i->mem_used = 0;
+  i->mem_free = NULL;
+  i->mem = NULL;
+  memset(&i->mem_stats, 0, sizeof(mpc_pool_stats_t));
+
+  i->flags = MPC_CONTEXT_DEFAULT;
+
+  i->spans_used = 0;
+  i->spans_free = NULL;
+  i->spans = NULL;
+
+  i->err_flight_id = -1;
+  i->err_state = mpc_state_invalid();
+  i->err_failure = NULL;
+  i->err_expected_num = 0;
+  i->err_expected_slots = 0;
+  i->err_expected = NULL;
+  i->err_seen_words = 0;
+  i->err_seen = NULL;
+
+  i->labels = NULL;
+  i->labels_num = 0;
+  i->labels_slots = 0;
+  i->labels_table = NULL;
+  i->labels_table_size = 0;
+  i->label_edges = NULL;
+  i->label_edges_num = 0;
+  i->label_edges_size = 0;
+
+  i->rewinds = 0;
+  i->profile = NULL;
+  i->trace = NULL;
+
+  return i;
+}
 
+static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_STRING);
+  mpc_input_init(i, string, length);
   return i;
+}
 
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+  return mpc_input_new_nstring(filename, string, strlen(string));
 }
 
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_PIPE);
+  i->file = pipe;
+  return i;
+}
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+#ifdef MPC_USE_POSIX
 
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
+static mpc_input_t *mpc_input_new_mapped(const char *filename, FILE *file, int *seekable) {
 
-  i->type = MPC_INPUT_PIPE;
-  i->state = mpc_state_new();
+  mpc_input_t *i;
+  struct stat st;
+  long offset;
+  void *map;
 
-  i->string = NULL;
-  i->buffer = NULL;
-  i->file = pipe;
+  *seekable = 1;
 
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
+  if (fstat(fileno(file), &st) != 0) { return NULL; }
+  if (!S_ISREG(st.st_mode)) { *seekable = 0; return NULL; }
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  offset = ftell(file);
+  if (offset < 0 || (off_t)offset > st.st_size) { return NULL; }
 
-  return i;
+  if (st.st_size == 0) {
+    i = mpc_input_new_nstring(filename, "", 0);
+    i->file = file;
+    return i;
+  }
 
+#ifdef MPC_USE_MMAP
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+  if (map == MAP_FAILED) { return NULL; }
+#else
+  (void)map;
+  return NULL;
+#endif
+
+  i = mpc_input_new_nstring(filename, (char*)map + offset, (size_t)(st.st_size - offset));
+  i->file = file;
+  i->map = map;
+  i->map_length = (size_t)st.st_size;
+  i->map_offset = offset;
+  return i;
 }
 
+#endif
+
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  mpc_input_t *i;
 
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_FILE;
-  i->state = mpc_state_new();
+#ifdef MPC_USE_POSIX
+  int seekable;
+  i = mpc_input_new_mapped(filename, file, &seekable);
+  if (i) { return i; }
+  if (!seekable) { return mpc_input_new_pipe(filename, file); }
+#endif
 
-  i->string = NULL;
-  i->buffer = NULL;
+  i = mpc_input_new(filename, MPC_INPUT_FILE);
   i->file = file;
-
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
-
   return i;
 }
 
+static void mpc_labels_delete(mpc_input_t *i);
+
 static void mpc_input_delete(mpc_input_t *i) {
 
   free(i->filename);
 
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
 
+  /* Leave the file positioned after the consumed input */
+  if (i->type == MPC_INPUT_STRING && i->file) {
+    fseek(i->file, i->map_offset + i->state.pos, SEEK_SET);
+  }
+
+#ifdef MPC_USE_MMAP
+  if (i->map) { munmap(i->map, i->map_length); }
+#endif
+
   free(i->marks);
   free(i->lasts);
+  free(i->mem);
+  free(i->spans);
+  free(i->err_expected);
+  free(i->err_seen);
+  mpc_labels_delete(i);
   free(i);
 }
 
+/*
+** Blocks which have been freed are threaded
+** onto a free list through their own storage.
+** Blocks never handed out yet are taken from
+** the end of the used part of the pool so it
+** never has to be initialised.
+*/
+
 static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+  return i->mem && (size_t)((char*)p - (char*)i->mem) < i->mem_num * sizeof(mpc_mem_t);
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
-  char *p;
 
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  mpc_mem_t *p;
 
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+  if (n > sizeof(mpc_mem_t)) {
+    i->mem_stats.large++;
+    return malloc(n);
+  }
+
+  if (i->mem_free) {
+    p = i->mem_free;
+    i->mem_free = p->next;
+    i->mem_stats.hits++;
+    return p;
+  }
+
+  if (i->mem_used < i->mem_num) {
+    if (i->mem == NULL) { i->mem = malloc(sizeof(mpc_mem_t) * i->mem_num); }
+    p = i->mem + i->mem_used++;
+    i->mem_stats.hits++;
+    return p;
+  }
 
+  i->mem_stats.full++;
   return malloc(n);
 }
 
@@ -260,11 +443,67 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
   return x;
 }
 
+/*
+** In span mode the text matched by the basic
+** parsers is not copied. Instead their output
+** is a span of the input string, which is only
+** turned into a real string when it is passed
+** somewhere that expects one. Spans are given
+** out from their own block so that they can be
+** told apart from other values by address. If
+** it runs out then plain strings are used.
+*/
+
+static int mpc_span_ptr(mpc_input_t *i, void *p) {
+  return i->spans && (size_t)((char*)p - (char*)i->spans) < MPC_INPUT_SPAN_NUM * sizeof(mpc_span_t);
+}
+
+static mpc_span_t *mpc_span_new(mpc_input_t *i, long pos, size_t length) {
+
+  mpc_span_t *p;
+
+  if (i->spans_free) {
+    p = i->spans_free;
+    i->spans_free = p->next;
+  } else if (i->spans_used < MPC_INPUT_SPAN_NUM) {
+    if (i->spans == NULL) { i->spans = malloc(sizeof(mpc_span_t) * MPC_INPUT_SPAN_NUM); }
+    p = i->spans + i->spans_used++;
+  } else {
+    return NULL;
+  }
+
+  p->s.start = i->string + (pos - i->string_pos);
+  p->s.length = length;
+  return p;
+}
+
+static void mpc_span_free(mpc_input_t *i, mpc_span_t *p) {
+  p->next = i->spans_free;
+  i->spans_free = p;
+}
+
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
-  if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  mpc_mem_t *q = p;
+  if (!mpc_mem_ptr(i, p)) {
+    if (mpc_span_ptr(i, p)) { mpc_span_free(i, p); return; }
+    free(p);
+    return;
+  }
+  q->next = i->mem_free;
+  i->mem_free = q;
+}
+
+static char *mpc_span_string(mpc_input_t *i, mpc_span_t *p, int heap) {
+  char *x = heap ? malloc(p->s.length + 1) : mpc_malloc(i, p->s.length + 1);
+  memcpy(x, p->s.start, p->s.length);
+  x[p->s.length] = '\0';
+  mpc_span_free(i, p);
+  return x;
+}
+
+/* Turns a span into a string before the value is handed to a user function */
+static void *mpc_span_out(mpc_input_t *i, void *p) {
+  return mpc_span_ptr(i, p) ? mpc_span_string(i, p, 0) : p;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
@@ -285,7 +524,9 @@ static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
-  if (!mpc_mem_ptr(i, p)) { return p; }
+  if (!mpc_mem_ptr(i, p)) {
+    return mpc_span_ptr(i, p) ? mpc_span_string(i, p, 1) : p;
+  }
   q = malloc(sizeof(mpc_mem_t));
   memcpy(q, p, sizeof(mpc_mem_t));
   mpc_free(i, p);
@@ -313,14 +554,9 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
@@ -335,15 +571,16 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
   }
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
+}
 
-    free(i->buffer);
-    i->buffer = NULL;
-  }
+enum {
+  MPC_TRACE_ENTER   = 0,
+  MPC_TRACE_SUCCESS = 1,
+  MPC_TRACE_FAILURE = 2,
+  MPC_TRACE_REWIND  = 3
+};
 
-}
+static void mpc_trace_add(mpc_trace_t *t, mpc_parser_t *p, long pos, int type);
 
 static void mpc_input_rewind(mpc_input_t *i) {
 
@@ -351,6 +588,8 @@ static void mpc_input_rewind(mpc_input_t *i) {
 
   i->state = i->marks[i->marks_num-1];
   i->last  = i->lasts[i->marks_num-1];
+  i->rewinds++;
+  if (i->trace) { mpc_trace_add(i->trace, NULL, i->state.pos, MPC_TRACE_REWIND); }
 
   if (i->type == MPC_INPUT_FILE) {
     fseek(i->file, i->state.pos, SEEK_SET);
@@ -359,12 +598,49 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+enum {
+  MPC_INPUT_PIPE_CHUNK = 4096
+};
+
+static int mpc_input_buffer_fill(mpc_input_t *i) {
+
+  size_t drop, n;
+  long keep;
+
+  if ((size_t)(i->state.pos - i->buffer_pos) < i->buffer_len) { return 1; }
+  if (i->buffer_eof) { return 0; }
+
+  /* Drop input which no mark can rewind back into */
+  keep = i->marks_num > 0 ? i->marks[0].pos : i->state.pos;
+  drop = (size_t)(keep - i->buffer_pos);
+  if (drop > 0 && drop >= i->buffer_len / 2) {
+    memmove(i->buffer, i->buffer + drop, i->buffer_len - drop);
+    i->buffer_len -= drop;
+    i->buffer_pos += (long)drop;
+  }
+
+  if (i->buffer_slots - i->buffer_len < MPC_INPUT_PIPE_CHUNK) {
+    i->buffer_slots = i->buffer_len + i->buffer_len / 2 + MPC_INPUT_PIPE_CHUNK;
+    i->buffer = realloc(i->buffer, i->buffer_slots);
+  }
+
+  /* A short read only happens at the end of the stream or on an error */
+  n = fread(i->buffer + i->buffer_len, 1, i->buffer_slots - i->buffer_len, i->file);
+  if (n < i->buffer_slots - i->buffer_len) { i->buffer_eof = 1; }
+
+  i->buffer_len += n;
+  return n > 0;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  return mpc_input_buffer_fill(i) ? i->buffer[i->state.pos - i->buffer_pos] : '\0';
+}
+
+static char mpc_input_string_at(mpc_input_t *i) {
+  size_t j = (size_t)(i->state.pos - i->string_pos);
+  if (j < i->length) { return i->string[j]; }
+  if (i->partial) { i->starved = 1; }
+  return '\0';
 }
 
 static char mpc_input_getc(mpc_input_t *i) {
@@ -373,19 +649,9 @@ static char mpc_input_getc(mpc_input_t *i) {
 
   switch (i->type) {
 
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return mpc_input_string_at(i);
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) { c = getc(i->file); return c; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
+    case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
 
     default: return c;
   }
@@ -396,7 +662,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
 
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return mpc_input_string_at(i);
     case MPC_INPUT_FILE:
 
       c = fgetc(i->file);
@@ -405,23 +671,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
       fseek(i->file, -1, SEEK_CUR);
       return c;
 
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
+    case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
 
     default: return c;
   }
@@ -434,19 +684,12 @@ static int mpc_input_terminated(mpc_input_t *i) {
 
 static int mpc_input_failure(mpc_input_t *i, char c) {
 
+  (void)c;
+
   switch (i->type) {
     case MPC_INPUT_STRING: { break; }
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file);
-      }
-    }
+    case MPC_INPUT_PIPE: { break; }
     default: { break; }
   }
   return 0;
@@ -454,11 +697,14 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+  if (o && i->recognize) {
+    *o = NULL;
+    o = NULL;
+  }
+
+  if (o && (i->flags & MPC_CONTEXT_AST_SPANS)) {
+    *o = (char*)mpc_span_new(i, i->state.pos, 1);
+    if (*o) { o = NULL; }
   }
 
   i->last = c;
@@ -521,25 +767,200 @@ static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
   return cond(x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
+/*
+** When the whole input is in memory and failure
+** rewinds anyway, a literal can be tested with a
+** single `memcmp` against the remaining bytes and
+** the position moved on in one step, rather than
+** matching it a character at a time under a mark.
+*/
+
+static int mpc_input_string_bulk(mpc_input_t *i, const char *c, size_t len) {
+
+  const char *x;
+  size_t j = (size_t)(i->state.pos - i->string_pos);
+  size_t n = j < i->length ? i->length - j : 0;
+
+  if (n > len) { n = len; }
+  if (n && memcmp(i->string + j, c, n) != 0) { return 0; }
+  if (n < len) {
+    if (i->partial) { i->starved = 1; }
+    return 0;
+  }
+
+  for (x = c; x < c + len; x++) {
+    i->state.col++;
+    if (*x == '\n') {
+      i->state.col = 0;
+      i->state.row++;
+    }
+  }
+
+  i->state.pos += (long)len;
+  if (len) { i->last = c[len-1]; }
+  return 1;
+}
+
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
 
   const char *x = c;
+  long start = i->state.pos;
+  size_t len = strlen(c);
 
-  mpc_input_mark(i);
-  while (*x) {
-    if (!mpc_input_char(i, *x, NULL)) {
-      mpc_input_rewind(i);
-      return 0;
+  if (i->type == MPC_INPUT_STRING && i->backtrack >= 1) {
+    if (!mpc_input_string_bulk(i, c, len)) { return 0; }
+  } else {
+    mpc_input_mark(i);
+    while (*x) {
+      if (!mpc_input_char(i, *x, NULL)) {
+        mpc_input_rewind(i);
+        return 0;
+      }
+      x++;
     }
-    x++;
+    mpc_input_unmark(i);
+  }
+
+  if (i->recognize) {
+    *o = NULL;
+    return 1;
+  }
+
+  if (i->flags & MPC_CONTEXT_AST_SPANS) {
+    *o = (char*)mpc_span_new(i, start, (size_t)(i->state.pos - start));
+    if (*o) { return 1; }
+  }
+
+  *o = mpc_malloc(i, len + 1);
+  memcpy(*o, c, len + 1);
+  return 1;
+}
+
+/*
+** Character sets are bitmaps of which of the
+** 256 byte values they match. A span matches as
+** many characters from its set as it can, like
+** `many` of the set folded with `mpcf_strfold`,
+** but without a result for each character.
+*/
+
+enum {
+  MPC_SET_BYTES = 32
+};
+
+#define MPC_SET_HAS(s, c) ((s)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+
+static int mpc_input_set(mpc_input_t *i, const unsigned char *s, char **o) {
+  char x;
+  if (mpc_input_terminated(i)) { return 0; }
+  x = mpc_input_getc(i);
+  return MPC_SET_HAS(s, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+}
+
+static int mpc_input_span(mpc_input_t *i, const unsigned char *s, int n, char **o) {
+
+  char x;
+  char *y = NULL;
+  const char *c, *end;
+  long start = i->state.pos;
+  size_t length, slots = 0;
+
+  if (i->type == MPC_INPUT_STRING) {
+    c = i->string + (start - i->string_pos);
+    end = i->string + i->length;
+    while (c < end && MPC_SET_HAS(s, *c)) {
+      i->last = *c;
+      i->state.pos++;
+      i->state.col++;
+      if (*c == '\n') {
+        i->state.col = 0;
+        i->state.row++;
+      }
+      c++;
+    }
+    if (c == end && i->partial) { i->starved = 1; }
+  } else {
+    while (!mpc_input_terminated(i)) {
+      x = mpc_input_getc(i);
+      if (!MPC_SET_HAS(s, x)) { mpc_input_failure(i, x); break; }
+      mpc_input_success(i, x, NULL);
+      if (i->recognize) { continue; }
+      length = (size_t)(i->state.pos - start);
+      if (length + 1 > slots) {
+        slots = slots ? slots * 2 : 16;
+        y = mpc_realloc(i, y, slots);
+      }
+      y[length - 1] = x;
+    }
+  }
+
+  length = (size_t)(i->state.pos - start);
+  if (length < (size_t)n) { return 0; }
+
+  if (i->recognize) {
+    *o = NULL;
+    return 1;
   }
-  mpc_input_unmark(i);
 
-  *o = mpc_malloc(i, strlen(c) + 1);
-  strcpy(*o, c);
+  if (length == 0) {
+    *o = mpc_calloc(i, 1, 1);
+    return 1;
+  }
+
+  if (i->flags & MPC_CONTEXT_AST_SPANS) {
+    *o = (char*)mpc_span_new(i, start, length);
+    if (*o) { mpc_free(i, y); return 1; }
+  }
+
+  if (y == NULL) {
+    y = mpc_malloc(i, length + 1);
+    memcpy(y, i->string + (start - i->string_pos), length);
+  }
+
+  y[length] = '\0';
+  *o = y;
   return 1;
 }
 
+/*
+** Skipping whitespace never fails and gives no
+** result, so a run of it is stepped over without
+** building a string. Only the last newline in
+** the run decides the column it ends on. Running
+** into the end of partial input does not make the
+** parse wait for more, as `mpc_blank` never did.
+*/
+
+#define MPC_BLANK_HAS(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+
+static void mpc_input_blank(mpc_input_t *i) {
+
+  char x;
+  const char *c, *end, *start, *nl = NULL;
+  int starved = i->starved;
+
+  if (i->type == MPC_INPUT_STRING) {
+    start = c = i->string + (i->state.pos - i->string_pos);
+    end = i->string + i->length;
+    while (c < end && MPC_BLANK_HAS(*c)) {
+      if (*c == '\n') { nl = c; i->state.row++; }
+      c++;
+    }
+    if (c == start) { return; }
+    i->state.col = nl ? (long)(c - nl - 1) : i->state.col + (long)(c - start);
+    i->state.pos += (long)(c - start);
+    i->last = c[-1];
+    return;
+  }
+
+  while (!mpc_input_terminated(i)) {
+    x = mpc_input_getc(i);
+    if (!MPC_BLANK_HAS(x)) { mpc_input_failure(i, x); break; }
+    mpc_input_success(i, x, NULL);
+  }
+  i->starved = starved;
+}
+
 static int mpc_input_anchor(mpc_input_t* i, int(*f)(char,char), char **o) {
   *o = NULL;
   return f(i->last, mpc_input_peekc(i));
@@ -663,38 +1084,7 @@ char *mpc_err_string(mpc_err_t *x) {
   return realloc(buffer, strlen(buffer) + 1);
 }
 
-static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
-  mpc_err_t *x;
-  if (i->suppress) { return NULL; }
-  x = mpc_malloc(i, sizeof(mpc_err_t));
-  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
-  strcpy(x->filename, i->filename);
-  x->state = i->state;
-  x->expected_num = 1;
-  x->expected = mpc_malloc(i, sizeof(char*));
-  x->expected[0] = mpc_malloc(i, strlen(expected) + 1);
-  strcpy(x->expected[0], expected);
-  x->failure = NULL;
-  x->received = mpc_input_peekc(i);
-  return x;
-}
-
-static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
-  mpc_err_t *x;
-  if (i->suppress) { return NULL; }
-  x = mpc_malloc(i, sizeof(mpc_err_t));
-  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
-  strcpy(x->filename, i->filename);
-  x->state = i->state;
-  x->expected_num = 0;
-  x->expected = NULL;
-  x->failure = mpc_malloc(i, strlen(failure) + 1);
-  strcpy(x->failure, failure);
-  x->received = ' ';
-  return x;
-}
-
-static mpc_err_t *mpc_err_file(const char *filename, const char *failure) {
+static mpc_err_t *mpc_err_file(const char *filename, const char *failure) {
   mpc_err_t *x;
   x = malloc(sizeof(mpc_err_t));
   x->filename = malloc(strlen(filename) + 1);
@@ -708,174 +1098,6 @@ static mpc_err_t *mpc_err_file(const char *filename, const char *failure) {
   return x;
 }
 
-static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
-  int j;
-  if (x == NULL) { return; }
-  for (j = 0; j < x->expected_num; j++) { mpc_free(i, x->expected[j]); }
-  mpc_free(i, x->expected);
-  mpc_free(i, x->filename);
-  mpc_free(i, x->failure);
-  mpc_free(i, x);
-}
-
-static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
-  int j;
-  for (j = 0; j < x->expected_num; j++) {
-    x->expected[j] = mpc_export(i, x->expected[j]);
-  }
-  x->expected = mpc_export(i, x->expected);
-  x->filename = mpc_export(i, x->filename);
-  x->failure = mpc_export(i, x->failure);
-  return mpc_export(i, x);
-}
-
-static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
-  int j;
-  (void)i;
-  for (j = 0; j < x->expected_num; j++) {
-    if (strcmp(x->expected[j], expected) == 0) { return 1; }
-  }
-  return 0;
-}
-
-static void mpc_err_add_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
-  (void)i;
-  x->expected_num++;
-  x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-  x->expected[x->expected_num-1] = mpc_malloc(i, strlen(expected) + 1);
-  strcpy(x->expected[x->expected_num-1], expected);
-}
-
-static mpc_err_t *mpc_err_or(mpc_input_t *i, mpc_err_t** x, int n) {
-
-  int j, k, fst;
-  mpc_err_t *e;
-
-  fst = -1;
-  for (j = 0; j < n; j++) {
-    if (x[j] != NULL) { fst = j; }
-  }
-
-  if (fst == -1) { return NULL; }
-
-  e = mpc_malloc(i, sizeof(mpc_err_t));
-  e->state = mpc_state_invalid();
-  e->expected_num = 0;
-  e->expected = NULL;
-  e->failure = NULL;
-  e->filename = mpc_malloc(i, strlen(x[fst]->filename)+1);
-  strcpy(e->filename, x[fst]->filename);
-
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    if (x[j]->state.pos > e->state.pos) { e->state = x[j]->state; }
-  }
-
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    if (x[j]->state.pos < e->state.pos) { continue; }
-
-    if (x[j]->failure) {
-      e->failure = mpc_malloc(i, strlen(x[j]->failure)+1);
-      strcpy(e->failure, x[j]->failure);
-      break;
-    }
-
-    e->received = x[j]->received;
-
-    for (k = 0; k < x[j]->expected_num; k++) {
-      if (!mpc_err_contains_expected(i, e, x[j]->expected[k])) {
-        mpc_err_add_expected(i, e, x[j]->expected[k]);
-      }
-    }
-  }
-
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    mpc_err_delete_internal(i, x[j]);
-  }
-
-  return e;
-}
-
-static mpc_err_t *mpc_err_repeat(mpc_input_t *i, mpc_err_t *x, const char *prefix) {
-
-  int j = 0;
-  size_t l = 0;
-  char *expect = NULL;
-
-  if (x == NULL) { return NULL; }
-
-  if (x->expected_num == 0) {
-    expect = mpc_calloc(i, 1, 1);
-    x->expected_num = 1;
-    x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-    x->expected[0] = expect;
-    return x;
-  }
-
-  else if (x->expected_num == 1) {
-    expect = mpc_malloc(i, strlen(prefix) + strlen(x->expected[0]) + 1);
-    strcpy(expect, prefix);
-    strcat(expect, x->expected[0]);
-    mpc_free(i, x->expected[0]);
-    x->expected[0] = expect;
-    return x;
-  }
-
-  else if (x->expected_num > 1) {
-
-    l += strlen(prefix);
-    for (j = 0; j < x->expected_num-2; j++) {
-      l += strlen(x->expected[j]) + strlen(", ");
-    }
-    l += strlen(x->expected[x->expected_num-2]);
-    l += strlen(" or ");
-    l += strlen(x->expected[x->expected_num-1]);
-
-    expect = mpc_malloc(i, l + 1);
-
-    strcpy(expect, prefix);
-    for (j = 0; j < x->expected_num-2; j++) {
-      strcat(expect, x->expected[j]); strcat(expect, ", ");
-    }
-    strcat(expect, x->expected[x->expected_num-2]);
-    strcat(expect, " or ");
-    strcat(expect, x->expected[x->expected_num-1]);
-
-    for (j = 0; j < x->expected_num; j++) { mpc_free(i, x->expected[j]); }
-
-    x->expected_num = 1;
-    x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-    x->expected[0] = expect;
-    return x;
-  }
-
-  return NULL;
-}
-
-static mpc_err_t *mpc_err_many1(mpc_input_t *i, mpc_err_t *x) {
-  return mpc_err_repeat(i, x, "one or more of ");
-}
-
-static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
-  mpc_err_t *y;
-  int digits = n/10 + 1;
-  char *prefix;
-  prefix = mpc_malloc(i, digits + strlen(" of ") + 1);
-  sprintf(prefix, "%i of ", n);
-  y = mpc_err_repeat(i, x, prefix);
-  mpc_free(i, prefix);
-  return y;
-}
-
-static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
-  mpc_err_t *errs[2];
-  errs[0] = x;
-  errs[1] = y;
-  return mpc_err_or(i, errs, 2);
-}
-
 /*
 ** Parser Type
 */
@@ -914,7 +1136,11 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_CLASS      = 29,
+  MPC_TYPE_SPAN       = 30,
+  MPC_TYPE_BLANK      = 31
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -932,8 +1158,9 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; ch
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned char *first; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { unsigned char *x; int n; char *m; } mpc_pdata_set_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -953,6 +1180,7 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_set_t set;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -962,1191 +1190,5558 @@ struct mpc_parser_t {
   char retained;
 };
 
-static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
-  int j;
-  for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
-  return xs[x];
-}
+/*
+** Tag Interning
+**
+** Every distinct AST tag is stored once in a
+** global table and given a small integer id,
+** so nodes share their tag strings and can be
+** compared by id. Tags built by prefixing one
+** tag onto another are remembered per pair of
+** ids, meaning the combined string only needs
+** building the first time. Each entry also
+** lists the ids of its `|` separated parts.
+**
+** Parsers join tags while parsing, so several
+** threads sharing parsers may add to the table
+** at once. Adding and joining take a lock, and
+** entries are kept in blocks which never move.
+** New blocks and entries are published with
+** release stores and looked up by id with
+** acquire loads, so reading needs no lock.
+** Compilers without these builtins take the
+** lock for reads as well. Define
+** `MPC_NO_THREADS` to leave the lock out.
+*/
 
-static mpc_val_t *mpcf_input_fst_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 0); }
-static mpc_val_t *mpcf_input_snd_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 1); }
-static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 2); }
+typedef struct {
+  int id;
+  char *name;
+  size_t length;
+  unsigned long hash;
+  int parts_num;
+  int *parts;
+} mpc_tag_t;
 
-static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
-  int j;
-  size_t l = 0;
-  if (n == 0) { return mpc_calloc(i, 1, 1); }
-  for (j = 0; j < n; j++) { l += strlen(xs[j]); }
-  xs[0] = mpc_realloc(i, xs[0], l + 1);
-  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
-  return xs[0];
-}
+typedef struct {
+  int op;
+  int a;
+  int b;
+  int r;
+} mpc_tag_edge_t;
 
-static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
-  mpc_state_t *s = ((mpc_state_t**)xs)[0];
-  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
-  a = mpc_ast_state(a, *s);
-  mpc_free(i, s);
-  (void) n;
-  return a;
+enum {
+  MPC_TAG_ADD  = 0,
+  MPC_TAG_ROOT = 1
+};
+
+enum {
+  MPC_TAG_TABLE_MIN = 64,
+  MPC_TAG_BLOCKS    = 24
+};
+
+/* Block `k` holds `MPC_TAG_TABLE_MIN << k` entries, so each is as big as all before it */
+
+static mpc_tag_t **mpc_tags[MPC_TAG_BLOCKS];
+static int mpc_tags_num = 0;
+static int mpc_tags_ready = 0;
+
+static int *mpc_tags_table = NULL;
+static size_t mpc_tags_table_size = 0;
+
+static mpc_tag_edge_t *mpc_tag_edges = NULL;
+static size_t mpc_tag_edges_num = 0;
+static size_t mpc_tag_edges_size = 0;
+
+#ifdef MPC_USE_THREADS
+static pthread_mutex_t mpc_tags_lock = PTHREAD_MUTEX_INITIALIZER;
+static void mpc_tag_lock(void) { pthread_mutex_lock(&mpc_tags_lock); }
+static void mpc_tag_unlock(void) { pthread_mutex_unlock(&mpc_tags_lock); }
+#else
+static void mpc_tag_lock(void) { }
+static void mpc_tag_unlock(void) { }
+#endif
+
+#if defined(MPC_USE_THREADS) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#define MPC_TAG_ATOMIC
+#define MPC_TAG_LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define MPC_TAG_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#else
+#define MPC_TAG_LOAD(x) (x)
+#define MPC_TAG_STORE(x, v) ((x) = (v))
+#endif
+
+static int mpc_tag_block(int id) {
+  int k = 0, x = id / MPC_TAG_TABLE_MIN + 1;
+  while (x >>= 1) { k++; }
+  return k;
 }
 
-static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
-  int j;
-  if (f == mpcf_null)      { return mpcf_null(n, xs); }
-  if (f == mpcf_fst)       { return mpcf_fst(n, xs); }
-  if (f == mpcf_snd)       { return mpcf_snd(n, xs); }
-  if (f == mpcf_trd)       { return mpcf_trd(n, xs); }
-  if (f == mpcf_fst_free)  { return mpcf_input_fst_free(i, n, xs); }
-  if (f == mpcf_snd_free)  { return mpcf_input_snd_free(i, n, xs); }
-  if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
-  if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
-  if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
-  for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
-  return f(j, xs);
+/* Callers hold the lock, or the entry is read with an acquire load */
+
+static mpc_tag_t *mpc_tag_get(int id) {
+  int k = mpc_tag_block(id);
+  mpc_tag_t **b = MPC_TAG_LOAD(mpc_tags[k]);
+  return MPC_TAG_LOAD(b[id - MPC_TAG_TABLE_MIN * ((1 << k) - 1)]);
 }
 
-static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
-  mpc_free(i, x);
-  return NULL;
+static void mpc_tag_set(int id, mpc_tag_t *t) {
+  int k = mpc_tag_block(id);
+  MPC_TAG_STORE(mpc_tags[k][id - MPC_TAG_TABLE_MIN * ((1 << k) - 1)], t);
 }
 
-static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
-  mpc_free(i, c);
-  return a;
+static mpc_tag_t *mpc_tag_at(int id) {
+#if defined(MPC_USE_THREADS) && !defined(MPC_TAG_ATOMIC)
+  mpc_tag_t *t;
+  mpc_tag_lock();
+  t = mpc_tag_get(id);
+  mpc_tag_unlock();
+  return t;
+#else
+  return mpc_tag_get(id);
+#endif
 }
 
-static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
-  if (f == mpcf_free)     { return mpcf_input_free(i, x); }
-  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
-  return f(mpc_export(i, x));
+static unsigned long mpc_tag_hash(const char *s, size_t n) {
+  unsigned long h = 2166136261UL;
+  size_t j;
+  for (j = 0; j < n; j++) { h = (h ^ (unsigned char)s[j]) * 16777619UL; }
+  return h;
 }
 
-static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
-  return f(mpc_export(i, x), d);
+static mpc_tag_t *mpc_tag_find(const char *s, size_t n, unsigned long h) {
+
+  size_t j, mask = mpc_tags_table_size - 1;
+  mpc_tag_t *t;
+
+  if (mpc_tags_table_size == 0) { return NULL; }
+
+  for (j = h & mask; mpc_tags_table[j]; j = (j+1) & mask) {
+    t = mpc_tag_get(mpc_tags_table[j]-1);
+    if (t->hash == h && t->length == n && memcmp(t->name, s, n) == 0) { return t; }
+  }
+
+  return NULL;
 }
 
-static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
-  if (d == free) { mpc_free(i, x); return; }
-  d(mpc_export(i, x));
+static void mpc_tag_table_insert(mpc_tag_t *t) {
+  size_t j, mask = mpc_tags_table_size - 1;
+  for (j = t->hash & mask; mpc_tags_table[j]; j = (j+1) & mask);
+  mpc_tags_table[j] = t->id + 1;
 }
 
-enum {
-  MPC_PARSE_STACK_MIN = 4
-};
+/* Callers hold the lock */
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+static mpc_tag_t *mpc_tag_insert(const char *s, size_t n) {
 
-#define MPC_MAX_RECURSION_DEPTH 1000
+  unsigned long h = mpc_tag_hash(s, n);
+  mpc_tag_t *t = mpc_tag_find(s, n, h);
+  int *parts = NULL;
+  int parts_num = 0;
+  size_t j, k;
+  int i;
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+  if (t) { return t; }
 
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+  /* The tags of the nodes AST parsers make for themselves are always there */
+  if (!mpc_tags_ready) {
+    mpc_tags_ready = 1;
+    mpc_tag_insert("", 0);
+    mpc_tag_insert(">", 1);
+    return mpc_tag_insert(s, n);
+  }
 
-  if (depth == MPC_MAX_RECURSION_DEPTH)
-  {
-    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+  /* Intern the parts first so they get their ids before this tag */
+  if (memchr(s, '|', n)) {
+    for (j = 0, k = 0; j <= n; j++) {
+      if (j < n && s[j] != '|') { continue; }
+      parts = realloc(parts, sizeof(int) * (parts_num + 1));
+      parts[parts_num++] = mpc_tag_insert(s + k, j - k)->id;
+      k = j + 1;
+    }
   }
 
-  switch (p->type) {
+  if ((size_t)(mpc_tags_num + 1) * 2 > mpc_tags_table_size) {
+    free(mpc_tags_table);
+    mpc_tags_table_size = mpc_tags_table_size ? mpc_tags_table_size * 2 : MPC_TAG_TABLE_MIN;
+    mpc_tags_table = calloc(mpc_tags_table_size, sizeof(int));
+    for (i = 0; i < mpc_tags_num; i++) { mpc_tag_table_insert(mpc_tag_get(i)); }
+  }
 
-    /* Basic Parsers */
+  /* A full block is followed by a new one, as the id is the first past the end of it */
+  i = mpc_tags_num / MPC_TAG_TABLE_MIN + 1;
+  if ((i & (i - 1)) == 0 && mpc_tags_num % MPC_TAG_TABLE_MIN == 0) {
+    for (k = 0; i >>= 1; k++);
+    MPC_TAG_STORE(mpc_tags[k], (mpc_tag_t**)malloc(sizeof(mpc_tag_t*) * (MPC_TAG_TABLE_MIN << k)));
+  }
 
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
-    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
-    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
+  t = malloc(sizeof(mpc_tag_t));
+  t->id = mpc_tags_num;
+  t->name = malloc(n + 1);
+  memcpy(t->name, s, n);
+  t->name[n] = '\0';
+  t->length = n;
+  t->hash = h;
+
+  if (parts == NULL) {
+    parts = malloc(sizeof(int));
+    parts[parts_num++] = t->id;
+  }
+  t->parts_num = parts_num;
+  t->parts = parts;
 
-    /* Other parsers */
+  mpc_tag_set(mpc_tags_num++, t);
+  mpc_tag_table_insert(t);
+  return t;
+}
 
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+static mpc_tag_t *mpc_tag_intern(const char *s, size_t n) {
+  mpc_tag_t *t;
+  mpc_tag_lock();
+  t = mpc_tag_insert(s, n);
+  mpc_tag_unlock();
+  return t;
+}
 
-    /* Application Parsers */
+static size_t mpc_tag_edge_slot(int op, int a, int b) {
+  size_t j, mask = mpc_tag_edges_size - 1;
+  j = ((size_t)a * 31 + (size_t)b) * 3 + (size_t)op;
+  for (j = j & mask; mpc_tag_edges[j].a != -1; j = (j+1) & mask) {
+    if (mpc_tag_edges[j].op == op && mpc_tag_edges[j].a == a && mpc_tag_edges[j].b == b) { break; }
+  }
+  return j;
+}
 
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
+static mpc_tag_t *mpc_tag_join(int op, int a, int b) {
 
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  mpc_tag_edge_t *old;
+  mpc_tag_t *x = mpc_tag_at(a), *y = mpc_tag_at(b), *t;
+  size_t j, n, old_size;
+  char *s;
 
-    case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
-        if (p->data.check.f(&r->output)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  mpc_tag_lock();
 
-    case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
-        if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  if (mpc_tag_edges_size) {
+    j = mpc_tag_edge_slot(op, a, b);
+    if (mpc_tag_edges[j].a != -1) {
+      t = mpc_tag_get(mpc_tag_edges[j].r);
+      mpc_tag_unlock();
+      return t;
+    }
+  }
 
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
+  /* `ADD` joins the tags with a separator, `ROOT` drops the last character of the first */
+  n = op == MPC_TAG_ADD ? x->length + 1 : (x->length ? x->length - 1 : 0);
+  s = malloc(n + y->length + 1);
+  memcpy(s, x->name, n);
+  if (op == MPC_TAG_ADD) { s[n-1] = '|'; }
+  memcpy(s + n, y->name, y->length);
+  t = mpc_tag_insert(s, n + y->length);
+  free(s);
 
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
+  if ((mpc_tag_edges_num + 1) * 2 > mpc_tag_edges_size) {
+    old = mpc_tag_edges;
+    old_size = mpc_tag_edges_size;
+    mpc_tag_edges_size = mpc_tag_edges_size ? mpc_tag_edges_size * 2 : MPC_TAG_TABLE_MIN;
+    mpc_tag_edges = malloc(sizeof(mpc_tag_edge_t) * mpc_tag_edges_size);
+    for (j = 0; j < mpc_tag_edges_size; j++) { mpc_tag_edges[j].a = -1; }
+    for (j = 0; j < old_size; j++) {
+      if (old[j].a != -1) { mpc_tag_edges[mpc_tag_edge_slot(old[j].op, old[j].a, old[j].b)] = old[j]; }
+    }
+    free(old);
+  }
 
-    /* Optional Parsers */
+  j = mpc_tag_edge_slot(op, a, b);
+  mpc_tag_edges[j].op = op;
+  mpc_tag_edges[j].a = a;
+  mpc_tag_edges[j].b = b;
+  mpc_tag_edges[j].r = t->id;
+  mpc_tag_edges_num++;
 
-    /* TODO: Update Not Error Message */
+  mpc_tag_unlock();
+  return t;
+}
 
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+static int mpc_tag_count(void) {
+  int n;
+  mpc_tag_lock();
+  n = mpc_tags_num;
+  mpc_tag_unlock();
+  return n;
+}
 
-    case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+int mpc_tag_id(const char *name) {
+  mpc_tag_t *t;
+  size_t n = strlen(name);
+  mpc_tag_lock();
+  t = mpc_tag_find(name, n, mpc_tag_hash(name, n));
+  mpc_tag_unlock();
+  return t ? t->id : -1;
+}
 
-    /* Repeat Parsers */
+const char *mpc_tag_name(int id) {
+  return id >= 0 && id < mpc_tag_count() ? mpc_tag_at(id)->name : NULL;
+}
 
-    case MPC_TYPE_MANY:
+void mpc_tag_cleanup(void) {
 
-      results = results_stk;
+  int j;
+  mpc_tag_t *t;
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
+  mpc_tag_lock();
 
-      *e = mpc_err_merge(i, *e, results[j].error);
+  for (j = 0; j < mpc_tags_num; j++) {
+    t = mpc_tag_get(j);
+    free(t->name);
+    free(t->parts);
+    free(t);
+  }
 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+  for (j = 0; j < MPC_TAG_BLOCKS; j++) {
+    free(mpc_tags[j]);
+    mpc_tags[j] = NULL;
+  }
 
-    case MPC_TYPE_MANY1:
+  free(mpc_tags_table);
+  free(mpc_tag_edges);
+  mpc_tags_num = 0;
+  mpc_tags_ready = 0;
+  mpc_tags_table = NULL;
+  mpc_tags_table_size = 0;
+  mpc_tag_edges = NULL;
+  mpc_tag_edges_num = 0;
+  mpc_tag_edges_size = 0;
 
-      results = results_stk;
+  mpc_tag_unlock();
+}
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
+/*
+** Labels
+**
+** What a failing parser expected is named by a
+** label. Each input interns its labels in its
+** own table, apart from the AST tags, so that
+** failing never touches anything shared and a
+** label is never split into parts. Labels made
+** by prefixing one label onto another are also
+** remembered per pair of ids. The table is kept
+** between the parses of a context.
+*/
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
+static void mpc_label_table_insert(mpc_input_t *i, int id) {
+  size_t j, mask = i->labels_table_size - 1;
+  for (j = i->labels[id].hash & mask; i->labels_table[j]; j = (j+1) & mask);
+  i->labels_table[j] = id + 1;
+}
 
-        *e = mpc_err_merge(i, *e, results[j].error);
+static int mpc_label_intern(mpc_input_t *i, const char *s, size_t n) {
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+  unsigned long h = mpc_tag_hash(s, n);
+  size_t j, mask = i->labels_table_size - 1;
+  mpc_label_t *l;
+  int k;
 
-    case MPC_TYPE_COUNT:
+  for (j = h & mask; i->labels_table_size && i->labels_table[j]; j = (j+1) & mask) {
+    l = &i->labels[i->labels_table[j]-1];
+    if (l->hash == h && l->length == n && memcmp(l->name, s, n) == 0) { return i->labels_table[j]-1; }
+  }
 
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+  if (i->labels_num == i->labels_slots) {
+    i->labels_slots = i->labels_slots ? i->labels_slots * 2 : MPC_TAG_TABLE_MIN;
+    i->labels = realloc(i->labels, sizeof(mpc_label_t) * i->labels_slots);
+  }
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
+  l = &i->labels[i->labels_num];
+  l->name = malloc(n + 1);
+  memcpy(l->name, s, n);
+  l->name[n] = '\0';
+  l->length = n;
+  l->hash = h;
+
+  if ((size_t)(i->labels_num + 1) * 2 > i->labels_table_size) {
+    free(i->labels_table);
+    i->labels_table_size = i->labels_table_size ? i->labels_table_size * 2 : MPC_TAG_TABLE_MIN;
+    i->labels_table = calloc(i->labels_table_size, sizeof(int));
+    for (k = 0; k < i->labels_num; k++) { mpc_label_table_insert(i, k); }
+  }
 
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
-        }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+  mpc_label_table_insert(i, i->labels_num);
+  return i->labels_num++;
+}
 
-    /* Combinatory Parsers */
+static size_t mpc_label_edge_slot(mpc_input_t *i, int a, int b) {
+  size_t j, mask = i->label_edges_size - 1;
+  for (j = ((size_t)a * 31 + (size_t)b) & mask; i->label_edges[j].a != -1; j = (j+1) & mask) {
+    if (i->label_edges[j].a == a && i->label_edges[j].b == b) { break; }
+  }
+  return j;
+}
 
-    case MPC_TYPE_OR:
+static int mpc_label_join(mpc_input_t *i, int a, int b) {
 
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+  mpc_label_edge_t *old = i->label_edges;
+  size_t j, old_size = i->label_edges_size, n = i->labels[a].length;
+  char *s;
+  int r;
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+  if (i->label_edges_size) {
+    j = mpc_label_edge_slot(i, a, b);
+    if (i->label_edges[j].a != -1) { return i->label_edges[j].r; }
+  }
 
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        }
-      }
+  s = malloc(n + i->labels[b].length + 1);
+  memcpy(s, i->labels[a].name, n);
+  memcpy(s + n, i->labels[b].name, i->labels[b].length);
+  r = mpc_label_intern(i, s, n + i->labels[b].length);
+  free(s);
 
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+  if ((i->label_edges_num + 1) * 2 > i->label_edges_size) {
+    i->label_edges_size = i->label_edges_size ? i->label_edges_size * 2 : MPC_TAG_TABLE_MIN;
+    i->label_edges = malloc(sizeof(mpc_label_edge_t) * i->label_edges_size);
+    for (j = 0; j < i->label_edges_size; j++) { i->label_edges[j].a = -1; }
+    for (j = 0; j < old_size; j++) {
+      if (old[j].a != -1) { i->label_edges[mpc_label_edge_slot(i, old[j].a, old[j].b)] = old[j]; }
+    }
+    free(old);
+  }
 
-    case MPC_TYPE_AND:
+  j = mpc_label_edge_slot(i, a, b);
+  i->label_edges[j].a = a;
+  i->label_edges[j].b = b;
+  i->label_edges[j].r = r;
+  i->label_edges_num++;
+  return r;
+}
 
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+static void mpc_labels_delete(mpc_input_t *i) {
+  int j;
+  for (j = 0; j < i->labels_num; j++) { free(i->labels[j].name); }
+  free(i->labels);
+  free(i->labels_table);
+  free(i->label_edges);
+}
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+/*
+** Expected Sets
+**
+** Without lazy errors, what a failure expected
+** is kept as a list of label ids in the order
+** they were added. Once the list grows past a
+** few entries a bitset of the same ids is kept
+** alongside it, so merging the errors of a wide
+** `or` tests each id with one lookup instead of
+** comparing strings. Errors are merged into the
+** first of them to get farthest rather than into
+** a new one, and a repeat relabels the list by
+** joining ids, which is remembered per pair, so
+** the combined string is only built once. The
+** strings and file name are only filled in when
+** the error is exported at the end of the parse.
+*/
 
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        }
-      }
-      mpc_input_unmark(i);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+enum {
+  MPC_ERR_SEEN_BITS = sizeof(unsigned long) * 8,
+  MPC_ERR_IDS_SCAN  = 8
+};
 
-    /* End */
+/* The first id is stored inline so most errors need no list */
 
-    default:
+typedef struct {
+  mpc_err_t x;
+  int id;
+  int ids_num;
+  int ids_slots;
+  int *ids;
+  int seen_words;
+  unsigned long *seen;
+} mpc_err_set_t;
+
+static mpc_err_t *mpc_err_lazy_new(mpc_input_t *i, const char *expected);
+static mpc_err_t *mpc_err_lazy_fail(mpc_input_t *i, const char *failure);
+static mpc_err_t *mpc_err_lazy_repeat(mpc_input_t *i, mpc_err_t *x, const char *prefix);
+static void mpc_err_lazy_merge(mpc_input_t *i);
+
+static mpc_err_set_t *mpc_err_set_new(mpc_input_t *i) {
+  mpc_err_set_t *s = mpc_malloc(i, sizeof(mpc_err_set_t));
+  s->x.state = i->state;
+  s->x.expected_num = 0;
+  s->x.filename = NULL;
+  s->x.failure = NULL;
+  s->x.expected = NULL;
+  s->x.received = ' ';
+  s->ids_num = 0;
+  s->ids_slots = 1;
+  s->ids = &s->id;
+  s->seen_words = 0;
+  s->seen = NULL;
+  return s;
+}
 
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
-  }
+static void mpc_err_set_mark(mpc_input_t *i, mpc_err_set_t *s, int id) {
 
-  return 0;
+  int words;
+
+  if (id / MPC_ERR_SEEN_BITS >= s->seen_words) {
+    words = id / MPC_ERR_SEEN_BITS + 1;
+    s->seen = mpc_realloc(i, s->seen, sizeof(unsigned long) * words);
+    memset(s->seen + s->seen_words, 0, sizeof(unsigned long) * (words - s->seen_words));
+    s->seen_words = words;
+  }
 
+  s->seen[id / MPC_ERR_SEEN_BITS] |= 1UL << (id % MPC_ERR_SEEN_BITS);
 }
 
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMITIVE
+static void mpc_err_set_add(mpc_input_t *i, mpc_err_set_t *s, int id) {
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
-  e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e, 0);
-  if (x) {
-    mpc_err_delete_internal(i, e);
-    r->output = mpc_export(i, r->output);
+  int j;
+
+  if (s->seen) {
+    if (id / MPC_ERR_SEEN_BITS < s->seen_words
+    && (s->seen[id / MPC_ERR_SEEN_BITS] & (1UL << (id % MPC_ERR_SEEN_BITS)))) { return; }
   } else {
-    r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
+    for (j = 0; j < s->ids_num; j++) {
+      if (s->ids[j] == id) { return; }
+    }
+  }
+
+  if (s->ids_num == s->ids_slots) {
+    s->ids_slots *= 2;
+    if (s->ids == &s->id) {
+      s->ids = mpc_malloc(i, sizeof(int) * s->ids_slots);
+      s->ids[0] = s->id;
+    } else {
+      s->ids = mpc_realloc(i, s->ids, sizeof(int) * s->ids_slots);
+    }
+  }
+  s->ids[s->ids_num++] = id;
+
+  if (s->seen) { mpc_err_set_mark(i, s, id); }
+  else if (s->ids_num == MPC_ERR_IDS_SCAN) {
+    for (j = 0; j < s->ids_num; j++) { mpc_err_set_mark(i, s, s->ids[j]); }
   }
-  return x;
 }
 
-int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_string(filename, string);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+static void mpc_err_set_clear(mpc_input_t *i, mpc_err_set_t *s) {
+  if (s->ids != &s->id) { mpc_free(i, s->ids); }
+  mpc_free(i, s->seen);
+  s->ids_num = 0;
+  s->ids_slots = 1;
+  s->ids = &s->id;
+  s->seen_words = 0;
+  s->seen = NULL;
 }
 
-int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
+  mpc_err_set_t *s;
+  if (i->suppress) { return NULL; }
+  if (i->flags & MPC_CONTEXT_LAZY_ERRORS) { return mpc_err_lazy_new(i, expected); }
+  s = mpc_err_set_new(i);
+  s->id = mpc_label_intern(i, expected, strlen(expected));
+  s->ids_num = 1;
+  s->x.received = mpc_input_peekc(i);
+  return &s->x;
 }
 
-int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
+  mpc_err_set_t *s;
+  if (i->suppress) { return NULL; }
+  if (i->flags & MPC_CONTEXT_LAZY_ERRORS) { return mpc_err_lazy_fail(i, failure); }
+  s = mpc_err_set_new(i);
+  s->x.failure = mpc_malloc(i, strlen(failure) + 1);
+  strcpy(s->x.failure, failure);
+  return &s->x;
 }
 
-int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
+  if (x == NULL) { return; }
+  mpc_err_set_clear(i, (mpc_err_set_t*)x);
+  mpc_free(i, x->failure);
+  mpc_free(i, x);
 }
 
-int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
 
-  FILE *f = fopen(filename, "rb");
-  int res;
+  int j;
+  mpc_label_t *l;
+  mpc_err_set_t *s = (mpc_err_set_t*)x;
+  mpc_err_t *y = malloc(sizeof(mpc_err_t));
 
-  if (f == NULL) {
-    r->output = NULL;
-    r->error = mpc_err_file(filename, "Unable to open file!");
-    return 0;
+  y->filename = malloc(strlen(i->filename) + 1);
+  strcpy(y->filename, i->filename);
+  y->state = x->state;
+  y->failure = NULL;
+  y->received = x->received;
+
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
   }
 
-  res = mpc_parse_file(filename, f, p, r);
-  fclose(f);
-  return res;
+  y->expected_num = s->ids_num;
+  y->expected = y->expected_num ? malloc(sizeof(char*) * y->expected_num) : NULL;
+  for (j = 0; j < y->expected_num; j++) {
+    l = &i->labels[s->ids[j]];
+    y->expected[j] = malloc(l->length + 1);
+    memcpy(y->expected[j], l->name, l->length + 1);
+  }
+
+  mpc_err_delete_internal(i, x);
+  return y;
 }
 
-/*
-** Building a Parser
-*/
+static mpc_err_t *mpc_err_or(mpc_input_t *i, mpc_err_t** x, int n) {
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+  int j, k, fst;
+  mpc_err_set_t *s, *y;
 
-static void mpc_undefine_or(mpc_parser_t *p) {
+  if (i->flags & MPC_CONTEXT_LAZY_ERRORS) {
+    for (j = 0; j < n; j++) {
+      if (x[j] != NULL) { mpc_err_lazy_merge(i); }
+    }
+    return NULL;
+  }
 
-  int i;
-  for (i = 0; i < p->data.or.n; i++) {
-    mpc_undefine_unretained(p->data.or.xs[i], 0);
+  fst = -1;
+  for (j = 0; j < n; j++) {
+    if (x[j] == NULL) { continue; }
+    if (fst == -1 || x[j]->state.pos > x[fst]->state.pos) { fst = j; }
   }
-  free(p->data.or.xs);
 
-}
+  if (fst == -1) { return NULL; }
 
-static void mpc_undefine_and(mpc_parser_t *p) {
+  s = (mpc_err_set_t*)x[fst];
 
-  int i;
-  for (i = 0; i < p->data.and.n; i++) {
-    mpc_undefine_unretained(p->data.and.xs[i], 0);
-  }
-  free(p->data.and.xs);
-  free(p->data.and.dxs);
+  /* A failure hides anything else expected at the same place */
+  for (j = fst + 1; j < n && s->x.failure == NULL; j++) {
+    if (x[j] == NULL) { continue; }
+    if (x[j]->state.pos < s->x.state.pos) { continue; }
 
-}
+    y = (mpc_err_set_t*)x[j];
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
+    if (y->x.failure) {
+      s->x.failure = y->x.failure;
+      y->x.failure = NULL;
+      break;
+    }
 
-  if (p->retained && !force) { return; }
+    s->x.received = y->x.received;
 
-  switch (p->type) {
+    for (k = 0; k < y->ids_num; k++) {
+      mpc_err_set_add(i, s, y->ids[k]);
+    }
+  }
 
-    case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+  for (j = 0; j < n; j++) {
+    if (j != fst) { mpc_err_delete_internal(i, x[j]); }
+  }
 
-    case MPC_TYPE_ONEOF:
-    case MPC_TYPE_NONEOF:
-    case MPC_TYPE_STRING:
-      free(p->data.string.x);
-      break;
+  return &s->x;
+}
 
-    case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
-    case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
-    case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+static mpc_err_t *mpc_err_repeat(mpc_input_t *i, mpc_err_t *x, const char *prefix) {
 
-    case MPC_TYPE_MAYBE:
-    case MPC_TYPE_NOT:
-      mpc_undefine_unretained(p->data.not.x, 0);
-      break;
+  int j, id;
+  mpc_err_set_t *s = (mpc_err_set_t*)x;
 
-    case MPC_TYPE_EXPECT:
-      mpc_undefine_unretained(p->data.expect.x, 0);
-      free(p->data.expect.m);
-      break;
+  if (x == NULL) { return NULL; }
+  if (i->flags & MPC_CONTEXT_LAZY_ERRORS) { return mpc_err_lazy_repeat(i, x, prefix); }
+  if (x->failure) { return x; }
 
-    case MPC_TYPE_MANY:
-    case MPC_TYPE_MANY1:
-    case MPC_TYPE_COUNT:
-      mpc_undefine_unretained(p->data.repeat.x, 0);
-      break;
+  if (s->ids_num == 0) {
+    id = mpc_label_intern(i, "", 0);
+  } else {
+    id = mpc_label_intern(i, prefix, strlen(prefix));
+    for (j = 0; j < s->ids_num; j++) {
+      if (j > 0 && j < s->ids_num-1) { id = mpc_label_join(i, id, mpc_label_intern(i, ", ", 2)); }
+      if (j > 0 && j == s->ids_num-1) { id = mpc_label_join(i, id, mpc_label_intern(i, " or ", 4)); }
+      id = mpc_label_join(i, id, s->ids[j]);
+    }
+  }
 
-    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
-    case MPC_TYPE_AND: mpc_undefine_and(p); break;
+  mpc_err_set_clear(i, s);
+  s->id = id;
+  s->ids_num = 1;
+  return x;
+}
 
-    case MPC_TYPE_CHECK:
-      mpc_undefine_unretained(p->data.check.x, 0);
-      free(p->data.check.e);
-      break;
+static mpc_err_t *mpc_err_many1(mpc_input_t *i, mpc_err_t *x) {
+  return mpc_err_repeat(i, x, "one or more of ");
+}
 
-    case MPC_TYPE_CHECK_WITH:
-      mpc_undefine_unretained(p->data.check_with.x, 0);
-      free(p->data.check_with.e);
-      break;
+static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
+  mpc_err_t *y;
+  int digits = n/10 + 1;
+  char *prefix;
+  if (x == NULL) { return NULL; }
+  prefix = mpc_malloc(i, digits + strlen(" of ") + 1);
+  sprintf(prefix, "%i of ", n);
+  y = mpc_err_repeat(i, x, prefix);
+  mpc_free(i, prefix);
+  return y;
+}
 
-    default: break;
-  }
+static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
+  mpc_err_t *errs[2];
+  errs[0] = x;
+  errs[1] = y;
+  return mpc_err_or(i, errs, 2);
+}
 
-  if (!force) {
-    free(p->name);
-    free(p);
-  }
+/*
+** Lazy Errors
+**
+** With `MPC_CONTEXT_LAZY_ERRORS` set, nothing
+** is allocated when a parser fails. A failing
+** parser only ever returns a single expected
+** string or failure message, and it is always
+** merged or relabelled by a repeat before any
+** other parser can fail, so the input holds it
+** in one place with the expected string as a
+** label id. Merging it updates a record of
+** the farthest position reached, what was
+** expected there, with a bitset to skip
+** repeats, or the first failure message. The
+** error is only built from this record once
+** the whole parse has failed, reading back the
+** character received from the string.
+*/
 
+static mpc_err_t *mpc_err_lazy_new(mpc_input_t *i, const char *expected) {
+  mpc_err_t *x = &i->err_flight;
+  x->state = i->state;
+  x->failure = NULL;
+  i->err_flight_id = mpc_label_intern(i, expected, strlen(expected));
+  return x;
 }
 
-void mpc_delete(mpc_parser_t *p) {
-  if (p->retained) {
+static mpc_err_t *mpc_err_lazy_fail(mpc_input_t *i, const char *failure) {
+  mpc_err_t *x = &i->err_flight;
+  x->state = i->state;
+  x->failure = (char*)failure;
+  i->err_flight_id = -1;
+  return x;
+}
 
-    if (p->type != MPC_TYPE_UNDEFINED) {
-      mpc_undefine_unretained(p, 0);
-    }
+static mpc_err_t *mpc_err_lazy_repeat(mpc_input_t *i, mpc_err_t *x, const char *prefix) {
 
-    free(p->name);
-    free(p);
+  int id;
+  if (x->failure) { return x; }
+  id = mpc_label_intern(i, prefix, strlen(prefix));
+  i->err_flight_id = mpc_label_join(i, id, i->err_flight_id);
+  return x;
+}
 
-  } else {
-    mpc_undefine_unretained(p, 0);
+static void mpc_err_lazy_reset(mpc_input_t *i, mpc_state_t s) {
+  int j, id;
+  for (j = 0; j < i->err_expected_num; j++) {
+    id = i->err_expected[j];
+    i->err_seen[id / MPC_ERR_SEEN_BITS] &= ~(1UL << (id % MPC_ERR_SEEN_BITS));
   }
+  i->err_expected_num = 0;
+  i->err_failure = NULL;
+  i->err_state = s;
 }
 
-static void mpc_soft_delete(mpc_val_t *x) {
-  mpc_undefine_unretained(x, 0);
-}
+static void mpc_err_lazy_merge(mpc_input_t *i) {
 
-static mpc_parser_t *mpc_undefined(void) {
-  mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
-  p->retained = 0;
-  p->type = MPC_TYPE_UNDEFINED;
-  p->name = NULL;
-  return p;
-}
+  mpc_err_t *x = &i->err_flight;
+  int id = i->err_flight_id, words;
+  unsigned long bit;
 
-mpc_parser_t *mpc_new(const char *name) {
-  mpc_parser_t *p = mpc_undefined();
-  p->retained = 1;
-  p->name = realloc(p->name, strlen(name) + 1);
-  strcpy(p->name, name);
-  return p;
-}
+  if (x->state.pos < i->err_state.pos) { return; }
+  if (x->state.pos > i->err_state.pos) { mpc_err_lazy_reset(i, x->state); }
 
-mpc_parser_t *mpc_copy(mpc_parser_t *a) {
-  int i = 0;
-  mpc_parser_t *p;
+  /* A failure hides anything else expected at the same place */
+  if (i->err_failure) { return; }
+  if (x->failure) { i->err_failure = x->failure; return; }
 
-  if (a->retained) { return a; }
+  bit = 1UL << (id % MPC_ERR_SEEN_BITS);
+  if (id / MPC_ERR_SEEN_BITS >= i->err_seen_words) {
+    words = id / MPC_ERR_SEEN_BITS + 1;
+    i->err_seen = realloc(i->err_seen, sizeof(unsigned long) * words);
+    memset(i->err_seen + i->err_seen_words, 0, sizeof(unsigned long) * (words - i->err_seen_words));
+    i->err_seen_words = words;
+  }
 
-  p = mpc_undefined();
-  p->retained = a->retained;
-  p->type = a->type;
-  p->data = a->data;
+  if (i->err_seen[id / MPC_ERR_SEEN_BITS] & bit) { return; }
+  i->err_seen[id / MPC_ERR_SEEN_BITS] |= bit;
 
-  if (a->name) {
-    p->name = malloc(strlen(a->name)+1);
-    strcpy(p->name, a->name);
+  if (i->err_expected_num == i->err_expected_slots) {
+    i->err_expected_slots = i->err_expected_slots ? i->err_expected_slots * 2 : 8;
+    i->err_expected = realloc(i->err_expected, sizeof(int) * i->err_expected_slots);
   }
+  i->err_expected[i->err_expected_num++] = id;
+}
 
-  switch (a->type) {
+static mpc_err_t *mpc_err_lazy_build(mpc_input_t *i) {
 
-    case MPC_TYPE_FAIL:
-      p->data.fail.m = malloc(strlen(a->data.fail.m)+1);
-      strcpy(p->data.fail.m, a->data.fail.m);
-    break;
+  int j;
+  size_t k = (size_t)(i->err_state.pos - i->string_pos);
+  mpc_err_t *x = malloc(sizeof(mpc_err_t));
 
-    case MPC_TYPE_ONEOF:
-    case MPC_TYPE_NONEOF:
-    case MPC_TYPE_STRING:
-      p->data.string.x = malloc(strlen(a->data.string.x)+1);
-      strcpy(p->data.string.x, a->data.string.x);
-      break;
+  x->filename = malloc(strlen(i->filename) + 1);
+  strcpy(x->filename, i->filename);
+  x->state = i->err_state;
+  x->expected_num = 0;
+  x->expected = NULL;
+  x->failure = NULL;
+  x->received = k < i->length ? i->string[k] : '\0';
 
-    case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
-    case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
-    case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+  if (i->err_failure) {
+    x->failure = malloc(strlen(i->err_failure) + 1);
+    strcpy(x->failure, i->err_failure);
+    return x;
+  }
 
-    case MPC_TYPE_MAYBE:
-    case MPC_TYPE_NOT:
-      p->data.not.x = mpc_copy(a->data.not.x);
-      break;
+  x->expected_num = i->err_expected_num;
+  x->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    x->expected[j] = malloc(i->labels[i->err_expected[j]].length + 1);
+    strcpy(x->expected[j], i->labels[i->err_expected[j]].name);
+  }
 
-    case MPC_TYPE_EXPECT:
-      p->data.expect.x = mpc_copy(a->data.expect.x);
-      p->data.expect.m = malloc(strlen(a->data.expect.m)+1);
-      strcpy(p->data.expect.m, a->data.expect.m);
-      break;
+  return x;
+}
 
-    case MPC_TYPE_MANY:
-    case MPC_TYPE_MANY1:
-    case MPC_TYPE_COUNT:
-      p->data.repeat.x = mpc_copy(a->data.repeat.x);
-      break;
+/*
+** AST Arenas
+**
+** When a context asks for it, the nodes, child
+** arrays and strings of an AST are carved out
+** of a few large chunks owned by an arena. The
+** arena belongs to the root of the tree and is
+** released in one go when the root is deleted.
+** Deleting any other node of the tree is a no-op
+** so the usual destructors can be left in place.
+**
+** Heap allocated nodes made by user callbacks
+** which are added as children of arena nodes
+** are copied into the arena and then deleted.
+*/
 
-    case MPC_TYPE_OR:
-      p->data.or.xs = malloc(a->data.or.n * sizeof(mpc_parser_t*));
-      for (i = 0; i < a->data.or.n; i++) {
-        p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
-      }
-    break;
-    case MPC_TYPE_AND:
-      p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
-      for (i = 0; i < a->data.and.n; i++) {
-        p->data.and.xs[i] = mpc_copy(a->data.and.xs[i]);
-      }
-      p->data.and.dxs = malloc((a->data.and.n-1) * sizeof(mpc_dtor_t));
-      for (i = 0; i < a->data.and.n-1; i++) {
-        p->data.and.dxs[i] = a->data.and.dxs[i];
-      }
-    break;
+enum {
+  MPC_ARENA_CHUNK_MIN = 4096,
+  MPC_ARENA_CHUNK_MAX = 65536
+};
 
-    case MPC_TYPE_CHECK:
-      p->data.check.x      = mpc_copy(a->data.check.x);
-      p->data.check.e      = malloc(strlen(a->data.check.e)+1);
-      strcpy(p->data.check.e, a->data.check.e);
-      break;
-    case MPC_TYPE_CHECK_WITH:
-      p->data.check_with.x = mpc_copy(a->data.check_with.x);
-      p->data.check_with.e = malloc(strlen(a->data.check_with.e)+1);
-      strcpy(p->data.check_with.e, a->data.check_with.e);
-      break;
+typedef union {
+  long l;
+  double d;
+  void *p;
+} mpc_arena_align_t;
+
+typedef struct mpc_arena_chunk_t {
+  struct mpc_arena_chunk_t *next;
+  mpc_arena_align_t data[1];
+} mpc_arena_chunk_t;
+
+struct mpc_arena_t {
+  mpc_arena_chunk_t *chunks;
+  char *next;
+  size_t left;
+  size_t chunk_size;
+  mpc_ast_t *root;
+};
 
-    default: break;
+static mpc_arena_t *mpc_arena_new(void) {
+  mpc_arena_t *m = malloc(sizeof(mpc_arena_t));
+  m->chunks = NULL;
+  m->next = NULL;
+  m->left = 0;
+  m->chunk_size = MPC_ARENA_CHUNK_MIN;
+  m->root = NULL;
+  return m;
+}
+
+static void mpc_arena_delete(mpc_arena_t *m) {
+
+  mpc_arena_chunk_t *c;
+
+  while (m->chunks) {
+    c = m->chunks;
+    m->chunks = c->next;
+    free(c);
   }
 
+  free(m);
+}
+
+static void *mpc_arena_alloc(mpc_arena_t *m, size_t n) {
+
+  mpc_arena_chunk_t *c;
+  size_t size;
+  char *p;
+
+  n = (n + sizeof(mpc_arena_align_t) - 1) / sizeof(mpc_arena_align_t) * sizeof(mpc_arena_align_t);
+
+  if (n > m->left) {
+    size = n > m->chunk_size ? n : m->chunk_size;
+    c = malloc(sizeof(mpc_arena_chunk_t) + size);
+    c->next = m->chunks;
+    m->chunks = c;
+    m->next = (char*)c->data;
+    m->left = size;
+    if (m->chunk_size < MPC_ARENA_CHUNK_MAX) { m->chunk_size *= 2; }
+  }
 
+  p = m->next;
+  m->next += n;
+  m->left -= n;
   return p;
 }
 
-mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
-  mpc_undefine_unretained(p, 1);
-  p->type = MPC_TYPE_UNDEFINED;
-  return p;
+static char *mpc_arena_strdup(mpc_arena_t *m, const char *s, size_t n) {
+  char *x = mpc_arena_alloc(m, n + 1);
+  memcpy(x, s, n);
+  x[n] = '\0';
+  return x;
 }
 
-mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+/* Child arrays double in size each time they fill up */
+static int mpc_arena_children_slots(int n) {
+  int slots = 4;
+  while (slots < n) { slots *= 2; }
+  return slots;
+}
 
-  if (p->retained) {
-    p->type = a->type;
-    p->data = a->data;
-  } else {
-    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
-    p->type = a2->type;
-    p->data = a2->data;
-    free(a2);
+static mpc_ast_t *mpc_arena_ast_new(mpc_arena_t *m, const char *tag, const char *contents) {
+  mpc_ast_t *a = mpc_arena_alloc(m, sizeof(mpc_ast_t));
+  mpc_tag_t *t = mpc_tag_intern(tag, strlen(tag));
+  a->tag = t->name;
+  a->tag_id = t->id;
+  a->contents = mpc_arena_strdup(m, contents, strlen(contents));
+  a->state = mpc_state_new();
+  a->source = NULL;
+  a->source_length = 0;
+  a->children_num = 0;
+  a->children = NULL;
+  a->arena = m;
+  return a;
+}
+
+static mpc_ast_t *mpc_arena_ast_copy(mpc_arena_t *m, mpc_ast_t *a) {
+
+  int j;
+  mpc_ast_t *r = mpc_arena_ast_new(m, "", mpc_ast_contents(a));
+
+  r->tag = a->tag;
+  r->tag_id = a->tag_id;
+  r->state = a->state;
+  r->children_num = a->children_num;
+  if (a->children_num == 0) { return r; }
+
+  r->children = mpc_arena_alloc(m, sizeof(mpc_ast_t*) * mpc_arena_children_slots(a->children_num));
+  for (j = 0; j < a->children_num; j++) {
+    r->children[j] = a->children[j]->arena == m
+      ? a->children[j] : mpc_arena_ast_copy(m, a->children[j]);
   }
 
-  free(a);
-  return p;
+  return r;
 }
 
-void mpc_cleanup(int n, ...) {
-  int i;
-  mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+static mpc_val_t *mpc_arena_finish(mpc_arena_t *m, int x, mpc_val_t *o) {
 
-  va_list va;
-  va_start(va, n);
-  for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
-  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
-  for (i = 0; i < n; i++) { mpc_delete(list[i]); }
-  va_end(va);
+  mpc_ast_t *a = o;
 
-  free(list);
-}
+  if (!x || a == NULL) {
+    mpc_arena_delete(m);
+    return o;
+  }
 
-mpc_parser_t *mpc_pass(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_PASS;
-  return p;
+  if (a->arena != m) {
+    a = mpc_arena_ast_copy(m, o);
+    mpc_ast_delete(o);
+  }
+
+  m->root = a;
+  return a;
 }
 
-mpc_parser_t *mpc_fail(const char *m) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_FAIL;
-  p->data.fail.m = malloc(strlen(m) + 1);
-  strcpy(p->data.fail.m, m);
-  return p;
+static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
+  int j;
+  for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
+  return xs[x];
 }
 
-/*
-** As `snprintf` is not ANSI standard this
-** function `mpc_failf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
-**
-** - Patch this function in your code base to
-**   use `snprintf` or whatever variant your
-**   system supports.
-**
-** - Avoid it altogether.
-**
-*/
+static mpc_val_t *mpcf_input_fst_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 0); }
+static mpc_val_t *mpcf_input_snd_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 1); }
+static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 2); }
 
-mpc_parser_t *mpc_failf(const char *fmt, ...) {
+static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
+  int j;
+  size_t l = 0;
+  mpc_span_t **ss = (mpc_span_t**)xs;
+  if (n == 0) { return mpc_calloc(i, 1, 1); }
 
-  va_list va;
-  char *buffer;
+  /* Spans which follow on from each other are merged without copying */
+  for (j = 0; j < n; j++) {
+    if (!mpc_span_ptr(i, xs[j])) { break; }
+    if (j > 0 && ss[j]->s.start != ss[j-1]->s.start + ss[j-1]->s.length) { break; }
+  }
 
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_FAIL;
+  if (j == n) {
+    for (j = 1; j < n; j++) {
+      ss[0]->s.length += ss[j]->s.length;
+      mpc_span_free(i, ss[j]);
+    }
+    return xs[0];
+  }
 
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
+  for (j = 0; j < n; j++) { xs[j] = mpc_span_out(i, xs[j]); }
+  for (j = 0; j < n; j++) { l += strlen(xs[j]); }
+  xs[0] = mpc_realloc(i, xs[0], l + 1);
+  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
+  return xs[0];
+}
 
-  buffer = realloc(buffer, strlen(buffer) + 1);
-  p->data.fail.m = buffer;
-  return p;
+static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
+  mpc_state_t *s = ((mpc_state_t**)xs)[0];
+  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
+  a = mpc_ast_state(a, *s);
+  mpc_free(i, s);
+  (void) n;
+  return a;
+}
 
+static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
+  int j;
+  if (f == mpcf_null)      { return mpcf_null(n, xs); }
+  if (f == mpcf_fst)       { return mpcf_fst(n, xs); }
+  if (f == mpcf_snd)       { return mpcf_snd(n, xs); }
+  if (f == mpcf_trd)       { return mpcf_trd(n, xs); }
+  if (f == mpcf_fst_free)  { return mpcf_input_fst_free(i, n, xs); }
+  if (f == mpcf_snd_free)  { return mpcf_input_snd_free(i, n, xs); }
+  if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
+  if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
+  if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
+  for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
+  return f(j, xs);
 }
 
-mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_LIFT_VAL;
-  p->data.lift.x = x;
-  return p;
+static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
+  mpc_free(i, x);
+  return NULL;
 }
 
-mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_LIFT;
-  p->data.lift.lf = lf;
-  return p;
+static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
+
+  mpc_ast_t *a;
+  mpc_span_t *s = mpc_span_ptr(i, c) ? c : NULL;
+
+  if (i->flags & MPC_CONTEXT_AST_ARENA) {
+    if (i->arena == NULL) { i->arena = mpc_arena_new(); }
+    a = mpc_arena_ast_new(i->arena, "", s ? "" : c);
+  } else {
+    a = mpc_ast_new("", s ? "" : c);
+  }
+
+  /* Leaves made from spans keep pointing into the input */
+  if (s) {
+    if (a->arena == NULL) { free(a->contents); }
+    a->contents = NULL;
+    a->source = s->s.start;
+    a->source_length = s->s.length;
+  }
+
+  mpc_free(i, c);
+  return a;
 }
 
-mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ANCHOR;
-  p->data.anchor.f = f;
-  return mpc_expect(p, "anchor");
+static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
+  if (f == mpcf_free)     { return mpcf_input_free(i, x); }
+  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
+  return f(mpc_export(i, x));
 }
 
-mpc_parser_t *mpc_state(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_STATE;
-  return p;
+static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
+  return f(mpc_export(i, x), d);
 }
 
-mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EXPECT;
-  p->data.expect.x = a;
-  p->data.expect.m = malloc(strlen(expected) + 1);
-  strcpy(p->data.expect.m, expected);
-  return p;
+static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
+  if (d == free) { mpc_free(i, x); return; }
+  d(mpc_export(i, x));
 }
 
 /*
-** As `snprintf` is not ANSI standard this
-** function `mpc_expectf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
-**
-** - Patch this function in your code base to
-**   use `snprintf` or whatever variant your
-**   system supports.
-**
-** - Avoid it altogether.
+** Profiling
 **
+** When a profile is attached every named
+** parser is run through `mpc_profile_run`,
+** which keeps a stack of the named parsers
+** currently running. Each frame notes the
+** time and counters when it was entered, and
+** when it returns whatever its own children
+** used is taken off again to give the self
+** figures. Parsers are looked up by address
+** in an open addressed table, so two parsers
+** with the same name are kept apart.
 */
 
-mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
-  va_list va;
-  char *buffer;
+enum {
+  MPC_PROFILE_SLOTS_MIN = 64
+};
 
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EXPECT;
+typedef struct {
+  int rule;
+  double start;
+  double children;
+  unsigned long allocs;
+  unsigned long rewinds;
+  unsigned long child_allocs;
+  unsigned long child_rewinds;
+} mpc_profile_frame_t;
+
+struct mpc_profile_t {
+
+  int rules_num;
+  int rules_slots;
+  mpc_profile_rule_t *rules;
+  mpc_parser_t **keys;
+  int *active;
+
+  int table_slots;
+  int *table;
+
+  int frames_num;
+  int frames_slots;
+  mpc_profile_frame_t *frames;
 
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
+};
 
-  buffer = realloc(buffer, strlen(buffer) + 1);
-  p->data.expect.x = a;
-  p->data.expect.m = buffer;
-  return p;
+static double mpc_clock(void) {
+#if defined(MPC_USE_POSIX) && defined(CLOCK_MONOTONIC)
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
 }
 
-/*
-** Basic Parsers
-*/
-
-mpc_parser_t *mpc_any(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ANY;
-  return mpc_expect(p, "any character");
+static unsigned long mpc_profile_allocs(mpc_input_t *i) {
+  return i->mem_stats.hits + i->mem_stats.full + i->mem_stats.large;
 }
 
-mpc_parser_t *mpc_char(char c) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SINGLE;
-  p->data.single.x = c;
-  return mpc_expectf(p, "'%c'", c);
+static int mpc_profile_hash(mpc_profile_t *f, mpc_parser_t *p) {
+  return (int)(((size_t)p >> 4) & (size_t)(f->table_slots - 1));
 }
 
-mpc_parser_t *mpc_range(char s, char e) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_RANGE;
-  p->data.range.x = s;
-  p->data.range.y = e;
-  return mpc_expectf(p, "character between '%c' and '%c'", s, e);
-}
+static void mpc_profile_rehash(mpc_profile_t *f) {
 
-mpc_parser_t *mpc_oneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "one of '%s'", s);
-}
+  int j, h;
 
-mpc_parser_t *mpc_noneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "none of '%s'", s);
+  f->table_slots *= 2;
+  f->table = realloc(f->table, sizeof(int) * f->table_slots);
+  for (j = 0; j < f->table_slots; j++) { f->table[j] = -1; }
 
+  for (j = 0; j < f->rules_num; j++) {
+    h = mpc_profile_hash(f, f->keys[j]);
+    while (f->table[h] != -1) { h = (h + 1) & (f->table_slots - 1); }
+    f->table[h] = j;
+  }
 }
 
-mpc_parser_t *mpc_satisfy(int(*f)(char)) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SATISFY;
-  p->data.satisfy.f = f;
-  return mpc_expectf(p, "character satisfying function %p", f);
-}
+static int mpc_profile_rule(mpc_profile_t *f, mpc_parser_t *p) {
 
-mpc_parser_t *mpc_string(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_STRING;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "\"%s\"", s);
-}
+  int h = mpc_profile_hash(f, p);
+  mpc_profile_rule_t *r;
+  char *name;
 
-/*
-** Core Parsers
-*/
+  while (f->table[h] != -1) {
+    if (f->keys[f->table[h]] == p) { return f->table[h]; }
+    h = (h + 1) & (f->table_slots - 1);
+  }
 
-mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_APPLY;
-  p->data.apply.x = a;
-  p->data.apply.f = f;
-  return p;
-}
+  if (f->rules_num == f->rules_slots) {
+    f->rules_slots *= 2;
+    f->rules = realloc(f->rules, sizeof(mpc_profile_rule_t) * f->rules_slots);
+    f->keys = realloc(f->keys, sizeof(mpc_parser_t*) * f->rules_slots);
+    f->active = realloc(f->active, sizeof(int) * f->rules_slots);
+  }
 
-mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_APPLY_TO;
-  p->data.apply_to.x = a;
-  p->data.apply_to.f = f;
-  p->data.apply_to.d = x;
-  return p;
-}
+  name = malloc(strlen(p->name) + 1);
+  strcpy(name, p->name);
 
-mpc_parser_t *mpc_check(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *e) {
-  mpc_parser_t  *p = mpc_undefined();
-  p->type = MPC_TYPE_CHECK;
-  p->data.check.x = a;
-  p->data.check.dx = da;
-  p->data.check.f = f;
-  p->data.check.e = malloc(strlen(e) + 1);
-  strcpy(p->data.check.e, e);
-  return p;
-}
+  r = f->rules + f->rules_num;
+  memset(r, 0, sizeof(mpc_profile_rule_t));
+  r->name = name;
+  f->keys[f->rules_num] = p;
+  f->active[f->rules_num] = 0;
+  f->table[h] = f->rules_num;
+  f->rules_num++;
 
-mpc_parser_t *mpc_check_with(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *e) {
-  mpc_parser_t  *p = mpc_undefined();
-  p->type = MPC_TYPE_CHECK_WITH;
-  p->data.check_with.x = a;
-  p->data.check_with.dx = da;
-  p->data.check_with.f = f;
-  p->data.check_with.d = x;
-  p->data.check_with.e = malloc(strlen(e) + 1);
-  strcpy(p->data.check_with.e, e);
-  return p;
+  if (f->rules_num * 2 > f->table_slots) { mpc_profile_rehash(f); }
+
+  return f->rules_num - 1;
 }
 
-mpc_parser_t *mpc_checkf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *fmt, ...) {
-  va_list va;
-  char *buffer;
-  mpc_parser_t *p;
+static int mpc_parse_node(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth);
 
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
+static int mpc_profile_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-  p = mpc_check(a, da, f, buffer);
-  free(buffer);
+  mpc_profile_t *f = i->profile;
+  mpc_profile_frame_t *t;
+  mpc_profile_rule_t *u;
+  long pos = i->state.pos;
+  int x, k = mpc_profile_rule(f, p);
+  unsigned long allocs, rewinds;
+  double elapsed;
 
-  return p;
+  if (f->frames_num == f->frames_slots) {
+    f->frames_slots *= 2;
+    f->frames = realloc(f->frames, sizeof(mpc_profile_frame_t) * f->frames_slots);
+  }
+
+  t = f->frames + f->frames_num++;
+  t->rule = k;
+  t->children = 0.0;
+  t->allocs = mpc_profile_allocs(i);
+  t->rewinds = i->rewinds;
+  t->child_allocs = 0;
+  t->child_rewinds = 0;
+  f->active[k]++;
+  t->start = mpc_clock();
+
+  x = mpc_parse_node(i, p, r, e, depth);
+
+  /* The frames may have moved while running */
+  t = f->frames + --f->frames_num;
+  elapsed = mpc_clock() - t->start;
+  allocs = mpc_profile_allocs(i) - t->allocs;
+  rewinds = i->rewinds - t->rewinds;
+
+  u = f->rules + k;
+  u->calls++;
+  if (x) {
+    u->successes++;
+    u->bytes += (unsigned long)(i->state.pos - pos);
+  } else {
+    u->failures++;
+  }
+  if (--f->active[k] == 0) { u->total += elapsed; }
+  u->self += elapsed - t->children;
+  u->allocs += allocs - t->child_allocs;
+  u->rewinds += rewinds - t->child_rewinds;
+
+  if (f->frames_num > 0) {
+    t = f->frames + f->frames_num - 1;
+    t->children += elapsed;
+    t->child_allocs += allocs;
+    t->child_rewinds += rewinds;
+  }
+
+  return x;
 }
 
-mpc_parser_t *mpc_check_withf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *fmt, ...) {
-  va_list va;
-  char *buffer;
-  mpc_parser_t *p;
+/*
+** Tracing
+**
+** Trace events are written into a ring that
+** is allocated when the trace is made, so the
+** only work while parsing is a clock read and
+** a store. The events are only paired up into
+** calls when they are written out, at which
+** point any exit whose entry was overwritten
+** is skipped.
+*/
 
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
+enum {
+  MPC_TRACE_EVENTS_DEFAULT = 65536
+};
 
-  p = mpc_check_with(a, da, f, x, buffer);
-  free(buffer);
+typedef struct {
+  mpc_parser_t *parser;
+  double time;
+  long pos;
+  int type;
+} mpc_trace_event_t;
+
+struct mpc_trace_t {
+  mpc_trace_event_t *events;
+  size_t events_slots;
+  size_t events_head;
+  size_t events_num;
+  unsigned long dropped;
+};
 
-  return p;
-}
+static void mpc_trace_add(mpc_trace_t *t, mpc_parser_t *p, long pos, int type) {
 
-mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_PREDICT;
-  p->data.predict.x = a;
-  return p;
-}
+  mpc_trace_event_t *v = t->events + t->events_head;
 
-mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NOT;
-  p->data.not.x = a;
-  p->data.not.dx = da;
-  p->data.not.lf = lf;
-  return p;
-}
+  v->parser = p;
+  v->time = mpc_clock();
+  v->pos = pos;
+  v->type = type;
 
-mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
-  return mpc_not_lift(a, da, mpcf_ctor_null);
+  t->events_head = (t->events_head + 1) % t->events_slots;
+  if (t->events_num < t->events_slots) { t->events_num++; } else { t->dropped++; }
 }
 
-mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MAYBE;
-  p->data.not.x = a;
-  p->data.not.lf = lf;
-  return p;
-}
+static int mpc_parse_named(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
-  return mpc_maybe_lift(a, mpcf_ctor_null);
-}
+  int x;
 
-mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MANY;
-  p->data.repeat.x = a;
-  p->data.repeat.f = f;
-  return p;
-}
+  if (i->trace) { mpc_trace_add(i->trace, p, i->state.pos, MPC_TRACE_ENTER); }
 
-mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MANY1;
-  p->data.repeat.x = a;
-  p->data.repeat.f = f;
-  return p;
-}
+  x = i->profile
+    ? mpc_profile_run(i, p, r, e, depth)
+    : mpc_parse_node(i, p, r, e, depth);
 
-mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_COUNT;
-  p->data.repeat.n = n;
-  p->data.repeat.f = f;
-  p->data.repeat.x = a;
-  p->data.repeat.dx = da;
-  return p;
+  if (i->trace) { mpc_trace_add(i->trace, p, i->state.pos, x ? MPC_TRACE_SUCCESS : MPC_TRACE_FAILURE); }
+
+  return x;
 }
 
-mpc_parser_t *mpc_or(int n, ...) {
+enum {
+  MPC_PARSE_STACK_MIN = 4
+};
 
-  int i;
-  va_list va;
+#define MPC_SUCCESS(x) r->output = x; return 1
+#define MPC_FAILURE(x) r->error = x; return 0
+#define MPC_PRIMITIVE(x) \
+  if (x) { MPC_SUCCESS(r->output); } \
+  else { MPC_FAILURE(NULL); }
 
-  mpc_parser_t *p = mpc_undefined();
+#define MPC_MAX_RECURSION_DEPTH 1000
 
-  p->type = MPC_TYPE_OR;
-  p->data.or.n = n;
-  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+/*
+** An `or` may keep a set for each alternative
+** of the characters it can start with. When the
+** next character is not in the set the parser
+** must fail, so it is not run. Its error is the
+** one given by the outermost `expect` it starts
+** with, if any, as every other parser it would
+** have run fails without one. Sets which are not
+** known have the end of input in them, which is
+** never in a known set.
+*/
 
-  va_start(va, n);
-  for (i = 0; i < n; i++) {
-    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
-  }
-  va_end(va);
+enum {
+  MPC_FIRST_DEPTH = 8
+};
 
-  return p;
+static int mpc_first_trivial(int type) {
+  return type == MPC_TYPE_PASS || type == MPC_TYPE_LIFT
+    ||   type == MPC_TYPE_LIFT_VAL || type == MPC_TYPE_STATE;
 }
 
-mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
-
-  int i;
-  va_list va;
+static int mpc_first_skip(mpc_input_t *i, const unsigned char *s, int depth) {
+  return !(s[0] & 1)
+    && depth + MPC_FIRST_DEPTH + 1 < MPC_MAX_RECURSION_DEPTH
+    && !MPC_SET_HAS(s, mpc_input_peekc(i));
+}
 
-  mpc_parser_t *p = mpc_undefined();
+static mpc_err_t *mpc_first_err(mpc_input_t *i, mpc_parser_t *p) {
 
-  p->type = MPC_TYPE_AND;
-  p->data.and.n = n;
-  p->data.and.f = f;
-  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+  int j;
 
-  va_start(va, f);
-  for (i = 0; i < n; i++) {
-    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
-  }
-  for (i = 0; i < (n-1); i++) {
-    p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
+  while (1) {
+    switch (p->type) {
+      case MPC_TYPE_EXPECT:   return mpc_err_new(i, p->data.expect.m);
+      case MPC_TYPE_APPLY:    p = p->data.apply.x; break;
+      case MPC_TYPE_APPLY_TO: p = p->data.apply_to.x; break;
+      case MPC_TYPE_AND:
+        for (j = 0; mpc_first_trivial(p->data.and.xs[j]->type); j++);
+        p = p->data.and.xs[j];
+        break;
+      default: return NULL;
+    }
   }
-  va_end(va);
-
-  return p;
 }
 
 /*
-** Common Parsers
+** Once its children have run, a node is
+** finished off the same way by the parser and
+** by its compiled form, so that part is kept
+** here and shared by `mpc_parse_node` and
+** `mpc_code_run`.
 */
 
-mpc_parser_t *mpc_soi(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SOI;
-  return mpc_expect(p, "start of input");
+/* Spans report what `many` of an `expect` of their set would */
+static int mpc_parse_span(mpc_input_t *i, const unsigned char *s, int n, const char *m, mpc_result_t *r, mpc_err_t **e) {
+  mpc_err_t *err;
+  int x = mpc_input_span(i, s, n, (char**)&r->output);
+  err = m ? mpc_err_new(i, m) : NULL;
+  if (x) {
+    *e = mpc_err_merge(i, *e, err);
+    return 1;
+  }
+  r->error = mpc_err_many1(i, err);
+  return 0;
 }
 
-mpc_parser_t *mpc_eoi(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EOI;
-  return mpc_expect(p, "end of input");
-}
+/* Checks are run with `recognize` cleared, which is put back here */
+static int mpc_parse_check(mpc_input_t *i, int x, int recognize, mpc_result_t *r,
+  mpc_dtor_t dx, mpc_check_t f, mpc_check_with_t g, void *d, const char *m) {
 
-static int mpc_boundary_anchor(char prev, char next) {
-  const char* word = "abcdefghijklmnopqrstuvwxyz"
-                     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                     "0123456789_";
-  if ( strchr(word, next) &&  prev == '\0') { return 1; }
-  if ( strchr(word, prev) &&  next == '\0') { return 1; }
-  if ( strchr(word, next) && !strchr(word, prev)) { return 1; }
-  if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }
+  if (!x) {
+    i->recognize = recognize;
+    return 0;
+  }
+
+  r->output = mpc_span_out(i, r->output);
+  if (f ? f(&r->output) : g(&r->output, d)) {
+    if (recognize) { mpc_parse_dtor(i, dx, r->output); r->output = NULL; }
+    i->recognize = recognize;
+    return 1;
+  }
+
+  mpc_parse_dtor(i, dx, r->output);
+  i->recognize = recognize;
+  r->error = mpc_err_fail(i, m);
   return 0;
 }
 
-static int mpc_boundary_newline_anchor(char prev, char next) {
-  (void)next;
-  return prev == '\n';
+/* The input has already been put back if the parser negated succeeded */
+static int mpc_parse_not(mpc_input_t *i, int x, mpc_result_t *r, mpc_dtor_t dx, mpc_ctor_t lf) {
+  mpc_input_suppress_disable(i);
+  if (x) {
+    if (!i->recognize) { mpc_parse_dtor(i, dx, r->output); }
+    r->error = mpc_err_new(i, "opposite");
+    return 0;
+  }
+  r->output = i->recognize ? NULL : lf();
+  return 1;
 }
 
-mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "word boundary"); }
-mpc_parser_t *mpc_boundary_newline(void) { return mpc_expect(mpc_anchor(mpc_boundary_newline_anchor), "start of newline"); }
-
-mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
-mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
-mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
-
-mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
-mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
-mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+static int mpc_parse_maybe(mpc_input_t *i, int x, mpc_result_t *r, mpc_err_t **e, mpc_ctor_t lf) {
+  if (!x) {
+    *e = mpc_err_merge(i, *e, r->error);
+    r->output = i->recognize ? NULL : lf();
+  }
+  return 1;
+}
 
-mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
-mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
-mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
-mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
-mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
-mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+/* Repeats keep results on the stack until there are too many */
+static mpc_result_t *mpc_parse_results_grow(mpc_input_t *i, mpc_result_t *results, mpc_result_t *stk, int j, int *slots) {
+  if (j == MPC_PARSE_STACK_MIN) {
+    *slots = j + j / 2;
+    results = mpc_malloc(i, sizeof(mpc_result_t) * *slots);
+    memcpy(results, stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+  } else if (j >= *slots) {
+    *slots = j + j / 2;
+    results = mpc_realloc(i, results, sizeof(mpc_result_t) * *slots);
+  }
+  return results;
+}
 
-mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
-mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
-mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
-mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
-mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+/* Ends a `many`, or a `many1` when `one` is set, after `j` results */
+static int mpc_parse_many(mpc_input_t *i, int one, mpc_fold_t f, int j, mpc_result_t *results, mpc_result_t *r, mpc_err_t **e) {
 
-mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
-mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
-mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
-mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
+  int x = j > 0 || !one;
 
-mpc_parser_t *mpc_real(void) {
+  if (x) {
+    *e = mpc_err_merge(i, *e, results[j].error);
+    r->output = mpc_parse_fold(i, f, j, (mpc_val_t**)results);
+  } else {
+    r->error = mpc_err_many1(i, results[j].error);
+  }
 
-  /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+  if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); }
+  return x;
+}
 
-  mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+/* Ends a `count` of `n` after `j` results */
+static int mpc_parse_count(mpc_input_t *i, int n, mpc_fold_t f, mpc_dtor_t dx, int j, mpc_result_t *results, mpc_result_t *r) {
 
-  p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-  p1 = mpc_digits();
-  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
-  p30 = mpc_oneof("eE");
-  p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-  p32 = mpc_digits();
-  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+  int k, x = j == n;
 
-  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+  if (x) {
+    r->output = mpc_parse_fold(i, f, j, (mpc_val_t**)results);
+  } else {
+    for (k = 0; k < j; k++) { mpc_parse_dtor(i, dx, results[k].output); }
+    r->error = mpc_err_count(i, results[j].error, n);
+  }
 
+  if (n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); }
+  return x;
 }
 
-mpc_parser_t *mpc_float(void) {
-  return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+  if (p->name && (i->profile || i->trace)) { return mpc_parse_named(i, p, r, e, depth); }
+  return mpc_parse_node(i, p, r, e, depth);
 }
 
-mpc_parser_t *mpc_char_lit(void) {
-  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
-}
+static int mpc_parse_node(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-mpc_parser_t *mpc_string_lit(void) {
-  mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
-}
+  int j = 0, k = 0, recognize;
+  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
+  mpc_result_t *results;
+  int results_slots = MPC_PARSE_STACK_MIN;
 
-mpc_parser_t *mpc_regex_lit(void) {
-  mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
-}
+  if (depth == MPC_MAX_RECURSION_DEPTH)
+  {
+    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+  }
 
-mpc_parser_t *mpc_ident(void) {
-  mpc_parser_t *p0, *p1;
-  p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
-  p1 = mpc_many(mpcf_strfold, mpc_alphanum());
-  return mpc_and(2, mpcf_strfold, p0, p1, free);
-}
+  switch (p->type) {
 
-/*
-** Useful Parsers
-*/
+    /* Basic Parsers */
 
-mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
-mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
+    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
+    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
+    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
+    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
+    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
+    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
+    case MPC_TYPE_CLASS:   MPC_PRIMITIVE(mpc_input_set(i, p->data.set.x, (char**)&r->output));
+    case MPC_TYPE_BLANK:   mpc_input_blank(i); MPC_SUCCESS(NULL);
 
-mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
-mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+    case MPC_TYPE_SPAN: return mpc_parse_span(i, p->data.set.x, p->data.set.n, p->data.set.m, r, e);
 
-mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+    /* Other parsers */
+
+    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
+    case MPC_TYPE_LIFT:      MPC_SUCCESS(i->recognize ? NULL : p->data.lift.lf());
+    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+    case MPC_TYPE_STATE:     MPC_SUCCESS(i->recognize ? NULL : mpc_input_state_copy(i));
+
+    /* Application Parsers */
+
+    case MPC_TYPE_APPLY:
+      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
+        MPC_SUCCESS(i->recognize ? NULL : mpc_parse_apply(i, p->data.apply.f, r->output));
+      } else {
+        MPC_FAILURE(r->output);
+      }
+
+    case MPC_TYPE_APPLY_TO:
+      if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
+        MPC_SUCCESS(i->recognize ? NULL : mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
+      } else {
+        MPC_FAILURE(r->error);
+      }
+
+    /* Checks need the real value even when only recognizing */
+
+    case MPC_TYPE_CHECK:
+      recognize = i->recognize;
+      i->recognize = 0;
+      j = mpc_parse_run(i, p->data.check.x, r, e, depth+1);
+      return mpc_parse_check(i, j, recognize, r, p->data.check.dx,
+        p->data.check.f, NULL, NULL, p->data.check.e);
+
+    case MPC_TYPE_CHECK_WITH:
+      recognize = i->recognize;
+      i->recognize = 0;
+      j = mpc_parse_run(i, p->data.check_with.x, r, e, depth+1);
+      return mpc_parse_check(i, j, recognize, r, p->data.check_with.dx,
+        NULL, p->data.check_with.f, p->data.check_with.d, p->data.check_with.e);
+
+    case MPC_TYPE_EXPECT:
+      mpc_input_suppress_enable(i);
+      if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
+        mpc_input_suppress_disable(i);
+        MPC_SUCCESS(r->output);
+      } else {
+        mpc_input_suppress_disable(i);
+        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
+      }
+
+    case MPC_TYPE_PREDICT:
+      mpc_input_backtrack_disable(i);
+      if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
+        mpc_input_backtrack_enable(i);
+        MPC_SUCCESS(r->output);
+      } else {
+        mpc_input_backtrack_enable(i);
+        MPC_FAILURE(r->error);
+      }
+
+    /* Optional Parsers */
+
+    /* TODO: Update Not Error Message */
+
+    case MPC_TYPE_NOT:
+      mpc_input_mark(i);
+      mpc_input_suppress_enable(i);
+      j = mpc_parse_run(i, p->data.not.x, r, e, depth+1);
+      if (j) { mpc_input_rewind(i); } else { mpc_input_unmark(i); }
+      return mpc_parse_not(i, j, r, p->data.not.dx, p->data.not.lf);
+
+    case MPC_TYPE_MAYBE:
+      j = mpc_parse_run(i, p->data.not.x, r, e, depth+1);
+      return mpc_parse_maybe(i, j, r, e, p->data.not.lf);
+
+    /* Repeat Parsers */
+
+    /* When only recognizing, no results are kept so nothing is folded or destroyed */
+
+    case MPC_TYPE_MANY:
+
+      if (i->recognize) {
+        while (mpc_parse_run(i, p->data.repeat.x, r, e, depth+1));
+        *e = mpc_err_merge(i, *e, r->error);
+        MPC_SUCCESS(NULL);
+      }
+
+      results = results_stk;
+
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
+        j++;
+        results = mpc_parse_results_grow(i, results, results_stk, j, &results_slots);
+      }
+
+      return mpc_parse_many(i, 0, p->data.repeat.f, j, results, r, e);
+
+    case MPC_TYPE_MANY1:
+
+      if (i->recognize) {
+        while (mpc_parse_run(i, p->data.repeat.x, r, e, depth+1)) { j++; }
+        if (j == 0) { MPC_FAILURE(mpc_err_many1(i, r->error)); }
+        *e = mpc_err_merge(i, *e, r->error);
+        MPC_SUCCESS(NULL);
+      }
+
+      results = results_stk;
+
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
+        j++;
+        results = mpc_parse_results_grow(i, results, results_stk, j, &results_slots);
+      }
+
+      return mpc_parse_many(i, 1, p->data.repeat.f, j, results, r, e);
+
+    case MPC_TYPE_COUNT:
+
+      if (i->recognize) {
+        while (j < p->data.repeat.n && mpc_parse_run(i, p->data.repeat.x, r, e, depth+1)) { j++; }
+        if (j == p->data.repeat.n) { MPC_SUCCESS(NULL); }
+        MPC_FAILURE(mpc_err_count(i, r->error, p->data.repeat.n));
+      }
+
+      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
+        : results_stk;
+
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
+        j++;
+        if (j == p->data.repeat.n) { break; }
+      }
+
+      return mpc_parse_count(i, p->data.repeat.n, p->data.repeat.f, p->data.repeat.dx, j, results, r);
+
+    /* Combinatory Parsers */
+
+    case MPC_TYPE_OR:
+
+      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+
+      if (i->recognize) {
+        for (j = 0; j < p->data.or.n; j++) {
+          if (p->data.or.first
+          &&  mpc_first_skip(i, p->data.or.first + j * MPC_SET_BYTES, depth)) {
+            *e = mpc_err_merge(i, *e, mpc_first_err(i, p->data.or.xs[j]));
+            continue;
+          }
+          if (mpc_parse_run(i, p->data.or.xs[j], r, e, depth+1)) { MPC_SUCCESS(NULL); }
+          *e = mpc_err_merge(i, *e, r->error);
+        }
+        MPC_FAILURE(NULL);
+      }
+
+      results = p->data.or.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+        : results_stk;
+
+      for (j = 0; j < p->data.or.n; j++) {
+        if (p->data.or.first
+        &&  mpc_first_skip(i, p->data.or.first + j * MPC_SET_BYTES, depth)) {
+          *e = mpc_err_merge(i, *e, mpc_first_err(i, p->data.or.xs[j]));
+        } else if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
+          MPC_SUCCESS(results[j].output;
+            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        } else {
+          *e = mpc_err_merge(i, *e, results[j].error);
+        }
+      }
+
+      MPC_FAILURE(NULL;
+        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+
+    case MPC_TYPE_AND:
+
+      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+
+      if (i->recognize) {
+        mpc_input_mark(i);
+        for (j = 0; j < p->data.and.n; j++) {
+          if (!mpc_parse_run(i, p->data.and.xs[j], r, e, depth+1)) {
+            mpc_input_rewind(i);
+            MPC_FAILURE(r->error);
+          }
+        }
+        mpc_input_unmark(i);
+        MPC_SUCCESS(NULL);
+      }
+
+      results = p->data.or.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+        : results_stk;
+
+      mpc_input_mark(i);
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
+          mpc_input_rewind(i);
+          for (k = 0; k < j; k++) {
+            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
+          }
+          MPC_FAILURE(results[j].error;
+            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        }
+      }
+      mpc_input_unmark(i);
+      MPC_SUCCESS(
+        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
+        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+
+    /* End */
+
+    default:
+
+      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+  }
+
+  return 0;
+
+}
+
+/*
+** Compiled Parsers
+**
+** A parser graph can be lowered into one array
+** of cells. Each instruction starts with its
+** parser type, followed by its operands, and
+** refers to its children by their offset from
+** its first cell. Strings are stored in the
+** cells after their length. A parser reached
+** twice is only compiled once, so recursive
+** rules become backward offsets.
+**
+** The interpreter follows `mpc_parse_node` case
+** for case and finishes each node with the same
+** helpers. Where labels can be addressed it
+** jumps straight to the code for each type
+** through a table instead of a switch.
+*/
+
+#if defined(__GNUC__) && !defined(__STRICT_ANSI__) && !defined(MPC_NO_THREADED)
+#define MPC_USE_THREADED
+#endif
+
+typedef union {
+  int n;
+  void *x;
+  mpc_fold_t fold;
+  mpc_apply_t apply;
+  mpc_apply_to_t apply_to;
+  mpc_check_t check;
+  mpc_check_with_t check_with;
+  mpc_dtor_t dtor;
+  mpc_ctor_t ctor;
+  int (*anchor)(char,char);
+  int (*satisfy)(char);
+} mpc_cell_t;
+
+struct mpc_code_t {
+  mpc_cell_t *cells;
+  int cells_num;
+  int cells_slots;
+  mpc_parser_t **seen;
+  int *seen_at;
+  int seen_num;
+};
+
+#define MPC_CODE_CHILD(c, k) ((c) + (c)[k].n)
+#define MPC_CODE_STRING(c, k) ((const char*)((c) + (k) + 1))
+#define MPC_CODE_SET(c, k) ((const unsigned char*)((c) + (k)))
+#define MPC_CODE_SET_CELLS ((int)((MPC_SET_BYTES + sizeof(mpc_cell_t) - 1) / sizeof(mpc_cell_t)))
+
+static int mpc_code_reserve(mpc_code_t *c, int n) {
+  int at = c->cells_num;
+  if (c->cells_num + n > c->cells_slots) {
+    while (c->cells_num + n > c->cells_slots) { c->cells_slots *= 2; }
+    c->cells = realloc(c->cells, sizeof(mpc_cell_t) * c->cells_slots);
+  }
+  memset(c->cells + at, 0, sizeof(mpc_cell_t) * n);
+  c->cells_num += n;
+  return at;
+}
+
+static int mpc_code_string_cells(const char *s) {
+  return 1 + (int)((strlen(s) + sizeof(mpc_cell_t)) / sizeof(mpc_cell_t));
+}
+
+static void mpc_code_string(mpc_code_t *c, int at, const char *s) {
+  c->cells[at].n = (int)strlen(s);
+  memcpy(c->cells + at + 1, s, strlen(s) + 1);
+}
+
+static int mpc_code_emit(mpc_code_t *c, mpc_parser_t *p);
+
+static void mpc_code_child(mpc_code_t *c, int at, int k, mpc_parser_t *x) {
+  int y = mpc_code_emit(c, x);
+  c->cells[at + k].n = y - at;
+}
+
+static int mpc_code_emit(mpc_code_t *c, mpc_parser_t *p) {
+
+  int j, at, n;
+  const char *s = NULL;
+  mpc_parser_t *x;
+
+  for (j = 0; j < c->seen_num; j++) {
+    if (c->seen[j] == p) { return c->seen_at[j]; }
+  }
+
+  switch (p->type) {
+    case MPC_TYPE_SINGLE:     n = 2; break;
+    case MPC_TYPE_RANGE:      n = 3; break;
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:     s = p->data.string.x; n = 1; break;
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_PREDICT:    n = 2; break;
+    case MPC_TYPE_FAIL:       s = p->data.fail.m; n = 1; break;
+    case MPC_TYPE_APPLY:      n = 3; break;
+    case MPC_TYPE_APPLY_TO:   n = 4; break;
+    case MPC_TYPE_CHECK:      s = p->data.check.e; n = 4; break;
+    case MPC_TYPE_CHECK_WITH: s = p->data.check_with.e; n = 5; break;
+    case MPC_TYPE_EXPECT:     s = p->data.expect.m; n = 2; break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:      n = 4; break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:      n = 5; break;
+    case MPC_TYPE_OR:         n = 3 + p->data.or.n * (p->data.or.first ? 1 + MPC_CODE_SET_CELLS : 1); break;
+    case MPC_TYPE_AND:        n = 3 + p->data.and.n + (p->data.and.n ? p->data.and.n - 1 : 0); break;
+    case MPC_TYPE_CLASS:      n = 1 + MPC_CODE_SET_CELLS; break;
+    case MPC_TYPE_SPAN:       s = p->data.set.m; n = 3 + MPC_CODE_SET_CELLS; break;
+    default:                  n = 1; break;
+  }
+
+  at = mpc_code_reserve(c, s ? n + mpc_code_string_cells(s) : n);
+  c->cells[at].n = p->type;
+  if (s) { mpc_code_string(c, at + n, s); }
+
+  c->seen = realloc(c->seen, sizeof(mpc_parser_t*) * (c->seen_num + 1));
+  c->seen_at = realloc(c->seen_at, sizeof(int) * (c->seen_num + 1));
+  c->seen[c->seen_num] = p;
+  c->seen_at[c->seen_num] = at;
+  c->seen_num++;
+
+  switch (p->type) {
+
+    case MPC_TYPE_SINGLE:   c->cells[at+1].n = p->data.single.x; break;
+    case MPC_TYPE_RANGE:    c->cells[at+1].n = p->data.range.x; c->cells[at+2].n = p->data.range.y; break;
+    case MPC_TYPE_SATISFY:  c->cells[at+1].satisfy = p->data.satisfy.f; break;
+    case MPC_TYPE_ANCHOR:   c->cells[at+1].anchor = p->data.anchor.f; break;
+    case MPC_TYPE_LIFT:     c->cells[at+1].ctor = p->data.lift.lf; break;
+    case MPC_TYPE_LIFT_VAL: c->cells[at+1].x = p->data.lift.x; break;
+    case MPC_TYPE_PREDICT:  mpc_code_child(c, at, 1, p->data.predict.x); break;
+    case MPC_TYPE_CLASS:    memcpy(c->cells + at + 1, p->data.set.x, MPC_SET_BYTES); break;
+
+    case MPC_TYPE_SPAN:
+      c->cells[at+1].n = p->data.set.n;
+      c->cells[at+2].n = p->data.set.m != NULL;
+      memcpy(c->cells + at + 3, p->data.set.x, MPC_SET_BYTES);
+      break;
+
+    case MPC_TYPE_APPLY:
+      c->cells[at+2].apply = p->data.apply.f;
+      mpc_code_child(c, at, 1, p->data.apply.x);
+      break;
+
+    case MPC_TYPE_APPLY_TO:
+      c->cells[at+2].apply_to = p->data.apply_to.f;
+      c->cells[at+3].x = p->data.apply_to.d;
+      mpc_code_child(c, at, 1, p->data.apply_to.x);
+      break;
+
+    case MPC_TYPE_CHECK:
+      c->cells[at+2].dtor = p->data.check.dx;
+      c->cells[at+3].check = p->data.check.f;
+      mpc_code_child(c, at, 1, p->data.check.x);
+      break;
+
+    case MPC_TYPE_CHECK_WITH:
+      c->cells[at+2].dtor = p->data.check_with.dx;
+      c->cells[at+3].check_with = p->data.check_with.f;
+      c->cells[at+4].x = p->data.check_with.d;
+      mpc_code_child(c, at, 1, p->data.check_with.x);
+      break;
+
+    /* Errors are suppressed inside an expect, so any directly nested one can be skipped */
+    case MPC_TYPE_EXPECT:
+      x = p->data.expect.x;
+      while (x->type == MPC_TYPE_EXPECT) { x = x->data.expect.x; }
+      mpc_code_child(c, at, 1, x);
+      break;
+
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      c->cells[at+2].dtor = p->data.not.dx;
+      c->cells[at+3].ctor = p->data.not.lf;
+      mpc_code_child(c, at, 1, p->data.not.x);
+      break;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      c->cells[at+2].n = p->data.repeat.n;
+      c->cells[at+3].fold = p->data.repeat.f;
+      c->cells[at+4].dtor = p->data.repeat.dx;
+      mpc_code_child(c, at, 1, p->data.repeat.x);
+      break;
+
+    case MPC_TYPE_OR:
+      c->cells[at+1].n = p->data.or.n;
+      c->cells[at+2].n = p->data.or.first != NULL;
+      if (p->data.or.first) {
+        for (j = 0; j < p->data.or.n; j++) {
+          memcpy(c->cells + at + 3 + p->data.or.n + j * MPC_CODE_SET_CELLS,
+            p->data.or.first + j * MPC_SET_BYTES, MPC_SET_BYTES);
+        }
+      }
+      for (j = 0; j < p->data.or.n; j++) {
+        mpc_code_child(c, at, 3 + j, p->data.or.xs[j]);
+      }
+      break;
+
+    case MPC_TYPE_AND:
+      c->cells[at+1].n = p->data.and.n;
+      c->cells[at+2].fold = p->data.and.f;
+      for (j = 0; j < p->data.and.n - 1; j++) {
+        c->cells[at+3+p->data.and.n+j].dtor = p->data.and.dxs[j];
+      }
+      for (j = 0; j < p->data.and.n; j++) {
+        mpc_code_child(c, at, 3 + j, p->data.and.xs[j]);
+      }
+      break;
+
+    default: break;
+  }
+
+  return at;
+}
+
+mpc_code_t *mpc_compile(mpc_parser_t *p) {
+  mpc_code_t *c = malloc(sizeof(mpc_code_t));
+  c->cells_num = 0;
+  c->cells_slots = 64;
+  c->cells = malloc(sizeof(mpc_cell_t) * c->cells_slots);
+  c->seen = NULL;
+  c->seen_at = NULL;
+  c->seen_num = 0;
+  mpc_code_emit(c, p);
+  free(c->seen);
+  free(c->seen_at);
+  c->seen = NULL;
+  c->seen_at = NULL;
+  c->seen_num = 0;
+  c->cells = realloc(c->cells, sizeof(mpc_cell_t) * c->cells_num);
+  c->cells_slots = c->cells_num;
+  return c;
+}
+
+void mpc_code_delete(mpc_code_t *c) {
+  free(c->cells);
+  free(c);
+}
+
+#ifdef MPC_USE_THREADED
+#define MPC_CODE_OP(t) op_##t
+#else
+#define MPC_CODE_OP(t) case MPC_TYPE_##t
+#endif
+
+/*
+** Primitives make up most of the instructions
+** run, so they are matched without a call.
+*/
+
+/* The same walk as `mpc_first_err`, over the compiled children */
+
+static mpc_err_t *mpc_code_first_err(mpc_input_t *i, const mpc_cell_t *c) {
+
+  int j;
+
+  while (1) {
+    switch (c->n) {
+      case MPC_TYPE_EXPECT:   return mpc_err_new(i, MPC_CODE_STRING(c, 2));
+      case MPC_TYPE_APPLY:
+      case MPC_TYPE_APPLY_TO: c = MPC_CODE_CHILD(c, 1); break;
+      case MPC_TYPE_AND:
+        for (j = 0; mpc_first_trivial(MPC_CODE_CHILD(c, 3+j)->n); j++);
+        c = MPC_CODE_CHILD(c, 3+j);
+        break;
+      default: return NULL;
+    }
+  }
+}
+
+#define MPC_CODE_RUN(x, res) \
+  ((((x)->n >= MPC_TYPE_ANCHOR && (x)->n <= MPC_TYPE_STRING) \
+  ||  (x)->n == MPC_TYPE_CLASS || (x)->n == MPC_TYPE_BLANK) \
+    && depth+1 < MPC_MAX_RECURSION_DEPTH \
+    ? mpc_code_leaf(i, x, res) : mpc_code_run(i, x, res, e, depth+1))
+
+static int mpc_code_leaf(mpc_input_t *i, const mpc_cell_t *c, mpc_result_t *r) {
+  int x;
+  switch (c->n) {
+    case MPC_TYPE_STATE:   r->output = i->recognize ? NULL : mpc_input_state_copy(i); return 1;
+    case MPC_TYPE_BLANK:   mpc_input_blank(i); r->output = NULL; return 1;
+    case MPC_TYPE_ANCHOR:  x = mpc_input_anchor(i, c[1].anchor, (char**)&r->output); break;
+    case MPC_TYPE_ANY:     x = mpc_input_any(i, (char**)&r->output); break;
+    case MPC_TYPE_SINGLE:  x = mpc_input_char(i, (char)c[1].n, (char**)&r->output); break;
+    case MPC_TYPE_RANGE:   x = mpc_input_range(i, (char)c[1].n, (char)c[2].n, (char**)&r->output); break;
+    case MPC_TYPE_ONEOF:   x = mpc_input_oneof(i, MPC_CODE_STRING(c, 1), (char**)&r->output); break;
+    case MPC_TYPE_NONEOF:  x = mpc_input_noneof(i, MPC_CODE_STRING(c, 1), (char**)&r->output); break;
+    case MPC_TYPE_SATISFY: x = mpc_input_satisfy(i, c[1].satisfy, (char**)&r->output); break;
+    case MPC_TYPE_CLASS:   x = mpc_input_set(i, MPC_CODE_SET(c, 1), (char**)&r->output); break;
+    default:               x = mpc_input_string(i, MPC_CODE_STRING(c, 1), (char**)&r->output); break;
+  }
+  if (!x) { r->error = NULL; }
+  return x;
+}
+
+/*
+** Only strings are run so backtracking needs
+** no more than a copy of the state on the stack.
+*/
+
+#define MPC_CODE_MARK() mark = i->state; mark_last = i->last
+#define MPC_CODE_REWIND() if (i->backtrack > 0) { i->state = mark; i->last = mark_last; }
+
+static int mpc_code_run(mpc_input_t *i, const mpc_cell_t *c, mpc_result_t *r, mpc_err_t **e, int depth) {
+
+  int j = 0, k = 0, n, recognize;
+  mpc_err_t *err;
+  mpc_state_t mark;
+  char mark_last;
+  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
+  mpc_result_t *results;
+  int results_slots = MPC_PARSE_STACK_MIN;
+
+#ifdef MPC_USE_THREADED
+  static void *ops[] = {
+    &&op_UNDEFINED, &&op_PASS, &&op_FAIL, &&op_LIFT, &&op_LIFT_VAL,
+    &&op_EXPECT, &&op_ANCHOR, &&op_STATE, &&op_ANY, &&op_SINGLE,
+    &&op_ONEOF, &&op_NONEOF, &&op_RANGE, &&op_SATISFY, &&op_STRING,
+    &&op_APPLY, &&op_APPLY_TO, &&op_PREDICT, &&op_NOT, &&op_MAYBE,
+    &&op_MANY, &&op_MANY1, &&op_COUNT, &&op_OR, &&op_AND,
+    &&op_CHECK, &&op_CHECK_WITH, &&op_SOI, &&op_EOI, &&op_CLASS,
+    &&op_SPAN, &&op_BLANK };
+#endif
+
+  if (depth == MPC_MAX_RECURSION_DEPTH)
+  {
+    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+  }
+
+#ifdef MPC_USE_THREADED
+  goto *ops[c->n];
+  {
+#else
+  switch (c->n) {
+#endif
+
+    /* Basic Parsers */
+
+    MPC_CODE_OP(ANY):     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
+    MPC_CODE_OP(SINGLE):  MPC_PRIMITIVE(mpc_input_char(i, (char)c[1].n, (char**)&r->output));
+    MPC_CODE_OP(RANGE):   MPC_PRIMITIVE(mpc_input_range(i, (char)c[1].n, (char)c[2].n, (char**)&r->output));
+    MPC_CODE_OP(ONEOF):   MPC_PRIMITIVE(mpc_input_oneof(i, MPC_CODE_STRING(c, 1), (char**)&r->output));
+    MPC_CODE_OP(NONEOF):  MPC_PRIMITIVE(mpc_input_noneof(i, MPC_CODE_STRING(c, 1), (char**)&r->output));
+    MPC_CODE_OP(SATISFY): MPC_PRIMITIVE(mpc_input_satisfy(i, c[1].satisfy, (char**)&r->output));
+    MPC_CODE_OP(STRING):  MPC_PRIMITIVE(mpc_input_string(i, MPC_CODE_STRING(c, 1), (char**)&r->output));
+    MPC_CODE_OP(ANCHOR):  MPC_PRIMITIVE(mpc_input_anchor(i, c[1].anchor, (char**)&r->output));
+    MPC_CODE_OP(SOI):     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
+    MPC_CODE_OP(EOI):     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
+    MPC_CODE_OP(CLASS):   MPC_PRIMITIVE(mpc_input_set(i, MPC_CODE_SET(c, 1), (char**)&r->output));
+    MPC_CODE_OP(BLANK):   mpc_input_blank(i); MPC_SUCCESS(NULL);
+
+    MPC_CODE_OP(SPAN):
+      return mpc_parse_span(i, MPC_CODE_SET(c, 3), c[1].n,
+        c[2].n ? MPC_CODE_STRING(c, 3 + MPC_CODE_SET_CELLS) : NULL, r, e);
+
+    /* Other parsers */
+
+    MPC_CODE_OP(UNDEFINED): MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+    MPC_CODE_OP(PASS):      MPC_SUCCESS(NULL);
+    MPC_CODE_OP(FAIL):      MPC_FAILURE(mpc_err_fail(i, MPC_CODE_STRING(c, 1)));
+    MPC_CODE_OP(LIFT):      MPC_SUCCESS(i->recognize ? NULL : c[1].ctor());
+    MPC_CODE_OP(LIFT_VAL):  MPC_SUCCESS(c[1].x);
+    MPC_CODE_OP(STATE):     MPC_SUCCESS(i->recognize ? NULL : mpc_input_state_copy(i));
+
+    /* Application Parsers */
+
+    MPC_CODE_OP(APPLY):
+      if (MPC_CODE_RUN(MPC_CODE_CHILD(c, 1), r)) {
+        MPC_SUCCESS(i->recognize ? NULL : mpc_parse_apply(i, c[2].apply, r->output));
+      } else {
+        MPC_FAILURE(r->output);
+      }
+
+    MPC_CODE_OP(APPLY_TO):
+      if (MPC_CODE_RUN(MPC_CODE_CHILD(c, 1), r)) {
+        MPC_SUCCESS(i->recognize ? NULL : mpc_parse_apply_to(i, c[2].apply_to, r->output, c[3].x));
+      } else {
+        MPC_FAILURE(r->error);
+      }
+
+    MPC_CODE_OP(CHECK):
+      recognize = i->recognize;
+      i->recognize = 0;
+      j = MPC_CODE_RUN(MPC_CODE_CHILD(c, 1), r);
+      return mpc_parse_check(i, j, recognize, r, c[2].dtor,
+        c[3].check, NULL, NULL, MPC_CODE_STRING(c, 4));
+
+    MPC_CODE_OP(CHECK_WITH):
+      recognize = i->recognize;
+      i->recognize = 0;
+      j = MPC_CODE_RUN(MPC_CODE_CHILD(c, 1), r);
+      return mpc_parse_check(i, j, recognize, r, c[2].dtor,
+        NULL, c[3].check_with, c[4].x, MPC_CODE_STRING(c, 5));
+
+    MPC_CODE_OP(EXPECT):
+      mpc_input_suppress_enable(i);
+      if (MPC_CODE_RUN(MPC_CODE_CHILD(c, 1), r)) {
+        mpc_input_suppress_disable(i);
+        MPC_SUCCESS(r->output);
+      } else {
+        mpc_input_suppress_disable(i);
+        MPC_FAILURE(mpc_err_new(i, MPC_CODE_STRING(c, 2)));
+      }
+
+    MPC_CODE_OP(PREDICT):
+      mpc_input_backtrack_disable(i);
+      if (MPC_CODE_RUN(MPC_CODE_CHILD(c, 1), r)) {
+        mpc_input_backtrack_enable(i);
+        MPC_SUCCESS(r->output);
+      } else {
+        mpc_input_backtrack_enable(i);
+        MPC_FAILURE(r->error);
+      }
+
+    /* Optional Parsers */
+
+    MPC_CODE_OP(NOT):
+      MPC_CODE_MARK();
+      mpc_input_suppress_enable(i);
+      j = MPC_CODE_RUN(MPC_CODE_CHILD(c, 1), r);
+      if (j) { MPC_CODE_REWIND(); }
+      return mpc_parse_not(i, j, r, c[2].dtor, c[3].ctor);
+
+    MPC_CODE_OP(MAYBE):
+      j = MPC_CODE_RUN(MPC_CODE_CHILD(c, 1), r);
+      return mpc_parse_maybe(i, j, r, e, c[3].ctor);
+
+    /* Repeat Parsers */
+
+    MPC_CODE_OP(MANY):
+
+      if (i->recognize) {
+        while (MPC_CODE_RUN(MPC_CODE_CHILD(c, 1), r));
+        *e = mpc_err_merge(i, *e, r->error);
+        MPC_SUCCESS(NULL);
+      }
+
+      results = results_stk;
+
+      while (MPC_CODE_RUN(MPC_CODE_CHILD(c, 1), &results[j])) {
+        j++;
+        results = mpc_parse_results_grow(i, results, results_stk, j, &results_slots);
+      }
+
+      return mpc_parse_many(i, 0, c[3].fold, j, results, r, e);
+
+    MPC_CODE_OP(MANY1):
+
+      if (i->recognize) {
+        while (MPC_CODE_RUN(MPC_CODE_CHILD(c, 1), r)) { j++; }
+        if (j == 0) { MPC_FAILURE(mpc_err_many1(i, r->error)); }
+        *e = mpc_err_merge(i, *e, r->error);
+        MPC_SUCCESS(NULL);
+      }
+
+      results = results_stk;
+
+      while (MPC_CODE_RUN(MPC_CODE_CHILD(c, 1), &results[j])) {
+        j++;
+        results = mpc_parse_results_grow(i, results, results_stk, j, &results_slots);
+      }
+
+      return mpc_parse_many(i, 1, c[3].fold, j, results, r, e);
+
+    MPC_CODE_OP(COUNT):
+
+      n = c[2].n;
+
+      if (i->recognize) {
+        while (j < n && MPC_CODE_RUN(MPC_CODE_CHILD(c, 1), r)) { j++; }
+        if (j == n) { MPC_SUCCESS(NULL); }
+        MPC_FAILURE(mpc_err_count(i, r->error, n));
+      }
+
+      results = n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * n)
+        : results_stk;
+
+      while (MPC_CODE_RUN(MPC_CODE_CHILD(c, 1), &results[j])) {
+        j++;
+        if (j == n) { break; }
+      }
+
+      return mpc_parse_count(i, n, c[3].fold, c[4].dtor, j, results, r);
+
+    /* Combinatory Parsers */
+
+    MPC_CODE_OP(OR):
+
+      n = c[1].n;
+
+      if (n == 0) { MPC_SUCCESS(NULL); }
+
+      if (i->recognize) {
+        for (j = 0; j < n; j++) {
+          if (c[2].n && mpc_first_skip(i, MPC_CODE_SET(c, 3 + n + j * MPC_CODE_SET_CELLS), depth)) {
+            err = mpc_code_first_err(i, MPC_CODE_CHILD(c, 3+j));
+            if (err) { *e = mpc_err_merge(i, *e, err); }
+            continue;
+          }
+          if (MPC_CODE_RUN(MPC_CODE_CHILD(c, 3+j), r)) { MPC_SUCCESS(NULL); }
+          if (r->error) { *e = mpc_err_merge(i, *e, r->error); }
+        }
+        MPC_FAILURE(NULL);
+      }
+
+      /* Only the successful alternative's result is kept */
+      for (j = 0; j < n; j++) {
+        if (c[2].n && mpc_first_skip(i, MPC_CODE_SET(c, 3 + n + j * MPC_CODE_SET_CELLS), depth)) {
+          err = mpc_code_first_err(i, MPC_CODE_CHILD(c, 3+j));
+          if (err) { *e = mpc_err_merge(i, *e, err); }
+          continue;
+        }
+        if (MPC_CODE_RUN(MPC_CODE_CHILD(c, 3+j), r)) {
+          MPC_SUCCESS(r->output);
+        }
+        if (r->error) { *e = mpc_err_merge(i, *e, r->error); }
+      }
+
+      MPC_FAILURE(NULL);
+
+    MPC_CODE_OP(AND):
+
+      n = c[1].n;
+
+      if (n == 0) { MPC_SUCCESS(NULL); }
+
+      if (i->recognize) {
+        MPC_CODE_MARK();
+        for (j = 0; j < n; j++) {
+          if (!MPC_CODE_RUN(MPC_CODE_CHILD(c, 3+j), r)) {
+            MPC_CODE_REWIND();
+            MPC_FAILURE(r->error);
+          }
+        }
+        MPC_SUCCESS(NULL);
+      }
+
+      results = n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * n)
+        : results_stk;
+
+      MPC_CODE_MARK();
+      for (j = 0; j < n; j++) {
+        if (!MPC_CODE_RUN(MPC_CODE_CHILD(c, 3+j), &results[j])) {
+          MPC_CODE_REWIND();
+          for (k = 0; k < j; k++) {
+            mpc_parse_dtor(i, c[3+n+k].dtor, results[k].output);
+          }
+          MPC_FAILURE(results[j].error;
+            if (n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        }
+      }
+      MPC_SUCCESS(
+        mpc_parse_fold(i, c[2].fold, j, (mpc_val_t**)results);
+        if (n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+
+#ifndef MPC_USE_THREADED
+    default:
+
+      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+#endif
+  }
+
+  return 0;
+
+}
+
+#undef MPC_CODE_OP
+#undef MPC_CODE_RUN
+#undef MPC_CODE_MARK
+#undef MPC_CODE_REWIND
+
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMITIVE
+
+static int mpc_parse_input_run(mpc_input_t *i, mpc_parser_t *p, mpc_code_t *c, mpc_result_t *r) {
+  int x;
+  mpc_err_t *e = NULL;
+  if (i->flags & MPC_CONTEXT_LAZY_ERRORS) {
+    mpc_err_lazy_reset(i, mpc_state_invalid());
+    i->err_failure = "Unknown Error";
+  } else {
+    e = mpc_err_fail(i, "Unknown Error");
+    e->state = mpc_state_invalid();
+  }
+  x = c ? mpc_code_run(i, c->cells, r, &e, 0) : mpc_parse_run(i, p, r, &e, 0);
+  if (x) {
+    mpc_err_delete_internal(i, e);
+    r->output = mpc_export(i, r->output);
+  } else if (i->flags & MPC_CONTEXT_LAZY_ERRORS) {
+    mpc_err_merge(i, e, r->error);
+    r->error = mpc_err_lazy_build(i);
+  } else {
+    r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
+  }
+  if (i->arena) {
+    if (x) { r->output = mpc_arena_finish(i->arena, x, r->output); }
+    else { mpc_arena_finish(i->arena, x, NULL); }
+    i->arena = NULL;
+  }
+  return x;
+}
+
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_input_run(i, p, NULL, r);
+}
+
+int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_file(filename, file);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_code_parse(const char *filename, const char *string, mpc_code_t *c, mpc_result_t *r) {
+  return mpc_code_nparse(filename, string, strlen(string), c, r);
+}
+
+int mpc_code_nparse(const char *filename, const char *string, size_t length, mpc_code_t *c, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  x = mpc_parse_input_run(i, NULL, c, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+static int mpc_recognize_input(mpc_input_t *i, mpc_parser_t *p, long *consumed, mpc_err_t **error) {
+
+  mpc_result_t r;
+  long start = i->state.pos;
+  int x;
+
+  i->recognize = 1;
+  x = mpc_parse_input(i, p, &r);
+  i->recognize = 0;
+
+  if (consumed) { *consumed = i->state.pos - start; }
+
+  if (x) {
+    if (error) { *error = NULL; }
+  } else {
+    if (error) { *error = r.error; } else { mpc_err_delete(r.error); }
+  }
+
+  return x;
+}
+
+int mpc_recognize(const char *filename, const char *string, size_t length, mpc_parser_t *p, long *consumed, mpc_err_t **error) {
+  int x;
+  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  x = mpc_recognize_input(i, p, consumed, error);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+
+  FILE *f = fopen(filename, "rb");
+  int res;
+
+  if (f == NULL) {
+    r->output = NULL;
+    r->error = mpc_err_file(filename, "Unable to open file!");
+    return 0;
+  }
+
+  res = mpc_parse_file(filename, f, p, r);
+  fclose(f);
+  return res;
+}
+
+/*
+** Parse Contexts
+**
+** A context keeps one input alive between
+** parses so that its block pool, marks and
+** filename are only allocated once. Every
+** pool block is handed back by the end of a
+** parse so nothing needs clearing in between.
+*/
+
+struct mpc_context_t {
+  mpc_input_t *input;
+  size_t filename_slots;
+};
+
+mpc_context_t *mpc_context_new(size_t pool_size) {
+  mpc_context_t *c = malloc(sizeof(mpc_context_t));
+  c->input = mpc_input_new_nstring("", "", 0);
+  c->input->mem_num = pool_size ? pool_size : MPC_INPUT_MEM_NUM;
+  c->filename_slots = 1;
+  return c;
+}
+
+void mpc_context_delete(mpc_context_t *c) {
+  mpc_input_delete(c->input);
+  free(c);
+}
+
+static mpc_input_t *mpc_context_input(mpc_context_t *c, const char *filename, const char *string, size_t length) {
+
+  mpc_input_t *i = c->input;
+  size_t n = strlen(filename) + 1;
+
+  if (n > c->filename_slots) {
+    c->filename_slots = n;
+    i->filename = realloc(i->filename, n);
+  }
+  memcpy(i->filename, filename, n);
+
+  mpc_input_init(i, string, length);
+  return i;
+}
+
+void mpc_context_set_flags(mpc_context_t *c, int flags) {
+  c->input->flags = flags;
+}
+
+void mpc_context_stats(mpc_context_t *c, mpc_pool_stats_t *s) {
+  *s = c->input->mem_stats;
+  s->peak = c->input->mem_used;
+}
+
+int mpc_context_parse(mpc_context_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_input(mpc_context_input(c, filename, string, strlen(string)), p, r);
+}
+
+int mpc_context_nparse(mpc_context_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_input(mpc_context_input(c, filename, string, length), p, r);
+}
+
+int mpc_context_code_parse(mpc_context_t *c, const char *filename, const char *string, mpc_code_t *code, mpc_result_t *r) {
+  return mpc_parse_input_run(mpc_context_input(c, filename, string, strlen(string)), NULL, code, r);
+}
+
+int mpc_context_code_nparse(mpc_context_t *c, const char *filename, const char *string, size_t length, mpc_code_t *code, mpc_result_t *r) {
+  return mpc_parse_input_run(mpc_context_input(c, filename, string, length), NULL, code, r);
+}
+
+int mpc_context_recognize(mpc_context_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, long *consumed, mpc_err_t **error) {
+  return mpc_recognize_input(mpc_context_input(c, filename, string, length), p, consumed, error);
+}
+
+void mpc_context_set_profile(mpc_context_t *c, mpc_profile_t *f) {
+  c->input->profile = f;
+}
+
+mpc_profile_t *mpc_profile_new(void) {
+
+  int j;
+  mpc_profile_t *f = malloc(sizeof(mpc_profile_t));
+
+  f->rules_num = 0;
+  f->rules_slots = MPC_PROFILE_SLOTS_MIN;
+  f->rules = malloc(sizeof(mpc_profile_rule_t) * f->rules_slots);
+  f->keys = malloc(sizeof(mpc_parser_t*) * f->rules_slots);
+  f->active = malloc(sizeof(int) * f->rules_slots);
+
+  f->table_slots = MPC_PROFILE_SLOTS_MIN * 2;
+  f->table = malloc(sizeof(int) * f->table_slots);
+  for (j = 0; j < f->table_slots; j++) { f->table[j] = -1; }
+
+  f->frames_num = 0;
+  f->frames_slots = MPC_PROFILE_SLOTS_MIN;
+  f->frames = malloc(sizeof(mpc_profile_frame_t) * f->frames_slots);
+
+  return f;
+}
+
+void mpc_profile_reset(mpc_profile_t *f) {
+  int j;
+  for (j = 0; j < f->rules_num; j++) { free((char*)f->rules[j].name); }
+  for (j = 0; j < f->table_slots; j++) { f->table[j] = -1; }
+  f->rules_num = 0;
+  f->frames_num = 0;
+}
+
+void mpc_profile_delete(mpc_profile_t *f) {
+  mpc_profile_reset(f);
+  free(f->rules);
+  free(f->keys);
+  free(f->active);
+  free(f->table);
+  free(f->frames);
+  free(f);
+}
+
+int mpc_profile_rules(mpc_profile_t *f, const mpc_profile_rule_t **rules) {
+  *rules = f->rules;
+  return f->rules_num;
+}
+
+static int mpc_profile_cmp_self(const void *a, const void *b) {
+  double x = (*(mpc_profile_rule_t**)a)->self, y = (*(mpc_profile_rule_t**)b)->self;
+  return (x < y) - (x > y);
+}
+
+static int mpc_profile_cmp_total(const void *a, const void *b) {
+  double x = (*(mpc_profile_rule_t**)a)->total, y = (*(mpc_profile_rule_t**)b)->total;
+  return (x < y) - (x > y);
+}
+
+static int mpc_profile_cmp_calls(const void *a, const void *b) {
+  unsigned long x = (*(mpc_profile_rule_t**)a)->calls, y = (*(mpc_profile_rule_t**)b)->calls;
+  return (x < y) - (x > y);
+}
+
+static int mpc_profile_cmp_name(const void *a, const void *b) {
+  return strcmp((*(mpc_profile_rule_t**)a)->name, (*(mpc_profile_rule_t**)b)->name);
+}
+
+static mpc_profile_rule_t **mpc_profile_sorted(mpc_profile_t *f, int sort) {
+
+  int j;
+  mpc_profile_rule_t **rs = malloc(sizeof(mpc_profile_rule_t*) * (f->rules_num + 1));
+
+  for (j = 0; j < f->rules_num; j++) { rs[j] = f->rules + j; }
+
+  switch (sort) {
+    case MPC_PROFILE_SORT_TOTAL: qsort(rs, f->rules_num, sizeof(mpc_profile_rule_t*), mpc_profile_cmp_total); break;
+    case MPC_PROFILE_SORT_CALLS: qsort(rs, f->rules_num, sizeof(mpc_profile_rule_t*), mpc_profile_cmp_calls); break;
+    case MPC_PROFILE_SORT_NAME:  qsort(rs, f->rules_num, sizeof(mpc_profile_rule_t*), mpc_profile_cmp_name); break;
+    default:                     qsort(rs, f->rules_num, sizeof(mpc_profile_rule_t*), mpc_profile_cmp_self); break;
+  }
+
+  return rs;
+}
+
+void mpc_profile_print(mpc_profile_t *f, FILE *out, int sort) {
+
+  int j;
+  double self = 0.0;
+  mpc_profile_rule_t **rs = mpc_profile_sorted(f, sort);
+
+  for (j = 0; j < f->rules_num; j++) { self += rs[j]->self; }
+
+  fprintf(out, "%-20s %10s %10s %10s %10s %10s %10s %10s %10s %6s\n",
+    "rule", "calls", "ok", "fail", "bytes", "rewinds", "allocs", "total ms", "self ms", "self%");
+
+  for (j = 0; j < f->rules_num; j++) {
+    fprintf(out, "%-20s %10lu %10lu %10lu %10lu %10lu %10lu %10.3f %10.3f %6.1f\n",
+      rs[j]->name, rs[j]->calls, rs[j]->successes, rs[j]->failures,
+      rs[j]->bytes, rs[j]->rewinds, rs[j]->allocs,
+      rs[j]->total * 1000.0, rs[j]->self * 1000.0,
+      self > 0.0 ? 100.0 * rs[j]->self / self : 0.0);
+  }
+
+  free(rs);
+}
+
+static void mpc_json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') { fprintf(out, "\\%c", *s); }
+    else if ((unsigned char)*s < 0x20) { fprintf(out, "\\u%04x", (unsigned char)*s); }
+    else { fputc(*s, out); }
+  }
+  fputc('"', out);
+}
+
+void mpc_profile_json(mpc_profile_t *f, FILE *out, int sort) {
+
+  int j;
+  mpc_profile_rule_t **rs = mpc_profile_sorted(f, sort);
+
+  fprintf(out, "[");
+  for (j = 0; j < f->rules_num; j++) {
+    fprintf(out, "%s\n  {\"name\": ", j ? "," : "");
+    mpc_json_string(out, rs[j]->name);
+    fprintf(out, ", \"calls\": %lu, \"successes\": %lu, \"failures\": %lu, "
+      "\"bytes\": %lu, \"rewinds\": %lu, \"allocs\": %lu, "
+      "\"total_ms\": %.6f, \"self_ms\": %.6f}",
+      rs[j]->calls, rs[j]->successes, rs[j]->failures,
+      rs[j]->bytes, rs[j]->rewinds, rs[j]->allocs,
+      rs[j]->total * 1000.0, rs[j]->self * 1000.0);
+  }
+  fprintf(out, "%s]\n", f->rules_num ? "\n" : "");
+
+  free(rs);
+}
+
+void mpc_context_set_trace(mpc_context_t *c, mpc_trace_t *t) {
+  c->input->trace = t;
+}
+
+mpc_trace_t *mpc_trace_new(size_t events) {
+  mpc_trace_t *t = malloc(sizeof(mpc_trace_t));
+  t->events_slots = events ? events : MPC_TRACE_EVENTS_DEFAULT;
+  t->events = malloc(sizeof(mpc_trace_event_t) * t->events_slots);
+  t->events_head = 0;
+  t->events_num = 0;
+  t->dropped = 0;
+  return t;
+}
+
+void mpc_trace_delete(mpc_trace_t *t) {
+  free(t->events);
+  free(t);
+}
+
+void mpc_trace_reset(mpc_trace_t *t) {
+  t->events_head = 0;
+  t->events_num = 0;
+  t->dropped = 0;
+}
+
+unsigned long mpc_trace_dropped(mpc_trace_t *t) {
+  return t->dropped;
+}
+
+static mpc_trace_event_t *mpc_trace_event(mpc_trace_t *t, size_t k) {
+  return t->events + (t->events_head + t->events_slots - t->events_num + k) % t->events_slots;
+}
+
+void mpc_trace_chrome(mpc_trace_t *t, FILE *out) {
+
+  size_t k;
+  int depth = 0, n = 0;
+  double start = t->events_num ? mpc_trace_event(t, 0)->time : 0.0;
+  mpc_trace_event_t *v;
+
+  fprintf(out, "{\"traceEvents\": [");
+
+  for (k = 0; k < t->events_num; k++) {
+
+    v = mpc_trace_event(t, k);
+
+    if (v->type == MPC_TRACE_SUCCESS || v->type == MPC_TRACE_FAILURE) {
+      if (depth == 0) { continue; }
+      depth--;
+    }
+
+    fprintf(out, "%s\n  {\"name\": ", n++ ? "," : "");
+
+    switch (v->type) {
+      case MPC_TRACE_ENTER:
+        mpc_json_string(out, v->parser->name);
+        fprintf(out, ", \"ph\": \"B\"");
+        depth++;
+        break;
+      case MPC_TRACE_REWIND:
+        fprintf(out, "\"rewind\", \"ph\": \"i\", \"s\": \"t\"");
+        break;
+      default:
+        mpc_json_string(out, v->parser->name);
+        fprintf(out, ", \"ph\": \"E\"");
+        break;
+    }
+
+    fprintf(out, ", \"ts\": %.3f, \"pid\": 1, \"tid\": 1, \"args\": {\"pos\": %ld",
+      (v->time - start) * 1e6, v->pos);
+    if (v->type == MPC_TRACE_SUCCESS) { fprintf(out, ", \"ok\": true"); }
+    if (v->type == MPC_TRACE_FAILURE) { fprintf(out, ", \"ok\": false"); }
+    fprintf(out, "}}");
+  }
+
+  fprintf(out, "%s], \"displayTimeUnit\": \"ns\"}\n", n ? "\n" : "");
+}
+
+/* Folded stacks are split on ';' and the last space */
+static void mpc_trace_folded_name(FILE *out, const char *s) {
+  for (; *s; s++) { fputc(*s == ';' || isspace((unsigned char)*s) ? '_' : *s, out); }
+}
+
+void mpc_trace_folded(mpc_trace_t *t, FILE *out) {
+
+  size_t k;
+  int j, depth = 0, slots = MPC_PROFILE_SLOTS_MIN;
+  double elapsed;
+  mpc_trace_event_t *v;
+  mpc_trace_event_t **stack = malloc(sizeof(mpc_trace_event_t*) * slots);
+  double *children = malloc(sizeof(double) * slots);
+
+  for (k = 0; k < t->events_num; k++) {
+
+    v = mpc_trace_event(t, k);
+
+    if (v->type == MPC_TRACE_ENTER) {
+      if (depth == slots) {
+        slots *= 2;
+        stack = realloc(stack, sizeof(mpc_trace_event_t*) * slots);
+        children = realloc(children, sizeof(double) * slots);
+      }
+      stack[depth] = v;
+      children[depth] = 0.0;
+      depth++;
+      continue;
+    }
+
+    if (v->type == MPC_TRACE_REWIND || depth == 0) { continue; }
+
+    depth--;
+    elapsed = v->time - stack[depth]->time;
+    if (depth > 0) { children[depth-1] += elapsed; }
+
+    for (j = 0; j <= depth; j++) {
+      if (j) { fputc(';', out); }
+      mpc_trace_folded_name(out, stack[j]->parser->name);
+    }
+    fprintf(out, " %lu\n", (unsigned long)((elapsed - children[depth]) * 1e9 + 0.5));
+  }
+
+  free(stack);
+  free(children);
+}
+
+/*
+** Push Parsing
+**
+** A push parser accepts input in arbitrary
+** chunks and yields every complete value as
+** soon as the bytes ending it have arrived.
+**
+** The combinators are recursive and cannot be
+** suspended half way through a rule, so any
+** unfinished value is kept in a buffer and the
+** parser is run over it again from its start
+** once more input is fed in. The input is put
+** into a partial mode in which reading past
+** the end of the buffered data marks it as
+** starved. A starved result, success or
+** failure, might change given more input and
+** so is thrown away. Only `mpc_blank`, such as
+** the trailing whitespace of `mpc_tok`, may
+** run into the end without starving, as more
+** whitespace can never change what it gives.
+**
+** Whitespace between values is skipped by the
+** driver itself. When a value fails, parsing
+** resumes from the position of the error, or
+** from the next byte if it failed where it
+** started, and carries on over whatever is
+** already buffered.
+*/
+
+enum {
+  MPC_PUSH_LIMIT_DEFAULT = 1048576,
+  MPC_PUSH_RESULTS_MIN = 8
+};
+
+struct mpc_push_t {
+
+  char *filename;
+  mpc_context_t *context;
+  mpc_parser_t *parser;
+  mpc_dtor_t dtor;
+  size_t limit;
+
+  char *buffer;
+  size_t buffer_start;
+  size_t buffer_len;
+  size_t buffer_slots;
+  mpc_state_t state;
+  char last;
+  int finished;
+
+  int *results_ok;
+  mpc_result_t *results;
+  int results_head;
+  int results_num;
+  int results_slots;
+
+};
+
+mpc_push_t *mpc_push_new(const char *filename, mpc_parser_t *p, mpc_dtor_t d, size_t limit) {
+
+  mpc_push_t *s = malloc(sizeof(mpc_push_t));
+
+  s->filename = malloc(strlen(filename) + 1);
+  strcpy(s->filename, filename);
+  s->context = mpc_context_new(0);
+  s->parser = p;
+  s->dtor = d;
+  s->limit = limit ? limit : MPC_PUSH_LIMIT_DEFAULT;
+
+  s->buffer = NULL;
+  s->buffer_start = 0;
+  s->buffer_len = 0;
+  s->buffer_slots = 0;
+  s->state = mpc_state_new();
+  s->last = '\0';
+  s->finished = 0;
+
+  s->results_head = 0;
+  s->results_num = 0;
+  s->results_slots = MPC_PUSH_RESULTS_MIN;
+  s->results_ok = malloc(sizeof(int) * s->results_slots);
+  s->results = malloc(sizeof(mpc_result_t) * s->results_slots);
+
+  return s;
+}
+
+void mpc_push_delete(mpc_push_t *s) {
+
+  mpc_result_t r;
+
+  while (mpc_push_ready(s)) {
+    if (mpc_push_next(s, &r)) {
+      if (s->dtor) { s->dtor(r.output); }
+    } else {
+      mpc_err_delete(r.error);
+    }
+  }
+
+  free(s->filename);
+  mpc_context_delete(s->context);
+  free(s->buffer);
+  free(s->results_ok);
+  free(s->results);
+  free(s);
+}
+
+static void mpc_push_result(mpc_push_t *s, int ok, mpc_result_t *r) {
+
+  int j;
+
+  if (s->results_head > 0 && s->results_head + s->results_num == s->results_slots) {
+    memmove(s->results_ok, s->results_ok + s->results_head, sizeof(int) * s->results_num);
+    memmove(s->results, s->results + s->results_head, sizeof(mpc_result_t) * s->results_num);
+    s->results_head = 0;
+  }
+
+  if (s->results_head + s->results_num == s->results_slots) {
+    s->results_slots = s->results_slots + s->results_slots / 2;
+    s->results_ok = realloc(s->results_ok, sizeof(int) * s->results_slots);
+    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
+  }
+
+  j = s->results_head + s->results_num;
+  s->results_ok[j] = ok;
+  s->results[j] = *r;
+  s->results_num++;
+}
+
+static void mpc_push_skip(mpc_push_t *s, size_t n) {
+
+  char c;
+
+  while (n > 0 && s->buffer_start < s->buffer_len) {
+    c = s->buffer[s->buffer_start];
+    n--;
+    s->buffer_start++;
+    s->last = c;
+    s->state.pos++;
+    s->state.col++;
+    if (c == '\n') {
+      s->state.col = 0;
+      s->state.row++;
+    }
+  }
+}
+
+static void mpc_push_space(mpc_push_t *s) {
+
+  char c;
+
+  while (s->buffer_start < s->buffer_len) {
+    c = s->buffer[s->buffer_start];
+    if (c == '\0' || !strchr(" \f\n\r\t\v", c)) { break; }
+    mpc_push_skip(s, 1);
+  }
+}
+
+static void mpc_push_error(mpc_push_t *s, const char *failure) {
+  mpc_result_t r;
+  r.error = mpc_err_file(s->filename, failure);
+  r.error->state = s->state;
+  mpc_push_result(s, 0, &r);
+}
+
+static void mpc_push_run(mpc_push_t *s) {
+
+  mpc_input_t *i;
+  mpc_result_t r;
+  long consumed, failed;
+  int x;
+
+  while (1) {
+
+    mpc_push_space(s);
+    if (s->buffer_start == s->buffer_len) { break; }
+
+    i = mpc_context_input(s->context, s->filename,
+      s->buffer + s->buffer_start, s->buffer_len - s->buffer_start);
+    i->state = s->state;
+    i->last = s->last;
+    i->string_pos = s->state.pos;
+    i->partial = !s->finished;
+
+    x = mpc_parse_input(i, s->parser, &r);
+
+    if (i->starved) {
+      if (x) {
+        if (s->dtor) { s->dtor(r.output); }
+      } else {
+        mpc_err_delete(r.error);
+      }
+      if (s->buffer_len - s->buffer_start > s->limit) {
+        mpc_push_error(s, "Input exceeds push buffer limit!");
+        mpc_push_skip(s, s->buffer_len - s->buffer_start);
+      }
+      break;
+    }
+
+    consumed = i->state.pos - s->state.pos;
+
+    if (x && consumed > 0) {
+      mpc_push_result(s, 1, &r);
+      s->state = i->state;
+      s->last = i->last;
+      s->buffer_start += (size_t)consumed;
+      continue;
+    }
+
+    /*
+    ** A failure which did not starve never looked
+    ** past the buffered data, so resuming at the
+    ** point it failed gives the same results
+    ** however the input was split into chunks.
+    */
+    if (x) {
+      if (s->dtor) { s->dtor(r.output); }
+      mpc_push_error(s, "Parser consumed no input!");
+      failed = 1;
+    } else {
+      failed = r.error->state.pos - s->state.pos;
+      mpc_push_result(s, 0, &r);
+    }
+
+    mpc_push_skip(s, failed > 0 ? (size_t)failed : 1);
+  }
+
+}
+
+int mpc_push_feed(mpc_push_t *s, const char *data, size_t length) {
+
+  if (s->finished || length == 0) { return s->results_num; }
+
+  if (s->buffer_start > 0) {
+    memmove(s->buffer, s->buffer + s->buffer_start, s->buffer_len - s->buffer_start);
+    s->buffer_len -= s->buffer_start;
+    s->buffer_start = 0;
+  }
+
+  if (s->buffer_len + length > s->buffer_slots) {
+    s->buffer_slots = s->buffer_len + length + s->buffer_len / 2;
+    s->buffer = realloc(s->buffer, s->buffer_slots);
+  }
+
+  memcpy(s->buffer + s->buffer_len, data, length);
+  s->buffer_len += length;
+
+  mpc_push_run(s);
+  return s->results_num;
+}
+
+int mpc_push_finish(mpc_push_t *s) {
+  if (s->finished) { return s->results_num; }
+  s->finished = 1;
+  mpc_push_run(s);
+  return s->results_num;
+}
+
+int mpc_push_ready(mpc_push_t *s) {
+  return s->results_num;
+}
+
+int mpc_push_next(mpc_push_t *s, mpc_result_t *r) {
+
+  int ok;
+
+  /* Callers which do not check first still get an error they can print and delete */
+  if (s->results_num == 0) {
+    r->error = mpc_err_file(s->filename, "No parse result is ready!");
+    return 0;
+  }
+
+  ok = s->results_ok[s->results_head];
+  *r = s->results[s->results_head];
+  s->results_head++;
+  s->results_num--;
+  if (s->results_num == 0) { s->results_head = 0; }
+
+  return ok;
+}
+
+/*
+** The first characters of a parser are only
+** worked out through parsers which belong to
+** it alone. A retained parser may be defined
+** again later, so it is never looked inside.
+** Within an `expect` errors are suppressed, so
+** an `or` may be looked through there as well.
+*/
+
+static void mpc_optimise_set_add(unsigned char *x, mpc_parser_t *p);
+
+static int mpc_first(mpc_parser_t *p, unsigned char *s, int expect, int depth) {
+
+  int j;
+
+  if (p->retained || p->name || depth == MPC_FIRST_DEPTH) { return 0; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CLASS:
+      mpc_optimise_set_add(s, p);
+      return 1;
+
+    case MPC_TYPE_ANY:
+      memset(s, 0xFF, MPC_SET_BYTES);
+      return 1;
+
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0] == '\0') { return 0; }
+      s[(unsigned char)p->data.string.x[0] >> 3] |= (unsigned char)(1 << ((unsigned char)p->data.string.x[0] & 7));
+      return 1;
+
+    case MPC_TYPE_EXPECT:   return mpc_first(p->data.expect.x, s, 1, depth+1);
+    case MPC_TYPE_APPLY:    return mpc_first(p->data.apply.x, s, expect, depth+1);
+    case MPC_TYPE_APPLY_TO: return mpc_first(p->data.apply_to.x, s, expect, depth+1);
+
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_first_trivial(p->data.and.xs[j]->type)) {
+          return mpc_first(p->data.and.xs[j], s, expect, depth+1);
+        }
+        if (p->data.and.xs[j]->retained || p->data.and.xs[j]->name) { return 0; }
+      }
+      return 0;
+
+    case MPC_TYPE_OR:
+      if (!expect || p->data.or.n == 0) { return 0; }
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_first(p->data.or.xs[j], s, expect, depth+1)) { return 0; }
+      }
+      return 1;
+
+    default: return 0;
+  }
+}
+
+static void mpc_or_first(mpc_parser_t *p) {
+
+  int j, known = 0;
+  unsigned char *s;
+
+  free(p->data.or.first);
+  p->data.or.first = NULL;
+  if (p->data.or.n == 0) { return; }
+
+  s = calloc(p->data.or.n, MPC_SET_BYTES);
+  for (j = 0; j < p->data.or.n; j++) {
+    if (mpc_first(p->data.or.xs[j], s + j * MPC_SET_BYTES, 0, 0)) {
+      s[j * MPC_SET_BYTES] &= 0xFE;
+      known = 1;
+    } else {
+      memset(s + j * MPC_SET_BYTES, 0xFF, MPC_SET_BYTES);
+    }
+  }
+
+  if (known) { p->data.or.first = s; } else { free(s); }
+}
+
+/*
+** Building a Parser
+*/
+
+static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+
+static void mpc_undefine_or(mpc_parser_t *p) {
+
+  int i;
+  for (i = 0; i < p->data.or.n; i++) {
+    mpc_undefine_unretained(p->data.or.xs[i], 0);
+  }
+  free(p->data.or.xs);
+  free(p->data.or.first);
+
+}
+
+static void mpc_undefine_and(mpc_parser_t *p) {
+
+  int i;
+  for (i = 0; i < p->data.and.n; i++) {
+    mpc_undefine_unretained(p->data.and.xs[i], 0);
+  }
+  free(p->data.and.xs);
+  free(p->data.and.dxs);
+
+}
+
+static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
+
+  if (p->retained && !force) { return; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      free(p->data.string.x);
+      break;
+
+    case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
+    case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
+    case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      mpc_undefine_unretained(p->data.not.x, 0);
+      break;
+
+    case MPC_TYPE_EXPECT:
+      mpc_undefine_unretained(p->data.expect.x, 0);
+      free(p->data.expect.m);
+      break;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_undefine_unretained(p->data.repeat.x, 0);
+      break;
+
+    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
+    case MPC_TYPE_AND: mpc_undefine_and(p); break;
+
+    case MPC_TYPE_CHECK:
+      mpc_undefine_unretained(p->data.check.x, 0);
+      free(p->data.check.e);
+      break;
+
+    case MPC_TYPE_CHECK_WITH:
+      mpc_undefine_unretained(p->data.check_with.x, 0);
+      free(p->data.check_with.e);
+      break;
+
+    case MPC_TYPE_CLASS:
+    case MPC_TYPE_SPAN:
+      free(p->data.set.x);
+      free(p->data.set.m);
+      break;
+
+    default: break;
+  }
+
+  if (!force) {
+    free(p->name);
+    free(p);
+  }
+
+}
+
+void mpc_delete(mpc_parser_t *p) {
+  if (p->retained) {
+
+    if (p->type != MPC_TYPE_UNDEFINED) {
+      mpc_undefine_unretained(p, 0);
+    }
+
+    free(p->name);
+    free(p);
+
+  } else {
+    mpc_undefine_unretained(p, 0);
+  }
+}
+
+static void mpc_soft_delete(mpc_val_t *x) {
+  mpc_undefine_unretained(x, 0);
+}
+
+static mpc_parser_t *mpc_undefined(void) {
+  mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
+  p->retained = 0;
+  p->type = MPC_TYPE_UNDEFINED;
+  p->name = NULL;
+  return p;
+}
+
+mpc_parser_t *mpc_new(const char *name) {
+  mpc_parser_t *p = mpc_undefined();
+  p->retained = 1;
+  p->name = realloc(p->name, strlen(name) + 1);
+  strcpy(p->name, name);
+  return p;
+}
+
+mpc_parser_t *mpc_copy(mpc_parser_t *a) {
+  int i = 0;
+  mpc_parser_t *p;
+
+  if (a->retained) { return a; }
+
+  p = mpc_undefined();
+  p->retained = a->retained;
+  p->type = a->type;
+  p->data = a->data;
+
+  if (a->name) {
+    p->name = malloc(strlen(a->name)+1);
+    strcpy(p->name, a->name);
+  }
+
+  switch (a->type) {
+
+    case MPC_TYPE_FAIL:
+      p->data.fail.m = malloc(strlen(a->data.fail.m)+1);
+      strcpy(p->data.fail.m, a->data.fail.m);
+    break;
+
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      p->data.string.x = malloc(strlen(a->data.string.x)+1);
+      strcpy(p->data.string.x, a->data.string.x);
+      break;
+
+    case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
+    case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
+    case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      p->data.not.x = mpc_copy(a->data.not.x);
+      break;
+
+    case MPC_TYPE_EXPECT:
+      p->data.expect.x = mpc_copy(a->data.expect.x);
+      p->data.expect.m = malloc(strlen(a->data.expect.m)+1);
+      strcpy(p->data.expect.m, a->data.expect.m);
+      break;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      p->data.repeat.x = mpc_copy(a->data.repeat.x);
+      break;
+
+    case MPC_TYPE_OR:
+      p->data.or.xs = malloc(a->data.or.n * sizeof(mpc_parser_t*));
+      for (i = 0; i < a->data.or.n; i++) {
+        p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
+      }
+      p->data.or.first = NULL;
+      mpc_or_first(p);
+    break;
+    case MPC_TYPE_AND:
+      p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
+      for (i = 0; i < a->data.and.n; i++) {
+        p->data.and.xs[i] = mpc_copy(a->data.and.xs[i]);
+      }
+      p->data.and.dxs = malloc((a->data.and.n-1) * sizeof(mpc_dtor_t));
+      for (i = 0; i < a->data.and.n-1; i++) {
+        p->data.and.dxs[i] = a->data.and.dxs[i];
+      }
+    break;
+
+    case MPC_TYPE_CHECK:
+      p->data.check.x      = mpc_copy(a->data.check.x);
+      p->data.check.e      = malloc(strlen(a->data.check.e)+1);
+      strcpy(p->data.check.e, a->data.check.e);
+      break;
+    case MPC_TYPE_CHECK_WITH:
+      p->data.check_with.x = mpc_copy(a->data.check_with.x);
+      p->data.check_with.e = malloc(strlen(a->data.check_with.e)+1);
+      strcpy(p->data.check_with.e, a->data.check_with.e);
+      break;
+
+    case MPC_TYPE_CLASS:
+    case MPC_TYPE_SPAN:
+      p->data.set.x = malloc(MPC_SET_BYTES);
+      memcpy(p->data.set.x, a->data.set.x, MPC_SET_BYTES);
+      if (a->data.set.m) {
+        p->data.set.m = malloc(strlen(a->data.set.m)+1);
+        strcpy(p->data.set.m, a->data.set.m);
+      }
+      break;
+
+    default: break;
+  }
+
+
+  return p;
+}
+
+mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+  mpc_undefine_unretained(p, 1);
+  p->type = MPC_TYPE_UNDEFINED;
+  return p;
+}
+
+mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+
+  if (p->retained) {
+    p->type = a->type;
+    p->data = a->data;
+  } else {
+    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
+    p->type = a2->type;
+    p->data = a2->data;
+    free(a2);
+  }
+
+  free(a);
+  return p;
+}
+
+void mpc_cleanup(int n, ...) {
+  int i;
+  mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+
+  va_list va;
+  va_start(va, n);
+  for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
+  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
+  for (i = 0; i < n; i++) { mpc_delete(list[i]); }
+  va_end(va);
+
+  free(list);
+}
+
+mpc_parser_t *mpc_pass(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PASS;
+  return p;
+}
+
+mpc_parser_t *mpc_fail(const char *m) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FAIL;
+  p->data.fail.m = malloc(strlen(m) + 1);
+  strcpy(p->data.fail.m, m);
+  return p;
+}
+
+/*
+** As `snprintf` is not ANSI standard this
+** function `mpc_failf` should be considered
+** unsafe.
+**
+** You have a few options if this is going to be
+** trouble.
+**
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
+**
+** - Patch this function in your code base to
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
+**
+*/
+
+mpc_parser_t *mpc_failf(const char *fmt, ...) {
+
+  va_list va;
+  char *buffer;
+
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FAIL;
+
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+
+  buffer = realloc(buffer, strlen(buffer) + 1);
+  p->data.fail.m = buffer;
+  return p;
+
+}
+
+mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LIFT_VAL;
+  p->data.lift.x = x;
+  return p;
+}
+
+mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LIFT;
+  p->data.lift.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ANCHOR;
+  p->data.anchor.f = f;
+  return mpc_expect(p, "anchor");
+}
+
+mpc_parser_t *mpc_state(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_STATE;
+  return p;
+}
+
+mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EXPECT;
+  p->data.expect.x = a;
+  p->data.expect.m = malloc(strlen(expected) + 1);
+  strcpy(p->data.expect.m, expected);
+  return p;
+}
+
+/*
+** As `snprintf` is not ANSI standard this
+** function `mpc_expectf` should be considered
+** unsafe.
+**
+** You have a few options if this is going to be
+** trouble.
+**
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
+**
+** - Patch this function in your code base to
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
+**
+*/
+
+mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
+  va_list va;
+  char *buffer;
+
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EXPECT;
+
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+
+  buffer = realloc(buffer, strlen(buffer) + 1);
+  p->data.expect.x = a;
+  p->data.expect.m = buffer;
+  return p;
+}
+
+/*
+** Basic Parsers
+*/
+
+mpc_parser_t *mpc_any(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ANY;
+  return mpc_expect(p, "any character");
+}
+
+mpc_parser_t *mpc_char(char c) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SINGLE;
+  p->data.single.x = c;
+  return mpc_expectf(p, "'%c'", c);
+}
+
+mpc_parser_t *mpc_range(char s, char e) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_RANGE;
+  p->data.range.x = s;
+  p->data.range.y = e;
+  return mpc_expectf(p, "character between '%c' and '%c'", s, e);
+}
+
+mpc_parser_t *mpc_oneof(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ONEOF;
+  p->data.string.x = malloc(strlen(s) + 1);
+  strcpy(p->data.string.x, s);
+  return mpc_expectf(p, "one of '%s'", s);
+}
+
+mpc_parser_t *mpc_noneof(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_NONEOF;
+  p->data.string.x = malloc(strlen(s) + 1);
+  strcpy(p->data.string.x, s);
+  return mpc_expectf(p, "none of '%s'", s);
+
+}
+
+mpc_parser_t *mpc_satisfy(int(*f)(char)) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SATISFY;
+  p->data.satisfy.f = f;
+  return mpc_expectf(p, "character satisfying function %p", f);
+}
+
+mpc_parser_t *mpc_string(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_STRING;
+  p->data.string.x = malloc(strlen(s) + 1);
+  strcpy(p->data.string.x, s);
+  return mpc_expectf(p, "\"%s\"", s);
+}
+
+/*
+** Core Parsers
+*/
+
+mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_APPLY;
+  p->data.apply.x = a;
+  p->data.apply.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_APPLY_TO;
+  p->data.apply_to.x = a;
+  p->data.apply_to.f = f;
+  p->data.apply_to.d = x;
+  return p;
+}
+
+mpc_parser_t *mpc_check(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *e) {
+  mpc_parser_t  *p = mpc_undefined();
+  p->type = MPC_TYPE_CHECK;
+  p->data.check.x = a;
+  p->data.check.dx = da;
+  p->data.check.f = f;
+  p->data.check.e = malloc(strlen(e) + 1);
+  strcpy(p->data.check.e, e);
+  return p;
+}
+
+mpc_parser_t *mpc_check_with(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *e) {
+  mpc_parser_t  *p = mpc_undefined();
+  p->type = MPC_TYPE_CHECK_WITH;
+  p->data.check_with.x = a;
+  p->data.check_with.dx = da;
+  p->data.check_with.f = f;
+  p->data.check_with.d = x;
+  p->data.check_with.e = malloc(strlen(e) + 1);
+  strcpy(p->data.check_with.e, e);
+  return p;
+}
+
+mpc_parser_t *mpc_checkf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *fmt, ...) {
+  va_list va;
+  char *buffer;
+  mpc_parser_t *p;
+
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+
+  p = mpc_check(a, da, f, buffer);
+  free(buffer);
+
+  return p;
+}
+
+mpc_parser_t *mpc_check_withf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *fmt, ...) {
+  va_list va;
+  char *buffer;
+  mpc_parser_t *p;
+
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+
+  p = mpc_check_with(a, da, f, x, buffer);
+  free(buffer);
+
+  return p;
+}
+
+mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PREDICT;
+  p->data.predict.x = a;
+  return p;
+}
+
+mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_NOT;
+  p->data.not.x = a;
+  p->data.not.dx = da;
+  p->data.not.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
+  return mpc_not_lift(a, da, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MAYBE;
+  p->data.not.x = a;
+  p->data.not.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
+  return mpc_maybe_lift(a, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MANY;
+  p->data.repeat.x = a;
+  p->data.repeat.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MANY1;
+  p->data.repeat.x = a;
+  p->data.repeat.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_COUNT;
+  p->data.repeat.n = n;
+  p->data.repeat.f = f;
+  p->data.repeat.x = a;
+  p->data.repeat.dx = da;
+  return p;
+}
+
+mpc_parser_t *mpc_or(int n, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+
+  p->type = MPC_TYPE_OR;
+  p->data.or.n = n;
+  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  va_end(va);
+
+  mpc_or_first(p);
+  return p;
+}
+
+mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+
+  p->type = MPC_TYPE_AND;
+  p->data.and.n = n;
+  p->data.and.f = f;
+  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+
+  va_start(va, f);
+  for (i = 0; i < n; i++) {
+    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  for (i = 0; i < (n-1); i++) {
+    p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
+  }
+  va_end(va);
+
+  return p;
+}
+
+/*
+** Common Parsers
+*/
+
+mpc_parser_t *mpc_soi(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SOI;
+  return mpc_expect(p, "start of input");
+}
+
+mpc_parser_t *mpc_eoi(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EOI;
+  return mpc_expect(p, "end of input");
+}
+
+static int mpc_boundary_anchor(char prev, char next) {
+  const char* word = "abcdefghijklmnopqrstuvwxyz"
+                     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                     "0123456789_";
+  if ( strchr(word, next) &&  prev == '\0') { return 1; }
+  if ( strchr(word, prev) &&  next == '\0') { return 1; }
+  if ( strchr(word, next) && !strchr(word, prev)) { return 1; }
+  if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }
+  return 0;
+}
+
+static int mpc_boundary_newline_anchor(char prev, char next) {
+  (void)next;
+  return prev == '\n';
+}
+
+mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "word boundary"); }
+mpc_parser_t *mpc_boundary_newline(void) { return mpc_expect(mpc_anchor(mpc_boundary_newline_anchor), "start of newline"); }
+
+mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
+mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
+mpc_parser_t *mpc_blank(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_BLANK;
+  return p;
+}
+
+mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
+mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
+mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+
+mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
+mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
+mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
+mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
+mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
+mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+
+mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
+mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
+mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
+mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
+mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+
+mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
+mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
+mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
+mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
+
+mpc_parser_t *mpc_real(void) {
+
+  /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+
+  mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+
+  p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  p1 = mpc_digits();
+  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
+  p30 = mpc_oneof("eE");
+  p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  p32 = mpc_digits();
+  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+
+  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+
+}
+
+mpc_parser_t *mpc_float(void) {
+  return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
+}
+
+mpc_parser_t *mpc_char_lit(void) {
+  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
+}
+
+mpc_parser_t *mpc_string_lit(void) {
+  mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+}
+
+mpc_parser_t *mpc_regex_lit(void) {
+  mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+}
+
+mpc_parser_t *mpc_ident(void) {
+  mpc_parser_t *p0, *p1;
+  p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
+  p1 = mpc_many(mpcf_strfold, mpc_alphanum());
+  return mpc_and(2, mpcf_strfold, p0, p1, free);
+}
+
+/*
+** Useful Parsers
+*/
+
+mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
+mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
+
+mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
+mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+
+mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+
+mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+  return mpc_and(3, mpcf_snd_free,
+    mpc_string(o), a, mpc_string(c),
+    free, ad);
+}
+
+mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+
+mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+  return mpc_and(3, mpcf_snd_free,
+    mpc_sym(o), mpc_tok(a), mpc_sym(c),
+    free, ad);
+}
+
+mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
+
+/*
+** Regular Expression Parsers
+*/
+
+/*
+** So here is a cute bootstrapping.
+**
+** I'm using the previously defined
+** mpc constructs and functions to
+** parse the user regex string and
+** construct a parser from it.
+**
+** As it turns out lots of the standard
+** mpc functions look a lot like `fold`
+** functions and so can be used indirectly
+** by many of the parsing functions to build
+** a parser directly - as we are parsing.
+**
+** This is certainly something that
+** would be less elegant/interesting
+** in a two-phase parser which first
+** builds an AST and then traverses it
+** to generate the object.
+**
+** This whole thing acts as a great
+** case study for how trivial it can be
+** to write a great parser in a few
+** lines of code using mpc.
+*/
+
+/*
+**
+**  ### Regular Expression Grammar
+**
+**      <regex> : <term> | (<term> "|" <regex>)
+**
+**      <term> : <factor>*
+**
+**      <factor> : <base>
+**               | <base> "*"
+**               | <base> "+"
+**               | <base> "?"
+**               | <base> "{" <digits> "}"
+**
+**      <base> : <char>
+**             | "\" <char>
+**             | "(" <regex> ")"
+**             | "[" <range> "]"
+*/
+
+static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  else { return mpc_or(2, xs[0], xs[1]); }
+}
+
+static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
+  int i;
+  mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
+  for (i = 0; i < n; i++) {
+    p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+  }
+  return p;
+}
+
+static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
+  int num;
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  switch(((char*)xs[1])[0])
+  {
+    case '*': { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }; break;
+    case '+': { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }; break;
+    case '?': { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }; break;
+    default:
+      num = *(int*)xs[1];
+      free(xs[1]);
+  }
+
+  return mpc_count(num, mpcf_strfold, xs[0], free);
+}
+
+static mpc_parser_t *mpc_re_escape_char(char c) {
+  switch (c) {
+    case 'a': return mpc_char('\a');
+    case 'f': return mpc_char('\f');
+    case 'n': return mpc_char('\n');
+    case 'r': return mpc_char('\r');
+    case 't': return mpc_char('\t');
+    case 'v': return mpc_char('\v');
+    case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
+    case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
+    case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+    case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
+    case 'd': return mpc_digit();
+    case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
+    case 's': return mpc_whitespace();
+    case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
+    case 'w': return mpc_alphanum();
+    case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
+    default: return NULL;
+  }
+}
+
+static mpc_val_t *mpcf_re_escape(mpc_val_t *x, void* data) {
+
+  int mode = *((int*)data);
+  char *s = x;
+  mpc_parser_t *p;
+
+  /* Any Character */
+  if (s[0] == '.') {
+    free(s);
+    if (mode & MPC_RE_DOTALL) {
+      return mpc_any();
+    } else {
+      return mpc_expect(mpc_noneof("\n"), "any character except a newline");
+    }
+  }
+
+  /* Start of Input */
+  if (s[0] == '^') {
+    free(s);
+    if (mode & MPC_RE_MULTILINE) {
+      return mpc_and(2, mpcf_snd, mpc_or(2, mpc_soi(), mpc_boundary_newline()), mpc_lift(mpcf_ctor_str), free);
+    } else {
+      return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+    }
+  }
+
+  /* End of Input */
+  if (s[0] == '$') {
+    free(s);
+    if (mode & MPC_RE_MULTILINE) {
+      return mpc_or(2,
+        mpc_newline(),
+        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
+    } else {
+      return mpc_or(2,
+        mpc_and(2, mpcf_fst, mpc_newline(), mpc_eoi(), free),
+        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
+    }
+  }
+
+  /* Regex Escape */
+  if (s[0] == '\\') {
+    p = mpc_re_escape_char(s[1]);
+    p = (p == NULL) ? mpc_char(s[1]) : p;
+    free(s);
+    return p;
+  }
+
+  /* Regex Standard */
+  p = mpc_char(s[0]);
+  free(s);
+  return p;
+}
+
+static const char *mpc_re_range_escape_char(char c) {
+  switch (c) {
+    case '-': return "-";
+    case 'a': return "\a";
+    case 'f': return "\f";
+    case 'n': return "\n";
+    case 'r': return "\r";
+    case 't': return "\t";
+    case 'v': return "\v";
+    case 'b': return "\b";
+    case 'd': return "0123456789";
+    case 's': return " \f\n\r\t\v";
+    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    default: return NULL;
+  }
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+
+  mpc_parser_t *out;
+  size_t i, j;
+  size_t start, end;
+  const char *tmp = NULL;
+  const char *s = x;
+  int comp = s[0] == '^' ? 1 : 0;
+  char *range = calloc(1,1);
+
+  if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  if (s[0] == '^' &&
+      s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+
+  for (i = comp; i < strlen(s); i++){
+
+    /* Regex Range Escape */
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) {
+        range = realloc(range, strlen(range) + strlen(tmp) + 1);
+        strcat(range, tmp);
+      } else {
+        range = realloc(range, strlen(range) + 1 + 1);
+        range[strlen(range) + 1] = '\0';
+        range[strlen(range) + 0] = s[i+1];
+      }
+      i++;
+    }
+
+    /* Regex Range...Range */
+    else if (s[i] == '-') {
+      if (s[i+1] == '\0' || i == 0) {
+          range = realloc(range, strlen(range) + strlen("-") + 1);
+          strcat(range, "-");
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) {
+          range = realloc(range, strlen(range) + 1 + 1 + 1);
+          range[strlen(range) + 1] = '\0';
+          range[strlen(range) + 0] = (char)j;
+        }
+      }
+    }
+
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+
+  }
+
+  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+
+  free(x);
+  free(range);
+
+  return out;
+}
+
+mpc_parser_t *mpc_re(const char *re) {
+  return mpc_re_mode(re, MPC_RE_DEFAULT);
+}
+
+mpc_parser_t *mpc_re_mode(const char *re, int mode) {
+
+  char *err_msg;
+  mpc_parser_t *err_out;
+  mpc_result_t r;
+  mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose;
+
+  Regex  = mpc_new("regex");
+  Term   = mpc_new("term");
+  Factor = mpc_new("factor");
+  Base   = mpc_new("base");
+  Range  = mpc_new("range");
+
+  mpc_define(Regex, mpc_and(2, mpcf_re_or,
+    Term,
+    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
+    (mpc_dtor_t)mpc_delete
+  ));
+
+  mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+
+  mpc_define(Factor, mpc_and(2, mpcf_re_repeat,
+    Base,
+    mpc_or(5,
+      mpc_char('*'), mpc_char('+'), mpc_char('?'),
+      mpc_brackets(mpc_int(), free),
+      mpc_pass()),
+    (mpc_dtor_t)mpc_delete
+  ));
+
+  mpc_define(Base, mpc_or(4,
+    mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
+    mpc_squares(Range, (mpc_dtor_t)mpc_delete),
+    mpc_apply_to(mpc_escape(), mpcf_re_escape, &mode),
+    mpc_apply_to(mpc_noneof(")|"), mpcf_re_escape, &mode)
+  ));
+
+  mpc_define(Range, mpc_apply(
+    mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
+    mpcf_re_range
+  ));
+
+  RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
+
+  mpc_optimise(RegexEnclose);
+  mpc_optimise(Regex);
+  mpc_optimise(Term);
+  mpc_optimise(Factor);
+  mpc_optimise(Base);
+  mpc_optimise(Range);
+
+  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
+    err_msg = mpc_err_string(r.error);
+    err_out = mpc_failf("Invalid Regex: %s", err_msg);
+    mpc_err_delete(r.error);
+    free(err_msg);
+    r.output = err_out;
+  }
+
+  mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
+
+  mpc_optimise(r.output);
+
+  return r.output;
+
+}
+
+/*
+** Common Fold Functions
+*/
+
+void mpcf_dtor_null(mpc_val_t *x) { (void) x; return; }
+
+mpc_val_t *mpcf_ctor_null(void) { return NULL; }
+mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
+mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+
+mpc_val_t *mpcf_int(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 10);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_hex(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 16);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_oct(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 8);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_float(mpc_val_t *x) {
+  float *y = malloc(sizeof(float));
+  *y = strtod(x, NULL);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_strtriml(mpc_val_t *x) {
+  char *s = x;
+  while (isspace((unsigned char)*s)) {
+    memmove(s, s+1, strlen(s));
+  }
+  return s;
+}
+
+mpc_val_t *mpcf_strtrimr(mpc_val_t *x) {
+  char *s = x;
+  size_t l = strlen(s);
+  while (l > 0 && isspace((unsigned char)s[l-1])) {
+    s[l-1] = '\0'; l--;
+  }
+  return s;
+}
+
+mpc_val_t *mpcf_strtrim(mpc_val_t *x) {
+  return mpcf_strtriml(mpcf_strtrimr(x));
+}
+
+static const char mpc_escape_input_c[]  = {
+  '\a', '\b', '\f', '\n', '\r',
+  '\t', '\v', '\\', '\'', '\"', '\0'};
+
+static const char *mpc_escape_output_c[] = {
+  "\\a", "\\b", "\\f", "\\n", "\\r", "\\t",
+  "\\v", "\\\\", "\\'", "\\\"", "\\0", NULL};
+
+static const char mpc_escape_input_raw_re[] = { '/' };
+static const char *mpc_escape_output_raw_re[] = { "\\/", NULL };
+
+static const char mpc_escape_input_raw_cstr[] = { '"' };
+static const char *mpc_escape_output_raw_cstr[] = { "\\\"", NULL };
+
+static const char mpc_escape_input_raw_cchar[] = { '\'' };
+static const char *mpc_escape_output_raw_cchar[] = { "\\'", NULL };
+
+static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **output) {
+
+  int i;
+  int found;
+  char buff[2];
+  char *s = x;
+  char *y = calloc(1, 1);
+
+  while (*s) {
+
+    i = 0;
+    found = 0;
+
+    while (output[i]) {
+      if (*s == input[i]) {
+        y = realloc(y, strlen(y) + strlen(output[i]) + 1);
+        strcat(y, output[i]);
+        found = 1;
+        break;
+      }
+      i++;
+    }
+
+    if (!found) {
+      y = realloc(y, strlen(y) + 2);
+      buff[0] = *s; buff[1] = '\0';
+      strcat(y, buff);
+    }
+
+    s++;
+  }
+
+
+  return y;
+}
+
+static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char **output) {
+
+  int i;
+  int found = 0;
+  char buff[2];
+  char *s = x;
+  char *y = calloc(1, 1);
+
+  while (*s) {
+
+    i = 0;
+    found = 0;
+
+    while (output[i]) {
+      if ((*(s+0)) == output[i][0] &&
+          (*(s+1)) == output[i][1]) {
+        y = realloc(y, strlen(y) + 1 + 1);
+        buff[0] = input[i]; buff[1] = '\0';
+        strcat(y, buff);
+        found = 1;
+        s++;
+        break;
+      }
+      i++;
+    }
+
+    if (!found) {
+      y = realloc(y, strlen(y) + 1 + 1);
+      buff[0] = *s; buff[1] = '\0';
+      strcat(y, buff);
+    }
+
+    if (*s == '\0') { break; }
+    else { s++; }
+  }
+
+  return y;
+
+}
+
+mpc_val_t *mpcf_escape(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_escape_regex(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_null(int n, mpc_val_t** xs) { (void) n; (void) xs; return NULL; }
+mpc_val_t *mpcf_fst(int n, mpc_val_t **xs) { (void) n; return xs[0]; }
+mpc_val_t *mpcf_snd(int n, mpc_val_t **xs) { (void) n; return xs[1]; }
+mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { (void) n; return xs[2]; }
+
+static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (i != x) { free(xs[i]); }
+  }
+  return xs[x];
+}
+
+mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0); }
+mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
+mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
+
+mpc_val_t *mpcf_freefold(int n, mpc_val_t **xs) {
+  int i;
+  for (i = 0; i < n; i++) {
+    free(xs[i]);
+  }
+  return NULL;
+}
+
+mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
+  int i;
+  size_t l = 0;
+
+  if (n == 0) { return calloc(1, 1); }
+
+  for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+
+  xs[0] = realloc(xs[0], l + 1);
+
+  for (i = 1; i < n; i++) {
+    strcat(xs[0], xs[i]); free(xs[i]);
+  }
+
+  return xs[0];
+}
+
+mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
+  int **vs = (int**)xs;
+  (void) n;
+
+  switch(((char*)xs[1])[0])
+  {
+    case '*': { *vs[0] *= *vs[2]; }; break;
+    case '/': { *vs[0] /= *vs[2]; }; break;
+    case '%': { *vs[0] %= *vs[2]; }; break;
+    case '+': { *vs[0] += *vs[2]; }; break;
+    case '-': { *vs[0] -= *vs[2]; }; break;
+    default: break;
+  }
+
+  free(xs[1]); free(xs[2]);
+
+  return xs[0];
+}
+
+/*
+** Printing
+*/
+
+static void mpc_print_set_char(int c) {
+  char *s;
+  char buff[2];
+  buff[0] = (char)c; buff[1] = '\0';
+  s = mpcf_escape_new(
+    buff,
+    mpc_escape_input_c,
+    mpc_escape_output_c);
+  printf("%s", s);
+  free(s);
+}
+
+static void mpc_print_unretained(mpc_parser_t *p, int force) {
+
+  /* TODO: Print Everything Escaped */
+
+  int i, j;
+  char *s, *e;
+  char buff[2];
+
+  if (p->retained && !force) {;
+    if (p->name) { printf("<%s>", p->name); }
+    else { printf("<anon>"); }
+    return;
+  }
+
+  if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
+  if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
+  if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
+  if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
+  if (p->type == MPC_TYPE_STATE)  { printf("<S>"); }
+  if (p->type == MPC_TYPE_ANCHOR) { printf("<@>"); }
+  if (p->type == MPC_TYPE_BLANK)  { printf("whitespace"); }
+  if (p->type == MPC_TYPE_EXPECT) {
+    printf("%s", p->data.expect.m);
+    /*mpc_print_unretained(p->data.expect.x, 0);*/
+  }
+
+  if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
+  if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
+
+  if (p->type == MPC_TYPE_SINGLE) {
+    buff[0] = p->data.single.x; buff[1] = '\0';
+    s = mpcf_escape_new(
+      buff,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("'%s'", s);
+    free(s);
+  }
+
+  if (p->type == MPC_TYPE_RANGE) {
+    buff[0] = p->data.range.x; buff[1] = '\0';
+    s = mpcf_escape_new(
+      buff,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    buff[0] = p->data.range.y; buff[1] = '\0';
+    e = mpcf_escape_new(
+      buff,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[%s-%s]", s, e);
+    free(s);
+    free(e);
+  }
+
+  if (p->type == MPC_TYPE_ONEOF) {
+    s = mpcf_escape_new(
+      p->data.string.x,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[%s]", s);
+    free(s);
+  }
+
+  if (p->type == MPC_TYPE_NONEOF) {
+    s = mpcf_escape_new(
+      p->data.string.x,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[^%s]", s);
+    free(s);
+  }
+
+  if (p->type == MPC_TYPE_STRING) {
+    s = mpcf_escape_new(
+      p->data.string.x,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("\"%s\"", s);
+    free(s);
+  }
+
+  if (p->type == MPC_TYPE_CLASS || p->type == MPC_TYPE_SPAN) {
+    printf("[");
+    for (i = 1; i < 256; i = j) {
+      for (j = i; j < 256 && MPC_SET_HAS(p->data.set.x, j); j++);
+      if (j == i) { j++; continue; }
+      mpc_print_set_char(i);
+      if (j - i > 2) { printf("-"); }
+      if (j - i > 1) { mpc_print_set_char(j - 1); }
+    }
+    printf("]");
+    if (p->type == MPC_TYPE_SPAN) { printf(p->data.set.n ? "+" : "*"); }
+  }
+
+  if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+
+  if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
+  if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
+
+  if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
+  if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
+  if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+
+  if (p->type == MPC_TYPE_OR) {
+    printf("(");
+    for(i = 0; i < p->data.or.n-1; i++) {
+      mpc_print_unretained(p->data.or.xs[i], 0);
+      printf(" | ");
+    }
+    mpc_print_unretained(p->data.or.xs[p->data.or.n-1], 0);
+    printf(")");
+  }
+
+  if (p->type == MPC_TYPE_AND) {
+    printf("(");
+    for(i = 0; i < p->data.and.n-1; i++) {
+      mpc_print_unretained(p->data.and.xs[i], 0);
+      printf(" ");
+    }
+    mpc_print_unretained(p->data.and.xs[p->data.and.n-1], 0);
+    printf(")");
+  }
+
+  if (p->type == MPC_TYPE_CHECK) {
+    mpc_print_unretained(p->data.check.x, 0);
+    printf("->?");
+  }
+  if (p->type == MPC_TYPE_CHECK_WITH) {
+    mpc_print_unretained(p->data.check_with.x, 0);
+    printf("->?");
+  }
+
+}
+
+void mpc_print(mpc_parser_t *p) {
+  mpc_print_unretained(p, 1);
+  printf("\n");
+}
+
+/*
+** Testing
+*/
+
+/*
+** These functions are slightly unwieldy and
+** also the whole of the testing suite for mpc
+** mpc is pretty shaky.
+**
+** It could do with a lot more tests and more
+** precision. Currently I am only really testing
+** changes off of the examples.
+**
+*/
+
+int mpc_test_fail(mpc_parser_t *p, const char *s, const void *d,
+  int(*tester)(const void*, const void*),
+  mpc_dtor_t destructor,
+  void(*printer)(const void*)) {
+  mpc_result_t r;
+  (void) printer;
+  if (mpc_parse("<test>", s, p, &r)) {
+
+    if (tester(r.output, d)) {
+      destructor(r.output);
+      return 0;
+    } else {
+      destructor(r.output);
+      return 1;
+    }
+
+  } else {
+    mpc_err_delete(r.error);
+    return 1;
+  }
+
+}
+
+int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
+  int(*tester)(const void*, const void*),
+  mpc_dtor_t destructor,
+  void(*printer)(const void*)) {
+
+  mpc_result_t r;
+  if (mpc_parse("<test>", s, p, &r)) {
+
+    if (tester(r.output, d)) {
+      destructor(r.output);
+      return 1;
+    } else {
+      printf("Got "); printer(r.output); printf("\n");
+      printf("Expected "); printer(d); printf("\n");
+      destructor(r.output);
+      return 0;
+    }
+
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 0;
+
+  }
+
+}
+
+
+/*
+** AST
+*/
+
+void mpc_ast_delete(mpc_ast_t *a) {
+
+  int i;
+
+  if (a == NULL) { return; }
+
+  if (a->arena) {
+    if (a->arena->root == a) { mpc_arena_delete(a->arena); }
+    return;
+  }
+
+  for (i = 0; i < a->children_num; i++) {
+    mpc_ast_delete(a->children[i]);
+  }
+
+  free(a->children);
+  free(a->contents);
+  free(a);
+
+}
+
+static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (a->arena) { return; }
+  free(a->children);
+  free(a->contents);
+  free(a);
+}
+
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+
+  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  mpc_tag_t *t = mpc_tag_intern(tag, strlen(tag));
+
+  a->tag = t->name;
+  a->tag_id = t->id;
+
+  a->contents = malloc(strlen(contents) + 1);
+  strcpy(a->contents, contents);
+
+  a->state = mpc_state_new();
+
+  a->source = NULL;
+  a->source_length = 0;
+  a->children_num = 0;
+  a->children = NULL;
+  a->arena = NULL;
+  return a;
+
+}
+
+mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
+
+  mpc_ast_t *a = mpc_ast_new(tag, "");
+
+  int i;
+  va_list va;
+  va_start(va, tag);
+
+  for (i = 0; i < n; i++) {
+    mpc_ast_add_child(a, va_arg(va, mpc_ast_t*));
+  }
+
+  va_end(va);
+
+  return a;
+
+}
+
+mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
+
+  mpc_ast_t *r;
+
+  if (a == NULL) { return a; }
+  if (a->children_num == 0) { return a; }
+  if (a->children_num == 1) { return a; }
+
+  r = a->arena ? mpc_arena_ast_new(a->arena, ">", "") : mpc_ast_new(">", "");
+  mpc_ast_add_child(r, a);
+  return r;
+}
+
+int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
+
+  int i;
+
+  if (a->tag_id != b->tag_id) { return 0; }
+  if (strcmp(mpc_ast_contents(a), mpc_ast_contents(b)) != 0) { return 0; }
+  if (a->children_num != b->children_num) { return 0; }
+
+  for (i = 0; i < a->children_num; i++) {
+    if (!mpc_ast_eq(a->children[i], b->children[i])) { return 0; }
+  }
+
+  return 1;
+}
+
+mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+
+  mpc_ast_t **children;
+  mpc_ast_t *b;
+  int n = r->children_num;
+
+  if (r->arena == NULL) {
+    r->children_num++;
+    r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
+    r->children[r->children_num-1] = a;
+    return r;
+  }
+
+  if (a && a->arena != r->arena) {
+    b = mpc_arena_ast_copy(r->arena, a);
+    mpc_ast_delete(a);
+    a = b;
+  }
+
+  if (n == 0 || n == mpc_arena_children_slots(n)) {
+    children = mpc_arena_alloc(r->arena, sizeof(mpc_ast_t*) * mpc_arena_children_slots(n+1));
+    if (n) { memcpy(children, r->children, sizeof(mpc_ast_t*) * n); }
+    r->children = children;
+  }
+
+  r->children[n] = a;
+  r->children_num++;
+  return r;
+}
+
+static mpc_ast_t *mpc_ast_tag_join(mpc_ast_t *a, int op, int t) {
+  mpc_tag_t *x;
+  if (a == NULL) { return a; }
+  x = mpc_tag_join(op, t, a->tag_id);
+  a->tag = x->name;
+  a->tag_id = x->id;
+  return a;
+}
+
+mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
+  return mpc_ast_tag_join(a, MPC_TAG_ADD, mpc_tag_intern(t, strlen(t))->id);
+}
+
+mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
+  return mpc_ast_tag_join(a, MPC_TAG_ROOT, mpc_tag_intern(t, strlen(t))->id);
+}
+
+mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  mpc_tag_t *x = mpc_tag_intern(t, strlen(t));
+  a->tag = x->name;
+  a->tag_id = x->id;
+  return a;
+}
+
+int mpc_ast_has_tag(mpc_ast_t *a, int id) {
+  mpc_tag_t *t = mpc_tag_at(a->tag_id);
+  int j;
+  for (j = 0; j < t->parts_num; j++) {
+    if (t->parts[j] == id) { return 1; }
+  }
+  return 0;
+}
+
+char *mpc_ast_contents(mpc_ast_t *a) {
+
+  if (a->contents) { return a->contents; }
+
+  a->contents = a->arena
+    ? mpc_arena_alloc(a->arena, a->source_length + 1)
+    : malloc(a->source_length + 1);
+  memcpy(a->contents, a->source, a->source_length);
+  a->contents[a->source_length] = '\0';
+  return a->contents;
+}
+
+mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
+  if (a == NULL) { return a; }
+  a->state = s;
+  return a;
+}
+
+static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
+
+  int i;
+
+  if (a == NULL) {
+    fprintf(fp, "NULL\n");
+    return;
+  }
+
+  for (i = 0; i < d; i++) { fprintf(fp, "  "); }
+
+  if (a->contents ? strlen(a->contents) : a->source_length) {
+    fprintf(fp, "%s:%lu:%lu '%.*s'\n", a->tag,
+      (long unsigned int)(a->state.row+1),
+      (long unsigned int)(a->state.col+1),
+      (int)(a->contents ? strlen(a->contents) : a->source_length),
+      a->contents ? a->contents : a->source);
+  } else {
+    fprintf(fp, "%s \n", a->tag);
+  }
+
+  for (i = 0; i < a->children_num; i++) {
+    mpc_ast_print_depth(a->children[i], d+1, fp);
+  }
+
+}
+
+void mpc_ast_print(mpc_ast_t *a) {
+  mpc_ast_print_depth(a, 0, stdout);
+}
+
+void mpc_ast_print_to(mpc_ast_t *a, FILE *fp) {
+  mpc_ast_print_depth(a, 0, fp);
+}
+
+int mpc_ast_get_index(mpc_ast_t *ast, const char *tag) {
+  return mpc_ast_get_index_lb(ast, tag, 0);
+}
+
+int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb) {
+  int id = mpc_tag_id(tag);
+  return id >= 0 ? mpc_ast_get_index_id_lb(ast, id, lb) : -1;
+}
+
+int mpc_ast_get_index_id(mpc_ast_t *ast, int id) {
+  return mpc_ast_get_index_id_lb(ast, id, 0);
+}
+
+int mpc_ast_get_index_id_lb(mpc_ast_t *ast, int id, int lb) {
+  int i;
+
+  for(i=lb; i<ast->children_num; i++) {
+    if(ast->children[i]->tag_id == id) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+mpc_ast_t *mpc_ast_get_child(mpc_ast_t *ast, const char *tag) {
+  return mpc_ast_get_child_lb(ast, tag, 0);
+}
+
+mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb) {
+  int i = mpc_ast_get_index_lb(ast, tag, lb);
+  return i >= 0 ? ast->children[i] : NULL;
+}
+
+mpc_ast_t *mpc_ast_get_child_id(mpc_ast_t *ast, int id) {
+  return mpc_ast_get_child_id_lb(ast, id, 0);
+}
+
+mpc_ast_t *mpc_ast_get_child_id_lb(mpc_ast_t *ast, int id, int lb) {
+  int i = mpc_ast_get_index_id_lb(ast, id, lb);
+  return i >= 0 ? ast->children[i] : NULL;
+}
+
+mpc_ast_trav_t *mpc_ast_traverse_start(mpc_ast_t *ast,
+                                       mpc_ast_trav_order_t order)
+{
+  mpc_ast_trav_t *trav, *n_trav;
+  mpc_ast_t *cnode = ast;
+
+  /* Create the traversal structure */
+  trav = malloc(sizeof(mpc_ast_trav_t));
+  trav->curr_node = cnode;
+  trav->parent = NULL;
+  trav->curr_child = 0;
+  trav->order = order;
+
+  /* Get start node */
+  switch(order) {
+    case mpc_ast_trav_order_pre:
+      /* Nothing else is needed for pre order start */
+      break;
+
+    case mpc_ast_trav_order_post:
+      while(cnode->children_num > 0) {
+        cnode = cnode->children[0];
+
+        n_trav = malloc(sizeof(mpc_ast_trav_t));
+        n_trav->curr_node = cnode;
+        n_trav->parent = trav;
+        n_trav->curr_child = 0;
+        n_trav->order = order;
+
+        trav = n_trav;
+      }
+
+      break;
+
+    default:
+      /* Unreachable, but compiler complaints */
+      break;
+  }
+
+  return trav;
+}
+
+mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav) {
+  mpc_ast_trav_t *n_trav, *to_free;
+  mpc_ast_t *ret = NULL;
+  int cchild;
+
+  /* The end of traversal was reached */
+  if(*trav == NULL) return NULL;
+
+  switch((*trav)->order) {
+    case mpc_ast_trav_order_pre:
+      ret = (*trav)->curr_node;
+
+      /* If there aren't any more children, go up */
+      while(*trav != NULL &&
+        (*trav)->curr_child >= (*trav)->curr_node->children_num)
+      {
+        to_free = *trav;
+        *trav = (*trav)->parent;
+        free(to_free);
+      }
+
+      /* If trav is NULL, the end was reached */
+      if(*trav == NULL) {
+        break;
+      }
+
+      /* Go to next child */
+      n_trav = malloc(sizeof(mpc_ast_trav_t));
+
+      cchild = (*trav)->curr_child;
+      n_trav->curr_node = (*trav)->curr_node->children[cchild];
+      n_trav->parent = *trav;
+      n_trav->curr_child = 0;
+      n_trav->order = (*trav)->order;
+
+      (*trav)->curr_child++;
+      *trav = n_trav;
+
+      break;
+
+    case mpc_ast_trav_order_post:
+      ret = (*trav)->curr_node;
+
+      /* Move up tree to the parent If the parent doesn't have any more nodes,
+       * then this is the current node. If it does, move down to its left most
+       * child. Also, free the previous traversal node */
+      to_free = *trav;
+      *trav = (*trav)->parent;
+      free(to_free);
+
+      if(*trav == NULL)
+        break;
+
+      /* Next child */
+      (*trav)->curr_child++;
+
+      /* If there aren't any more children, this is the next node */
+      if((*trav)->curr_child >= (*trav)->curr_node->children_num) {
+        break;
+      }
+
+      /* If there are still more children, find the leftmost child from this
+       * node */
+      while((*trav)->curr_node->children_num > 0) {
+        n_trav = malloc(sizeof(mpc_ast_trav_t));
+
+        cchild = (*trav)->curr_child;
+        n_trav->curr_node = (*trav)->curr_node->children[cchild];
+        n_trav->parent = *trav;
+        n_trav->curr_child = 0;
+        n_trav->order = (*trav)->order;
+
+        *trav = n_trav;
+      }
+
+    default:
+      /* Unreachable, but compiler complaints */
+      break;
+  }
+
+  return ret;
+}
+
+void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
+  mpc_ast_trav_t *n_trav;
+
+  /* Go through parents until all are free */
+  while(*trav != NULL) {
+      n_trav = (*trav)->parent;
+      free(*trav);
+      *trav = n_trav;
+  }
+}
+
+/*
+** A cursor keeps the nodes on the path from the
+** root with the index of the next child of each
+** to go into. Each step either goes into that
+** child or, with none left, comes back out of
+** the node on top, so every node is entered and
+** left once. Pre order returns nodes as they
+** are entered and post order as they are left.
+*/
+
+enum {
+  MPC_AST_CURSOR_MIN = 32
+};
+
+typedef struct {
+  mpc_ast_t *node;
+  int child;
+} mpc_ast_cursor_frame_t;
+
+struct mpc_ast_cursor_t {
+  mpc_ast_t *root;
+  mpc_ast_trav_order_t order;
+  int depth;
+  mpc_ast_cursor_frame_t *stack;
+  int stack_num;
+  int stack_slots;
+};
+
+mpc_ast_cursor_t *mpc_ast_cursor_new(void) {
+  mpc_ast_cursor_t *c = malloc(sizeof(mpc_ast_cursor_t));
+  c->root = NULL;
+  c->order = mpc_ast_trav_order_pre;
+  c->depth = 0;
+  c->stack_num = 0;
+  c->stack_slots = MPC_AST_CURSOR_MIN;
+  c->stack = malloc(sizeof(mpc_ast_cursor_frame_t) * c->stack_slots);
+  return c;
+}
+
+void mpc_ast_cursor_delete(mpc_ast_cursor_t *c) {
+  free(c->stack);
+  free(c);
+}
+
+void mpc_ast_cursor_start(mpc_ast_cursor_t *c, mpc_ast_t *a, mpc_ast_trav_order_t order) {
+  c->root = a;
+  c->order = order;
+  c->depth = 0;
+  c->stack_num = 0;
+}
+
+static void mpc_ast_cursor_push(mpc_ast_cursor_t *c, mpc_ast_t *a) {
+  if (c->stack_num == c->stack_slots) {
+    c->stack_slots *= 2;
+    c->stack = realloc(c->stack, sizeof(mpc_ast_cursor_frame_t) * c->stack_slots);
+  }
+  c->stack[c->stack_num].node = a;
+  c->stack[c->stack_num].child = 0;
+  c->stack_num++;
+  c->depth = c->stack_num - 1;
+}
+
+/* Returns the next node entered or left, and sets `enter` to which */
+
+static mpc_ast_t *mpc_ast_cursor_step(mpc_ast_cursor_t *c, int *enter) {
+
+  mpc_ast_cursor_frame_t *f;
+
+  if (c->root) {
+    mpc_ast_cursor_push(c, c->root);
+    c->root = NULL;
+    *enter = 1;
+    return c->stack[0].node;
+  }
+
+  if (c->stack_num == 0) { return NULL; }
+
+  f = &c->stack[c->stack_num-1];
+  if (f->child < f->node->children_num) {
+    mpc_ast_cursor_push(c, f->node->children[f->child++]);
+    *enter = 1;
+    return c->stack[c->stack_num-1].node;
+  }
+
+  c->stack_num--;
+  c->depth = c->stack_num;
+  *enter = 0;
+  return f->node;
+}
+
+mpc_ast_t *mpc_ast_cursor_next(mpc_ast_cursor_t *c) {
+
+  int enter;
+  mpc_ast_t *a;
+  int want = c->order == mpc_ast_trav_order_pre;
+
+  while ((a = mpc_ast_cursor_step(c, &enter))) {
+    if (enter == want) { return a; }
+  }
+  return NULL;
+}
+
+int mpc_ast_cursor_depth(mpc_ast_cursor_t *c) {
+  return c->depth;
+}
+
+void mpc_ast_cursor_skip(mpc_ast_cursor_t *c) {
+  mpc_ast_cursor_frame_t *f;
+  if (c->stack_num == 0) { return; }
+  f = &c->stack[c->stack_num-1];
+  f->child = f->node->children_num;
+}
+
+int mpc_ast_visit(mpc_ast_cursor_t *c, mpc_ast_t *a, mpc_ast_visit_t pre, mpc_ast_visit_t post, void *d) {
+
+  int enter, x = MPC_AST_VISIT_CONTINUE;
+  mpc_ast_cursor_t *own = c ? NULL : mpc_ast_cursor_new();
+
+  if (own) { c = own; }
+  mpc_ast_cursor_start(c, a, mpc_ast_trav_order_pre);
+
+  while ((a = mpc_ast_cursor_step(c, &enter))) {
+    if (enter && pre) {
+      x = pre(a, c->depth, d);
+      if (x == MPC_AST_VISIT_SKIP) { mpc_ast_cursor_skip(c); }
+    }
+    if (!enter && post) { x = post(a, c->depth, d); }
+    if (x == MPC_AST_VISIT_STOP) { break; }
+  }
+
+  if (own) { mpc_ast_cursor_delete(own); }
+  return x != MPC_AST_VISIT_STOP;
+}
+
+/*
+** Flattening walks the tree twice with a cursor,
+** once to size the arrays and once to fill them.
+** The node last entered at each depth is kept, so
+** a node entered below a parent which already
+** has a first child is the next sibling of the
+** node last entered at its own depth.
+*/
+
+static size_t mpc_ast_flat_length(mpc_ast_t *a) {
+  return a->contents ? strlen(a->contents) : a->source_length;
+}
+
+mpc_ast_flat_t *mpc_ast_flat_new(mpc_ast_t *a) {
+
+  int k = 0, d, depth = 0, *at;
+  size_t n, text = 1;
+  mpc_ast_t *x;
+  mpc_ast_cursor_t *c = mpc_ast_cursor_new();
+  mpc_ast_flat_t *f = malloc(sizeof(mpc_ast_flat_t));
+
+  f->nodes_num = 0;
+  if (a) {
+    mpc_ast_cursor_start(c, a, mpc_ast_trav_order_pre);
+    while ((x = mpc_ast_cursor_next(c))) {
+      n = mpc_ast_flat_length(x);
+      if (n) { text += n + 1; }
+      if (mpc_ast_cursor_depth(c) > depth) { depth = mpc_ast_cursor_depth(c); }
+      f->nodes_num++;
+    }
+  }
+
+  f->tag_id = malloc(sizeof(int) * (f->nodes_num + 1));
+  f->state = malloc(sizeof(mpc_state_t) * (f->nodes_num + 1));
+  f->contents = malloc(sizeof(size_t) * (f->nodes_num + 1));
+  f->contents_length = malloc(sizeof(size_t) * (f->nodes_num + 1));
+  f->parent = malloc(sizeof(int) * (f->nodes_num + 1));
+  f->first_child = malloc(sizeof(int) * (f->nodes_num + 1));
+  f->next_sibling = malloc(sizeof(int) * (f->nodes_num + 1));
+  f->children_num = malloc(sizeof(int) * (f->nodes_num + 1));
+  f->text = malloc(text);
+  f->text[0] = '\0';
+  f->text_length = 1;
+
+  if (f->nodes_num == 0) {
+    mpc_ast_cursor_delete(c);
+    return f;
+  }
+
+  at = malloc(sizeof(int) * (depth + 1));
+
+  mpc_ast_cursor_start(c, a, mpc_ast_trav_order_pre);
+  while ((x = mpc_ast_cursor_next(c))) {
+
+    d = mpc_ast_cursor_depth(c);
+    f->tag_id[k] = x->tag_id;
+    f->state[k] = x->state;
+    f->parent[k] = d ? at[d-1] : -1;
+    f->first_child[k] = -1;
+    f->next_sibling[k] = -1;
+    f->children_num[k] = x->children_num;
+
+    if (d && f->first_child[f->parent[k]] == -1) { f->first_child[f->parent[k]] = k; }
+    else if (d) { f->next_sibling[at[d]] = k; }
+    at[d] = k;
+
+    n = mpc_ast_flat_length(x);
+    f->contents[k] = 0;
+    f->contents_length[k] = n;
+    if (n) {
+      f->contents[k] = f->text_length;
+      memcpy(f->text + f->text_length, x->contents ? x->contents : x->source, n);
+      f->text[f->text_length + n] = '\0';
+      f->text_length += n + 1;
+    }
+
+    k++;
+  }
+
+  free(at);
+  mpc_ast_cursor_delete(c);
+  return f;
+}
+
+void mpc_ast_flat_delete(mpc_ast_flat_t *f) {
+  free(f->tag_id);
+  free(f->state);
+  free(f->contents);
+  free(f->contents_length);
+  free(f->parent);
+  free(f->first_child);
+  free(f->next_sibling);
+  free(f->children_num);
+  free(f->text);
+  free(f);
+}
+
+mpc_ast_t *mpc_ast_flat_to_ast(mpc_ast_flat_t *f) {
+
+  int k, j, x;
+  mpc_ast_t **as, *a;
+
+  if (f->nodes_num == 0) { return NULL; }
+
+  as = malloc(sizeof(mpc_ast_t*) * f->nodes_num);
+
+  for (k = 0; k < f->nodes_num; k++) {
+    a = malloc(sizeof(mpc_ast_t));
+    a->tag = mpc_tag_at(f->tag_id[k])->name;
+    a->tag_id = f->tag_id[k];
+    a->contents = malloc(f->contents_length[k] + 1);
+    memcpy(a->contents, f->text + f->contents[k], f->contents_length[k] + 1);
+    a->source = NULL;
+    a->source_length = 0;
+    a->state = f->state[k];
+    a->children_num = f->children_num[k];
+    a->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+    a->arena = NULL;
+    as[k] = a;
+  }
+
+  for (k = 0; k < f->nodes_num; k++) {
+    for (j = f->first_child[k], x = 0; j != -1; j = f->next_sibling[j], x++) {
+      as[k]->children[x] = as[j];
+    }
+  }
+
+  a = as[0];
+  free(as);
+  return a;
+}
+
+int mpc_ast_flat_find(mpc_ast_flat_t *f, int id, int lb) {
+
+  int k, j;
+  mpc_tag_t *t;
+
+  for (k = lb < 0 ? 0 : lb; k < f->nodes_num; k++) {
+    t = mpc_tag_at(f->tag_id[k]);
+    for (j = 0; j < t->parts_num; j++) {
+      if (t->parts[j] == id) { return k; }
+    }
+  }
+
+  return -1;
+}
+
+int mpc_context_parse_flat(mpc_context_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+
+  int x, flags = c->input->flags;
+  mpc_ast_t *a;
+
+  c->input->flags |= MPC_CONTEXT_AST_ARENA | MPC_CONTEXT_AST_SPANS;
+  x = mpc_context_nparse(c, filename, string, length, p, r);
+  c->input->flags = flags;
+
+  if (x) {
+    a = r->output;
+    r->output = mpc_ast_flat_new(a);
+    mpc_ast_delete(a);
+  }
+
+  return x;
+}
+
+mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+
+  int i, j;
+  mpc_ast_t** as = (mpc_ast_t**)xs;
+  mpc_ast_t *r;
+  mpc_arena_t *m = NULL;
+
+  if (n == 0) { return NULL; }
+  if (n == 1) { return xs[0]; }
+  if (n == 2 && xs[1] == NULL) { return xs[0]; }
+  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+
+  for (i = 0; i < n && m == NULL; i++) {
+    if (as[i]) { m = as[i]->arena; }
+  }
+
+  r = m ? mpc_arena_ast_new(m, ">", "") : mpc_ast_new(">", "");
+
+  for (i = 0; i < n; i++) {
+
+    if (as[i] == NULL) { continue; }
+
+    if        (as[i] && as[i]->children_num == 0) {
+      mpc_ast_add_child(r, as[i]);
+    } else if (as[i] && as[i]->children_num == 1) {
+      mpc_ast_add_child(r, mpc_ast_tag_join(as[i]->children[0], MPC_TAG_ROOT, as[i]->tag_id));
+      mpc_ast_delete_no_children(as[i]);
+    } else if (as[i] && as[i]->children_num >= 2) {
+      for (j = 0; j < as[i]->children_num; j++) {
+        mpc_ast_add_child(r, as[i]->children[j]);
+      }
+      mpc_ast_delete_no_children(as[i]);
+    }
+
+  }
+
+  if (r->children_num) {
+    r->state = r->children[0]->state;
+  }
+
+  return r;
+}
+
+mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
+  mpc_ast_t *a = mpc_ast_new("", c);
+  free(c);
+  return a;
+}
+
+mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
+  mpc_state_t *s = ((mpc_state_t**)xs)[0];
+  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
+  (void)n;
+  a = mpc_ast_state(a, *s);
+  free(s);
+  return a;
+}
 
-mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-  return mpc_and(3, mpcf_snd_free,
-    mpc_string(o), a, mpc_string(c),
-    free, ad);
+mpc_parser_t *mpca_state(mpc_parser_t *a) {
+  return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
 }
 
-mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+/* Tags given to parsers are interned once when the parser is built */
 
-mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-  return mpc_and(3, mpcf_snd_free,
-    mpc_sym(o), mpc_tok(a), mpc_sym(c),
-    free, ad);
+static mpc_val_t *mpcf_ast_tag_interned(mpc_val_t *a, void *t) {
+  if (a == NULL) { return a; }
+  ((mpc_ast_t*)a)->tag = ((mpc_tag_t*)t)->name;
+  ((mpc_ast_t*)a)->tag_id = ((mpc_tag_t*)t)->id;
+  return a;
 }
 
-mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
+static mpc_val_t *mpcf_ast_add_tag_interned(mpc_val_t *a, void *t) {
+  return mpc_ast_tag_join(a, MPC_TAG_ADD, ((mpc_tag_t*)t)->id);
+}
+
+mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
+  return mpc_apply_to(a, mpcf_ast_tag_interned, mpc_tag_intern(t, strlen(t)));
+}
+
+mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
+  return mpc_apply_to(a, mpcf_ast_add_tag_interned, mpc_tag_intern(t, strlen(t)));
+}
+
+mpc_parser_t *mpca_root(mpc_parser_t *a) {
+  return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
+}
+
+mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
+mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+
+mpc_parser_t *mpca_or(int n, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+
+  p->type = MPC_TYPE_OR;
+  p->data.or.n = n;
+  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  va_end(va);
+
+  mpc_or_first(p);
+  return p;
+
+}
+
+mpc_parser_t *mpca_and(int n, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+
+  p->type = MPC_TYPE_AND;
+  p->data.and.n = n;
+  p->data.and.f = mpcf_fold_ast;
+  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  for (i = 0; i < (n-1); i++) {
+    p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete;
+  }
+  va_end(va);
+
+  return p;
+}
+
+mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
 
 /*
-** Regular Expression Parsers
+** Grammar Parser
 */
 
 /*
-** So here is a cute bootstrapping.
-**
-** I'm using the previously defined
-** mpc constructs and functions to
-** parse the user regex string and
-** construct a parser from it.
+** This is another interesting bootstrapping.
 **
-** As it turns out lots of the standard
-** mpc functions look a lot like `fold`
-** functions and so can be used indirectly
-** by many of the parsing functions to build
-** a parser directly - as we are parsing.
+** Having a general purpose AST type allows
+** users to specify the grammar alone and
+** let all fold rules be automatically taken
+** care of by existing functions.
 **
-** This is certainly something that
-** would be less elegant/interesting
-** in a two-phase parser which first
-** builds an AST and then traverses it
-** to generate the object.
+** You don't get to control the type spat
+** out but this means you can make a nice
+** parser to take in some grammar in nice
+** syntax and spit out a parser that works.
 **
-** This whole thing acts as a great
-** case study for how trivial it can be
-** to write a great parser in a few
-** lines of code using mpc.
+** The grammar for this looks surprisingly
+** like regex but the main difference is that
+** it is now whitespace insensitive and the
+** base type takes literals of some form.
 */
 
 /*
 **
-**  ### Regular Expression Grammar
+**  ### Grammar Grammar
 **
-**      <regex> : <term> | (<term> "|" <regex>)
+**      <grammar> : (<term> "|" <grammar>) | <term>
 **
 **      <term> : <factor>*
 **
@@ -2156,1913 +6751,3328 @@ mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_
 **               | <base> "?"
 **               | <base> "{" <digits> "}"
 **
-**      <base> : <char>
-**             | "\" <char>
-**             | "(" <regex> ")"
-**             | "[" <range> "]"
+**      <base> : "<" (<digits> | <ident>) ">"
+**             | <string_lit>
+**             | <char_lit>
+**             | <regex_lit> <regex_mode>
+**             | "(" <grammar> ")"
 */
 
-static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  else { return mpc_or(2, xs[0], xs[1]); }
-}
+typedef struct {
+  va_list *va;
+  int parsers_num;
+  mpc_parser_t **parsers;
+  int flags;
+} mpca_grammar_st_t;
+
+static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  else { return mpca_or(2, xs[0], xs[1]); }
+}
+
+static mpc_val_t *mpcaf_grammar_and(int n, mpc_val_t **xs) {
+  int i;
+  mpc_parser_t *p = mpc_pass();
+  for (i = 0; i < n; i++) {
+    if (xs[i] != NULL) { p = mpca_and(2, p, xs[i]); }
+  }
+  return p;
+}
+
+static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) {
+  int num;
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  switch(((char*)xs[1])[0])
+  {
+    case '*': { free(xs[1]); return mpca_many(xs[0]); }; break;
+    case '+': { free(xs[1]); return mpca_many1(xs[0]); }; break;
+    case '?': { free(xs[1]); return mpca_maybe(xs[0]); }; break;
+    case '!': { free(xs[1]); return mpca_not(xs[0]); }; break;
+    default:
+      num = *((int*)xs[1]);
+      free(xs[1]);
+  }
+  return mpca_count(num, xs[0]);
+}
+
+static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
+  mpca_grammar_st_t *st = s;
+  char *y = mpcf_unescape(x);
+  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
+  free(y);
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+}
+
+static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
+  mpca_grammar_st_t *st = s;
+  char *y = mpcf_unescape(x);
+  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
+  free(y);
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+}
+
+static mpc_val_t *mpcaf_fold_regex(int n, mpc_val_t **xs) {
+  char *y = xs[0];
+  char *m = xs[1];
+  mpca_grammar_st_t *st = xs[2];
+  mpc_parser_t *p;
+  int mode = MPC_RE_DEFAULT;
+
+  (void)n;
+  if (strchr(m, 'm')) { mode |= MPC_RE_MULTILINE; }
+  if (strchr(m, 's')) { mode |= MPC_RE_DOTALL; }
+  y = mpcf_unescape_regex(y);
+  p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re_mode(y, mode) : mpc_tok(mpc_re_mode(y, mode));
+  free(y);
+  free(m);
+
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
+}
+
+/* Should this just use `isdigit` instead? */
+static int is_number(const char* s) {
+  size_t i;
+  for (i = 0; i < strlen(s); i++) { if (!strchr("0123456789", s[i])) { return 0; } }
+  return 1;
+}
+
+static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
+
+  int i;
+  mpc_parser_t *p;
+
+  /* Case of Number */
+  if (is_number(x)) {
+
+    i = strtol(x, NULL, 10);
+
+    /* Parsers given as an array end with a NULL */
+    if (st->va == NULL) {
+      if (i >= st->parsers_num - 1) {
+        return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num - 1);
+      }
+      return st->parsers[i];
+    }
+
+    while (st->parsers_num <= i) {
+      st->parsers_num++;
+      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
+      st->parsers[st->parsers_num-1] = va_arg(*st->va, mpc_parser_t*);
+      if (st->parsers[st->parsers_num-1] == NULL) {
+        return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
+      }
+    }
+
+    return st->parsers[st->parsers_num-1];
+
+  /* Case of Identifier */
+  } else {
+
+    /* Search Existing Parsers */
+    for (i = 0; i < st->parsers_num; i++) {
+      mpc_parser_t *q = st->parsers[i];
+      if (q == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+      if (q->name && strcmp(q->name, x) == 0) { return q; }
+    }
+
+    /* Search New Parsers */
+    while (1) {
+
+      p = va_arg(*st->va, mpc_parser_t*);
+
+      st->parsers_num++;
+      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
+      st->parsers[st->parsers_num-1] = p;
+
+      if (p == NULL || p->name == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+      if (p->name && strcmp(p->name, x) == 0) { return p; }
 
-static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
-  int i;
-  mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
-  for (i = 0; i < n; i++) {
-    p = mpc_and(2, mpcf_strfold, p, xs[i], free);
-  }
-  return p;
-}
+    }
 
-static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
-  int num;
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  switch(((char*)xs[1])[0])
-  {
-    case '*': { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }; break;
-    case '+': { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }; break;
-    case '?': { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }; break;
-    default:
-      num = *(int*)xs[1];
-      free(xs[1]);
   }
 
-  return mpc_count(num, mpcf_strfold, xs[0], free);
 }
 
-static mpc_parser_t *mpc_re_escape_char(char c) {
-  switch (c) {
-    case 'a': return mpc_char('\a');
-    case 'f': return mpc_char('\f');
-    case 'n': return mpc_char('\n');
-    case 'r': return mpc_char('\r');
-    case 't': return mpc_char('\t');
-    case 'v': return mpc_char('\v');
-    case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
-    case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
-    case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
-    case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
-    case 'd': return mpc_digit();
-    case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
-    case 's': return mpc_whitespace();
-    case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
-    case 'w': return mpc_alphanum();
-    case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
-    default: return NULL;
+static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
+
+  mpca_grammar_st_t *st = s;
+  mpc_parser_t *p = mpca_grammar_find_parser(x, st);
+  free(x);
+
+  if (p->name) {
+    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+  } else {
+    return mpca_state(mpca_root(p));
   }
 }
 
-static mpc_val_t *mpcf_re_escape(mpc_val_t *x, void* data) {
+mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
 
-  int mode = *((int*)data);
-  char *s = x;
-  mpc_parser_t *p;
+  char *err_msg;
+  mpc_parser_t *err_out;
+  mpc_result_t r;
+  mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
 
-  /* Any Character */
-  if (s[0] == '.') {
-    free(s);
-    if (mode & MPC_RE_DOTALL) {
-      return mpc_any();
-    } else {
-      return mpc_expect(mpc_noneof("\n"), "any character except a newline");
-    }
-  }
+  GrammarTotal = mpc_new("grammar_total");
+  Grammar = mpc_new("grammar");
+  Term = mpc_new("term");
+  Factor = mpc_new("factor");
+  Base = mpc_new("base");
 
-  /* Start of Input */
-  if (s[0] == '^') {
-    free(s);
-    if (mode & MPC_RE_MULTILINE) {
-      return mpc_and(2, mpcf_snd, mpc_or(2, mpc_soi(), mpc_boundary_newline()), mpc_lift(mpcf_ctor_str), free);
-    } else {
-      return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
-    }
-  }
+  mpc_define(GrammarTotal,
+    mpc_predictive(mpc_total(Grammar, mpc_soft_delete))
+  );
 
-  /* End of Input */
-  if (s[0] == '$') {
-    free(s);
-    if (mode & MPC_RE_MULTILINE) {
-      return mpc_or(2,
-        mpc_newline(),
-        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
-    } else {
-      return mpc_or(2,
-        mpc_and(2, mpcf_fst, mpc_newline(), mpc_eoi(), free),
-        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
-    }
-  }
+  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
+    Term,
+    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+    mpc_soft_delete
+  ));
 
-  /* Regex Escape */
-  if (s[0] == '\\') {
-    p = mpc_re_escape_char(s[1]);
-    p = (p == NULL) ? mpc_char(s[1]) : p;
-    free(s);
-    return p;
-  }
+  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
 
-  /* Regex Standard */
-  p = mpc_char(s[0]);
-  free(s);
-  return p;
-}
+  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
+    Base,
+      mpc_or(6,
+        mpc_sym("*"),
+        mpc_sym("+"),
+        mpc_sym("?"),
+        mpc_sym("!"),
+        mpc_tok_brackets(mpc_int(), free),
+        mpc_pass()),
+    mpc_soft_delete
+  ));
 
-static const char *mpc_re_range_escape_char(char c) {
-  switch (c) {
-    case '-': return "-";
-    case 'a': return "\a";
-    case 'f': return "\f";
-    case 'n': return "\n";
-    case 'r': return "\r";
-    case 't': return "\t";
-    case 'v': return "\v";
-    case 'b': return "\b";
-    case 'd': return "0123456789";
-    case 's': return " \f\n\r\t\v";
-    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
-    default: return NULL;
+  mpc_define(Base, mpc_or(5,
+    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
+    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+    mpc_tok_parens(Grammar, mpc_soft_delete)
+  ));
+
+  mpc_optimise(GrammarTotal);
+  mpc_optimise(Grammar);
+  mpc_optimise(Factor);
+  mpc_optimise(Term);
+  mpc_optimise(Base);
+
+  if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
+    err_msg = mpc_err_string(r.error);
+    err_out = mpc_failf("Invalid Grammar: %s", err_msg);
+    mpc_err_delete(r.error);
+    free(err_msg);
+    r.output = err_out;
   }
+
+  mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+
+  mpc_optimise(r.output);
+
+  return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
+  mpca_grammar_st_t st;
+  mpc_parser_t *res;
+  va_list va;
+  va_start(va, grammar);
 
-  mpc_parser_t *out;
-  size_t i, j;
-  size_t start, end;
-  const char *tmp = NULL;
-  const char *s = x;
-  int comp = s[0] == '^' ? 1 : 0;
-  char *range = calloc(1,1);
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
 
-  if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
-  if (s[0] == '^' &&
-      s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  res = mpca_grammar_st(grammar, &st);
+  free(st.parsers);
+  va_end(va);
+  return res;
+}
 
-  for (i = comp; i < strlen(s); i++){
+typedef struct {
+  char *ident;
+  char *name;
+  mpc_parser_t *grammar;
+} mpca_stmt_t;
 
-    /* Regex Range Escape */
-    if (s[i] == '\\') {
-      tmp = mpc_re_range_escape_char(s[i+1]);
-      if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
-      } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];
-      }
-      i++;
-    }
+static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
+  mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
+  stmt->ident = ((char**)xs)[0];
+  stmt->name = ((char**)xs)[1];
+  stmt->grammar = ((mpc_parser_t**)xs)[3];
+  (void) n;
+  free(((char**)xs)[2]);
+  free(((char**)xs)[4]);
 
-    /* Regex Range...Range */
-    else if (s[i] == '-') {
-      if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
-      } else {
-        start = s[i-1]+1;
-        end = s[i+1]-1;
-        for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = (char)j;
-        }
-      }
-    }
+  return stmt;
+}
 
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
-    }
+static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
 
+  int i;
+  mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+
+  for (i = 0; i < n; i++) {
+    stmts[i] = xs[i];
   }
+  stmts[n] = NULL;
 
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+  return stmts;
+}
+
+static void mpca_stmt_list_delete(mpc_val_t *x) {
+
+  mpca_stmt_t **stmts = x;
 
+  while(*stmts) {
+    mpca_stmt_t *stmt = *stmts;
+    free(stmt->ident);
+    free(stmt->name);
+    mpc_soft_delete(stmt->grammar);
+    free(stmt);
+    stmts++;
+  }
   free(x);
-  free(range);
 
-  return out;
 }
 
-mpc_parser_t *mpc_re(const char *re) {
-  return mpc_re_mode(re, MPC_RE_DEFAULT);
+static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
+
+  mpca_grammar_st_t *st = s;
+  mpca_stmt_t *stmt;
+  mpca_stmt_t **stmts = x;
+  mpc_parser_t *left;
+
+  while(*stmts) {
+    stmt = *stmts;
+    left = mpca_grammar_find_parser(stmt->ident, st);
+    if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
+    if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    mpc_optimise(stmt->grammar);
+    mpc_define(left, stmt->grammar);
+    free(stmt->ident);
+    free(stmt->name);
+    free(stmt);
+    stmts++;
+  }
+
+  free(x);
+
+  return NULL;
 }
 
-mpc_parser_t *mpc_re_mode(const char *re, int mode) {
+static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
 
-  char *err_msg;
-  mpc_parser_t *err_out;
   mpc_result_t r;
-  mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose;
+  mpc_err_t *e;
+  mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base;
 
-  Regex  = mpc_new("regex");
-  Term   = mpc_new("term");
-  Factor = mpc_new("factor");
-  Base   = mpc_new("base");
-  Range  = mpc_new("range");
+  Lang    = mpc_new("lang");
+  Stmt    = mpc_new("stmt");
+  Grammar = mpc_new("grammar");
+  Term    = mpc_new("term");
+  Factor  = mpc_new("factor");
+  Base    = mpc_new("base");
 
-  mpc_define(Regex, mpc_and(2, mpcf_re_or,
-    Term,
-    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
-    (mpc_dtor_t)mpc_delete
+  mpc_define(Lang, mpc_apply_to(
+    mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
+    mpca_stmt_list_apply_to, st
   ));
 
-  mpc_define(Term, mpc_many(mpcf_re_and, Factor));
-
-  mpc_define(Factor, mpc_and(2, mpcf_re_repeat,
-    Base,
-    mpc_or(5,
-      mpc_char('*'), mpc_char('+'), mpc_char('?'),
-      mpc_brackets(mpc_int(), free),
-      mpc_pass()),
-    (mpc_dtor_t)mpc_delete
+  mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
+    mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
+    free, free, free, mpc_soft_delete
   ));
 
-  mpc_define(Base, mpc_or(4,
-    mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
-    mpc_squares(Range, (mpc_dtor_t)mpc_delete),
-    mpc_apply_to(mpc_escape(), mpcf_re_escape, &mode),
-    mpc_apply_to(mpc_noneof(")|"), mpcf_re_escape, &mode)
+  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
+      Term,
+      mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+      mpc_soft_delete
   ));
 
-  mpc_define(Range, mpc_apply(
-    mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
-    mpcf_re_range
+  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+
+  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
+    Base,
+      mpc_or(6,
+        mpc_sym("*"),
+        mpc_sym("+"),
+        mpc_sym("?"),
+        mpc_sym("!"),
+        mpc_tok_brackets(mpc_int(), free),
+        mpc_pass()),
+    mpc_soft_delete
   ));
 
-  RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
+  mpc_define(Base, mpc_or(5,
+    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
+    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+    mpc_tok_parens(Grammar, mpc_soft_delete)
+  ));
 
-  mpc_optimise(RegexEnclose);
-  mpc_optimise(Regex);
+  mpc_optimise(Lang);
+  mpc_optimise(Stmt);
+  mpc_optimise(Grammar);
   mpc_optimise(Term);
   mpc_optimise(Factor);
   mpc_optimise(Base);
-  mpc_optimise(Range);
 
-  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
-    err_msg = mpc_err_string(r.error);
-    err_out = mpc_failf("Invalid Regex: %s", err_msg);
-    mpc_err_delete(r.error);
-    free(err_msg);
-    r.output = err_out;
+  if (!mpc_parse_input(i, Lang, &r)) {
+    e = r.error;
+  } else {
+    e = NULL;
   }
 
-  mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
-
-  mpc_optimise(r.output);
-
-  return r.output;
+  mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
 
+  return e;
 }
 
-/*
-** Common Fold Functions
-*/
+mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
 
-void mpcf_dtor_null(mpc_val_t *x) { (void) x; return; }
+  va_list va;
+  va_start(va, f);
 
-mpc_val_t *mpcf_ctor_null(void) { return NULL; }
-mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
-mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
 
-mpc_val_t *mpcf_int(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 10);
-  free(x);
-  return y;
-}
+  i = mpc_input_new_file("<mpca_lang_file>", f);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
 
-mpc_val_t *mpcf_hex(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 16);
-  free(x);
-  return y;
+  free(st.parsers);
+  va_end(va);
+  return err;
 }
 
-mpc_val_t *mpcf_oct(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 8);
-  free(x);
-  return y;
-}
+mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
 
-mpc_val_t *mpcf_float(mpc_val_t *x) {
-  float *y = malloc(sizeof(float));
-  *y = strtod(x, NULL);
-  free(x);
-  return y;
-}
+  va_list va;
+  va_start(va, p);
 
-mpc_val_t *mpcf_strtriml(mpc_val_t *x) {
-  char *s = x;
-  while (isspace((unsigned char)*s)) {
-    memmove(s, s+1, strlen(s));
-  }
-  return s;
-}
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
 
-mpc_val_t *mpcf_strtrimr(mpc_val_t *x) {
-  char *s = x;
-  size_t l = strlen(s);
-  while (l > 0 && isspace((unsigned char)s[l-1])) {
-    s[l-1] = '\0'; l--;
-  }
-  return s;
-}
+  i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
 
-mpc_val_t *mpcf_strtrim(mpc_val_t *x) {
-  return mpcf_strtriml(mpcf_strtrimr(x));
+  free(st.parsers);
+  va_end(va);
+  return err;
 }
 
-static const char mpc_escape_input_c[]  = {
-  '\a', '\b', '\f', '\n', '\r',
-  '\t', '\v', '\\', '\'', '\"', '\0'};
-
-static const char *mpc_escape_output_c[] = {
-  "\\a", "\\b", "\\f", "\\n", "\\r", "\\t",
-  "\\v", "\\\\", "\\'", "\\\"", "\\0", NULL};
-
-static const char mpc_escape_input_raw_re[] = { '/' };
-static const char *mpc_escape_output_raw_re[] = { "\\/", NULL };
-
-static const char mpc_escape_input_raw_cstr[] = { '"' };
-static const char *mpc_escape_output_raw_cstr[] = { "\\\"", NULL };
-
-static const char mpc_escape_input_raw_cchar[] = { '\'' };
-static const char *mpc_escape_output_raw_cchar[] = { "\\'", NULL };
-
-static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **output) {
-
-  int i;
-  int found;
-  char buff[2];
-  char *s = x;
-  char *y = calloc(1, 1);
-
-  while (*s) {
-
-    i = 0;
-    found = 0;
+mpc_err_t *mpca_lang(int flags, const char *language, ...) {
 
-    while (output[i]) {
-      if (*s == input[i]) {
-        y = realloc(y, strlen(y) + strlen(output[i]) + 1);
-        strcat(y, output[i]);
-        found = 1;
-        break;
-      }
-      i++;
-    }
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
 
-    if (!found) {
-      y = realloc(y, strlen(y) + 2);
-      buff[0] = *s; buff[1] = '\0';
-      strcat(y, buff);
-    }
+  va_list va;
+  va_start(va, language);
 
-    s++;
-  }
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
 
+  i = mpc_input_new_string("<mpca_lang>", language);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
 
-  return y;
+  free(st.parsers);
+  va_end(va);
+  return err;
 }
 
-static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char **output) {
+mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
 
-  int i;
-  int found = 0;
-  char buff[2];
-  char *s = x;
-  char *y = calloc(1, 1);
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
 
-  while (*s) {
+  va_list va;
 
-    i = 0;
-    found = 0;
+  FILE *f = fopen(filename, "rb");
 
-    while (output[i]) {
-      if ((*(s+0)) == output[i][0] &&
-          (*(s+1)) == output[i][1]) {
-        y = realloc(y, strlen(y) + 1 + 1);
-        buff[0] = input[i]; buff[1] = '\0';
-        strcat(y, buff);
-        found = 1;
-        s++;
-        break;
-      }
-      i++;
-    }
+  if (f == NULL) {
+    err = mpc_err_file(filename, "Unable to open file!");
+    return err;
+  }
 
-    if (!found) {
-      y = realloc(y, strlen(y) + 1 + 1);
-      buff[0] = *s; buff[1] = '\0';
-      strcat(y, buff);
-    }
+  va_start(va, filename);
 
-    if (*s == '\0') { break; }
-    else { s++; }
-  }
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
 
-  return y;
+  i = mpc_input_new_file(filename, f);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
 
-}
+  free(st.parsers);
+  va_end(va);
 
-mpc_val_t *mpcf_escape(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-  free(x);
-  return y;
-}
+  fclose(f);
 
-mpc_val_t *mpcf_unescape(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-  free(x);
-  return y;
+  return err;
 }
 
-mpc_val_t *mpcf_escape_regex(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-  free(x);
-  return y;
-}
+static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
 
-mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-  free(x);
-  return y;
-}
+  int i, total;
 
-mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-  free(x);
-  return y;
-}
+  if (p->retained && !force) { return 0; }
 
-mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-  free(x);
-  return y;
-}
+  if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
 
-mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-  free(x);
-  return y;
-}
+  if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
 
-mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-  free(x);
-  return y;
-}
+  if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
+  if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
 
-mpc_val_t *mpcf_null(int n, mpc_val_t** xs) { (void) n; (void) xs; return NULL; }
-mpc_val_t *mpcf_fst(int n, mpc_val_t **xs) { (void) n; return xs[0]; }
-mpc_val_t *mpcf_snd(int n, mpc_val_t **xs) { (void) n; return xs[1]; }
-mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { (void) n; return xs[2]; }
+  if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
 
-static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
-  int i;
-  for (i = 0; i < n; i++) {
-    if (i != x) { free(xs[i]); }
-  }
-  return xs[x];
-}
+  if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
 
-mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0); }
-mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
-mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
+  if (p->type == MPC_TYPE_OR) {
+    total = 1;
+    for(i = 0; i < p->data.or.n; i++) {
+      total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
+    }
+    return total;
+  }
 
-mpc_val_t *mpcf_freefold(int n, mpc_val_t **xs) {
-  int i;
-  for (i = 0; i < n; i++) {
-    free(xs[i]);
+  if (p->type == MPC_TYPE_AND) {
+    total = 1;
+    for(i = 0; i < p->data.and.n; i++) {
+      total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
+    }
+    return total;
   }
-  return NULL;
+
+  return 1;
+
 }
 
-mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
-  int i;
-  size_t l = 0;
+void mpc_stats(mpc_parser_t* p) {
+  printf("Stats\n");
+  printf("=====\n");
+  printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+}
 
-  if (n == 0) { return calloc(1, 1); }
+/*
+** Parsers matching one character from a set
+** are all turned into a bitmap, which is then
+** what `or` and `many` of them are fused into.
+** Literals are merged into a single string in
+** the same way. Since every parser made here
+** has a single parent, a parser which only
+** hands on the result of its one child is
+** replaced with the child. Each rewrite keeps
+** the same results and errors.
+*/
 
-  for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+static int mpc_optimise_char(mpc_parser_t *p) {
+  return !p->retained
+    && (p->type == MPC_TYPE_SINGLE || p->type == MPC_TYPE_RANGE
+    ||  p->type == MPC_TYPE_ONEOF  || p->type == MPC_TYPE_NONEOF
+    ||  p->type == MPC_TYPE_CLASS);
+}
 
-  xs[0] = realloc(xs[0], l + 1);
+static void mpc_optimise_set_add(unsigned char *x, mpc_parser_t *p) {
 
-  for (i = 1; i < n; i++) {
-    strcat(xs[0], xs[i]); free(xs[i]);
+  int c;
+  const char *s;
+
+  switch (p->type) {
+    case MPC_TYPE_SINGLE:
+      c = (unsigned char)p->data.single.x;
+      x[c >> 3] |= (unsigned char)(1 << (c & 7));
+      break;
+    case MPC_TYPE_RANGE:
+      for (c = p->data.range.x; c <= p->data.range.y; c++) {
+        x[(unsigned char)c >> 3] |= (unsigned char)(1 << ((unsigned char)c & 7));
+      }
+      break;
+    case MPC_TYPE_ONEOF:
+      for (s = p->data.string.x; *s; s++) {
+        x[(unsigned char)*s >> 3] |= (unsigned char)(1 << ((unsigned char)*s & 7));
+      }
+      break;
+    case MPC_TYPE_NONEOF:
+      for (c = 1; c < 256; c++) {
+        if (strchr(p->data.string.x, c) == NULL) { x[c >> 3] |= (unsigned char)(1 << (c & 7)); }
+      }
+      break;
+    case MPC_TYPE_CLASS:
+      for (c = 0; c < MPC_SET_BYTES; c++) { x[c] |= p->data.set.x[c]; }
+      break;
+    default: break;
   }
 
-  return xs[0];
+  /* The end of the input is never matched */
+  x[0] &= 0xFE;
 }
 
-mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
-  int **vs = (int**)xs;
-  (void) n;
+static void mpc_optimise_set(mpc_parser_t *p) {
 
-  switch(((char*)xs[1])[0])
-  {
-    case '*': { *vs[0] *= *vs[2]; }; break;
-    case '/': { *vs[0] /= *vs[2]; }; break;
-    case '%': { *vs[0] %= *vs[2]; }; break;
-    case '+': { *vs[0] += *vs[2]; }; break;
-    case '-': { *vs[0] -= *vs[2]; }; break;
-    default: break;
-  }
+  unsigned char *x;
 
-  free(xs[1]); free(xs[2]);
+  if (p->type == MPC_TYPE_CLASS) { return; }
 
-  return xs[0];
-}
+  x = calloc(1, MPC_SET_BYTES);
+  mpc_optimise_set_add(x, p);
+  if (p->type == MPC_TYPE_ONEOF || p->type == MPC_TYPE_NONEOF) { free(p->data.string.x); }
 
-/*
-** Printing
-*/
+  p->type = MPC_TYPE_CLASS;
+  p->data.set.x = x;
+  p->data.set.n = 0;
+  p->data.set.m = NULL;
+}
 
-static void mpc_print_unretained(mpc_parser_t *p, int force) {
+static int mpc_optimise_literal(mpc_parser_t *p) {
+  return !p->retained
+    && ((p->type == MPC_TYPE_SINGLE && p->data.single.x != '\0') || p->type == MPC_TYPE_STRING);
+}
 
-  /* TODO: Print Everything Escaped */
+static int mpc_optimise_literals(mpc_parser_t *p) {
 
-  int i;
-  char *s, *e;
-  char buff[2];
+  int j, n = p->data.and.n;
+  char *s;
+  size_t l;
+  mpc_parser_t *a, *b;
 
-  if (p->retained && !force) {;
-    if (p->name) { printf("<%s>", p->name); }
-    else { printf("<anon>"); }
-    return;
+  for (j = 0; j < n-1; j++) {
+    if (mpc_optimise_literal(p->data.and.xs[j])
+    &&  mpc_optimise_literal(p->data.and.xs[j+1])
+    &&  p->data.and.dxs[j] == free
+    && (j+1 == n-1 || p->data.and.dxs[j+1] == free)) { break; }
   }
 
-  if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
-  if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
-  if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
-  if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
-  if (p->type == MPC_TYPE_STATE)  { printf("<S>"); }
-  if (p->type == MPC_TYPE_ANCHOR) { printf("<@>"); }
-  if (p->type == MPC_TYPE_EXPECT) {
-    printf("%s", p->data.expect.m);
-    /*mpc_print_unretained(p->data.expect.x, 0);*/
-  }
+  if (j == n-1) { return 0; }
 
-  if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
-  if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
+  a = p->data.and.xs[j];
+  b = p->data.and.xs[j+1];
 
-  if (p->type == MPC_TYPE_SINGLE) {
-    buff[0] = p->data.single.x; buff[1] = '\0';
-    s = mpcf_escape_new(
-      buff,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("'%s'", s);
-    free(s);
-  }
+  l = a->type == MPC_TYPE_SINGLE ? 1 : strlen(a->data.string.x);
+  s = malloc(l + (b->type == MPC_TYPE_SINGLE ? 1 : strlen(b->data.string.x)) + 1);
 
-  if (p->type == MPC_TYPE_RANGE) {
-    buff[0] = p->data.range.x; buff[1] = '\0';
-    s = mpcf_escape_new(
-      buff,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    buff[0] = p->data.range.y; buff[1] = '\0';
-    e = mpcf_escape_new(
-      buff,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[%s-%s]", s, e);
-    free(s);
-    free(e);
+  if (a->type == MPC_TYPE_SINGLE) { s[0] = a->data.single.x; s[1] = '\0'; }
+  else { strcpy(s, a->data.string.x); free(a->data.string.x); }
+
+  if (b->type == MPC_TYPE_SINGLE) { s[l] = b->data.single.x; s[l+1] = '\0'; }
+  else { strcpy(s + l, b->data.string.x); }
+
+  a->type = MPC_TYPE_STRING;
+  a->data.string.x = s;
+  mpc_delete(b);
+
+  memmove(p->data.and.xs + j + 1, p->data.and.xs + j + 2, (n - j - 2) * sizeof(mpc_parser_t*));
+  if (j+1 < n-1) {
+    memmove(p->data.and.dxs + j + 1, p->data.and.dxs + j + 2, (n - j - 3) * sizeof(mpc_dtor_t));
   }
+  p->data.and.n--;
+  return 1;
+}
 
-  if (p->type == MPC_TYPE_ONEOF) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[%s]", s);
-    free(s);
+static int mpc_optimise_classes(mpc_parser_t *p) {
+
+  int j, n = p->data.or.n;
+  mpc_parser_t *a, *b;
+
+  for (j = 0; j < n-1; j++) {
+    if (mpc_optimise_char(p->data.or.xs[j])
+    &&  mpc_optimise_char(p->data.or.xs[j+1])) { break; }
   }
 
-  if (p->type == MPC_TYPE_NONEOF) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[^%s]", s);
-    free(s);
+  if (j >= n-1) { return 0; }
+
+  a = p->data.or.xs[j];
+  b = p->data.or.xs[j+1];
+  mpc_optimise_set(a);
+  mpc_optimise_set_add(a->data.set.x, b);
+  mpc_delete(b);
+
+  memmove(p->data.or.xs + j + 1, p->data.or.xs + j + 2, (n - j - 2) * sizeof(mpc_parser_t*));
+  p->data.or.n--;
+  return 1;
+}
+
+static int mpc_optimise_span(mpc_parser_t *p) {
+
+  mpc_parser_t *x = p->data.repeat.x, *c = x;
+  unsigned char *s;
+  char *m = NULL;
+
+  if (!x->retained && x->type == MPC_TYPE_EXPECT) {
+    c = x->data.expect.x;
+    m = x->data.expect.m;
   }
 
-  if (p->type == MPC_TYPE_STRING) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("\"%s\"", s);
-    free(s);
+  if (!mpc_optimise_char(c)) { return 0; }
+
+  s = calloc(1, MPC_SET_BYTES);
+  mpc_optimise_set_add(s, c);
+  if (x->type == MPC_TYPE_EXPECT) { x->data.expect.m = NULL; }
+  mpc_delete(x);
+
+  p->data.set.n = p->type == MPC_TYPE_MANY1;
+  p->type = MPC_TYPE_SPAN;
+  p->data.set.x = s;
+  p->data.set.m = m;
+  return 1;
+}
+
+/* Primitives fail without an error, so an `or` of one of them is the same as it */
+
+static int mpc_optimise_inline(mpc_parser_t *p) {
+
+  char *name = p->name;
+  char retained = p->retained;
+  mpc_parser_t *t;
+
+  if (p->type == MPC_TYPE_AND
+  &&  p->data.and.n == 1
+  && !p->data.and.xs[0]->retained
+  && (p->data.and.f == mpcf_strfold || p->data.and.f == mpcf_fold_ast
+  ||  p->data.and.f == mpcf_fst     || p->data.and.f == mpcf_fst_free)) {
+    t = p->data.and.xs[0];
+    free(p->data.and.xs);
+    free(p->data.and.dxs);
+  } else if (p->type == MPC_TYPE_OR
+  &&  p->data.or.n == 1
+  && !p->data.or.xs[0]->retained
+  && ((p->data.or.xs[0]->type >= MPC_TYPE_ANCHOR && p->data.or.xs[0]->type <= MPC_TYPE_STRING)
+  ||   p->data.or.xs[0]->type == MPC_TYPE_CLASS)) {
+    t = p->data.or.xs[0];
+    free(p->data.or.xs);
+    free(p->data.or.first);
+  } else {
+    return 0;
   }
 
-  if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  memcpy(p, t, sizeof(mpc_parser_t));
+  p->retained = retained;
+  if (name) { p->name = name; free(t->name); }
+  free(t);
+  return 1;
+}
 
-  if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
-  if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
+static void mpc_optimise_unretained(mpc_parser_t *p, int force, mpc_optimise_stats_t *st) {
 
-  if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
-  if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
-  if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+  int i, n, m;
+  mpc_parser_t *t;
+
+  if (p->retained && !force) { return; }
+
+  /* Optimise Subexpressions */
+
+  if (p->type == MPC_TYPE_EXPECT)     { mpc_optimise_unretained(p->data.expect.x, 0, st); }
+  if (p->type == MPC_TYPE_APPLY)      { mpc_optimise_unretained(p->data.apply.x, 0, st); }
+  if (p->type == MPC_TYPE_APPLY_TO)   { mpc_optimise_unretained(p->data.apply_to.x, 0, st); }
+  if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0, st); }
+  if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0, st); }
+  if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0, st); }
+  if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0, st); }
+  if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0, st); }
+  if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0, st); }
+  if (p->type == MPC_TYPE_MANY1)      { mpc_optimise_unretained(p->data.repeat.x, 0, st); }
+  if (p->type == MPC_TYPE_COUNT)      { mpc_optimise_unretained(p->data.repeat.x, 0, st); }
 
   if (p->type == MPC_TYPE_OR) {
-    printf("(");
-    for(i = 0; i < p->data.or.n-1; i++) {
-      mpc_print_unretained(p->data.or.xs[i], 0);
-      printf(" | ");
+    for(i = 0; i < p->data.or.n; i++) {
+      mpc_optimise_unretained(p->data.or.xs[i], 0, st);
     }
-    mpc_print_unretained(p->data.or.xs[p->data.or.n-1], 0);
-    printf(")");
   }
 
   if (p->type == MPC_TYPE_AND) {
-    printf("(");
-    for(i = 0; i < p->data.and.n-1; i++) {
-      mpc_print_unretained(p->data.and.xs[i], 0);
-      printf(" ");
+    for(i = 0; i < p->data.and.n; i++) {
+      mpc_optimise_unretained(p->data.and.xs[i], 0, st);
     }
-    mpc_print_unretained(p->data.and.xs[p->data.and.n-1], 0);
-    printf(")");
-  }
-
-  if (p->type == MPC_TYPE_CHECK) {
-    mpc_print_unretained(p->data.check.x, 0);
-    printf("->?");
-  }
-  if (p->type == MPC_TYPE_CHECK_WITH) {
-    mpc_print_unretained(p->data.check_with.x, 0);
-    printf("->?");
   }
 
-}
-
-void mpc_print(mpc_parser_t *p) {
-  mpc_print_unretained(p, 1);
-  printf("\n");
-}
-
-/*
-** Testing
-*/
+  /* Perform optimisations */
 
-/*
-** These functions are slightly unwieldy and
-** also the whole of the testing suite for mpc
-** mpc is pretty shaky.
-**
-** It could do with a lot more tests and more
-** precision. Currently I am only really testing
-** changes off of the examples.
-**
-*/
+  while (1) {
 
-int mpc_test_fail(mpc_parser_t *p, const char *s, const void *d,
-  int(*tester)(const void*, const void*),
-  mpc_dtor_t destructor,
-  void(*printer)(const void*)) {
-  mpc_result_t r;
-  (void) printer;
-  if (mpc_parse("<test>", s, p, &r)) {
+    /* Merge rhs `or` */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.xs[p->data.or.n-1]->type == MPC_TYPE_OR
+    && !p->data.or.xs[p->data.or.n-1]->retained) {
+      t = p->data.or.xs[p->data.or.n-1];
+      n = p->data.or.n; m = t->data.or.n;
+      p->data.or.n = n + m - 1;
+      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      free(t->data.or.xs); free(t->data.or.first); free(t->name); free(t);
+      st->flattened++;
+      continue;
+    }
 
-    if (tester(r.output, d)) {
-      destructor(r.output);
-      return 0;
-    } else {
-      destructor(r.output);
-      return 1;
+    /* Merge lhs `or` */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.xs[0]->type == MPC_TYPE_OR
+    && !p->data.or.xs[0]->retained) {
+      t = p->data.or.xs[0];
+      n = p->data.or.n; m = t->data.or.n;
+      p->data.or.n = n + m - 1;
+      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
+      memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      free(t->data.or.xs); free(t->data.or.first); free(t->name); free(t);
+      st->flattened++;
+      continue;
     }
 
-  } else {
-    mpc_err_delete(r.error);
-    return 1;
-  }
+    /* Remove ast `pass` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.n == 2
+    &&  p->data.and.xs[0]->type == MPC_TYPE_PASS
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.f == mpcf_fold_ast) {
+      t = p->data.and.xs[1];
+      mpc_delete(p->data.and.xs[0]);
+      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
+      memcpy(p, t, sizeof(mpc_parser_t));
+      free(t);
+      st->flattened++;
+      continue;
+    }
 
-}
+    /* Merge ast lhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_fold_ast
+    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.xs[0]->data.and.f == mpcf_fold_ast) {
+      t = p->data.and.xs[0];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
+      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
+      st->flattened++;
+      continue;
+    }
 
-int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
-  int(*tester)(const void*, const void*),
-  mpc_dtor_t destructor,
-  void(*printer)(const void*)) {
+    /* Merge ast rhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_fold_ast
+    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
+    && !p->data.and.xs[p->data.and.n-1]->retained
+    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_fold_ast) {
+      t = p->data.and.xs[p->data.and.n-1];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
+      st->flattened++;
+      continue;
+    }
 
-  mpc_result_t r;
-  if (mpc_parse("<test>", s, p, &r)) {
+    /* Remove re `lift` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.n == 2
+    &&  p->data.and.xs[0]->type == MPC_TYPE_LIFT
+    &&  p->data.and.xs[0]->data.lift.lf == mpcf_ctor_str
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.f == mpcf_strfold) {
+      t = p->data.and.xs[1];
+      mpc_delete(p->data.and.xs[0]);
+      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
+      memcpy(p, t, sizeof(mpc_parser_t));
+      free(t);
+      st->flattened++;
+      continue;
+    }
 
-    if (tester(r.output, d)) {
-      destructor(r.output);
-      return 1;
-    } else {
-      printf("Got "); printer(r.output); printf("\n");
-      printf("Expected "); printer(d); printf("\n");
-      destructor(r.output);
-      return 0;
+    /* Merge re lhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_strfold
+    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.xs[0]->data.and.f == mpcf_strfold) {
+      t = p->data.and.xs[0];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
+      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
+      st->flattened++;
+      continue;
     }
 
-  } else {
-    mpc_err_print(r.error);
-    mpc_err_delete(r.error);
-    return 0;
+    /* Merge re rhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_strfold
+    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
+    && !p->data.and.xs[p->data.and.n-1]->retained
+    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_strfold) {
+      t = p->data.and.xs[p->data.and.n-1];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
+      st->flattened++;
+      continue;
+    }
 
-  }
+    /* Merge adjacent literals */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_strfold
+    &&  mpc_optimise_literals(p)) {
+      st->literals++;
+      continue;
+    }
 
-}
+    /* Fuse character sets */
+    if (p->type == MPC_TYPE_OR && mpc_optimise_classes(p)) {
+      st->classes++;
+      continue;
+    }
 
+    if ((p->type == MPC_TYPE_ONEOF || p->type == MPC_TYPE_NONEOF)) {
+      mpc_optimise_set(p);
+      st->classes++;
+      continue;
+    }
 
-/*
-** AST
-*/
+    /* Scan spans of a set */
+    if ((p->type == MPC_TYPE_MANY || p->type == MPC_TYPE_MANY1)
+    &&  p->data.repeat.f == mpcf_strfold
+    &&  mpc_optimise_span(p)) {
+      st->spans++;
+      continue;
+    }
 
-void mpc_ast_delete(mpc_ast_t *a) {
+    /* Inline single children */
+    if (mpc_optimise_inline(p)) {
+      st->inlined++;
+      continue;
+    }
 
-  int i;
+    /* Alternatives may have changed, so their first characters are found again */
+    if (p->type == MPC_TYPE_OR) { mpc_or_first(p); }
 
-  if (a == NULL) { return; }
+    return;
 
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_delete(a->children[i]);
   }
 
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+}
 
+void mpc_optimise(mpc_parser_t *p) {
+  mpc_optimise_stats_t st;
+  mpc_optimise_stats(p, &st);
 }
 
-static void mpc_ast_delete_no_children(mpc_ast_t *a) {
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+void mpc_optimise_stats(mpc_parser_t *p, mpc_optimise_stats_t *st) {
+  memset(st, 0, sizeof(mpc_optimise_stats_t));
+  mpc_optimise_unretained(p, 1, st);
 }
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+/*
+** Code Generation
+**
+** A parser graph can also be written out as C.
+** Each parser becomes a function which calls
+** the functions of its children directly, with
+** its characters, strings and messages written
+** in as constants. Values are still built and
+** folded by the functions the parser was given,
+** which are called by name, so the generated
+** file only needs these to be ones `mpc.h`
+** declares. Errors are kept in the same way as
+** with `MPC_CONTEXT_LAZY_ERRORS`.
+**
+** When generating from a grammar the grammar is
+** written into the file too, along with a `main`
+** enabled by `MPC_CODEGEN_CHECK` which parses its
+** inputs with both the generated parser and one
+** built by `mpca_lang`, and reports differences.
+*/
 
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+enum {
+  MPC_GEN_NEXT     = 1,
+  MPC_GEN_NONE     = 2,
+  MPC_GEN_EXPECT   = 4,
+  MPC_GEN_REPEAT   = 8,
+  MPC_GEN_STRING   = 16,
+  MPC_GEN_STATE    = 32,
+  MPC_GEN_PUSH     = 64,
+  MPC_GEN_BOUNDARY = 128,
+  MPC_GEN_NEWLINE  = 256,
+  MPC_GEN_SPAN     = 512
+};
 
-  a->contents = malloc(strlen(contents) + 1);
-  strcpy(a->contents, contents);
+static const char *mpc_gen_core_lines[] = {
+  "typedef struct {",
+  "  const char *filename;",
+  "  const char *string;",
+  "  size_t length;",
+  "  mpc_state_t state;",
+  "  char last;",
+  "  int backtrack;",
+  "  int suppress;",
+  "  int flight;",
+  "  mpc_state_t flight_state;",
+  "  const char *flight_expected;",
+  "  const char *flight_failure;",
+  "  mpc_state_t err_state;",
+  "  const char *err_failure;",
+  "  int err_expected_num;",
+  "  int err_expected_slots;",
+  "  const char **err_expected;",
+  "  int strings_num;",
+  "  int strings_slots;",
+  "  char **strings;",
+  "} mpcg_input_t;",
+  "",
+  "static char *mpcg_strdup(const char *s) {",
+  "  char *x = malloc(strlen(s) + 1);",
+  "  strcpy(x, s);",
+  "  return x;",
+  "}",
+  "",
+  "static char mpcg_peek(mpcg_input_t *i) {",
+  "  size_t j = (size_t)i->state.pos;",
+  "  return j < i->length ? i->string[j] : '\\0';",
+  "}",
+  "",
+  "static void mpcg_step(mpcg_input_t *i, char c) {",
+  "  i->last = c;",
+  "  i->state.pos++;",
+  "  i->state.col++;",
+  "  if (c == '\\n') {",
+  "    i->state.col = 0;",
+  "    i->state.row++;",
+  "  }",
+  "}",
+  "",
+  "static int mpcg_fail(mpcg_input_t *i, const char *failure) {",
+  "  i->flight = !i->suppress;",
+  "  i->flight_state = i->state;",
+  "  i->flight_expected = NULL;",
+  "  i->flight_failure = failure;",
+  "  return 0;",
+  "}",
+  "",
+  "static void mpcg_merge(mpcg_input_t *i) {",
+  "",
+  "  int j;",
+  "",
+  "  if (!i->flight) { return; }",
+  "  if (i->flight_state.pos < i->err_state.pos) { return; }",
+  "  if (i->flight_state.pos > i->err_state.pos) {",
+  "    i->err_state = i->flight_state;",
+  "    i->err_failure = NULL;",
+  "    i->err_expected_num = 0;",
+  "  }",
+  "",
+  "  if (i->err_failure) { return; }",
+  "  if (i->flight_failure) { i->err_failure = i->flight_failure; return; }",
+  "",
+  "  for (j = 0; j < i->err_expected_num; j++) {",
+  "    if (strcmp(i->err_expected[j], i->flight_expected) == 0) { return; }",
+  "  }",
+  "",
+  "  if (i->err_expected_num == i->err_expected_slots) {",
+  "    i->err_expected_slots = i->err_expected_slots ? i->err_expected_slots * 2 : 8;",
+  "    i->err_expected = realloc(i->err_expected, sizeof(char*) * i->err_expected_slots);",
+  "  }",
+  "  i->err_expected[i->err_expected_num++] = i->flight_expected;",
+  "}",
+  "",
+  "static mpc_err_t *mpcg_error(mpcg_input_t *i) {",
+  "",
+  "  int j;",
+  "  size_t k = (size_t)i->err_state.pos;",
+  "  mpc_err_t *x = malloc(sizeof(mpc_err_t));",
+  "",
+  "  x->filename = mpcg_strdup(i->filename);",
+  "  x->state = i->err_state;",
+  "  x->expected_num = 0;",
+  "  x->expected = NULL;",
+  "  x->failure = NULL;",
+  "  x->received = k < i->length ? i->string[k] : '\\0';",
+  "",
+  "  if (i->err_failure) {",
+  "    x->failure = mpcg_strdup(i->err_failure);",
+  "    return x;",
+  "  }",
+  "",
+  "  x->expected_num = i->err_expected_num;",
+  "  x->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;",
+  "  for (j = 0; j < x->expected_num; j++) {",
+  "    x->expected[j] = mpcg_strdup(i->err_expected[j]);",
+  "  }",
+  "",
+  "  return x;",
+  "}",
+  "",
+  "static void mpcg_init(mpcg_input_t *i, const char *filename, const char *string, size_t length) {",
+  "  memset(i, 0, sizeof(mpcg_input_t));",
+  "  i->filename = filename;",
+  "  i->string = string;",
+  "  i->length = length;",
+  "  i->backtrack = 1;",
+  "  i->err_state.pos = -1;",
+  "  i->err_state.row = -1;",
+  "  i->err_state.col = -1;",
+  "  i->err_failure = \"Unknown Error\";",
+  "}",
+  "",
+  "static void mpcg_done(mpcg_input_t *i) {",
+  "  int j;",
+  "  for (j = 0; j < i->strings_num; j++) { free(i->strings[j]); }",
+  "  free(i->strings);",
+  "  free(i->err_expected);",
+  "}",
+  NULL
+};
 
-  a->state = mpc_state_new();
+static const char *mpc_gen_next_lines[] = {
+  "static int mpcg_next(mpcg_input_t *i, char c, mpc_val_t **o) {",
+  "  char *x = malloc(2);",
+  "  mpcg_step(i, c);",
+  "  x[0] = c;",
+  "  x[1] = '\\0';",
+  "  *o = x;",
+  "  return 1;",
+  "}",
+  NULL
+};
 
-  a->children_num = 0;
-  a->children = NULL;
-  return a;
+static const char *mpc_gen_none_lines[] = {
+  "static int mpcg_none(mpcg_input_t *i) {",
+  "  i->flight = 0;",
+  "  return 0;",
+  "}",
+  NULL
+};
 
-}
+static const char *mpc_gen_expect_lines[] = {
+  "static int mpcg_expect(mpcg_input_t *i, const char *expected) {",
+  "  i->flight = !i->suppress;",
+  "  i->flight_state = i->state;",
+  "  i->flight_expected = expected;",
+  "  i->flight_failure = NULL;",
+  "  return 0;",
+  "}",
+  NULL
+};
 
-mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
+static const char *mpc_gen_repeat_lines[] = {
+  "static void mpcg_repeat(mpcg_input_t *i, const char *prefix) {",
+  "",
+  "  char *x;",
+  "",
+  "  if (!i->flight || i->flight_failure) { return; }",
+  "",
+  "  x = malloc(strlen(prefix) + strlen(i->flight_expected) + 1);",
+  "  strcpy(x, prefix);",
+  "  strcat(x, i->flight_expected);",
+  "",
+  "  if (i->strings_num == i->strings_slots) {",
+  "    i->strings_slots = i->strings_slots ? i->strings_slots * 2 : 8;",
+  "    i->strings = realloc(i->strings, sizeof(char*) * i->strings_slots);",
+  "  }",
+  "  i->strings[i->strings_num++] = x;",
+  "  i->flight_expected = x;",
+  "}",
+  NULL
+};
 
-  mpc_ast_t *a = mpc_ast_new(tag, "");
+static const char *mpc_gen_string_lines[] = {
+  "static int mpcg_string(mpcg_input_t *i, const char *x, mpc_val_t **o) {",
+  "",
+  "  const char *c = x;",
+  "  mpc_state_t s = i->state;",
+  "  char l = i->last;",
+  "",
+  "  while (*c) {",
+  "    if (mpcg_peek(i) != *c) {",
+  "      if (i->backtrack >= 1) { i->state = s; i->last = l; }",
+  "      i->flight = 0;",
+  "      return 0;",
+  "    }",
+  "    mpcg_step(i, *c);",
+  "    c++;",
+  "  }",
+  "",
+  "  *o = mpcg_strdup(x);",
+  "  return 1;",
+  "}",
+  NULL
+};
 
-  int i;
-  va_list va;
-  va_start(va, tag);
+static const char *mpc_gen_state_lines[] = {
+  "static mpc_val_t *mpcg_state(mpcg_input_t *i) {",
+  "  mpc_state_t *s = malloc(sizeof(mpc_state_t));",
+  "  *s = i->state;",
+  "  return s;",
+  "}",
+  NULL
+};
 
-  for (i = 0; i < n; i++) {
-    mpc_ast_add_child(a, va_arg(va, mpc_ast_t*));
-  }
+static const char *mpc_gen_push_lines[] = {
+  "static mpc_val_t **mpcg_push(mpc_val_t **xs, mpc_val_t **stk, int n, int *slots) {",
+  "  if (n < *slots) { return xs; }",
+  "  *slots = n + n / 2;",
+  "  if (xs != stk) { return realloc(xs, sizeof(mpc_val_t*) * *slots); }",
+  "  xs = malloc(sizeof(mpc_val_t*) * *slots);",
+  "  memcpy(xs, stk, sizeof(mpc_val_t*) * n);",
+  "  return xs;",
+  "}",
+  NULL
+};
 
-  va_end(va);
+static const char *mpc_gen_span_lines[] = {
+  "static mpc_val_t *mpcg_span(mpcg_input_t *i, long s) {",
+  "  size_t n = (size_t)(i->state.pos - s);",
+  "  char *x = malloc(n + 1);",
+  "  memcpy(x, i->string + s, n);",
+  "  x[n] = '\\0';",
+  "  return x;",
+  "}",
+  NULL
+};
 
-  return a;
+static const char *mpc_gen_boundary_lines[] = {
+  "static int mpcg_boundary_anchor(char prev, char next) {",
+  "  const char* word = \"abcdefghijklmnopqrstuvwxyz\"",
+  "                     \"ABCDEFGHIJKLMNOPQRSTUVWXYZ\"",
+  "                     \"0123456789_\";",
+  "  if ( strchr(word, next) &&  prev == '\\0') { return 1; }",
+  "  if ( strchr(word, prev) &&  next == '\\0') { return 1; }",
+  "  if ( strchr(word, next) && !strchr(word, prev)) { return 1; }",
+  "  if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }",
+  "  return 0;",
+  "}",
+  NULL
+};
 
-}
+static const char *mpc_gen_newline_lines[] = {
+  "static int mpcg_boundary_newline_anchor(char prev, char next) {",
+  "  (void)next;",
+  "  return prev == '\\n';",
+  "}",
+  NULL
+};
 
-mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
+static const char *mpc_gen_same_lines[] = {
+  "static int mpcg_same(mpc_ast_t *a, mpc_ast_t *b) {",
+  "",
+  "  int j;",
+  "",
+  "  if (a == NULL || b == NULL) { return a == b; }",
+  "  if (strcmp(a->tag, b->tag) != 0) { return 0; }",
+  "  if (strcmp(mpc_ast_contents(a), mpc_ast_contents(b)) != 0) { return 0; }",
+  "  if (a->state.pos != b->state.pos",
+  "  ||  a->state.row != b->state.row",
+  "  ||  a->state.col != b->state.col) { return 0; }",
+  "  if (a->children_num != b->children_num) { return 0; }",
+  "",
+  "  for (j = 0; j < a->children_num; j++) {",
+  "    if (!mpcg_same(a->children[j], b->children[j])) { return 0; }",
+  "  }",
+  "",
+  "  return 1;",
+  "}",
+  "",
+  "static char *mpcg_read(FILE *f, size_t *n) {",
+  "",
+  "  size_t k, slots = 4096;",
+  "  char *s = malloc(slots);",
+  "",
+  "  *n = 0;",
+  "  while ((k = fread(s + *n, 1, slots - *n, f)) > 0) {",
+  "    *n += k;",
+  "    if (*n == slots) {",
+  "      slots *= 2;",
+  "      s = realloc(s, slots);",
+  "    }",
+  "  }",
+  "",
+  "  return s;",
+  "}",
+  NULL
+};
 
-  mpc_ast_t *r;
+static const char *mpc_gen_compare_lines[] = {
+  "  if (x && y) {",
+  "    same = mpcg_same(rx.output, ry.output);",
+  "    if (!same) {",
+  "      fprintf(stderr, \"%s: outputs differ\\n\", filename);",
+  "      if (rx.output) { mpc_ast_print_to(rx.output, stderr); }",
+  "      if (ry.output) { mpc_ast_print_to(ry.output, stderr); }",
+  "    }",
+  "    mpc_ast_delete(rx.output);",
+  "    mpc_ast_delete(ry.output);",
+  "    return same;",
+  "  }",
+  "",
+  "  if (!x && !y) {",
+  "    ex = mpc_err_string(rx.error);",
+  "    ey = mpc_err_string(ry.error);",
+  "    same = strcmp(ex, ey) == 0;",
+  "    if (!same) { fprintf(stderr, \"%s: errors differ\\n%s%s\", filename, ex, ey); }",
+  "    free(ex);",
+  "    free(ey);",
+  "    mpc_err_delete(rx.error);",
+  "    mpc_err_delete(ry.error);",
+  "    return same;",
+  "  }",
+  "",
+  "  fprintf(stderr, \"%s: only the %s parser succeeded\\n\", filename, x ? \"interpreted\" : \"generated\");",
+  "  if (x) {",
+  "    mpc_ast_delete(rx.output);",
+  "    mpc_err_delete(ry.error);",
+  "  } else {",
+  "    mpc_err_delete(rx.error);",
+  "    mpc_ast_delete(ry.output);",
+  "  }",
+  "  return 0;",
+  "}",
+  NULL
+};
 
-  if (a == NULL) { return a; }
-  if (a->children_num == 0) { return a; }
-  if (a->children_num == 1) { return a; }
+static const char *mpc_gen_main_lines[] = {
+  "  /* Each input is checked whole and then line by line */",
+  "",
+  "  for (j = 1; j < argc || j == 1; j++) {",
+  "",
+  "    filename = j < argc ? argv[j] : \"<stdin>\";",
+  "    file = j < argc ? fopen(argv[j], \"rb\") : stdin;",
+  "    if (file == NULL) {",
+  "      fprintf(stderr, \"%s: could not open file\\n\", filename);",
+  "      failed++;",
+  "      continue;",
+  "    }",
+  "",
+  "    s = mpcg_read(file, &n);",
+  "    if (file != stdin) { fclose(file); }",
+  "",
+  "    total++;",
+  "    failed += !mpcg_check(p0, filename, s, n);",
+  "",
+  "    for (a = 0; a < n; a = b + 1) {",
+  "      for (b = a; b < n && s[b] != '\\n'; b++);",
+  "      total++;",
+  "      failed += !mpcg_check(p0, filename, s + a, b - a);",
+  "    }",
+  "",
+  "    free(s);",
+  "  }",
+  "",
+  "  printf(\"%i inputs checked, %i differed\\n\", total, failed);",
+  NULL
+};
 
-  r = mpc_ast_new(">", "");
-  mpc_ast_add_child(r, a);
-  return r;
-}
+/* The functions parsers can use when they are written out as C or saved, with the type of each */
 
-int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
+typedef void(*mpc_gen_fn_t)(void);
 
-  int i;
+enum {
+  MPC_GEN_FN_DTOR,
+  MPC_GEN_FN_CTOR,
+  MPC_GEN_FN_APPLY,
+  MPC_GEN_FN_APPLY_TO,
+  MPC_GEN_FN_FOLD,
+  MPC_GEN_FN_ANCHOR,
+  MPC_GEN_FN_SATISFY,
+  MPC_GEN_FN_CHECK,
+  MPC_GEN_FN_CHECK_WITH
+};
 
-  if (strcmp(a->tag, b->tag) != 0) { return 0; }
-  if (strcmp(a->contents, b->contents) != 0) { return 0; }
-  if (a->children_num != b->children_num) { return 0; }
+typedef struct {
+  mpc_gen_fn_t f;
+  const char *name;
+  int type;
+  int use;
+} mpc_gen_name_t;
+
+static const mpc_gen_name_t mpc_gen_names[] = {
+  { (mpc_gen_fn_t)free,                        "free",                        MPC_GEN_FN_DTOR, 0 },
+  { (mpc_gen_fn_t)mpc_ast_delete,              "mpc_ast_delete",              MPC_GEN_FN_DTOR, 0 },
+  { (mpc_gen_fn_t)mpc_ast_add_root,            "mpc_ast_add_root",            MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_dtor_null,              "mpcf_dtor_null",              MPC_GEN_FN_DTOR, 0 },
+  { (mpc_gen_fn_t)mpcf_ctor_null,              "mpcf_ctor_null",              MPC_GEN_FN_CTOR, 0 },
+  { (mpc_gen_fn_t)mpcf_ctor_str,               "mpcf_ctor_str",               MPC_GEN_FN_CTOR, 0 },
+  { (mpc_gen_fn_t)mpcf_free,                   "mpcf_free",                   MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_int,                    "mpcf_int",                    MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_hex,                    "mpcf_hex",                    MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_oct,                    "mpcf_oct",                    MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_float,                  "mpcf_float",                  MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_strtriml,               "mpcf_strtriml",               MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_strtrimr,               "mpcf_strtrimr",               MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_strtrim,                "mpcf_strtrim",                MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_escape,                 "mpcf_escape",                 MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_escape_regex,           "mpcf_escape_regex",           MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_escape_string_raw,      "mpcf_escape_string_raw",      MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_escape_char_raw,        "mpcf_escape_char_raw",        MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_unescape,               "mpcf_unescape",               MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_unescape_regex,         "mpcf_unescape_regex",         MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_unescape_string_raw,    "mpcf_unescape_string_raw",    MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_unescape_char_raw,      "mpcf_unescape_char_raw",      MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_null,                   "mpcf_null",                   MPC_GEN_FN_FOLD, 0 },
+  { (mpc_gen_fn_t)mpcf_fst,                    "mpcf_fst",                    MPC_GEN_FN_FOLD, 0 },
+  { (mpc_gen_fn_t)mpcf_snd,                    "mpcf_snd",                    MPC_GEN_FN_FOLD, 0 },
+  { (mpc_gen_fn_t)mpcf_trd,                    "mpcf_trd",                    MPC_GEN_FN_FOLD, 0 },
+  { (mpc_gen_fn_t)mpcf_fst_free,               "mpcf_fst_free",               MPC_GEN_FN_FOLD, 0 },
+  { (mpc_gen_fn_t)mpcf_snd_free,               "mpcf_snd_free",               MPC_GEN_FN_FOLD, 0 },
+  { (mpc_gen_fn_t)mpcf_trd_free,               "mpcf_trd_free",               MPC_GEN_FN_FOLD, 0 },
+  { (mpc_gen_fn_t)mpcf_strfold,                "mpcf_strfold",                MPC_GEN_FN_FOLD, 0 },
+  { (mpc_gen_fn_t)mpcf_maths,                  "mpcf_maths",                  MPC_GEN_FN_FOLD, 0 },
+  { (mpc_gen_fn_t)mpcf_fold_ast,               "mpcf_fold_ast",               MPC_GEN_FN_FOLD, 0 },
+  { (mpc_gen_fn_t)mpcf_str_ast,                "mpcf_str_ast",                MPC_GEN_FN_APPLY, 0 },
+  { (mpc_gen_fn_t)mpcf_state_ast,              "mpcf_state_ast",              MPC_GEN_FN_FOLD, 0 },
+  { (mpc_gen_fn_t)mpc_boundary_anchor,         "mpcg_boundary_anchor",        MPC_GEN_FN_ANCHOR, MPC_GEN_BOUNDARY },
+  { (mpc_gen_fn_t)mpc_boundary_newline_anchor, "mpcg_boundary_newline_anchor", MPC_GEN_FN_ANCHOR, MPC_GEN_NEWLINE },
+  { (mpc_gen_fn_t)mpcf_ast_tag_interned,       "mpca_tag",                    MPC_GEN_FN_APPLY_TO, 0 },
+  { (mpc_gen_fn_t)mpcf_ast_add_tag_interned,   "mpca_add_tag",                MPC_GEN_FN_APPLY_TO, 0 },
+  { NULL, NULL, 0, 0 }
+};
 
-  for (i = 0; i < a->children_num; i++) {
-    if (!mpc_ast_eq(a->children[i], b->children[i])) { return 0; }
+typedef struct {
+  FILE *f;
+  int num;
+  int slots;
+  mpc_parser_t **ps;
+  mpc_parser_t *bad;
+  int use;
+} mpc_gen_t;
+
+static int mpc_gen_find(mpc_gen_t *g, mpc_parser_t *p) {
+  int k;
+  for (k = 0; k < g->num; k++) {
+    if (g->ps[k] == p) { return k; }
   }
-
-  return 1;
+  return -1;
 }
 
-mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
-  r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
-  r->children[r->children_num-1] = a;
-  return r;
+static void mpc_gen_add(mpc_gen_t *g, mpc_parser_t *p) {
+  if (mpc_gen_find(g, p) >= 0) { return; }
+  if (g->num == g->slots) {
+    g->slots = g->slots ? g->slots * 2 : 64;
+    g->ps = realloc(g->ps, sizeof(mpc_parser_t*) * g->slots);
+  }
+  g->ps[g->num++] = p;
 }
 
-mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
-  if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
-  return a;
+static const char *mpc_gen_name(mpc_gen_t *g, mpc_parser_t *p, mpc_gen_fn_t f) {
+  int j;
+  for (j = 0; mpc_gen_names[j].f; j++) {
+    if (mpc_gen_names[j].f == f) {
+      g->use |= mpc_gen_names[j].use;
+      return mpc_gen_names[j].name;
+    }
+  }
+  if (g->bad == NULL) { g->bad = p; }
+  return "";
 }
 
-mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
-  if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
-  memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, (strlen(t)-1));
-  return a;
+static int mpc_gen_tag(mpc_apply_to_t f) {
+  return f == mpcf_ast_tag_interned || f == mpcf_ast_add_tag_interned;
 }
 
-mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
-  return a;
-}
+/*
+** Everything reachable is numbered up front,
+** checking that it can be written out, so that
+** nothing is written for graphs which cannot.
+*/
 
-mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
-  if (a == NULL) { return a; }
-  a->state = s;
-  return a;
-}
+static void mpc_gen_collect(mpc_gen_t *g, mpc_parser_t *p) {
 
-static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
+  int k, j;
 
-  int i;
+  mpc_gen_add(g, p);
 
-  if (a == NULL) {
-    fprintf(fp, "NULL\n");
-    return;
-  }
+  for (k = 0; k < g->num; k++) {
 
-  for (i = 0; i < d; i++) { fprintf(fp, "  "); }
+    p = g->ps[k];
 
-  if (strlen(a->contents)) {
-    fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag,
-      (long unsigned int)(a->state.row+1),
-      (long unsigned int)(a->state.col+1),
-      a->contents);
-  } else {
-    fprintf(fp, "%s \n", a->tag);
-  }
+    switch (p->type) {
 
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_print_depth(a->children[i], d+1, fp);
-  }
+      case MPC_TYPE_ANY:
+      case MPC_TYPE_SINGLE:
+      case MPC_TYPE_RANGE:
+        g->use |= MPC_GEN_NEXT | MPC_GEN_NONE;
+        break;
+      case MPC_TYPE_ONEOF:
+      case MPC_TYPE_NONEOF:
+        g->use |= MPC_GEN_NEXT | MPC_GEN_NONE;
+        break;
+      case MPC_TYPE_SATISFY:
+        g->use |= MPC_GEN_NEXT | MPC_GEN_NONE;
+        mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.satisfy.f);
+        break;
+      case MPC_TYPE_STRING: g->use |= MPC_GEN_STRING; break;
+      case MPC_TYPE_ANCHOR:
+        g->use |= MPC_GEN_NONE;
+        mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.anchor.f);
+        break;
+      case MPC_TYPE_SOI:
+      case MPC_TYPE_EOI: g->use |= MPC_GEN_NONE; break;
+      case MPC_TYPE_CLASS: g->use |= MPC_GEN_NEXT | MPC_GEN_NONE; break;
+      case MPC_TYPE_SPAN:
+        g->use |= MPC_GEN_SPAN | (p->data.set.m ? MPC_GEN_EXPECT : MPC_GEN_NONE);
+        if (p->data.set.m && p->data.set.n) { g->use |= MPC_GEN_REPEAT; }
+        break;
 
-}
+      case MPC_TYPE_LIFT: mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.lift.lf); break;
+      case MPC_TYPE_LIFT_VAL: if (p->data.lift.x && g->bad == NULL) { g->bad = p; } break;
+      case MPC_TYPE_STATE: g->use |= MPC_GEN_STATE; break;
 
-void mpc_ast_print(mpc_ast_t *a) {
-  mpc_ast_print_depth(a, 0, stdout);
-}
+      case MPC_TYPE_APPLY:
+        mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.apply.f);
+        mpc_gen_add(g, p->data.apply.x);
+        break;
+      case MPC_TYPE_APPLY_TO:
+        if (!mpc_gen_tag(p->data.apply_to.f)) {
+          mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.apply_to.f);
+          if (p->data.apply_to.d && g->bad == NULL) { g->bad = p; }
+        }
+        mpc_gen_add(g, p->data.apply_to.x);
+        break;
+      case MPC_TYPE_CHECK:
+        mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.check.dx);
+        mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.check.f);
+        mpc_gen_add(g, p->data.check.x);
+        break;
+      case MPC_TYPE_CHECK_WITH:
+        mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.check_with.dx);
+        mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.check_with.f);
+        if (p->data.check_with.d && g->bad == NULL) { g->bad = p; }
+        mpc_gen_add(g, p->data.check_with.x);
+        break;
+      case MPC_TYPE_EXPECT:
+        g->use |= MPC_GEN_EXPECT;
+        mpc_gen_add(g, p->data.expect.x);
+        break;
+      case MPC_TYPE_PREDICT: mpc_gen_add(g, p->data.predict.x); break;
 
-void mpc_ast_print_to(mpc_ast_t *a, FILE *fp) {
-  mpc_ast_print_depth(a, 0, fp);
-}
+      case MPC_TYPE_NOT:
+        g->use |= MPC_GEN_EXPECT;
+        mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.not.dx);
+        mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.not.lf);
+        mpc_gen_add(g, p->data.not.x);
+        break;
+      case MPC_TYPE_MAYBE:
+        mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.not.lf);
+        mpc_gen_add(g, p->data.not.x);
+        break;
 
-int mpc_ast_get_index(mpc_ast_t *ast, const char *tag) {
-  return mpc_ast_get_index_lb(ast, tag, 0);
-}
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+      case MPC_TYPE_COUNT:
+        g->use |= p->type == MPC_TYPE_MANY ? MPC_GEN_PUSH : MPC_GEN_PUSH | MPC_GEN_REPEAT;
+        if (p->type == MPC_TYPE_COUNT) {
+          mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.repeat.dx);
+          if (p->data.repeat.n < 1 && g->bad == NULL) { g->bad = p; }
+        }
+        mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.repeat.f);
+        mpc_gen_add(g, p->data.repeat.x);
+        break;
 
-int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb) {
-  int i;
+      case MPC_TYPE_OR:
+        if (p->data.or.n > 0) { g->use |= MPC_GEN_NONE; }
+        for (j = 0; j < p->data.or.n; j++) { mpc_gen_add(g, p->data.or.xs[j]); }
+        break;
+      case MPC_TYPE_AND:
+        if (p->data.and.n == 0) { break; }
+        mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.and.f);
+        for (j = 0; j < p->data.and.n-1; j++) { mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.and.dxs[j]); }
+        for (j = 0; j < p->data.and.n; j++) { mpc_gen_add(g, p->data.and.xs[j]); }
+        break;
 
-  for(i=lb; i<ast->children_num; i++) {
-    if(strcmp(ast->children[i]->tag, tag) == 0) {
-      return i;
+      default: break;
     }
   }
-
-  return -1;
 }
 
-mpc_ast_t *mpc_ast_get_child(mpc_ast_t *ast, const char *tag) {
-  return mpc_ast_get_child_lb(ast, tag, 0);
+static void mpc_gen_lines(FILE *f, const char **ls) {
+  while (*ls) { fprintf(f, "%s\n", *ls); ls++; }
+  fprintf(f, "\n");
 }
 
-mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb) {
-  int i;
-
-  for(i=lb; i<ast->children_num; i++) {
-    if(strcmp(ast->children[i]->tag, tag) == 0) {
-      return ast->children[i];
-    }
+static void mpc_gen_escape(FILE *f, char c, char q) {
+  switch (c) {
+    case '\n': fprintf(f, "\\n"); break;
+    case '\t': fprintf(f, "\\t"); break;
+    case '\r': fprintf(f, "\\r"); break;
+    case '\\': fprintf(f, "\\\\"); break;
+    case '?':  fprintf(f, "\\?"); break;
+    default:
+      if (c == q) { fprintf(f, "\\%c", c); }
+      else if (c >= ' ' && c <= '~') { fprintf(f, "%c", c); }
+      else { fprintf(f, "\\%03o", (unsigned char)c); }
   }
-
-  return NULL;
 }
 
-mpc_ast_trav_t *mpc_ast_traverse_start(mpc_ast_t *ast,
-                                       mpc_ast_trav_order_t order)
-{
-  mpc_ast_trav_t *trav, *n_trav;
-  mpc_ast_t *cnode = ast;
+static void mpc_gen_char(FILE *f, char c) {
+  fprintf(f, "'");
+  mpc_gen_escape(f, c, '\'');
+  fprintf(f, "'");
+}
 
-  /* Create the traversal structure */
-  trav = malloc(sizeof(mpc_ast_trav_t));
-  trav->curr_node = cnode;
-  trav->parent = NULL;
-  trav->curr_child = 0;
-  trav->order = order;
+static void mpc_gen_string(FILE *f, const char *s) {
+  fprintf(f, "\"");
+  while (*s) { mpc_gen_escape(f, *s, '"'); s++; }
+  fprintf(f, "\"");
+}
 
-  /* Get start node */
-  switch(order) {
-    case mpc_ast_trav_order_pre:
-      /* Nothing else is needed for pre order start */
-      break;
+/* Long strings are split into several literals to keep within the limits of older compilers */
 
-    case mpc_ast_trav_order_post:
-      while(cnode->children_num > 0) {
-        cnode = cnode->children[0];
+static void mpc_gen_long_string(FILE *f, const char *s) {
+  int n = 0;
+  fprintf(f, "  \"");
+  while (*s) {
+    mpc_gen_escape(f, *s, '"');
+    if ((*s == '\n' || ++n == 64) && s[1]) { fprintf(f, "\"\n  \""); n = 0; }
+    s++;
+  }
+  fprintf(f, "\"");
+}
 
-        n_trav = malloc(sizeof(mpc_ast_trav_t));
-        n_trav->curr_node = cnode;
-        n_trav->parent = trav;
-        n_trav->curr_child = 0;
-        n_trav->order = order;
+static void mpc_gen_set(FILE *f, const char *s, const char *in, const char *out) {
 
-        trav = n_trav;
-      }
+  int j, n = 0;
 
-      break;
+  fprintf(f, "  switch (c) {\n");
+  for (j = 0; s[j]; j++) {
+    if (strchr(s, s[j]) != s + j) { continue; }
+    fprintf(f, n % 8 ? " " : "    ");
+    fprintf(f, "case ");
+    mpc_gen_char(f, s[j]);
+    fprintf(f, ":");
+    if (++n % 8 == 0) { fprintf(f, "\n"); }
+  }
+  if (n % 8) { fprintf(f, "\n"); }
+  if (n) { fprintf(f, "      return %s;\n", in); }
+  fprintf(f, "    default:\n      return %s;\n  }\n", out);
+}
 
-    default:
-      /* Unreachable, but compiler complaints */
-      break;
+static void mpc_gen_bitmap(FILE *f, const unsigned char *x) {
+  int j;
+  fprintf(f, "  static const unsigned char set[%i] = {", MPC_SET_BYTES);
+  for (j = 0; j < MPC_SET_BYTES; j++) {
+    fprintf(f, "%s0x%02x%s", j % 8 ? " " : "\n    ", x[j], j < MPC_SET_BYTES-1 ? "," : "");
   }
+  fprintf(f, "\n  };\n");
+}
 
-  return trav;
+static void mpc_gen_child(mpc_gen_t *g, mpc_parser_t *x, const char *o) {
+  fprintf(g->f, "mpcg_%i(i, %s, d+1)", mpc_gen_find(g, x), o);
 }
 
-mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav) {
-  mpc_ast_trav_t *n_trav, *to_free;
-  mpc_ast_t *ret = NULL;
-  int cchild;
+static void mpc_gen_node(mpc_gen_t *g, int k) {
 
-  /* The end of traversal was reached */
-  if(*trav == NULL) return NULL;
+  int j, n;
+  FILE *f = g->f;
+  mpc_parser_t *p = g->ps[k];
+  mpc_tag_t *t;
 
-  switch((*trav)->order) {
-    case mpc_ast_trav_order_pre:
-      ret = (*trav)->curr_node;
+  if (p->name && !strstr(p->name, "*/")) { fprintf(f, "/* %s */\n", p->name); }
+  fprintf(f, "static int mpcg_%i(mpcg_input_t *i, mpc_val_t **o, int d) {\n\n", k);
 
-      /* If there aren't any more children, go up */
-      while(*trav != NULL &&
-        (*trav)->curr_child >= (*trav)->curr_node->children_num)
-      {
-        to_free = *trav;
-        *trav = (*trav)->parent;
-        free(to_free);
-      }
+  switch (p->type) {
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_BLANK:
+      fprintf(f, "  char c;\n\n");
+      break;
+    case MPC_TYPE_CLASS:
+      mpc_gen_bitmap(f, p->data.set.x);
+      fprintf(f, "  char c;\n\n");
+      break;
+    case MPC_TYPE_SPAN:
+      mpc_gen_bitmap(f, p->data.set.x);
+      fprintf(f, "  long s = i->state.pos;\n  char c;\n\n");
+      break;
+    case MPC_TYPE_PREDICT:
+      fprintf(f, "  int x;\n\n");
+      break;
+    case MPC_TYPE_NOT:
+      fprintf(f, "  mpc_state_t s = i->state;\n  char l = i->last;\n\n");
+      break;
+    /* Temporaries start out empty, so compilers can see nothing is read before it is set */
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      fprintf(f, "  mpc_val_t *x = NULL, *stk[%i] = { NULL };\n  mpc_val_t **xs = stk;\n  int n = 0, slots = %i;\n\n",
+        MPC_PARSE_STACK_MIN, MPC_PARSE_STACK_MIN);
+      break;
+    case MPC_TYPE_COUNT:
+      fprintf(f, "  mpc_val_t *xs[%i] = { NULL };\n  int j, n = 0;\n\n", p->data.repeat.n);
+      break;
+    case MPC_TYPE_AND:
+      if (p->data.and.n == 0) { break; }
+      fprintf(f, "  mpc_val_t *xs[%i] = { NULL };\n  mpc_state_t s = i->state;\n  char l = i->last;\n\n", p->data.and.n);
+      break;
+    default: break;
+  }
 
-      /* If trav is NULL, the end was reached */
-      if(*trav == NULL) {
-        break;
-      }
+  fprintf(f, "  if (d == MPCG_MAX_DEPTH) { return mpcg_fail(i, \"Maximum recursion depth exceeded!\"); }\n\n");
 
-      /* Go to next child */
-      n_trav = malloc(sizeof(mpc_ast_trav_t));
+  switch (p->type) {
 
-      cchild = (*trav)->curr_child;
-      n_trav->curr_node = (*trav)->curr_node->children[cchild];
-      n_trav->parent = *trav;
-      n_trav->curr_child = 0;
-      n_trav->order = (*trav)->order;
+    case MPC_TYPE_ANY:
+      fprintf(f, "  c = mpcg_peek(i);\n");
+      fprintf(f, "  if (c == '\\0') { return mpcg_none(i); }\n");
+      fprintf(f, "  return mpcg_next(i, c, o);\n");
+      break;
 
-      (*trav)->curr_child++;
-      *trav = n_trav;
+    case MPC_TYPE_SINGLE:
+      fprintf(f, "  c = mpcg_peek(i);\n");
+      fprintf(f, "  if (c == '\\0' || c != ");
+      mpc_gen_char(f, p->data.single.x);
+      fprintf(f, ") { return mpcg_none(i); }\n");
+      fprintf(f, "  return mpcg_next(i, c, o);\n");
+      break;
 
+    case MPC_TYPE_RANGE:
+      fprintf(f, "  c = mpcg_peek(i);\n");
+      fprintf(f, "  if (c == '\\0' || c < ");
+      mpc_gen_char(f, p->data.range.x);
+      fprintf(f, " || c > ");
+      mpc_gen_char(f, p->data.range.y);
+      fprintf(f, ") { return mpcg_none(i); }\n");
+      fprintf(f, "  return mpcg_next(i, c, o);\n");
       break;
 
-    case mpc_ast_trav_order_post:
-      ret = (*trav)->curr_node;
+    case MPC_TYPE_ONEOF:
+      fprintf(f, "  c = mpcg_peek(i);\n");
+      fprintf(f, "  if (c == '\\0') { return mpcg_none(i); }\n");
+      mpc_gen_set(f, p->data.string.x, "mpcg_next(i, c, o)", "mpcg_none(i)");
+      break;
 
-      /* Move up tree to the parent If the parent doesn't have any more nodes,
-       * then this is the current node. If it does, move down to its left most
-       * child. Also, free the previous traversal node */
-      to_free = *trav;
-      *trav = (*trav)->parent;
-      free(to_free);
+    case MPC_TYPE_NONEOF:
+      fprintf(f, "  c = mpcg_peek(i);\n");
+      fprintf(f, "  if (c == '\\0') { return mpcg_none(i); }\n");
+      mpc_gen_set(f, p->data.string.x, "mpcg_none(i)", "mpcg_next(i, c, o)");
+      break;
 
-      if(*trav == NULL)
-        break;
+    case MPC_TYPE_SATISFY:
+      fprintf(f, "  c = mpcg_peek(i);\n");
+      fprintf(f, "  if (c == '\\0' || !%s(c)) { return mpcg_none(i); }\n",
+        mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.satisfy.f));
+      fprintf(f, "  return mpcg_next(i, c, o);\n");
+      break;
 
-      /* Next child */
-      (*trav)->curr_child++;
+    case MPC_TYPE_CLASS:
+      fprintf(f, "  c = mpcg_peek(i);\n");
+      fprintf(f, "  if (c == '\\0' || !(set[(unsigned char)c >> 3] & (1 << ((unsigned char)c & 7)))) { return mpcg_none(i); }\n");
+      fprintf(f, "  return mpcg_next(i, c, o);\n");
+      break;
 
-      /* If there aren't any more children, this is the next node */
-      if((*trav)->curr_child >= (*trav)->curr_node->children_num) {
-        break;
+    case MPC_TYPE_SPAN:
+      fprintf(f, "  while ((c = mpcg_peek(i)) != '\\0' && (set[(unsigned char)c >> 3] & (1 << ((unsigned char)c & 7)))) {\n");
+      fprintf(f, "    mpcg_step(i, c);\n");
+      fprintf(f, "  }\n");
+      if (p->data.set.m) {
+        fprintf(f, "  mpcg_expect(i, ");
+        mpc_gen_string(f, p->data.set.m);
+        fprintf(f, ");\n");
+      } else {
+        fprintf(f, "  mpcg_none(i);\n");
       }
-
-      /* If there are still more children, find the leftmost child from this
-       * node */
-      while((*trav)->curr_node->children_num > 0) {
-        n_trav = malloc(sizeof(mpc_ast_trav_t));
-
-        cchild = (*trav)->curr_child;
-        n_trav->curr_node = (*trav)->curr_node->children[cchild];
-        n_trav->parent = *trav;
-        n_trav->curr_child = 0;
-        n_trav->order = (*trav)->order;
-
-        *trav = n_trav;
+      if (p->data.set.n) {
+        fprintf(f, "  if (i->state.pos == s) {\n");
+        if (p->data.set.m) { fprintf(f, "    mpcg_repeat(i, \"one or more of \");\n"); }
+        fprintf(f, "    return 0;\n");
+        fprintf(f, "  }\n");
       }
-
-    default:
-      /* Unreachable, but compiler complaints */
+      fprintf(f, "  mpcg_merge(i);\n");
+      fprintf(f, "  *o = mpcg_span(i, s);\n");
+      fprintf(f, "  return 1;\n");
       break;
-  }
-
-  return ret;
-}
-
-void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
-  mpc_ast_trav_t *n_trav;
-
-  /* Go through parents until all are free */
-  while(*trav != NULL) {
-      n_trav = (*trav)->parent;
-      free(*trav);
-      *trav = n_trav;
-  }
-}
 
-mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+    case MPC_TYPE_BLANK:
+      fprintf(f, "  while ((c = mpcg_peek(i)) == ' ' || (c >= '\\t' && c <= '\\r')) {\n");
+      fprintf(f, "    mpcg_step(i, c);\n");
+      fprintf(f, "  }\n");
+      fprintf(f, "  *o = NULL;\n");
+      fprintf(f, "  return 1;\n");
+      break;
 
-  int i, j;
-  mpc_ast_t** as = (mpc_ast_t**)xs;
-  mpc_ast_t *r;
+    case MPC_TYPE_STRING:
+      fprintf(f, "  return mpcg_string(i, ");
+      mpc_gen_string(f, p->data.string.x);
+      fprintf(f, ", o);\n");
+      break;
 
-  if (n == 0) { return NULL; }
-  if (n == 1) { return xs[0]; }
-  if (n == 2 && xs[1] == NULL) { return xs[0]; }
-  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+    case MPC_TYPE_ANCHOR:
+      fprintf(f, "  *o = NULL;\n");
+      fprintf(f, "  return %s(i->last, mpcg_peek(i)) ? 1 : mpcg_none(i);\n",
+        mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.anchor.f));
+      break;
 
-  r = mpc_ast_new(">", "");
+    case MPC_TYPE_SOI:
+      fprintf(f, "  *o = NULL;\n");
+      fprintf(f, "  return i->last == '\\0' ? 1 : mpcg_none(i);\n");
+      break;
 
-  for (i = 0; i < n; i++) {
+    case MPC_TYPE_EOI:
+      fprintf(f, "  *o = NULL;\n");
+      fprintf(f, "  if (i->state.term || mpcg_peek(i) != '\\0') { return mpcg_none(i); }\n");
+      fprintf(f, "  i->state.term = 1;\n");
+      fprintf(f, "  return 1;\n");
+      break;
 
-    if (as[i] == NULL) { continue; }
+    case MPC_TYPE_UNDEFINED:
+      fprintf(f, "  (void)o;\n");
+      fprintf(f, "  return mpcg_fail(i, \"Parser Undefined!\");\n");
+      break;
 
-    if        (as[i] && as[i]->children_num == 0) {
-      mpc_ast_add_child(r, as[i]);
-    } else if (as[i] && as[i]->children_num == 1) {
-      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
-      mpc_ast_delete_no_children(as[i]);
-    } else if (as[i] && as[i]->children_num >= 2) {
-      for (j = 0; j < as[i]->children_num; j++) {
-        mpc_ast_add_child(r, as[i]->children[j]);
-      }
-      mpc_ast_delete_no_children(as[i]);
-    }
+    case MPC_TYPE_FAIL:
+      fprintf(f, "  (void)o;\n");
+      fprintf(f, "  return mpcg_fail(i, ");
+      mpc_gen_string(f, p->data.fail.m);
+      fprintf(f, ");\n");
+      break;
 
-  }
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT_VAL:
+      fprintf(f, "  *o = NULL;\n");
+      fprintf(f, "  return 1;\n");
+      break;
 
-  if (r->children_num) {
-    r->state = r->children[0]->state;
-  }
+    case MPC_TYPE_LIFT:
+      fprintf(f, "  *o = %s();\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.lift.lf));
+      fprintf(f, "  return 1;\n");
+      break;
 
-  return r;
-}
+    case MPC_TYPE_STATE:
+      fprintf(f, "  *o = mpcg_state(i);\n");
+      fprintf(f, "  return 1;\n");
+      break;
 
-mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
-  free(c);
-  return a;
-}
+    case MPC_TYPE_APPLY:
+      fprintf(f, "  if (!");
+      mpc_gen_child(g, p->data.apply.x, "o");
+      fprintf(f, ") { return 0; }\n");
+      fprintf(f, "  *o = %s(*o);\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.apply.f));
+      fprintf(f, "  return 1;\n");
+      break;
 
-mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
-  mpc_state_t *s = ((mpc_state_t**)xs)[0];
-  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
-  (void)n;
-  a = mpc_ast_state(a, *s);
-  free(s);
-  return a;
-}
+    case MPC_TYPE_APPLY_TO:
+      fprintf(f, "  if (!");
+      mpc_gen_child(g, p->data.apply_to.x, "o");
+      fprintf(f, ") { return 0; }\n");
+      if (mpc_gen_tag(p->data.apply_to.f)) {
+        t = p->data.apply_to.d;
+        fprintf(f, p->data.apply_to.f == mpcf_ast_tag_interned
+          ? "  *o = *o ? mpc_ast_tag(*o, " : "  *o = mpc_ast_add_tag(*o, ");
+        mpc_gen_string(f, t->name);
+        fprintf(f, p->data.apply_to.f == mpcf_ast_tag_interned ? ") : NULL;\n" : ");\n");
+      } else {
+        fprintf(f, "  *o = %s(*o, NULL);\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.apply_to.f));
+      }
+      fprintf(f, "  return 1;\n");
+      break;
 
-mpc_parser_t *mpca_state(mpc_parser_t *a) {
-  return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
-}
+    case MPC_TYPE_CHECK:
+    case MPC_TYPE_CHECK_WITH:
+      fprintf(f, "  if (!");
+      mpc_gen_child(g, p->data.check.x, "o");
+      fprintf(f, ") { return 0; }\n");
+      if (p->type == MPC_TYPE_CHECK) {
+        fprintf(f, "  if (%s(o)) { return 1; }\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.check.f));
+        fprintf(f, "  %s(*o);\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.check.dx));
+        fprintf(f, "  return mpcg_fail(i, ");
+        mpc_gen_string(f, p->data.check.e);
+      } else {
+        fprintf(f, "  if (%s(o, NULL)) { return 1; }\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.check_with.f));
+        fprintf(f, "  %s(*o);\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.check_with.dx));
+        fprintf(f, "  return mpcg_fail(i, ");
+        mpc_gen_string(f, p->data.check_with.e);
+      }
+      fprintf(f, ");\n");
+      break;
 
-mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
-}
+    case MPC_TYPE_EXPECT:
+      fprintf(f, "  i->suppress++;\n");
+      fprintf(f, "  if (");
+      mpc_gen_child(g, p->data.expect.x, "o");
+      fprintf(f, ") { i->suppress--; return 1; }\n");
+      fprintf(f, "  i->suppress--;\n");
+      fprintf(f, "  return mpcg_expect(i, ");
+      mpc_gen_string(f, p->data.expect.m);
+      fprintf(f, ");\n");
+      break;
 
-mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
-}
+    case MPC_TYPE_PREDICT:
+      fprintf(f, "  i->backtrack--;\n");
+      fprintf(f, "  x = ");
+      mpc_gen_child(g, p->data.predict.x, "o");
+      fprintf(f, ";\n");
+      fprintf(f, "  i->backtrack++;\n");
+      fprintf(f, "  return x;\n");
+      break;
 
-mpc_parser_t *mpca_root(mpc_parser_t *a) {
-  return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
-}
+    case MPC_TYPE_NOT:
+      fprintf(f, "  i->suppress++;\n");
+      fprintf(f, "  if (");
+      mpc_gen_child(g, p->data.not.x, "o");
+      fprintf(f, ") {\n");
+      fprintf(f, "    if (i->backtrack >= 1) { i->state = s; i->last = l; }\n");
+      fprintf(f, "    i->suppress--;\n");
+      fprintf(f, "    %s(*o);\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.not.dx));
+      fprintf(f, "    return mpcg_expect(i, \"opposite\");\n");
+      fprintf(f, "  }\n");
+      fprintf(f, "  i->suppress--;\n");
+      fprintf(f, "  *o = %s();\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.not.lf));
+      fprintf(f, "  return 1;\n");
+      break;
 
-mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
-mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
-mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+    case MPC_TYPE_MAYBE:
+      fprintf(f, "  if (");
+      mpc_gen_child(g, p->data.not.x, "o");
+      fprintf(f, ") { return 1; }\n");
+      fprintf(f, "  mpcg_merge(i);\n");
+      fprintf(f, "  *o = %s();\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.not.lf));
+      fprintf(f, "  return 1;\n");
+      break;
 
-mpc_parser_t *mpca_or(int n, ...) {
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      fprintf(f, "  while (");
+      mpc_gen_child(g, p->data.repeat.x, "&x");
+      fprintf(f, ") {\n");
+      fprintf(f, "    xs = mpcg_push(xs, stk, n, &slots);\n");
+      fprintf(f, "    xs[n++] = x;\n");
+      fprintf(f, "  }\n");
+      if (p->type == MPC_TYPE_MANY1) {
+        fprintf(f, "  if (n == 0) {\n");
+        fprintf(f, "    mpcg_repeat(i, \"one or more of \");\n");
+        fprintf(f, "    return 0;\n");
+        fprintf(f, "  }\n");
+      }
+      fprintf(f, "  mpcg_merge(i);\n");
+      fprintf(f, "  *o = %s(n, xs);\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.repeat.f));
+      fprintf(f, "  if (xs != stk) { free(xs); }\n");
+      fprintf(f, "  return 1;\n");
+      break;
 
-  int i;
-  va_list va;
+    case MPC_TYPE_COUNT:
+      fprintf(f, "  while (n < %i && ", p->data.repeat.n);
+      mpc_gen_child(g, p->data.repeat.x, "&xs[n]");
+      fprintf(f, ") { n++; }\n");
+      fprintf(f, "  if (n == %i) {\n", p->data.repeat.n);
+      fprintf(f, "    *o = %s(n, xs);\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.repeat.f));
+      fprintf(f, "    return 1;\n");
+      fprintf(f, "  }\n");
+      fprintf(f, "  for (j = 0; j < n; j++) { %s(xs[j]); }\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.repeat.dx));
+      fprintf(f, "  mpcg_repeat(i, \"%i of \");\n", p->data.repeat.n);
+      fprintf(f, "  return 0;\n");
+      break;
 
-  mpc_parser_t *p = mpc_undefined();
+    case MPC_TYPE_OR:
+      n = p->data.or.n;
+      if (n == 0) {
+        fprintf(f, "  *o = NULL;\n");
+        fprintf(f, "  return 1;\n");
+        break;
+      }
+      for (j = 0; j < n; j++) {
+        fprintf(f, "  if (");
+        mpc_gen_child(g, p->data.or.xs[j], "o");
+        fprintf(f, ") { return 1; }\n");
+        fprintf(f, "  mpcg_merge(i);\n");
+      }
+      fprintf(f, "  return mpcg_none(i);\n");
+      break;
 
-  p->type = MPC_TYPE_OR;
-  p->data.or.n = n;
-  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+    case MPC_TYPE_AND:
+      n = p->data.and.n;
+      if (n == 0) {
+        fprintf(f, "  *o = NULL;\n");
+        fprintf(f, "  return 1;\n");
+        break;
+      }
+      for (j = 0; j < n; j++) {
+        fprintf(f, "  if (!mpcg_%i(i, &xs[%i], d+1)) { goto fail%i; }\n",
+          mpc_gen_find(g, p->data.and.xs[j]), j, j);
+      }
+      fprintf(f, "  *o = %s(%i, xs);\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.and.f), n);
+      fprintf(f, "  return 1;\n\n");
+      for (j = n-1; j > 0; j--) {
+        fprintf(f, "fail%i:\n", j);
+        fprintf(f, "  %s(xs[%i]);\n", mpc_gen_name(g, p, (mpc_gen_fn_t)p->data.and.dxs[j-1]), j-1);
+      }
+      fprintf(f, "fail0:\n");
+      fprintf(f, "  if (i->backtrack >= 1) { i->state = s; i->last = l; }\n");
+      fprintf(f, "  return 0;\n");
+      break;
 
-  va_start(va, n);
-  for (i = 0; i < n; i++) {
-    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+    default:
+      fprintf(f, "  (void)o;\n");
+      fprintf(f, "  return mpcg_fail(i, \"Unknown Parser Type Id!\");\n");
+      break;
   }
-  va_end(va);
-
-  return p;
 
+  fprintf(f, "}\n\n");
 }
 
-mpc_parser_t *mpca_and(int n, ...) {
-
-  int i;
-  va_list va;
-
-  mpc_parser_t *p = mpc_undefined();
+static void mpc_gen_check(FILE *f, const char *name, int flags, const char *language, int n, mpc_parser_t **ps) {
 
-  p->type = MPC_TYPE_AND;
-  p->data.and.n = n;
-  p->data.and.f = mpcf_fold_ast;
-  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+  int j;
 
-  va_start(va, n);
-  for (i = 0; i < n; i++) {
-    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  fprintf(f, "#ifdef MPC_CODEGEN_CHECK\n\n");
+  fprintf(f, "static const char *mpcg_grammar =\n");
+  mpc_gen_long_string(f, language);
+  fprintf(f, ";\n\n");
+
+  mpc_gen_lines(f, mpc_gen_same_lines);
+
+  fprintf(f, "static int mpcg_check(mpc_parser_t *p, const char *filename, const char *s, size_t n) {\n\n");
+  fprintf(f, "  int x, y, same;\n");
+  fprintf(f, "  char *ex, *ey;\n");
+  fprintf(f, "  mpc_result_t rx, ry;\n\n");
+  fprintf(f, "  x = mpc_nparse(filename, s, n, p, &rx);\n");
+  fprintf(f, "  y = %s_nparse(filename, s, n, &ry);\n\n", name);
+  mpc_gen_lines(f, mpc_gen_compare_lines);
+
+  fprintf(f, "int main(int argc, char **argv) {\n\n");
+  fprintf(f, "  int j, total = 0, failed = 0;\n");
+  fprintf(f, "  size_t n, a, b;\n");
+  fprintf(f, "  char *s;\n");
+  fprintf(f, "  const char *filename;\n");
+  fprintf(f, "  FILE *file;\n");
+  fprintf(f, "  mpc_err_t *e;\n");
+  for (j = 0; j < n; j++) {
+    fprintf(f, "  mpc_parser_t *p%i = mpc_new(", j);
+    mpc_gen_string(f, ps[j]->name);
+    fprintf(f, ");\n");
   }
-  for (i = 0; i < (n-1); i++) {
-    p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete;
+  fprintf(f, "\n  e = mpca_lang(%i, mpcg_grammar", flags);
+  for (j = 0; j < n; j++) { fprintf(f, ", p%i", j); }
+  fprintf(f, ", NULL);\n");
+  fprintf(f, "  if (e) {\n");
+  fprintf(f, "    mpc_err_print_to(e, stderr);\n");
+  fprintf(f, "    mpc_err_delete(e);\n");
+  fprintf(f, "    return 2;\n");
+  fprintf(f, "  }\n\n");
+  mpc_gen_lines(f, mpc_gen_main_lines);
+  fprintf(f, "  mpc_cleanup(%i", n);
+  for (j = 0; j < n; j++) { fprintf(f, ", p%i", j); }
+  fprintf(f, ");\n");
+  fprintf(f, "  return failed ? 1 : 0;\n");
+  fprintf(f, "}\n\n");
+  fprintf(f, "#endif\n");
+}
+
+static mpc_err_t *mpc_gen_run(FILE *f, const char *name, mpc_parser_t *p, int flags, const char *language, int n, mpc_parser_t **ps) {
+
+  int k;
+  char buffer[512];
+  mpc_gen_t g;
+
+  g.f = f;
+  g.num = 0;
+  g.slots = 0;
+  g.ps = NULL;
+  g.bad = NULL;
+  g.use = 0;
+
+  mpc_gen_collect(&g, p);
+
+  if (g.bad) {
+    if (g.bad->name) {
+      sprintf(buffer, "Cannot generate code for parser '%.256s' as it uses a function or value mpc does not export!", g.bad->name);
+    } else {
+      sprintf(buffer, "Cannot generate code for a parser as it uses a function or value mpc does not export!");
+    }
+    free(g.ps);
+    return mpc_err_file("<mpc_codegen>", buffer);
   }
-  va_end(va);
 
-  return p;
+  fprintf(f, "/*\n** Generated by mpc from parser '%s'. Do not edit.\n**\n", p->name && !strstr(p->name, "*/") ? p->name : "");
+  fprintf(f, "** int %s_parse(const char *filename, const char *string, mpc_result_t *r);\n", name);
+  fprintf(f, "** int %s_nparse(const char *filename, const char *string, size_t length, mpc_result_t *r);\n*/\n\n", name);
+  fprintf(f, "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n\n#include \"mpc.h\"\n\n");
+  fprintf(f, "#define MPCG_MAX_DEPTH %i\n\n", MPC_MAX_RECURSION_DEPTH);
+
+  mpc_gen_lines(f, mpc_gen_core_lines);
+  if (g.use & MPC_GEN_NEXT)     { mpc_gen_lines(f, mpc_gen_next_lines); }
+  if (g.use & MPC_GEN_NONE)     { mpc_gen_lines(f, mpc_gen_none_lines); }
+  if (g.use & MPC_GEN_EXPECT)   { mpc_gen_lines(f, mpc_gen_expect_lines); }
+  if (g.use & MPC_GEN_REPEAT)   { mpc_gen_lines(f, mpc_gen_repeat_lines); }
+  if (g.use & MPC_GEN_STRING)   { mpc_gen_lines(f, mpc_gen_string_lines); }
+  if (g.use & MPC_GEN_STATE)    { mpc_gen_lines(f, mpc_gen_state_lines); }
+  if (g.use & MPC_GEN_PUSH)     { mpc_gen_lines(f, mpc_gen_push_lines); }
+  if (g.use & MPC_GEN_BOUNDARY) { mpc_gen_lines(f, mpc_gen_boundary_lines); }
+  if (g.use & MPC_GEN_NEWLINE)  { mpc_gen_lines(f, mpc_gen_newline_lines); }
+  if (g.use & MPC_GEN_SPAN)     { mpc_gen_lines(f, mpc_gen_span_lines); }
+
+  for (k = 0; k < g.num; k++) {
+    fprintf(f, "static int mpcg_%i(mpcg_input_t *i, mpc_val_t **o, int d);\n", k);
+  }
+  fprintf(f, "\n");
+
+  for (k = 0; k < g.num; k++) { mpc_gen_node(&g, k); }
+
+  fprintf(f, "int %s_nparse(const char *filename, const char *string, size_t length, mpc_result_t *r) {\n", name);
+  fprintf(f, "  int x;\n");
+  fprintf(f, "  mpcg_input_t i;\n");
+  fprintf(f, "  mpcg_init(&i, filename, string, length);\n");
+  fprintf(f, "  x = mpcg_0(&i, &r->output, 0);\n");
+  fprintf(f, "  if (!x) {\n");
+  fprintf(f, "    mpcg_merge(&i);\n");
+  fprintf(f, "    r->error = mpcg_error(&i);\n");
+  fprintf(f, "  }\n");
+  fprintf(f, "  mpcg_done(&i);\n");
+  fprintf(f, "  return x;\n");
+  fprintf(f, "}\n\n");
+
+  fprintf(f, "int %s_parse(const char *filename, const char *string, mpc_result_t *r) {\n", name);
+  fprintf(f, "  return %s_nparse(filename, string, strlen(string), r);\n", name);
+  fprintf(f, "}\n\n");
+
+  if (language) { mpc_gen_check(f, name, flags, language, n, ps); }
+
+  free(g.ps);
+  return NULL;
 }
 
-mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_err_t *mpc_codegen(FILE *f, const char *name, mpc_parser_t *p) {
+  return mpc_gen_run(f, name, p, 0, NULL, 0, NULL);
+}
 
-/*
-** Grammar Parser
-*/
+mpc_err_t *mpca_codegen(FILE *f, const char *name, int flags, const char *language, int n, mpc_parser_t **ps) {
 
-/*
-** This is another interesting bootstrapping.
-**
-** Having a general purpose AST type allows
-** users to specify the grammar alone and
-** let all fold rules be automatically taken
-** care of by existing functions.
-**
-** You don't get to control the type spat
-** out but this means you can make a nice
-** parser to take in some grammar in nice
-** syntax and spit out a parser that works.
-**
-** The grammar for this looks surprisingly
-** like regex but the main difference is that
-** it is now whitespace insensitive and the
-** base type takes literals of some form.
-*/
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
 
-/*
-**
-**  ### Grammar Grammar
-**
-**      <grammar> : (<term> "|" <grammar>) | <term>
-**
-**      <term> : <factor>*
-**
-**      <factor> : <base>
-**               | <base> "*"
-**               | <base> "+"
-**               | <base> "?"
-**               | <base> "{" <digits> "}"
-**
-**      <base> : "<" (<digits> | <ident>) ">"
-**             | <string_lit>
-**             | <char_lit>
-**             | <regex_lit> <regex_mode>
-**             | "(" <grammar> ")"
-*/
+  st.va = NULL;
+  st.parsers_num = n + 1;
+  st.parsers = malloc(sizeof(mpc_parser_t*) * (n + 1));
+  memcpy(st.parsers, ps, sizeof(mpc_parser_t*) * n);
+  st.parsers[n] = NULL;
+  st.flags = flags;
 
-typedef struct {
-  va_list *va;
-  int parsers_num;
-  mpc_parser_t **parsers;
-  int flags;
-} mpca_grammar_st_t;
+  i = mpc_input_new_string("<mpca_codegen>", language);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+  free(st.parsers);
 
-static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  else { return mpca_or(2, xs[0], xs[1]); }
+  if (err) { return err; }
+  return mpc_gen_run(f, name, ps[0], flags, language, n, ps);
 }
 
-static mpc_val_t *mpcaf_grammar_and(int n, mpc_val_t **xs) {
-  int i;
-  mpc_parser_t *p = mpc_pass();
-  for (i = 0; i < n; i++) {
-    if (xs[i] != NULL) { p = mpca_and(2, p, xs[i]); }
+/*
+** Saving Parsers
+**
+** A set of parsers can be saved to a file and
+** loaded back without building them again. Each
+** parser in the graph is given a number, with
+** the ones being saved first, and parsers only
+** refer to each other by these numbers. Strings
+** are stored once in a table at the start and
+** functions are stored by their name, so the
+** same rules apply as for code generation. All
+** numbers are written seven bits to a byte and
+** the file ends with a hash of its contents.
+**
+** The header holds a key given by the caller,
+** such as a hash of the grammar the parsers
+** were built from. It is compared first, so a
+** file saved under another key is turned down
+** before any of the rest is looked at.
+**
+** Every other parser has exactly one parent
+** with a smaller number, which is how they are
+** numbered when saved. Loading checks this, as
+** well as everything else in the file, before
+** building anything, so that a bad file cannot
+** leave behind a graph which is unsafe to free.
+*/
+
+enum {
+  MPC_SAVE_VERSION = 2
+};
+
+typedef struct {
+  char *data;
+  size_t length;
+  size_t slots;
+  int strings_num;
+  int strings_slots;
+  const char **strings;
+} mpc_save_t;
+
+static void mpc_save_bytes(mpc_save_t *s, const void *x, size_t n) {
+  if (n == 0) { return; }
+  if (s->length + n > s->slots) {
+    s->slots = s->length + n + s->slots / 2 + 256;
+    s->data = realloc(s->data, s->slots);
   }
-  return p;
+  memcpy(s->data + s->length, x, n);
+  s->length += n;
 }
 
-static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) {
-  int num;
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  switch(((char*)xs[1])[0])
-  {
-    case '*': { free(xs[1]); return mpca_many(xs[0]); }; break;
-    case '+': { free(xs[1]); return mpca_many1(xs[0]); }; break;
-    case '?': { free(xs[1]); return mpca_maybe(xs[0]); }; break;
-    case '!': { free(xs[1]); return mpca_not(xs[0]); }; break;
-    default:
-      num = *((int*)xs[1]);
-      free(xs[1]);
+static unsigned long mpc_save_hash(const char *data, size_t length) {
+  size_t j;
+  unsigned long h = 2166136261UL;
+  for (j = 0; j < length; j++) {
+    h = ((h ^ (unsigned char)data[j]) * 16777619UL) & 0xFFFFFFFFUL;
   }
-  return mpca_count(num, xs[0]);
+  return h;
 }
 
-static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
-  mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
-  free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+static void mpc_save_uint(mpc_save_t *s, unsigned long x) {
+  unsigned char b;
+  do {
+    b = (unsigned char)(x & 0x7F);
+    x >>= 7;
+    if (x) { b |= 0x80; }
+    mpc_save_bytes(s, &b, 1);
+  } while (x);
 }
 
-static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
-  mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
-  free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+static int mpc_save_string_id(mpc_save_t *s, const char *x) {
+  int j;
+  for (j = 0; j < s->strings_num; j++) {
+    if (strcmp(s->strings[j], x) == 0) { return j; }
+  }
+  if (s->strings_num == s->strings_slots) {
+    s->strings_slots = s->strings_slots ? s->strings_slots * 2 : 64;
+    s->strings = realloc(s->strings, sizeof(char*) * s->strings_slots);
+  }
+  s->strings[s->strings_num] = x;
+  return s->strings_num++;
 }
 
-static mpc_val_t *mpcaf_fold_regex(int n, mpc_val_t **xs) {
-  char *y = xs[0];
-  char *m = xs[1];
-  mpca_grammar_st_t *st = xs[2];
-  mpc_parser_t *p;
-  int mode = MPC_RE_DEFAULT;
+/* Optional strings and functions are stored with one added so that zero is `NULL` */
 
-  (void)n;
-  if (strchr(m, 'm')) { mode |= MPC_RE_MULTILINE; }
-  if (strchr(m, 's')) { mode |= MPC_RE_DOTALL; }
-  y = mpcf_unescape_regex(y);
-  p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re_mode(y, mode) : mpc_tok(mpc_re_mode(y, mode));
-  free(y);
-  free(m);
+static void mpc_save_string(mpc_save_t *s, const char *x) {
+  mpc_save_uint(s, (unsigned long)mpc_save_string_id(s, x));
+}
 
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
+static void mpc_save_optional(mpc_save_t *s, const char *x) {
+  mpc_save_uint(s, x ? (unsigned long)mpc_save_string_id(s, x) + 1 : 0);
 }
 
-/* Should this just use `isdigit` instead? */
-static int is_number(const char* s) {
-  size_t i;
-  for (i = 0; i < strlen(s); i++) { if (!strchr("0123456789", s[i])) { return 0; } }
-  return 1;
+static void mpc_save_fn(mpc_save_t *s, mpc_gen_fn_t f) {
+  int j;
+  for (j = 0; mpc_gen_names[j].f; j++) {
+    if (mpc_gen_names[j].f == f) { break; }
+  }
+  mpc_save_optional(s, mpc_gen_names[j].name);
 }
 
-static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
+static void mpc_save_node(mpc_save_t *s, mpc_gen_t *g, mpc_parser_t *p) {
 
-  int i;
-  mpc_parser_t *p;
+  int j;
 
-  /* Case of Number */
-  if (is_number(x)) {
+  mpc_save_uint(s, (unsigned long)p->type);
 
-    i = strtol(x, NULL, 10);
+  switch (p->type) {
 
-    while (st->parsers_num <= i) {
-      st->parsers_num++;
-      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-      st->parsers[st->parsers_num-1] = va_arg(*st->va, mpc_parser_t*);
-      if (st->parsers[st->parsers_num-1] == NULL) {
-        return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
+    case MPC_TYPE_FAIL: mpc_save_string(s, p->data.fail.m); break;
+    case MPC_TYPE_LIFT: mpc_save_fn(s, (mpc_gen_fn_t)p->data.lift.lf); break;
+    case MPC_TYPE_ANCHOR: mpc_save_fn(s, (mpc_gen_fn_t)p->data.anchor.f); break;
+    case MPC_TYPE_SATISFY: mpc_save_fn(s, (mpc_gen_fn_t)p->data.satisfy.f); break;
+
+    case MPC_TYPE_SINGLE:
+      mpc_save_uint(s, (unsigned char)p->data.single.x);
+      break;
+    case MPC_TYPE_RANGE:
+      mpc_save_uint(s, (unsigned char)p->data.range.x);
+      mpc_save_uint(s, (unsigned char)p->data.range.y);
+      break;
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      mpc_save_string(s, p->data.string.x);
+      break;
+
+    case MPC_TYPE_EXPECT:
+      mpc_save_uint(s, (unsigned long)mpc_gen_find(g, p->data.expect.x));
+      mpc_save_string(s, p->data.expect.m);
+      break;
+    case MPC_TYPE_APPLY:
+      mpc_save_uint(s, (unsigned long)mpc_gen_find(g, p->data.apply.x));
+      mpc_save_fn(s, (mpc_gen_fn_t)p->data.apply.f);
+      break;
+    case MPC_TYPE_APPLY_TO:
+      mpc_save_uint(s, (unsigned long)mpc_gen_find(g, p->data.apply_to.x));
+      mpc_save_fn(s, (mpc_gen_fn_t)p->data.apply_to.f);
+      mpc_save_optional(s, mpc_gen_tag(p->data.apply_to.f) ? ((mpc_tag_t*)p->data.apply_to.d)->name : NULL);
+      break;
+    case MPC_TYPE_CHECK:
+    case MPC_TYPE_CHECK_WITH:
+      mpc_save_uint(s, (unsigned long)mpc_gen_find(g, p->data.check.x));
+      mpc_save_fn(s, (mpc_gen_fn_t)p->data.check.dx);
+      if (p->type == MPC_TYPE_CHECK) {
+        mpc_save_fn(s, (mpc_gen_fn_t)p->data.check.f);
+        mpc_save_string(s, p->data.check.e);
+      } else {
+        mpc_save_fn(s, (mpc_gen_fn_t)p->data.check_with.f);
+        mpc_save_string(s, p->data.check_with.e);
       }
-    }
+      break;
+    case MPC_TYPE_PREDICT:
+      mpc_save_uint(s, (unsigned long)mpc_gen_find(g, p->data.predict.x));
+      break;
+    case MPC_TYPE_CLASS:
+      mpc_save_bytes(s, p->data.set.x, MPC_SET_BYTES);
+      break;
+    case MPC_TYPE_SPAN:
+      mpc_save_uint(s, (unsigned long)p->data.set.n);
+      mpc_save_optional(s, p->data.set.m);
+      mpc_save_bytes(s, p->data.set.x, MPC_SET_BYTES);
+      break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      mpc_save_uint(s, (unsigned long)mpc_gen_find(g, p->data.not.x));
+      mpc_save_fn(s, (mpc_gen_fn_t)p->data.not.dx);
+      mpc_save_fn(s, (mpc_gen_fn_t)p->data.not.lf);
+      break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_save_uint(s, (unsigned long)mpc_gen_find(g, p->data.repeat.x));
+      mpc_save_uint(s, (unsigned long)p->data.repeat.n);
+      mpc_save_fn(s, (mpc_gen_fn_t)p->data.repeat.f);
+      mpc_save_fn(s, (mpc_gen_fn_t)p->data.repeat.dx);
+      break;
 
-    return st->parsers[st->parsers_num-1];
+    case MPC_TYPE_OR:
+      mpc_save_uint(s, (unsigned long)p->data.or.n);
+      for (j = 0; j < p->data.or.n; j++) {
+        mpc_save_uint(s, (unsigned long)mpc_gen_find(g, p->data.or.xs[j]));
+      }
+      break;
+    case MPC_TYPE_AND:
+      mpc_save_uint(s, (unsigned long)p->data.and.n);
+      mpc_save_fn(s, (mpc_gen_fn_t)p->data.and.f);
+      for (j = 0; j < p->data.and.n; j++) {
+        mpc_save_uint(s, (unsigned long)mpc_gen_find(g, p->data.and.xs[j]));
+      }
+      for (j = 0; j < p->data.and.n-1; j++) {
+        mpc_save_fn(s, (mpc_gen_fn_t)p->data.and.dxs[j]);
+      }
+      break;
 
-  /* Case of Identifier */
-  } else {
+    default: break;
+  }
+}
 
-    /* Search Existing Parsers */
-    for (i = 0; i < st->parsers_num; i++) {
-      mpc_parser_t *q = st->parsers[i];
-      if (q == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-      if (q->name && strcmp(q->name, x) == 0) { return q; }
-    }
+/* Adds the hash to the end of `s` and writes it out, freeing the data */
 
-    /* Search New Parsers */
-    while (1) {
+static mpc_err_t *mpc_save_write(const char *filename, mpc_save_t *s) {
 
-      p = va_arg(*st->va, mpc_parser_t*);
+  int j;
+  unsigned long hash;
+  unsigned char b;
+  FILE *f;
+
+  hash = mpc_save_hash(s->data, s->length);
+  for (j = 0; j < 4; j++) {
+    b = (unsigned char)((hash >> (8 * j)) & 0xFF);
+    mpc_save_bytes(s, &b, 1);
+  }
 
-      st->parsers_num++;
-      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-      st->parsers[st->parsers_num-1] = p;
+  f = fopen(filename, "wb");
+  if (f == NULL || fwrite(s->data, 1, s->length, f) != s->length) {
+    if (f) { fclose(f); }
+    free(s->data);
+    return mpc_err_file(filename, "Unable to write file!");
+  }
 
-      if (p == NULL || p->name == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-      if (p->name && strcmp(p->name, x) == 0) { return p; }
+  free(s->data);
+  return fclose(f) == 0 ? NULL : mpc_err_file(filename, "Unable to write file!");
+}
 
+static mpc_err_t *mpc_save_run(const char *filename, const char *key, int n, mpc_parser_t **ps) {
+
+  int j, k;
+  char buffer[512];
+  mpc_gen_t g;
+  mpc_save_t s, body;
+
+  g.f = NULL;
+  g.num = 0;
+  g.slots = 0;
+  g.ps = NULL;
+  g.bad = NULL;
+  g.use = 0;
+
+  for (j = 0; j < n; j++) { mpc_gen_add(&g, ps[j]); }
+  if (g.num < n) {
+    free(g.ps);
+    return mpc_err_file(filename, "The same parser was given more than once!");
+  }
+  if (n > 0) { mpc_gen_collect(&g, ps[0]); }
+
+  for (k = n; k < g.num && g.bad == NULL; k++) {
+    if (g.ps[k]->retained) { g.bad = g.ps[k]; }
+  }
+
+  if (g.bad) {
+    if (g.bad->retained) {
+      sprintf(buffer, "Parser '%.256s' must be saved along with the parsers which use it!", g.bad->name);
+    } else if (g.bad->name) {
+      sprintf(buffer, "Cannot save parser '%.256s' as it uses a function or value mpc does not export!", g.bad->name);
+    } else {
+      sprintf(buffer, "Cannot save a parser as it uses a function or value mpc does not export!");
     }
+    free(g.ps);
+    return mpc_err_file(filename, buffer);
+  }
+
+  memset(&s, 0, sizeof(mpc_save_t));
+  memset(&body, 0, sizeof(mpc_save_t));
+
+  /* Nodes are written first so the string table is complete */
+
+  mpc_save_uint(&body, (unsigned long)g.num);
+  mpc_save_uint(&body, (unsigned long)n);
+  for (k = 0; k < g.num; k++) { mpc_save_optional(&body, g.ps[k]->name); }
+  for (k = 0; k < g.num; k++) { mpc_save_node(&body, &g, g.ps[k]); }
 
+  mpc_save_bytes(&s, "MPCB", 4);
+  mpc_save_uint(&s, MPC_SAVE_VERSION);
+  mpc_save_uint(&s, (unsigned long)strlen(key));
+  mpc_save_bytes(&s, key, strlen(key));
+  mpc_save_uint(&s, (unsigned long)body.strings_num);
+  for (j = 0; j < body.strings_num; j++) {
+    mpc_save_uint(&s, (unsigned long)strlen(body.strings[j]));
+    mpc_save_bytes(&s, body.strings[j], strlen(body.strings[j]));
   }
+  mpc_save_bytes(&s, body.data, body.length);
 
+  free(g.ps);
+  free(body.data);
+  free(body.strings);
+
+  return mpc_save_write(filename, &s);
 }
 
-static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
+mpc_err_t *mpc_save(const char *filename, int n, ...) {
 
-  mpca_grammar_st_t *st = s;
-  mpc_parser_t *p = mpca_grammar_find_parser(x, st);
-  free(x);
+  int j;
+  mpc_err_t *err;
+  mpc_parser_t **ps = malloc(sizeof(mpc_parser_t*) * (n > 0 ? n : 1));
+  va_list va;
 
-  if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
-  } else {
-    return mpca_state(mpca_root(p));
-  }
+  va_start(va, n);
+  for (j = 0; j < n; j++) { ps[j] = va_arg(va, mpc_parser_t*); }
+  va_end(va);
+
+  err = mpc_save_run(filename, "", n, ps);
+  free(ps);
+  return err;
 }
 
-mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
+mpc_err_t *mpc_save_key(const char *filename, const char *key, int n, ...) {
 
-  char *err_msg;
-  mpc_parser_t *err_out;
-  mpc_result_t r;
-  mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
+  int j;
+  mpc_err_t *err;
+  mpc_parser_t **ps = malloc(sizeof(mpc_parser_t*) * (n > 0 ? n : 1));
+  va_list va;
 
-  GrammarTotal = mpc_new("grammar_total");
-  Grammar = mpc_new("grammar");
-  Term = mpc_new("term");
-  Factor = mpc_new("factor");
-  Base = mpc_new("base");
+  va_start(va, n);
+  for (j = 0; j < n; j++) { ps[j] = va_arg(va, mpc_parser_t*); }
+  va_end(va);
 
-  mpc_define(GrammarTotal,
-    mpc_predictive(mpc_total(Grammar, mpc_soft_delete))
-  );
+  err = mpc_save_run(filename, key ? key : "", n, ps);
+  free(ps);
+  return err;
+}
 
-  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-    Term,
-    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-    mpc_soft_delete
-  ));
+typedef struct {
+  const unsigned char *data;
+  size_t length;
+  size_t pos;
+  int bad;
+  int build;
+  int strings_num;
+  size_t *strings;
+  int nodes_num;
+  int roots_num;
+  int node;
+  int *refs;
+  mpc_parser_t **ps;
+} mpc_load_t;
+
+static unsigned long mpc_load_uint(mpc_load_t *l) {
+
+  int shift = 0;
+  unsigned long x = 0;
+  unsigned char b;
 
-  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+  do {
+    if (l->pos >= l->length || shift > 28) { l->bad = 1; return 0; }
+    b = l->data[l->pos++];
+    x |= (unsigned long)(b & 0x7F) << shift;
+    shift += 7;
+  } while (b & 0x80);
 
-  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-    Base,
-      mpc_or(6,
-        mpc_sym("*"),
-        mpc_sym("+"),
-        mpc_sym("?"),
-        mpc_sym("!"),
-        mpc_tok_brackets(mpc_int(), free),
-        mpc_pass()),
-    mpc_soft_delete
-  ));
+  return x;
+}
 
-  mpc_define(Base, mpc_or(5,
-    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
-    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-    mpc_tok_parens(Grammar, mpc_soft_delete)
-  ));
+static int mpc_load_count(mpc_load_t *l) {
+  unsigned long x = mpc_load_uint(l);
+  /* Every item counted takes at least one byte */
+  if (x > l->length - l->pos) { l->bad = 1; return 0; }
+  return (int)x;
+}
 
-  mpc_optimise(GrammarTotal);
-  mpc_optimise(Grammar);
-  mpc_optimise(Factor);
-  mpc_optimise(Term);
-  mpc_optimise(Base);
+static size_t mpc_load_string_length(mpc_load_t *l, int j) {
+  size_t k = l->strings[j];
+  while (l->data[k] & 0x80) { k++; }
+  return l->strings[j+1] - k - 1;
+}
 
-  if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
-    err_msg = mpc_err_string(r.error);
-    err_out = mpc_failf("Invalid Grammar: %s", err_msg);
-    mpc_err_delete(r.error);
-    free(err_msg);
-    r.output = err_out;
-  }
+static const char *mpc_load_string_at(mpc_load_t *l, int j) {
+  return (const char*)l->data + l->strings[j+1] - mpc_load_string_length(l, j);
+}
+
+static int mpc_load_string_eq(mpc_load_t *l, int j, const char *x) {
+  size_t n = mpc_load_string_length(l, j);
+  return strlen(x) == n && memcmp(mpc_load_string_at(l, j), x, n) == 0;
+}
+
+static int mpc_load_string_id(mpc_load_t *l, int optional) {
+  unsigned long x = mpc_load_uint(l);
+  if (optional && x == 0) { return -1; }
+  if (optional) { x--; }
+  if (x >= (unsigned long)l->strings_num) { l->bad = 1; return -1; }
+  return (int)x;
+}
 
-  mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+static char *mpc_load_copy(mpc_load_t *l, int j) {
+  size_t n;
+  char *x;
+  if (j < 0 || !l->build) { return NULL; }
+  n = mpc_load_string_length(l, j);
+  x = malloc(n + 1);
+  memcpy(x, mpc_load_string_at(l, j), n);
+  x[n] = '\0';
+  return x;
+}
 
-  mpc_optimise(r.output);
+/* Strings must not hold a null character as parsers use them as C strings */
 
-  return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+static char *mpc_load_string(mpc_load_t *l) {
+  int j = mpc_load_string_id(l, 0);
+  if (j >= 0 && memchr(mpc_load_string_at(l, j), '\0', mpc_load_string_length(l, j))) { l->bad = 1; }
+  return mpc_load_copy(l, j);
+}
 
+/* A function is only taken for a field of the same type, so it is never called with the wrong arguments */
+
+static mpc_gen_fn_t mpc_load_fn(mpc_load_t *l, int type) {
+  int j, k = mpc_load_string_id(l, 1);
+  if (k < 0) { return NULL; }
+  for (j = 0; mpc_gen_names[j].f; j++) {
+    if (mpc_gen_names[j].type == type && mpc_load_string_eq(l, k, mpc_gen_names[j].name)) { return mpc_gen_names[j].f; }
+  }
+  l->bad = 1;
+  return NULL;
 }
 
-mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
-  mpca_grammar_st_t st;
-  mpc_parser_t *res;
-  va_list va;
-  va_start(va, grammar);
+static mpc_parser_t *mpc_load_child(mpc_load_t *l) {
+  unsigned long x = mpc_load_uint(l);
+  if (x >= (unsigned long)l->nodes_num) { l->bad = 1; return NULL; }
+  if (!l->build && (int)x >= l->roots_num) {
+    if ((int)x <= l->node) { l->bad = 1; }
+    l->refs[x]++;
+  }
+  return l->build ? l->ps[x] : NULL;
+}
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+static unsigned char *mpc_load_set(mpc_load_t *l) {
+  unsigned char *x = NULL;
+  if (l->length - l->pos < MPC_SET_BYTES) { l->bad = 1; return NULL; }
+  if (l->build) {
+    x = malloc(MPC_SET_BYTES);
+    memcpy(x, l->data + l->pos, MPC_SET_BYTES);
+    x[0] &= 0xFE;
+  }
+  l->pos += MPC_SET_BYTES;
+  return x;
+}
 
-  res = mpca_grammar_st(grammar, &st);
-  free(st.parsers);
-  va_end(va);
-  return res;
+static char mpc_load_char(mpc_load_t *l) {
+  unsigned long x = mpc_load_uint(l);
+  if (x == 0 || x > 255) { l->bad = 1; }
+  return (char)x;
 }
 
-typedef struct {
-  char *ident;
-  char *name;
-  mpc_parser_t *grammar;
-} mpca_stmt_t;
+static void mpc_load_node(mpc_load_t *l, mpc_parser_t *p) {
 
-static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
-  mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
-  stmt->ident = ((char**)xs)[0];
-  stmt->name = ((char**)xs)[1];
-  stmt->grammar = ((mpc_parser_t**)xs)[3];
-  (void) n;
-  free(((char**)xs)[2]);
-  free(((char**)xs)[4]);
+  int j, k;
+  mpc_tag_t *t;
 
-  return stmt;
-}
+  p->type = (char)mpc_load_uint(l);
 
-static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
+  switch (p->type) {
 
-  int i;
-  mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_BLANK:
+      break;
 
-  for (i = 0; i < n; i++) {
-    stmts[i] = xs[i];
-  }
-  stmts[n] = NULL;
+    case MPC_TYPE_FAIL: p->data.fail.m = mpc_load_string(l); break;
+    case MPC_TYPE_LIFT: p->data.lift.lf = (mpc_ctor_t)mpc_load_fn(l, MPC_GEN_FN_CTOR); break;
+    case MPC_TYPE_ANCHOR: p->data.anchor.f = (int(*)(char,char))mpc_load_fn(l, MPC_GEN_FN_ANCHOR); break;
+    case MPC_TYPE_SATISFY: p->data.satisfy.f = (int(*)(char))mpc_load_fn(l, MPC_GEN_FN_SATISFY); break;
 
-  return stmts;
-}
+    case MPC_TYPE_SINGLE:
+      p->data.single.x = mpc_load_char(l);
+      break;
+    case MPC_TYPE_RANGE:
+      p->data.range.x = mpc_load_char(l);
+      p->data.range.y = mpc_load_char(l);
+      break;
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      p->data.string.x = mpc_load_string(l);
+      break;
 
-static void mpca_stmt_list_delete(mpc_val_t *x) {
+    case MPC_TYPE_EXPECT:
+      p->data.expect.x = mpc_load_child(l);
+      p->data.expect.m = mpc_load_string(l);
+      break;
+    case MPC_TYPE_APPLY:
+      p->data.apply.x = mpc_load_child(l);
+      p->data.apply.f = (mpc_apply_t)mpc_load_fn(l, MPC_GEN_FN_APPLY);
+      break;
+    case MPC_TYPE_APPLY_TO:
+      p->data.apply_to.x = mpc_load_child(l);
+      p->data.apply_to.f = (mpc_apply_to_t)mpc_load_fn(l, MPC_GEN_FN_APPLY_TO);
+      k = mpc_load_string_id(l, 1);
+      p->data.apply_to.d = NULL;
+      if (l->bad) { break; }
+      if (mpc_gen_tag(p->data.apply_to.f) != (k >= 0)) { l->bad = 1; break; }
+      if (k >= 0 && l->build) {
+        t = mpc_tag_intern(mpc_load_string_at(l, k), mpc_load_string_length(l, k));
+        p->data.apply_to.d = t;
+      }
+      break;
+    case MPC_TYPE_CHECK:
+    case MPC_TYPE_CHECK_WITH:
+      p->data.check.x = mpc_load_child(l);
+      p->data.check.dx = (mpc_dtor_t)mpc_load_fn(l, MPC_GEN_FN_DTOR);
+      if (p->type == MPC_TYPE_CHECK) {
+        p->data.check.f = (mpc_check_t)mpc_load_fn(l, MPC_GEN_FN_CHECK);
+        p->data.check.e = mpc_load_string(l);
+      } else {
+        p->data.check_with.f = (mpc_check_with_t)mpc_load_fn(l, MPC_GEN_FN_CHECK_WITH);
+        p->data.check_with.d = NULL;
+        p->data.check_with.e = mpc_load_string(l);
+      }
+      break;
+    case MPC_TYPE_PREDICT:
+      p->data.predict.x = mpc_load_child(l);
+      break;
+    case MPC_TYPE_CLASS:
+    case MPC_TYPE_SPAN:
+      p->data.set.n = 0;
+      p->data.set.m = NULL;
+      if (p->type == MPC_TYPE_SPAN) {
+        p->data.set.n = mpc_load_uint(l) > 0;
+        k = mpc_load_string_id(l, 1);
+        if (k >= 0 && memchr(mpc_load_string_at(l, k), '\0', mpc_load_string_length(l, k))) { l->bad = 1; }
+        p->data.set.m = mpc_load_copy(l, k);
+      }
+      p->data.set.x = mpc_load_set(l);
+      break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      p->data.not.x = mpc_load_child(l);
+      p->data.not.dx = (mpc_dtor_t)mpc_load_fn(l, MPC_GEN_FN_DTOR);
+      p->data.not.lf = (mpc_ctor_t)mpc_load_fn(l, MPC_GEN_FN_CTOR);
+      break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      p->data.repeat.x = mpc_load_child(l);
+      p->data.repeat.n = mpc_load_count(l);
+      p->data.repeat.f = (mpc_fold_t)mpc_load_fn(l, MPC_GEN_FN_FOLD);
+      p->data.repeat.dx = (mpc_dtor_t)mpc_load_fn(l, MPC_GEN_FN_DTOR);
+      break;
 
-  mpca_stmt_t **stmts = x;
+    case MPC_TYPE_OR:
+      p->data.or.n = mpc_load_count(l);
+      p->data.or.xs = l->build ? malloc(sizeof(mpc_parser_t*) * (p->data.or.n + 1)) : NULL;
+      for (j = 0; j < p->data.or.n && !l->bad; j++) {
+        if (l->build) { p->data.or.xs[j] = mpc_load_child(l); }
+        else { mpc_load_child(l); }
+      }
+      break;
+    case MPC_TYPE_AND:
+      p->data.and.n = mpc_load_count(l);
+      p->data.and.f = (mpc_fold_t)mpc_load_fn(l, MPC_GEN_FN_FOLD);
+      p->data.and.xs = l->build ? malloc(sizeof(mpc_parser_t*) * (p->data.and.n + 1)) : NULL;
+      p->data.and.dxs = l->build ? malloc(sizeof(mpc_dtor_t) * (p->data.and.n + 1)) : NULL;
+      for (j = 0; j < p->data.and.n && !l->bad; j++) {
+        if (l->build) { p->data.and.xs[j] = mpc_load_child(l); }
+        else { mpc_load_child(l); }
+      }
+      for (j = 0; j < p->data.and.n-1 && !l->bad; j++) {
+        if (l->build) { p->data.and.dxs[j] = (mpc_dtor_t)mpc_load_fn(l, MPC_GEN_FN_DTOR); }
+        else { mpc_load_fn(l, MPC_GEN_FN_DTOR); }
+      }
+      break;
 
-  while(*stmts) {
-    mpca_stmt_t *stmt = *stmts;
-    free(stmt->ident);
-    free(stmt->name);
-    mpc_soft_delete(stmt->grammar);
-    free(stmt);
-    stmts++;
+    default:
+      l->bad = 1;
+      break;
   }
-  free(x);
-
 }
 
-static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
+/*
+** Loading reads the file twice, first only to
+** check it and then to build the parsers. The
+** parsers given are only defined at the end.
+*/
 
-  mpca_grammar_st_t *st = s;
-  mpca_stmt_t *stmt;
-  mpca_stmt_t **stmts = x;
-  mpc_parser_t *left;
+static mpc_err_t *mpc_load_data(const char *filename, const char *key, const char *data, size_t length, int n, mpc_parser_t **ps) {
 
-  while(*stmts) {
-    stmt = *stmts;
-    left = mpca_grammar_find_parser(stmt->ident, st);
-    if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
-    if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
-    mpc_optimise(stmt->grammar);
-    mpc_define(left, stmt->grammar);
-    free(stmt->ident);
-    free(stmt->name);
-    free(stmt);
-    stmts++;
-  }
+  int j, k, name;
+  size_t start, keylen;
+  unsigned long hash;
+  mpc_load_t l;
+  mpc_parser_t *roots;
+  mpc_err_t *err = NULL;
 
-  free(x);
+  memset(&l, 0, sizeof(mpc_load_t));
+  l.data = (const unsigned char*)data;
 
-  return NULL;
-}
+  if (length < 8 || memcmp(data, "MPCB", 4) != 0) {
+    return mpc_err_file(filename, "Not a file of saved parsers!");
+  }
 
-static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
+  l.length = length - 4;
+  l.pos = 4;
+  if (mpc_load_uint(&l) != MPC_SAVE_VERSION) {
+    return mpc_err_file(filename, "Parsers were saved by a different version of mpc!");
+  }
 
-  mpc_result_t r;
-  mpc_err_t *e;
-  mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base;
+  start = mpc_load_uint(&l);
+  keylen = strlen(key);
+  if (l.bad || start != keylen || keylen > l.length - l.pos
+  || memcmp(l.data + l.pos, key, keylen) != 0) {
+    return mpc_err_file(filename, "Parsers were saved under a different key!");
+  }
+  l.pos += keylen;
 
-  Lang    = mpc_new("lang");
-  Stmt    = mpc_new("stmt");
-  Grammar = mpc_new("grammar");
-  Term    = mpc_new("term");
-  Factor  = mpc_new("factor");
-  Base    = mpc_new("base");
+  hash = 0;
+  for (j = 0; j < 4; j++) {
+    hash |= (unsigned long)l.data[l.length + j] << (8 * j);
+  }
+  if (mpc_save_hash(data, l.length) != hash) {
+    return mpc_err_file(filename, "File of saved parsers is corrupt!");
+  }
 
-  mpc_define(Lang, mpc_apply_to(
-    mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
-    mpca_stmt_list_apply_to, st
-  ));
+  /* Each string is found from where the next begins, so one extra is kept */
 
-  mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
-    mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
-    free, free, free, mpc_soft_delete
-  ));
+  l.strings_num = mpc_load_count(&l);
+  l.strings = malloc(sizeof(size_t) * (l.strings_num + 1));
+  for (j = 0; j < l.strings_num && !l.bad; j++) {
+    l.strings[j] = l.pos;
+    start = mpc_load_uint(&l);
+    if (start > l.length - l.pos) { l.bad = 1; break; }
+    l.pos += start;
+  }
+  l.strings[j] = l.pos;
+
+  l.nodes_num = mpc_load_count(&l);
+  l.roots_num = mpc_load_count(&l);
+  if (l.roots_num != n || l.nodes_num < n) { l.bad = 1; }
+  if (l.bad) {
+    free(l.strings);
+    return mpc_err_file(filename, l.roots_num != n && !l.bad
+      ? "Number of parsers given does not match the file!"
+      : "File of saved parsers is corrupt!");
+  }
 
-  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-      Term,
-      mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-      mpc_soft_delete
-  ));
+  l.refs = calloc(l.nodes_num + 1, sizeof(int));
+  l.ps = calloc(l.nodes_num + 1, sizeof(mpc_parser_t*));
+  roots = calloc(n + 1, sizeof(mpc_parser_t));
 
-  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+  /* Match the saved parsers to the ones given by name */
 
-  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-    Base,
-      mpc_or(6,
-        mpc_sym("*"),
-        mpc_sym("+"),
-        mpc_sym("?"),
-        mpc_sym("!"),
-        mpc_tok_brackets(mpc_int(), free),
-        mpc_pass()),
-    mpc_soft_delete
-  ));
+  for (k = 0; k < l.nodes_num && !l.bad; k++) {
+    name = mpc_load_string_id(&l, 1);
+    if (k >= n || l.bad) { continue; }
+    for (j = 0; j < n; j++) {
+      if (name >= 0 && ps[j]->name && mpc_load_string_eq(&l, name, ps[j]->name)) { break; }
+    }
+    if (j == n && err == NULL) { err = mpc_err_file(filename, "Parsers given do not match the file!"); }
+    l.ps[k] = j < n ? ps[j] : NULL;
+  }
 
-  mpc_define(Base, mpc_or(5,
-    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
-    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-    mpc_tok_parens(Grammar, mpc_soft_delete)
-  ));
+  for (k = 0; k < n && !err && !l.bad; k++) {
+    for (j = k + 1; j < n && !err; j++) {
+      if (l.ps[k] == l.ps[j]) { err = mpc_err_file(filename, "Parsers given do not match the file!"); }
+    }
+  }
 
-  mpc_optimise(Lang);
-  mpc_optimise(Stmt);
-  mpc_optimise(Grammar);
-  mpc_optimise(Term);
-  mpc_optimise(Factor);
-  mpc_optimise(Base);
+  start = l.pos;
 
-  if (!mpc_parse_input(i, Lang, &r)) {
-    e = r.error;
-  } else {
-    e = NULL;
+  for (l.node = 0; l.node < l.nodes_num && !l.bad && !err; l.node++) {
+    mpc_load_node(&l, l.node < n ? &roots[l.node] : &roots[n]);
+  }
+  for (k = n; k < l.nodes_num && !l.bad && !err; k++) {
+    if (l.refs[k] != 1) { l.bad = 1; }
   }
+  if (l.pos != l.length) { l.bad = 1; }
 
-  mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
+  if (!l.bad && !err) {
 
-  return e;
-}
+    l.build = 1;
+    l.pos = start;
+    for (k = n; k < l.nodes_num; k++) { l.ps[k] = mpc_undefined(); }
 
-mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+    for (l.node = 0; l.node < l.nodes_num; l.node++) {
+      mpc_load_node(&l, l.node < n ? &roots[l.node] : l.ps[l.node]);
+    }
 
-  va_list va;
-  va_start(va, f);
+    /* Anything the targets were defined as before is freed first */
+    for (k = 0; k < n; k++) {
+      mpc_undefine(l.ps[k]);
+      l.ps[k]->type = roots[k].type;
+      l.ps[k]->data = roots[k].data;
+    }
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+    for (k = 0; k < l.nodes_num; k++) {
+      if (l.ps[k]->type == MPC_TYPE_OR) { mpc_or_first(l.ps[k]); }
+    }
+  }
 
-  i = mpc_input_new_file("<mpca_lang_file>", f);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+  if (l.bad && !err) { err = mpc_err_file(filename, "File of saved parsers is corrupt!"); }
 
-  free(st.parsers);
-  va_end(va);
+  free(roots);
+  free(l.refs);
+  free(l.ps);
+  free(l.strings);
   return err;
 }
 
-mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+/* Maps or reads in the whole of a file, to be let go with `mpc_load_unmap` */
 
-  va_list va;
-  va_start(va, p);
+static mpc_err_t *mpc_load_map(const char *filename, char **data, size_t *length, int *mapped) {
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+  FILE *f;
+#ifdef MPC_USE_MMAP
+  struct stat st;
+#endif
 
-  i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+  f = fopen(filename, "rb");
+  if (f == NULL) { return mpc_err_file(filename, "Unable to open file!"); }
 
-  free(st.parsers);
-  va_end(va);
-  return err;
+  *mapped = 0;
+
+#ifdef MPC_USE_MMAP
+  if (fstat(fileno(f), &st) == 0 && st.st_size > 0) {
+    *length = (size_t)st.st_size;
+    *data = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (*data != MAP_FAILED) {
+      *mapped = 1;
+      fclose(f);
+      return NULL;
+    }
+  }
+#endif
+
+  fseek(f, 0, SEEK_END);
+  *length = (size_t)ftell(f);
+  fseek(f, 0, SEEK_SET);
+  *data = malloc(*length + 1);
+  if (fread(*data, 1, *length, f) != *length) {
+    free(*data);
+    fclose(f);
+    return mpc_err_file(filename, "Unable to read file!");
+  }
+
+  fclose(f);
+  return NULL;
 }
 
-mpc_err_t *mpca_lang(int flags, const char *language, ...) {
+static void mpc_load_unmap(char *data, size_t length, int mapped) {
+#ifdef MPC_USE_MMAP
+  if (mapped) { munmap(data, length); return; }
+#endif
+  (void)length;
+  (void)mapped;
+  free(data);
+}
 
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
+static mpc_err_t *mpc_load_run(const char *filename, const char *key, int n, mpc_parser_t **ps) {
+
+  int mapped;
+  char *data;
+  size_t length;
   mpc_err_t *err;
 
-  va_list va;
-  va_start(va, language);
+  err = mpc_load_map(filename, &data, &length, &mapped);
+  if (err) { return err; }
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+  err = mpc_load_data(filename, key, data, length, n, ps);
+  mpc_load_unmap(data, length, mapped);
+  return err;
+}
 
-  i = mpc_input_new_string("<mpca_lang>", language);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+mpc_err_t *mpc_load(const char *filename, int n, ...) {
 
-  free(st.parsers);
+  int j;
+  mpc_err_t *err;
+  mpc_parser_t **ps = malloc(sizeof(mpc_parser_t*) * (n > 0 ? n : 1));
+  va_list va;
+
+  va_start(va, n);
+  for (j = 0; j < n; j++) { ps[j] = va_arg(va, mpc_parser_t*); }
   va_end(va);
+
+  err = mpc_load_run(filename, "", n, ps);
+  free(ps);
   return err;
 }
 
-mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
+mpc_err_t *mpc_load_key(const char *filename, const char *key, int n, ...) {
 
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
+  int j;
   mpc_err_t *err;
-
+  mpc_parser_t **ps = malloc(sizeof(mpc_parser_t*) * (n > 0 ? n : 1));
   va_list va;
 
-  FILE *f = fopen(filename, "rb");
-
-  if (f == NULL) {
-    err = mpc_err_file(filename, "Unable to open file!");
-    return err;
-  }
-
-  va_start(va, filename);
+  va_start(va, n);
+  for (j = 0; j < n; j++) { ps[j] = va_arg(va, mpc_parser_t*); }
+  va_end(va);
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+  err = mpc_load_run(filename, key ? key : "", n, ps);
+  free(ps);
+  return err;
+}
 
-  i = mpc_input_new_file(filename, f);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+/*
+** Saving ASTs
+**
+** An AST is saved with the tags it uses in a
+** table at the start, numbered in the order
+** they are first seen, followed by the contents
+** of its nodes in one heap of `\0` ended strings.
+** The heap starts with the empty string and any
+** contents which repeat are stored only once.
+** Nodes then follow in pre order, each giving
+** its tag number, where its contents start in
+** the heap and how long they are, its state as
+** the difference from that of its parent, the
+** number of its children and the number of bytes
+** they take up, so a reader can step over a
+** whole subtree. Numbers are written as for
+** saved parsers, with signed ones folded so that
+** small differences either way take one byte,
+** and the file again ends with a hash.
+**
+** Opening a file checks every node once, after
+** which nodes are read straight from the mapping.
+*/
 
-  free(st.parsers);
-  va_end(va);
+enum {
+  MPC_AST_SAVE_VERSION = 1
+};
 
-  fclose(f);
+struct mpc_ast_map_t {
+  char *data;
+  size_t length;
+  int mapped;
+  int *tags;
+  int nodes_num;
+  const char *heap;
+  size_t heap_length;
+  size_t root;
+  size_t end;
+};
 
-  return err;
+static unsigned long mpc_ast_save_signed(long x) {
+  return x < 0 ? ((unsigned long)(-(x + 1)) << 1) | 1 : (unsigned long)x << 1;
 }
 
-static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
+static long mpc_ast_load_signed(unsigned long x) {
+  return x & 1 ? -(long)(x >> 1) - 1 : (long)(x >> 1);
+}
 
-  int i, total;
+static void mpc_ast_save_node(mpc_save_t *s, mpc_ast_flat_t *f, int k, int tag, size_t heap, size_t children) {
 
-  if (p->retained && !force) { return 0; }
+  int p = f->parent[k];
 
-  if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
+  mpc_save_uint(s, (unsigned long)tag);
+  mpc_save_uint(s, (unsigned long)heap);
+  mpc_save_uint(s, (unsigned long)f->contents_length[k]);
+  mpc_save_uint(s, mpc_ast_save_signed(f->state[k].pos - (p < 0 ? 0 : f->state[p].pos)));
+  mpc_save_uint(s, mpc_ast_save_signed(f->state[k].row - (p < 0 ? 0 : f->state[p].row)));
+  mpc_save_uint(s, mpc_ast_save_signed(f->state[k].col - (p < 0 ? 0 : f->state[p].col)));
+  mpc_save_uint(s, mpc_ast_save_signed(f->state[k].term));
+  mpc_save_uint(s, (unsigned long)f->children_num[k]);
+  mpc_save_uint(s, (unsigned long)children);
+}
 
-  if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+mpc_err_t *mpc_ast_save(const char *filename, mpc_ast_t *a) {
 
-  if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
-  if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
+  int j, k, x, tags_num = 0, tags_all = mpc_tag_count(), *tags, *ids, *table;
+  size_t n, h, mask, *heap, *children;
+  mpc_save_t s, hs, body;
+  mpc_ast_flat_t *f = mpc_ast_flat_new(a);
 
-  if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+  memset(&s, 0, sizeof(mpc_save_t));
+  memset(&hs, 0, sizeof(mpc_save_t));
+  memset(&body, 0, sizeof(mpc_save_t));
 
-  if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  tags = malloc(sizeof(int) * (tags_all + 1));
+  ids = malloc(sizeof(int) * (f->nodes_num + 1));
+  heap = malloc(sizeof(size_t) * (f->nodes_num + 1));
+  children = calloc(f->nodes_num + 1, sizeof(size_t));
 
-  if (p->type == MPC_TYPE_OR) {
-    total = 1;
-    for(i = 0; i < p->data.or.n; i++) {
-      total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
+  for (j = 0; j < tags_all; j++) { tags[j] = -1; }
+  for (k = 0; k < f->nodes_num; k++) {
+    if (tags[f->tag_id[k]] == -1) {
+      ids[tags_num] = f->tag_id[k];
+      tags[f->tag_id[k]] = tags_num++;
     }
-    return total;
   }
 
-  if (p->type == MPC_TYPE_AND) {
-    total = 1;
-    for(i = 0; i < p->data.and.n; i++) {
-      total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
+  /* Contents are found again by hash, keeping the first node with each */
+
+  for (mask = 1; mask < (size_t)f->nodes_num * 2 + 2; mask *= 2);
+  table = calloc(mask, sizeof(int));
+  mask--;
+
+  mpc_save_bytes(&hs, "", 1);
+  for (k = 0; k < f->nodes_num; k++) {
+    n = f->contents_length[k];
+    heap[k] = 0;
+    if (n == 0) { continue; }
+    h = mpc_save_hash(f->text + f->contents[k], n);
+    for (h &= mask; (x = table[h]); h = (h + 1) & mask) {
+      x--;
+      if (f->contents_length[x] == n && memcmp(f->text + f->contents[x], f->text + f->contents[k], n) == 0) { break; }
     }
-    return total;
+    if (table[h]) { heap[k] = heap[x]; continue; }
+    table[h] = k + 1;
+    heap[k] = hs.length;
+    mpc_save_bytes(&hs, f->text + f->contents[k], n + 1);
   }
 
-  return 1;
+  /* Children come after their parent in pre order, so sizes are summed backwards */
+
+  for (k = f->nodes_num - 1; k >= 0; k--) {
+    if (f->parent[k] < 0) { continue; }
+    body.length = 0;
+    mpc_ast_save_node(&body, f, k, tags[f->tag_id[k]], heap[k], children[k]);
+    children[f->parent[k]] += body.length + children[k];
+  }
 
+  body.length = 0;
+  for (k = 0; k < f->nodes_num; k++) {
+    mpc_ast_save_node(&body, f, k, tags[f->tag_id[k]], heap[k], children[k]);
+  }
+
+  mpc_save_bytes(&s, "MPCT", 4);
+  mpc_save_uint(&s, MPC_AST_SAVE_VERSION);
+  mpc_save_uint(&s, (unsigned long)tags_num);
+  for (j = 0; j < tags_num; j++) {
+    mpc_save_uint(&s, (unsigned long)mpc_tag_at(ids[j])->length);
+    mpc_save_bytes(&s, mpc_tag_at(ids[j])->name, mpc_tag_at(ids[j])->length);
+  }
+  mpc_save_uint(&s, (unsigned long)hs.length);
+  mpc_save_bytes(&s, hs.data, hs.length);
+  mpc_save_uint(&s, (unsigned long)f->nodes_num);
+  mpc_save_bytes(&s, body.data, body.length);
+
+  free(tags);
+  free(ids);
+  free(heap);
+  free(children);
+  free(table);
+  free(hs.data);
+  free(body.data);
+  mpc_ast_flat_delete(f);
+
+  return mpc_save_write(filename, &s);
 }
 
-void mpc_stats(mpc_parser_t* p) {
-  printf("Stats\n");
-  printf("=====\n");
-  printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+static unsigned long mpc_ast_map_uint(const unsigned char *data, size_t *pos) {
+
+  int shift = 0;
+  unsigned long x = 0;
+  unsigned char b;
+
+  do {
+    b = data[(*pos)++];
+    x |= (unsigned long)(b & 0x7F) << shift;
+    shift += 7;
+  } while (b & 0x80);
+
+  return x;
 }
 
-static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
+/*
+** Each level of the tree being checked has
+** where its children end and how many of them
+** are left to read. Tags are only interned once
+** the whole file is known to be good.
+*/
 
-  int i, n, m;
-  mpc_parser_t *t;
+static mpc_err_t *mpc_ast_map_check(const char *filename, mpc_ast_map_t *m) {
 
-  if (p->retained && !force) { return; }
+  int j, d = 0, slots = 0, count = 0, tags_num;
+  size_t n, start, *names, *ends = NULL;
+  unsigned long x, hash, *lefts = NULL;
+  mpc_load_t l;
 
-  /* Optimise Subexpressions */
+  memset(&l, 0, sizeof(mpc_load_t));
+  l.data = (const unsigned char*)m->data;
 
-  if (p->type == MPC_TYPE_EXPECT)     { mpc_optimise_unretained(p->data.expect.x, 0); }
-  if (p->type == MPC_TYPE_APPLY)      { mpc_optimise_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO)   { mpc_optimise_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
-  if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
-  if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_MANY1)      { mpc_optimise_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_COUNT)      { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  if (m->length < 8 || memcmp(m->data, "MPCT", 4) != 0) {
+    return mpc_err_file(filename, "Not a file of saved ASTs!");
+  }
 
-  if (p->type == MPC_TYPE_OR) {
-    for(i = 0; i < p->data.or.n; i++) {
-      mpc_optimise_unretained(p->data.or.xs[i], 0);
-    }
+  l.length = m->length - 4;
+  hash = 0;
+  for (j = 0; j < 4; j++) {
+    hash |= (unsigned long)l.data[l.length + j] << (8 * j);
+  }
+  if (mpc_save_hash(m->data, l.length) != hash) {
+    return mpc_err_file(filename, "File of saved ASTs is corrupt!");
   }
 
-  if (p->type == MPC_TYPE_AND) {
-    for(i = 0; i < p->data.and.n; i++) {
-      mpc_optimise_unretained(p->data.and.xs[i], 0);
-    }
+  l.pos = 4;
+  if (mpc_load_uint(&l) != MPC_AST_SAVE_VERSION) {
+    return mpc_err_file(filename, "AST was saved by a different version of mpc!");
   }
 
-  /* Perform optimisations */
+  /* Names are kept as where each starts and how long it is */
 
-  while (1) {
+  tags_num = mpc_load_count(&l);
+  names = malloc(sizeof(size_t) * (tags_num * 2 + 1));
+  for (j = 0; j < tags_num && !l.bad; j++) {
+    n = mpc_load_uint(&l);
+    if (n > l.length - l.pos) { l.bad = 1; break; }
+    names[j*2+0] = l.pos;
+    names[j*2+1] = n;
+    l.pos += n;
+  }
 
-    /* Merge rhs `or` */
-    if (p->type == MPC_TYPE_OR
-    &&  p->data.or.xs[p->data.or.n-1]->type == MPC_TYPE_OR
-    && !p->data.or.xs[p->data.or.n-1]->retained) {
-      t = p->data.or.xs[p->data.or.n-1];
-      n = p->data.or.n; m = t->data.or.n;
-      p->data.or.n = n + m - 1;
-      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
-      continue;
-    }
+  m->heap_length = mpc_load_uint(&l);
+  if (m->heap_length == 0 || m->heap_length > l.length - l.pos) { l.bad = 1; }
+  else {
+    m->heap = m->data + l.pos;
+    l.pos += m->heap_length;
+    if (m->heap[0] != '\0' || m->heap[m->heap_length - 1] != '\0') { l.bad = 1; }
+  }
 
-    /* Merge lhs `or` */
-    if (p->type == MPC_TYPE_OR
-    &&  p->data.or.xs[0]->type == MPC_TYPE_OR
-    && !p->data.or.xs[0]->retained) {
-      t = p->data.or.xs[0];
-      n = p->data.or.n; m = t->data.or.n;
-      p->data.or.n = n + m - 1;
-      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
-      memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
-      continue;
-    }
+  m->nodes_num = mpc_load_count(&l);
+  m->root = l.pos;
+  m->end = l.length;
 
-    /* Remove ast `pass` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.n == 2
-    &&  p->data.and.xs[0]->type == MPC_TYPE_PASS
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.f == mpcf_fold_ast) {
-      t = p->data.and.xs[1];
-      mpc_delete(p->data.and.xs[0]);
-      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
-      memcpy(p, t, sizeof(mpc_parser_t));
-      free(t);
-      continue;
-    }
+  slots = 16;
+  ends = malloc(sizeof(size_t) * slots);
+  lefts = malloc(sizeof(unsigned long) * slots);
+  ends[0] = l.length;
+  lefts[0] = m->nodes_num ? 1 : 0;
+  d = 1;
 
-    /* Merge ast lhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_fold_ast
-    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.xs[0]->data.and.f == mpcf_fold_ast) {
-      t = p->data.and.xs[0];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
-      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
-      continue;
-    }
+  while (d > 0 && !l.bad) {
 
-    /* Merge ast rhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_fold_ast
-    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
-    && !p->data.and.xs[p->data.and.n-1]->retained
-    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_fold_ast) {
-      t = p->data.and.xs[p->data.and.n-1];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
+    if (lefts[d-1] == 0) {
+      if (l.pos != ends[d-1]) { l.bad = 1; }
+      d--;
       continue;
     }
 
-    /* Remove re `lift` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.n == 2
-    &&  p->data.and.xs[0]->type == MPC_TYPE_LIFT
-    &&  p->data.and.xs[0]->data.lift.lf == mpcf_ctor_str
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.f == mpcf_strfold) {
-      t = p->data.and.xs[1];
-      mpc_delete(p->data.and.xs[0]);
-      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
-      memcpy(p, t, sizeof(mpc_parser_t));
-      free(t);
-      continue;
+    if (l.pos >= ends[d-1] || count == m->nodes_num) { l.bad = 1; break; }
+    lefts[d-1]--;
+    count++;
+
+    if (mpc_load_uint(&l) >= (unsigned long)tags_num) { l.bad = 1; }
+    start = mpc_load_uint(&l);
+    n = mpc_load_uint(&l);
+    if (l.bad || start >= m->heap_length || n >= m->heap_length - start || m->heap[start + n] != '\0') {
+      l.bad = 1;
+      break;
     }
 
-    /* Merge re lhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_strfold
-    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.xs[0]->data.and.f == mpcf_strfold) {
-      t = p->data.and.xs[0];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
-      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
-      continue;
+    for (j = 0; j < 4; j++) { mpc_load_uint(&l); }
+    x = mpc_load_uint(&l);
+    n = mpc_load_uint(&l);
+    if (l.bad || l.pos > ends[d-1] || n > ends[d-1] - l.pos || (x == 0) != (n == 0) || x > n) {
+      l.bad = 1;
+      break;
     }
 
-    /* Merge re rhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_strfold
-    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
-    && !p->data.and.xs[p->data.and.n-1]->retained
-    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_strfold) {
-      t = p->data.and.xs[p->data.and.n-1];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
-      continue;
+    if (d == slots) {
+      slots *= 2;
+      ends = realloc(ends, sizeof(size_t) * slots);
+      lefts = realloc(lefts, sizeof(unsigned long) * slots);
     }
+    ends[d] = l.pos + n;
+    lefts[d] = x;
+    d++;
+  }
 
-    return;
+  if (count != m->nodes_num || l.pos != l.length) { l.bad = 1; }
 
+  if (!l.bad) {
+    m->tags = malloc(sizeof(int) * (tags_num + 1));
+    for (j = 0; j < tags_num; j++) {
+      m->tags[j] = mpc_tag_intern(m->data + names[j*2+0], names[j*2+1])->id;
+    }
   }
 
+  free(names);
+  free(ends);
+  free(lefts);
+  return l.bad ? mpc_err_file(filename, "File of saved ASTs is corrupt!") : NULL;
 }
 
-void mpc_optimise(mpc_parser_t *p) {
-  mpc_optimise_unretained(p, 1);
+mpc_err_t *mpc_ast_map_open(const char *filename, mpc_ast_map_t **m) {
+
+  mpc_err_t *err;
+  mpc_ast_map_t *x = calloc(1, sizeof(mpc_ast_map_t));
+
+  err = mpc_load_map(filename, &x->data, &x->length, &x->mapped);
+  if (err) { free(x); return err; }
+
+  err = mpc_ast_map_check(filename, x);
+  if (err) { mpc_ast_map_close(x); return err; }
+
+  *m = x;
+  return NULL;
+}
+
+void mpc_ast_map_close(mpc_ast_map_t *m) {
+  mpc_load_unmap(m->data, m->length, m->mapped);
+  free(m->tags);
+  free(m);
+}
+
+int mpc_ast_map_nodes(mpc_ast_map_t *m) {
+  return m->nodes_num;
+}
+
+static void mpc_ast_map_read(mpc_ast_map_t *m, mpc_ast_mapped_t *n, size_t at, size_t limit, mpc_state_t parent) {
+
+  const unsigned char *data = (const unsigned char*)m->data;
+  size_t children;
+
+  n->tag_id = m->tags[mpc_ast_map_uint(data, &at)];
+  n->tag = mpc_tag_at(n->tag_id)->name;
+  n->contents = m->heap + mpc_ast_map_uint(data, &at);
+  n->contents_length = mpc_ast_map_uint(data, &at);
+  n->state.pos = parent.pos + mpc_ast_load_signed(mpc_ast_map_uint(data, &at));
+  n->state.row = parent.row + mpc_ast_load_signed(mpc_ast_map_uint(data, &at));
+  n->state.col = parent.col + mpc_ast_load_signed(mpc_ast_map_uint(data, &at));
+  n->state.term = (int)mpc_ast_load_signed(mpc_ast_map_uint(data, &at));
+  n->children_num = (int)mpc_ast_map_uint(data, &at);
+  children = mpc_ast_map_uint(data, &at);
+  n->reader.first = at;
+  n->reader.end = at + children;
+  n->reader.limit = limit;
+  n->reader.parent = parent;
+}
+
+int mpc_ast_map_root(mpc_ast_map_t *m, mpc_ast_mapped_t *n) {
+
+  mpc_state_t s;
+
+  if (m->nodes_num == 0) { return 0; }
+
+  s.pos = 0;
+  s.row = 0;
+  s.col = 0;
+  s.term = 0;
+  mpc_ast_map_read(m, n, m->root, m->end, s);
+  return 1;
 }
 
+int mpc_ast_map_child(mpc_ast_map_t *m, mpc_ast_mapped_t *n, mpc_ast_mapped_t *c) {
+  if (n->children_num == 0) { return 0; }
+  mpc_ast_map_read(m, c, n->reader.first, n->reader.end, n->state);
+  return 1;
+}
+
+int mpc_ast_map_next(mpc_ast_map_t *m, mpc_ast_mapped_t *n) {
+  if (n->reader.end >= n->reader.limit) { return 0; }
+  mpc_ast_map_read(m, n, n->reader.end, n->reader.limit, n->reader.parent);
+  return 1;
+}
+
+static mpc_ast_t *mpc_ast_map_build(mpc_ast_map_t *m, mpc_ast_mapped_t *n) {
+
+  int j = 0;
+  mpc_ast_mapped_t c;
+  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+
+  a->tag = mpc_tag_at(n->tag_id)->name;
+  a->tag_id = n->tag_id;
+  a->contents = malloc(n->contents_length + 1);
+  memcpy(a->contents, n->contents, n->contents_length + 1);
+  a->source = NULL;
+  a->source_length = 0;
+  a->state = n->state;
+  a->children_num = n->children_num;
+  a->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+  a->arena = NULL;
+
+  if (mpc_ast_map_child(m, n, &c)) {
+    do { a->children[j++] = mpc_ast_map_build(m, &c); } while (mpc_ast_map_next(m, &c));
+  }
+
+  return a;
+}
+
+mpc_ast_t *mpc_ast_map_to_ast(mpc_ast_map_t *m) {
+  mpc_ast_mapped_t n;
+  return mpc_ast_map_root(m, &n) ? mpc_ast_map_build(m, &n) : NULL;
+}
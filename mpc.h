@@ -65,12 +65,33 @@ typedef union {
 struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
+/*
+** `mpc_parse` and `mpc_nparse` scan the caller's buffer in place
+** rather than copying it, so it must stay unchanged until they
+** return. `mpc_nparse` never reads past `length` bytes and does
+** not require the buffer to be null-terminated.
+** `mpc_parse_pipe` reads the stream in large chunks and consumes
+** it to the end of the last chunk read, which may lie beyond
+** the parsed input. Those trailing bytes are not given back.
+*/
+
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** `mpc_recognize` only checks that the input matches. No values
+** are built and no fold, apply or destructor functions are run,
+** except inside `mpc_check` which needs the value to test. The
+** number of bytes matched is written to `consumed` and, when
+** matching fails, the error is written to `error` if it is not
+** `NULL`.
+*/
+
+int mpc_recognize(const char *filename, const char *string, size_t length, mpc_parser_t *p, long *consumed, mpc_err_t **error);
+
 /*
 ** Function Types
 */
@@ -85,6 +106,190 @@ typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
 typedef int(*mpc_check_t)(mpc_val_t**);
 typedef int(*mpc_check_with_t)(mpc_val_t**,void*);
 
+/*
+** Parse Contexts
+**
+** A context can be reused for many parses to avoid setting up
+** the internal allocator each time. `pool_size` is the number
+** of small blocks it may hand out before falling back to the
+** heap, or `0` for the default. `mpc_context_stats` reports
+** how many small allocations were served by the pool, how many
+** fell back to the heap because it was full or the request too
+** large, and the most blocks ever in use at once.
+**
+** With `MPC_CONTEXT_AST_ARENA` set, ASTs built by the `mpca_`
+** combinators are allocated in bulk and owned by their root.
+** Calling `mpc_ast_delete` on the root frees the whole tree at
+** once while on any other node it does nothing, so subtrees
+** cannot be detached and kept. `mpc_ast_add_child` copies heap
+** nodes which are added to an arena tree and deletes them. The
+** parser must produce an `mpc_ast_t` for this flag to be used.
+**
+** With `MPC_CONTEXT_AST_SPANS` set, matched text is not copied
+** while parsing. AST leaves instead record where their text is
+** in the input using `source` and `source_length`, and leave
+** `contents` as `NULL` until `mpc_ast_contents` is called. The
+** input must then outlive the AST. Values passed to functions
+** other than the built in ones are still plain strings.
+**
+** With `MPC_CONTEXT_LAZY_ERRORS` set, failing parsers only
+** record the farthest position reached and what was expected
+** there. The `mpc_err_t` is built once the parse has failed.
+*/
+
+enum {
+  MPC_CONTEXT_DEFAULT     = 0,
+  MPC_CONTEXT_AST_ARENA   = 1,
+  MPC_CONTEXT_AST_SPANS   = 2,
+  MPC_CONTEXT_LAZY_ERRORS = 4
+};
+
+struct mpc_context_t;
+typedef struct mpc_context_t mpc_context_t;
+
+typedef struct {
+  unsigned long hits;
+  unsigned long full;
+  unsigned long large;
+  size_t peak;
+} mpc_pool_stats_t;
+
+mpc_context_t *mpc_context_new(size_t pool_size);
+void mpc_context_delete(mpc_context_t *c);
+void mpc_context_set_flags(mpc_context_t *c, int flags);
+void mpc_context_stats(mpc_context_t *c, mpc_pool_stats_t *s);
+int mpc_context_parse(mpc_context_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_context_nparse(mpc_context_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+int mpc_context_recognize(mpc_context_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, long *consumed, mpc_err_t **error);
+
+/*
+** Profiling
+**
+** A profile attached to a context with `mpc_context_set_profile`
+** records, for every named parser run by that context, how many
+** times it was entered, how many of those succeeded or failed,
+** how many bytes its matches consumed and how long was spent in
+** it. `total` only counts the outermost call of a recursive rule
+** and `self` leaves out the time spent in named parsers it calls.
+** The input rewinds and pool allocations made while it was the
+** innermost named parser are counted too. Figures add up over
+** parses until `mpc_profile_reset`, and passing `NULL` turns the
+** profiling off again. Compiled parsers are not profiled.
+**
+** `mpc_profile_print` writes the figures as a table and
+** `mpc_profile_json` as an array of objects, both ordered by one
+** of the `MPC_PROFILE_SORT_` keys. `mpc_profile_rules` returns
+** the rows themselves in the order the parsers were first run.
+*/
+
+enum {
+  MPC_PROFILE_SORT_SELF  = 0,
+  MPC_PROFILE_SORT_TOTAL = 1,
+  MPC_PROFILE_SORT_CALLS = 2,
+  MPC_PROFILE_SORT_NAME  = 3
+};
+
+struct mpc_profile_t;
+typedef struct mpc_profile_t mpc_profile_t;
+
+typedef struct {
+  const char *name;
+  unsigned long calls;
+  unsigned long successes;
+  unsigned long failures;
+  unsigned long bytes;
+  unsigned long rewinds;
+  unsigned long allocs;
+  double total;
+  double self;
+} mpc_profile_rule_t;
+
+mpc_profile_t *mpc_profile_new(void);
+void mpc_profile_delete(mpc_profile_t *f);
+void mpc_profile_reset(mpc_profile_t *f);
+void mpc_context_set_profile(mpc_context_t *c, mpc_profile_t *f);
+int mpc_profile_rules(mpc_profile_t *f, const mpc_profile_rule_t **rules);
+void mpc_profile_print(mpc_profile_t *f, FILE *out, int sort);
+void mpc_profile_json(mpc_profile_t *f, FILE *out, int sort);
+
+/*
+** Tracing
+**
+** A trace attached to a context with `mpc_context_set_trace`
+** records an event with the time and input position each time a
+** named parser is entered or returns, and each time the input is
+** rewound. Events go into a ring buffer of `events` entries, or
+** a default size for `0`, allocated up front. Once it is full the
+** oldest events are overwritten, and `mpc_trace_dropped` says how
+** many were lost. Events only refer to their parsers, so those
+** must not be deleted before the trace is written out.
+**
+** `mpc_trace_chrome` writes the events in the Chrome Trace Event
+** JSON format, which can be opened in `chrome://tracing` or
+** Perfetto. `mpc_trace_folded` writes one folded stack per rule
+** exit weighted by its self time in nanoseconds, which is the
+** input expected by `flamegraph.pl` and similar tools. Calls cut
+** in half by the ring wrapping around are left out of both.
+*/
+
+struct mpc_trace_t;
+typedef struct mpc_trace_t mpc_trace_t;
+
+mpc_trace_t *mpc_trace_new(size_t events);
+void mpc_trace_delete(mpc_trace_t *t);
+void mpc_trace_reset(mpc_trace_t *t);
+void mpc_context_set_trace(mpc_context_t *c, mpc_trace_t *t);
+unsigned long mpc_trace_dropped(mpc_trace_t *t);
+void mpc_trace_chrome(mpc_trace_t *t, FILE *out);
+void mpc_trace_folded(mpc_trace_t *t, FILE *out);
+
+/*
+** Push Parsing
+**
+** Input is fed in arbitrary chunks and each complete value
+** produced by the parser is queued as soon as it has arrived.
+** `mpc_push_next` pops the oldest result and returns `1` for
+** an output or `0` for an error, like `mpc_parse`. Popping
+** when `mpc_push_ready` is `0` also gives `0`, with an error
+** saying that no result is ready. After an error parsing
+** resumes where it failed, so the results do not depend on
+** how the input was split into chunks. A `limit`
+** of `0` selects the default bound on buffered input, and
+** `d` is used to destroy outputs which are never collected.
+*/
+
+struct mpc_push_t;
+typedef struct mpc_push_t mpc_push_t;
+
+mpc_push_t *mpc_push_new(const char *filename, mpc_parser_t *p, mpc_dtor_t d, size_t limit);
+void mpc_push_delete(mpc_push_t *s);
+int mpc_push_feed(mpc_push_t *s, const char *data, size_t length);
+int mpc_push_finish(mpc_push_t *s);
+int mpc_push_ready(mpc_push_t *s);
+int mpc_push_next(mpc_push_t *s, mpc_result_t *r);
+
+/*
+** Compiled Parsers
+**
+** `mpc_compile` lowers a parser and every parser it refers to
+** into one contiguous block of instructions, which is then run
+** without following pointers between parser objects. It gives
+** the same results and errors as the parser. The compiled form
+** is a snapshot, so the parser should be fully defined first,
+** and can be optimised first. Later changes to the parser are
+** not seen. It keeps no reference to the parsers themselves.
+*/
+
+struct mpc_code_t;
+typedef struct mpc_code_t mpc_code_t;
+
+mpc_code_t *mpc_compile(mpc_parser_t *p);
+void mpc_code_delete(mpc_code_t *c);
+int mpc_code_parse(const char *filename, const char *string, mpc_code_t *c, mpc_result_t *r);
+int mpc_code_nparse(const char *filename, const char *string, size_t length, mpc_code_t *c, mpc_result_t *r);
+int mpc_context_code_parse(mpc_context_t *c, const char *filename, const char *string, mpc_code_t *code, mpc_result_t *r);
+int mpc_context_code_nparse(mpc_context_t *c, const char *filename, const char *string, size_t length, mpc_code_t *code, mpc_result_t *r);
+
 /*
 ** Building a Parser
 */
@@ -280,12 +485,19 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+struct mpc_arena_t;
+typedef struct mpc_arena_t mpc_arena_t;
+
 typedef struct mpc_ast_t {
   char *tag;
+  int tag_id;
   char *contents;
+  const char *source;
+  size_t source_length;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  mpc_arena_t *arena;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
@@ -296,6 +508,7 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
+char *mpc_ast_contents(mpc_ast_t *a);
 
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
@@ -306,6 +519,34 @@ int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb);
 mpc_ast_t *mpc_ast_get_child(mpc_ast_t *ast, const char *tag);
 mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb);
 
+/*
+** Tags are interned and shared between nodes so they must not
+** be modified or freed. Each distinct tag has an integer id,
+** and `mpc_ast_has_tag` tests if the tag with id `id` is one
+** of the `|` separated parts of the tag of `a`.
+**
+** `mpc_tag_id` only looks tags up, giving `-1` for a name no
+** parser or AST has used yet, so ask for ids once the grammar
+** is built. `mpc_tag_cleanup` frees every interned tag and is
+** only safe once all parsers and ASTs using them are deleted.
+**
+** Every tag given to `mpc_ast_new`, `mpc_ast_build`,
+** `mpc_ast_tag` and the other functions above is interned
+** too and kept until `mpc_tag_cleanup`. Tags should come from
+** a bounded set, such as rule names, and never be built from
+** the input being parsed.
+*/
+
+int mpc_tag_id(const char *name);
+const char *mpc_tag_name(int id);
+void mpc_tag_cleanup(void);
+int mpc_ast_has_tag(mpc_ast_t *a, int id);
+
+int mpc_ast_get_index_id(mpc_ast_t *ast, int id);
+int mpc_ast_get_index_id_lb(mpc_ast_t *ast, int id, int lb);
+mpc_ast_t *mpc_ast_get_child_id(mpc_ast_t *ast, int id);
+mpc_ast_t *mpc_ast_get_child_id_lb(mpc_ast_t *ast, int id, int lb);
+
 typedef enum {
   mpc_ast_trav_order_pre,
   mpc_ast_trav_order_post
@@ -325,6 +566,86 @@ mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav);
 
 void mpc_ast_traverse_free(mpc_ast_trav_t **trav);
 
+/*
+** A cursor walks a tree depth first using a stack of its own which
+** only grows, so once it has been through a tree as deep as the
+** next one it walks it without allocating. `mpc_ast_cursor_start`
+** begins a walk of `a`, after which `mpc_ast_cursor_next` returns
+** each node in the order given, then `NULL`. `mpc_ast_cursor_depth`
+** is the depth of the node last returned, with `0` for the root,
+** and `mpc_ast_cursor_skip` stops a pre order walk going into the
+** children of the node last returned. The tree must not change
+** while it is being walked.
+**
+** `mpc_ast_visit` calls `pre` on each node before its children and
+** `post` after them, either of which may be `NULL`. Returning
+** `MPC_AST_VISIT_SKIP` from `pre` leaves out the children of that
+** node but still calls `post` on it, and returning
+** `MPC_AST_VISIT_STOP` from either ends the walk, in which case
+** `mpc_ast_visit` returns `0` rather than `1`. The cursor `c` is
+** used for the stack, or one only for this walk if it is `NULL`.
+*/
+
+enum {
+  MPC_AST_VISIT_CONTINUE = 0,
+  MPC_AST_VISIT_SKIP     = 1,
+  MPC_AST_VISIT_STOP     = 2
+};
+
+struct mpc_ast_cursor_t;
+typedef struct mpc_ast_cursor_t mpc_ast_cursor_t;
+
+typedef int(*mpc_ast_visit_t)(mpc_ast_t*,int,void*);
+
+mpc_ast_cursor_t *mpc_ast_cursor_new(void);
+void mpc_ast_cursor_delete(mpc_ast_cursor_t *c);
+void mpc_ast_cursor_start(mpc_ast_cursor_t *c, mpc_ast_t *a, mpc_ast_trav_order_t order);
+mpc_ast_t *mpc_ast_cursor_next(mpc_ast_cursor_t *c);
+int mpc_ast_cursor_depth(mpc_ast_cursor_t *c);
+void mpc_ast_cursor_skip(mpc_ast_cursor_t *c);
+
+int mpc_ast_visit(mpc_ast_cursor_t *c, mpc_ast_t *a, mpc_ast_visit_t pre, mpc_ast_visit_t post, void *d);
+
+/*
+** A flat AST holds a tree as one array per field, indexed by node
+** in pre order, so the root is `0` and every subtree is a run of
+** consecutive nodes. Nodes refer to each other by index, with `-1`
+** for none. The contents of all the nodes are kept one after the
+** other in `text`, each ending in a `\0`, and `contents` gives
+** where each one starts.
+**
+** `mpc_ast_flat_new` makes a flat copy of `a`, which may be `NULL`
+** for an empty tree, and `mpc_ast_flat_to_ast` makes an `mpc_ast_t`
+** back from one. `mpc_ast_flat_find` returns the first node from
+** `lb` on with the tag `id` as one of its parts, or `-1`.
+**
+** `mpc_context_parse_flat` parses as `mpc_context_nparse` does and
+** on success gives a flat AST as the output. The tree is built in
+** an arena with leaves referring to the input, which is then
+** copied into flat form in one pass and freed in one go, whatever
+** flags the context has. The parser must produce an `mpc_ast_t`.
+*/
+
+typedef struct {
+  int nodes_num;
+  int *tag_id;
+  mpc_state_t *state;
+  size_t *contents;
+  size_t *contents_length;
+  int *parent;
+  int *first_child;
+  int *next_sibling;
+  int *children_num;
+  char *text;
+  size_t text_length;
+} mpc_ast_flat_t;
+
+mpc_ast_flat_t *mpc_ast_flat_new(mpc_ast_t *a);
+void mpc_ast_flat_delete(mpc_ast_flat_t *f);
+mpc_ast_t *mpc_ast_flat_to_ast(mpc_ast_flat_t *f);
+int mpc_ast_flat_find(mpc_ast_flat_t *f, int id, int lb);
+int mpc_context_parse_flat(mpc_context_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+
 /*
 ** Warning: This function currently doesn't test for equality of the `state` member!
 */
@@ -363,6 +684,102 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+/*
+** Code Generation
+**
+** `mpc_codegen` writes `p` out to `f` as a C file which only
+** needs `mpc.h`. It defines `<name>_parse` and `<name>_nparse`,
+** which take the same arguments as `mpc_parse` and `mpc_nparse`
+** without the parser and give the same results and errors, but
+** do not take a context. Every function the parser uses must be
+** one declared here, and no parser may hold a value pointer
+** other than the tags given by the `mpca_` functions, or an
+** error is returned and nothing is written.
+**
+** `mpca_codegen` defines the `n` parsers in `ps` from a grammar
+** as `mpca_lang` does, then writes out the first. The grammar is
+** kept in the file, and when it is compiled with
+** `MPC_CODEGEN_CHECK` defined it also has a `main` which parses
+** each file given, whole and line by line, with both the
+** generated parser and one built from the grammar, reporting any
+** difference in their outputs or errors.
+*/
+
+mpc_err_t *mpc_codegen(FILE *f, const char *name, mpc_parser_t *p);
+mpc_err_t *mpca_codegen(FILE *f, const char *name, int flags, const char *language, int n, mpc_parser_t **ps);
+
+/*
+** Saving Parsers
+**
+** `mpc_save` writes the `n` parsers given, and every parser they
+** use, to a binary file which `mpc_load` reads back into the same
+** number of parsers from `mpc_new`, matched up by name, so they
+** need not be built from a grammar again. Any named parser which
+** is used must be among those saved, and the same rules on
+** functions and values as for code generation apply. The file is
+** hashed and fully checked before anything is built, including
+** that each function named is of the type its place expects, and
+** on error the parsers given are left unchanged.
+**
+** `mpc_save_key` also writes `key`, such as a version or a hash
+** of the grammar, into the header. `mpc_load_key` refuses a file
+** saved under any other key before checking the rest of it. The
+** plain functions use the empty key.
+*/
+
+mpc_err_t *mpc_save(const char *filename, int n, ...);
+mpc_err_t *mpc_save_key(const char *filename, const char *key, int n, ...);
+mpc_err_t *mpc_load(const char *filename, int n, ...);
+mpc_err_t *mpc_load_key(const char *filename, const char *key, int n, ...);
+
+/*
+** Saving ASTs
+**
+** `mpc_ast_save` writes `a`, which may be `NULL`, to a binary
+** file. `mpc_ast_map_open` maps such a file into memory, checks
+** it in full and sets `*m`, after which its nodes are read in
+** place without building any `mpc_ast_t`. An `mpc_ast_mapped_t`
+** is a handle on one node, filled in by `mpc_ast_map_root` for
+** the root and `mpc_ast_map_child` for the first child of a node,
+** and moved along to the next sibling by `mpc_ast_map_next`, each
+** returning `0` if there is no such node. `contents` points into
+** the mapping, ends in a `\0` and is valid until the file is
+** closed. `reader` is where the node is in the file, which only
+** the functions here may look at or change.
+**
+** `mpc_ast_map_to_ast` builds a full `mpc_ast_t` from the file
+** for code which needs one, or returns `NULL` for an empty tree.
+*/
+
+struct mpc_ast_map_t;
+typedef struct mpc_ast_map_t mpc_ast_map_t;
+
+typedef struct {
+  size_t first;
+  size_t end;
+  size_t limit;
+  mpc_state_t parent;
+} mpc_ast_map_reader_t;
+
+typedef struct {
+  int tag_id;
+  const char *tag;
+  const char *contents;
+  size_t contents_length;
+  mpc_state_t state;
+  int children_num;
+  mpc_ast_map_reader_t reader;
+} mpc_ast_mapped_t;
+
+mpc_err_t *mpc_ast_save(const char *filename, mpc_ast_t *a);
+mpc_err_t *mpc_ast_map_open(const char *filename, mpc_ast_map_t **m);
+void mpc_ast_map_close(mpc_ast_map_t *m);
+int mpc_ast_map_nodes(mpc_ast_map_t *m);
+int mpc_ast_map_root(mpc_ast_map_t *m, mpc_ast_mapped_t *n);
+int mpc_ast_map_child(mpc_ast_map_t *m, mpc_ast_mapped_t *n, mpc_ast_mapped_t *c);
+int mpc_ast_map_next(mpc_ast_map_t *m, mpc_ast_mapped_t *n);
+mpc_ast_t *mpc_ast_map_to_ast(mpc_ast_map_t *m);
+
 /*
 ** Misc
 */
@@ -372,6 +789,25 @@ void mpc_print(mpc_parser_t *p);
 void mpc_optimise(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
 
+/*
+** `mpc_optimise_stats` optimises `p` as `mpc_optimise` does and
+** fills in how many rewrites each pass made: nested `or` and `and`
+** flattened, adjacent literals merged into one string, characters
+** and ranges fused into a set, `many` of a set with `mpcf_strfold`
+** turned into a single span, and parsers replaced by their only
+** child.
+*/
+
+typedef struct {
+  int flattened;
+  int literals;
+  int classes;
+  int spans;
+  int inlined;
+} mpc_optimise_stats_t;
+
+void mpc_optimise_stats(mpc_parser_t *p, mpc_optimise_stats_t *s);
+
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
   int(*tester)(const void*, const void*), 
   mpc_dtor_t destructor, 
@@ -0,0 +1,91 @@
+/*
+** mpcgen
+**
+** Writes the parser for a grammar out as C using
+** `mpca_codegen`, so that it does not need to be
+** built from the grammar when a program starts.
+**
+**   mpcgen [-p] [-w] name grammar rule...
+**
+** The rules are named as they would be passed to
+** `mpca_lang`, with the first being the one that
+** is generated. `-p` and `-w` set the predictive
+** and whitespace sensitive flags. The file is
+** written to standard output. It defines
+** `<name>_parse` and `<name>_nparse`, and is built
+** with `-DMPC_CODEGEN_CHECK` to test it against
+** the grammar.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mpc.h"
+
+static char *read_file(const char *filename) {
+
+  FILE *f = fopen(filename, "rb");
+  char *s, *t;
+  size_t n = 0, k, slots = 4096;
+
+  if (f == NULL) { return NULL; }
+
+  s = malloc(slots);
+  if (s == NULL) { fclose(f); return NULL; }
+
+  while ((k = fread(s + n, 1, slots - n - 1, f)) > 0) {
+    n += k;
+    if (n == slots - 1) {
+      slots *= 2;
+      t = realloc(s, slots);
+      if (t == NULL) { free(s); fclose(f); return NULL; }
+      s = t;
+    }
+  }
+  s[n] = '\0';
+
+  fclose(f);
+  return s;
+}
+
+int main(int argc, char **argv) {
+
+  int j, n, flags = MPCA_LANG_DEFAULT;
+  char *grammar;
+  mpc_parser_t **ps;
+  mpc_err_t *e;
+
+  for (j = 1; j < argc && argv[j][0] == '-'; j++) {
+    if      (argv[j][1] == 'p') { flags |= MPCA_LANG_PREDICTIVE; }
+    else if (argv[j][1] == 'w') { flags |= MPCA_LANG_WHITESPACE_SENSITIVE; }
+    else { break; }
+  }
+
+  if (argc - j < 3) {
+    fprintf(stderr, "usage: %s [-p] [-w] name grammar rule...\n", argv[0]);
+    return 2;
+  }
+
+  grammar = read_file(argv[j+1]);
+  if (grammar == NULL) {
+    fprintf(stderr, "%s: could not read '%s'\n", argv[0], argv[j+1]);
+    return 2;
+  }
+
+  n = argc - j - 2;
+  ps = malloc(sizeof(mpc_parser_t*) * n);
+  for (j = 0; j < n; j++) { ps[j] = mpc_new(argv[argc - n + j]); }
+
+  e = mpca_codegen(stdout, argv[argc - n - 2], flags, grammar, n, ps);
+  if (e) {
+    mpc_err_print_to(e, stderr);
+    mpc_err_delete(e);
+  }
+
+  for (j = 0; j < n; j++) { mpc_undefine(ps[j]); }
+  for (j = 0; j < n; j++) { mpc_delete(ps[j]); }
+
+  free(ps);
+  free(grammar);
+  return e ? 1 : 0;
+}
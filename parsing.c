@@ -121,29 +121,41 @@ void lval_del(lval* v) {
 
 lval* lval_read_num(mpc_ast_t* t) {
   errno = 0;
-  long x = strtol(t->contents, NULL, 10);
+  long x = strtol(mpc_ast_contents(t), NULL, 10);
   return errno != ERANGE
       ? lval_num(x)
       : lval_err("invalid number");
 }
 
+/* interned ids of the tags lval_read looks for */
+int tag_number, tag_symbol, tag_sexpr, tag_qexpr, tag_regex, tag_root;
+
+void lval_read_tags(void) {
+  tag_number = mpc_tag_id("number");
+  tag_symbol = mpc_tag_id("symbol");
+  tag_sexpr  = mpc_tag_id("sexpr");
+  tag_qexpr  = mpc_tag_id("qexpr");
+  tag_regex  = mpc_tag_id("regex");
+  tag_root   = mpc_tag_id(">");
+}
+
 lval* lval_read(mpc_ast_t* t) {
   /* if number of symbol, create them directly */
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+  if (mpc_ast_has_tag(t, tag_number)) { return lval_read_num(t); }
+  if (mpc_ast_has_tag(t, tag_symbol)) { return lval_sym(mpc_ast_contents(t)); }
 
   /* if root (>) or sexpr then create empty list */
   lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-  if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+  if (t->tag_id == tag_root)         { x = lval_sexpr(); }
+  if (mpc_ast_has_tag(t, tag_sexpr)) { x = lval_sexpr(); }
+  if (mpc_ast_has_tag(t, tag_qexpr)) { x = lval_qexpr(); }
 
   for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
+    if (strcmp(mpc_ast_contents(t->children[i]), "(") == 0) { continue; }
+    if (strcmp(mpc_ast_contents(t->children[i]), ")") == 0) { continue; }
+    if (strcmp(mpc_ast_contents(t->children[i]), "{") == 0) { continue; }
+    if (strcmp(mpc_ast_contents(t->children[i]), "}") == 0) { continue; }
+    if (t->children[i]->tag_id == tag_regex) { continue; }
     x = lval_add(x, lval_read(t->children[i]));
   }
 
@@ -359,6 +371,31 @@ lval* builtin(lval* a, char* func) {
   return lval_err("Unknown function");
 }
 
+/* the language, also used by bench.c */
+const char* lispy_grammar =
+  "                                                                            \
+   number   : /-?([0-9]*[.])?[0-9]+/ ;                                         \
+   symbol   : ('+'|\"add\") | ('-'|\"sub\") | ('*'|\"mult\") | ('/'|\"div\")   \
+              | ('%'| \"mod\") | ('^'|\"exp\") | \"list\" | \"head\"           \
+              | \"tail\" | \"join\" | \"eval\" ;                               \
+   sexpr    : '(' <expr>* ')' ;                                                \
+   qexpr    : '{' <expr>* '}' ;                                                \
+   expr     : <number> | <symbol> | <sexpr> | <qexpr> ;                        \
+   lispy    : /^/ <expr>* /$/ ;                                                \
+  ";
+
+/* bench.c includes this file and brings its own main */
+#ifndef LISPY_NO_MAIN
+
+/* FNV-1a hash of the grammar, so a cache built from an older grammar is not used */
+unsigned long lispy_grammar_hash(void) {
+  unsigned long h = 2166136261UL;
+  for (const char* c = lispy_grammar; *c; c++) {
+    h = ((h ^ (unsigned char)*c) * 16777619UL) & 0xFFFFFFFFUL;
+  }
+  return h;
+}
+
 int main(int argc, char** argv) {
 
   /* create some parsers */
@@ -369,24 +406,40 @@ int main(int argc, char** argv) {
   mpc_parser_t* Expr = mpc_new("expr");
   mpc_parser_t* Lispy = mpc_new("lispy");
 
+  /* the cache is saved under the grammar hash so a cache of another grammar fails to load */
+  char key[32];
+  sprintf(key, "grammar-%08lx", lispy_grammar_hash());
+
+  /* load the parsers from a cache if one is given, otherwise build them */
+  const char* cache = getenv("LISPY_GRAMMAR_CACHE");
+  mpc_err_t* cached = cache ? mpc_load_key(cache, key, 6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy) : NULL;
+  if (cached) { mpc_err_delete(cached); }
+
   /* define parsers with following language */
-  mpca_lang(MPCA_LANG_DEFAULT,
-            "                                                                            \
-             number   : /-?([0-9]*[.])?[0-9]+/ ;                                         \
-             symbol   : ('+'|\"add\") | ('-'|\"sub\") | ('*'|\"mult\") | ('/'|\"div\")   \
-                        | ('%'| \"mod\") | ('^'|\"exp\") | \"list\" | \"head\"           \
-                        | \"tail\" | \"join\" | \"eval\" ;                               \
-             sexpr    : '(' <expr>* ')' ;                                                \
-             qexpr    : '{' <expr>* '}' ;                                                \
-             expr     : <number> | <symbol> | <sexpr> | <qexpr> ;                        \
-             lispy    : /^/ <expr>* /$/ ;                                                \
-            ",
-            Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  if (cache == NULL || cached != NULL) {
+    mpca_lang(MPCA_LANG_DEFAULT, lispy_grammar,
+              Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+
+    /* write the cache for the next start, it is only a speedup so errors are ignored */
+    if (cache) {
+      mpc_err_t* saved = mpc_save_key(cache, key, 6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+      if (saved) { mpc_err_delete(saved); }
+    }
+  }
+
+  lval_read_tags();
+
+  /* lower the grammar into bytecode once up front */
+  mpc_code_t* code = mpc_compile(Lispy);
 
   /* print version and exit info   */
   puts("Lispy version 0.0.0.0.1");
   puts("Press Ctl+c to exit\n");
 
+  /* reuse one parse context for every line */
+  mpc_context_t* ctx = mpc_context_new(0);
+  mpc_context_set_flags(ctx, MPC_CONTEXT_AST_ARENA | MPC_CONTEXT_AST_SPANS | MPC_CONTEXT_LAZY_ERRORS);
+
   while(1) {
 
     /* output prompt and get info */
@@ -397,7 +450,7 @@ int main(int argc, char** argv) {
 
     /* attempt to parse user input */
     mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
+    if (mpc_context_code_parse(ctx, "<stdin>", input, code, &r)) {
       /* print the result */
       // lval result = eval(r.output);
       lval* x = lval_eval(lval_read(r.output));
@@ -415,7 +468,11 @@ int main(int argc, char** argv) {
   }
 
   /* cleanup our parsers */
+  mpc_context_delete(ctx);
+  mpc_code_delete(code);
   mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
 
   return 0;
 }
+
+#endif
@@ -0,0 +1,105 @@
+/*
+** Feeds the same input to a push parser whole and one byte at a time
+** and checks that both give the same results.
+**
+**   cc -std=c99 -I.. push.c ../mpc.c -lm -o push && ./push
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpc.h"
+
+typedef struct {
+  int num;
+  int ok[64];
+  mpc_result_t r[64];
+} results_t;
+
+static void collect(mpc_push_t *s, results_t *out) {
+  while (mpc_push_ready(s) && out->num < 64) {
+    out->ok[out->num] = mpc_push_next(s, &out->r[out->num]);
+    out->num++;
+  }
+}
+
+static void run(mpc_parser_t *p, const char *in, size_t chunk, results_t *out) {
+  mpc_push_t *s = mpc_push_new("push", p, (mpc_dtor_t)mpc_ast_delete, 0);
+  size_t len = strlen(in);
+  out->num = 0;
+  for (size_t k = 0; k < len; k += chunk) {
+    mpc_push_feed(s, in + k, len - k < chunk ? len - k : chunk);
+    collect(s, out);
+  }
+  mpc_push_finish(s);
+  collect(s, out);
+  mpc_push_delete(s);
+}
+
+static void release(results_t *out) {
+  for (int j = 0; j < out->num; j++) {
+    if (out->ok[j]) { mpc_ast_delete(out->r[j].output); }
+    else { mpc_err_delete(out->r[j].error); }
+  }
+}
+
+static int same(results_t *a, results_t *b) {
+  if (a->num != b->num) { return 0; }
+  for (int j = 0; j < a->num; j++) {
+    if (a->ok[j] != b->ok[j]) { return 0; }
+    if (a->ok[j]) {
+      if (!mpc_ast_eq(a->r[j].output, b->r[j].output)) { return 0; }
+    } else {
+      char *x = mpc_err_string(a->r[j].error);
+      char *y = mpc_err_string(b->r[j].error);
+      int eq = strcmp(x, y) == 0;
+      free(x); free(y);
+      if (!eq) { return 0; }
+    }
+  }
+  return 1;
+}
+
+int main(void) {
+
+  const char *inputs[] = {
+    ") 1 2 (+ 3 4)",
+    "1 2 (+ 3 4)",
+    "(+ 1 ] 2 {3 4}",
+    "(head {1 2 3})\n) )\n-5 (list 1",
+    "  \n  ",
+  };
+
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *Sexpr  = mpc_new("sexpr");
+  mpc_parser_t *Qexpr  = mpc_new("qexpr");
+  mpc_parser_t *Expr   = mpc_new("expr");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " number : /-?[0-9]+/ ;                                  "
+    " symbol : '+' | '-' | \"list\" | \"head\" ;             "
+    " sexpr  : '(' <expr>* ')' ;                             "
+    " qexpr  : '{' <expr>* '}' ;                             "
+    " expr   : <number> | <symbol> | <sexpr> | <qexpr> ;     ",
+    Number, Symbol, Sexpr, Qexpr, Expr);
+
+  int failures = 0;
+
+  for (size_t j = 0; j < sizeof(inputs) / sizeof(inputs[0]); j++) {
+    results_t whole, bytes;
+    run(Expr, inputs[j], strlen(inputs[j]) + 1, &whole);
+    run(Expr, inputs[j], 1, &bytes);
+    if (!same(&whole, &bytes)) {
+      printf("FAIL: %s (%d whole, %d byte by byte)\n", inputs[j], whole.num, bytes.num);
+      failures++;
+    }
+    release(&whole);
+    release(&bytes);
+  }
+
+  mpc_cleanup(5, Number, Symbol, Sexpr, Qexpr, Expr);
+
+  if (failures == 0) { puts("ok"); }
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}